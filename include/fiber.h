@@ -12,6 +12,8 @@
 typedef int fiber_state_t;
 
 struct fiber_manager;
+struct fiber_group;
+struct fiber_wait;
 
 #define FIBER_STATE_RUNNING (1)
 #define FIBER_STATE_READY (2)
@@ -24,6 +26,13 @@ struct fiber_manager;
 #define FIBER_DETACH_WAIT_TO_JOIN (2)
 #define FIBER_DETACH_DETACHED (3)
 
+// a fiber runs ahead of any lower priority (higher numbered) fibers waiting on
+// the same thread, give or take aging (see FIBER_SCHEDULER_AGING_LIMIT)
+#define FIBER_PRIORITY_HIGH (0)
+#define FIBER_PRIORITY_NORMAL (1)
+#define FIBER_PRIORITY_LOW (2)
+#define FIBER_NUM_PRIORITIES (3)
+
 typedef struct fiber {
   volatile fiber_state_t state;
   fiber_run_function_t run_function;
@@ -38,8 +47,19 @@ typedef struct fiber {
   void* volatile scratch;  // to be used by internal fiber mechanisms. be sure
                            // mechanisms do not conflict! (ie. only use scratch
                            // while a fiber is sleeping/waiting)
+  size_t stack_size;       // rounded to a cache size class while caching
+  int priority;            // FIBER_PRIORITY_*, used when the fiber is queued
+  // the group (see fiber_group.h) the fiber is a child of, or NULL
+  struct fiber_group* group;
+  // kept for the fiber's next timed wait (see fiber_wait_t), or NULL
+  struct fiber_wait* wait;
 } fiber_t;
 
+typedef struct fiber_attr {
+  size_t stack_size;
+  int priority;
+} fiber_attr_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -53,6 +73,19 @@ extern fiber_t* fiber_create(size_t stack_size, fiber_run_function_t run,
 extern fiber_t* fiber_create_no_sched(size_t stack_size,
                                       fiber_run_function_t run, void* param);
 
+// sets the default attributes: FIBER_DEFAULT_STACK_SIZE and
+// FIBER_PRIORITY_NORMAL
+extern void fiber_attr_init(fiber_attr_t* attr);
+
+extern fiber_t* fiber_create_with_attr(const fiber_attr_t* attr,
+                                       fiber_run_function_t run, void* param);
+
+// takes effect the next time the fiber is queued to run (ie. when it yields,
+// or is woken)
+extern int fiber_set_priority(fiber_t* f, int priority);
+
+extern int fiber_get_priority(fiber_t* f);
+
 extern fiber_t* fiber_create_from_thread();
 
 extern int fiber_join(fiber_t* f, void** result);
@@ -61,8 +94,32 @@ extern int fiber_tryjoin(fiber_t* f, void** result);
 
 extern int fiber_yield();
 
+// yields if the calling fiber has used up its time slice (see
+// fiber_manager_set_time_slice). cheap enough to call in a loop which never
+// blocks, so the loop doesn't starve other fibers. returns 1 if it yielded.
+extern int fiber_maybe_yield();
+
+// switches straight to target if the calling fiber just woke it (it's waiting
+// in this thread's run_next slot), skipping the scheduler. the caller is
+// rescheduled. otherwise this is the same as fiber_yield().
+extern int fiber_yield_to(fiber_t* target);
+
 extern int fiber_detach(fiber_t* f);
 
+// fiber_spawn_external and fiber_wake_external may be called from any thread,
+// including threads which aren't fiber managers (such as those started by
+// other libraries). from another thread the request is queued for the managers
+// and a parked manager is woken to pick it up. both fail with EINVAL if the
+// managers aren't running, and ENOMEM if the request can't be queued.
+
+// runs run(param) in a new, detached fiber with the default attributes
+extern int fiber_spawn_external(fiber_run_function_t run, void* param);
+
+// makes a waiting fiber runnable. the caller must own the fiber's wake up: it
+// waited with fiber_manager_set_and_wait(), say, and the caller took it from
+// the location it was stored at.
+extern int fiber_wake_external(fiber_t* f);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,45 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#ifndef _FIBER_BLOCKING_H_
+#define _FIBER_BLOCKING_H_
+
+/*
+    Description: A pool of helper threads for calls which block the calling
+                 kernel thread no matter what - regular file io, fsync, stat,
+                 getaddrinfo and so on. The calling fiber is suspended while a
+                 helper makes the call, so the other fibers on its manager
+                 thread keep running.
+
+                 Helpers are started on demand, up to
+                 FIBER_BLOCKING_MAX_THREADS, and live until fiber_shutdown().
+                 They aren't fiber managers, so a helper reports completion
+                 through an eventfd (a pipe elsewhere) which the fiber waits on
+                 with fiber_wait_for_event(). Those fds are reused, so a call
+                 usually costs no event registration.
+
+                 The io shims send reads and writes on regular files and
+                 fsync()/fdatasync() through the pool automatically.
+*/
+
+#define FIBER_BLOCKING_MAX_THREADS (16)
+// completion fds kept for reuse once their calls are done
+#define FIBER_BLOCKING_MAX_IDLE_FDS (64)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// runs fn(arg) on a helper thread, suspending the calling fiber until it
+// returns. returns fn's result, with errno as fn left it. called from outside
+// a fiber (or if the pool can't take the call) fn simply runs inline.
+extern void* fiber_run_blocking(void* (*fn)(void*), void* arg);
+
+// stops the helper threads once the calls queued so far have run
+extern void fiber_blocking_shutdown();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
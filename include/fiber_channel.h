@@ -5,10 +5,12 @@
 #define _FIBER_CHANNEL_H_
 
 #include <assert.h>
+#include <errno.h>
 #include <malloc.h>
 #include <stddef.h>
 #include <stdint.h>
 
+#include "fiber_event.h"
 #include "fiber_manager.h"
 #include "fiber_signal.h"
 #include "machine_specific.h"
@@ -141,6 +143,37 @@ static inline int fiber_bounded_channel_try_receive(
   return 0;
 }
 
+// waits for the channel's signal, or yields if it has none, until
+// fiber_time_now_ns() >= deadline_ns. fails with ETIMEDOUT.
+static inline int fiber_channel_wait_until(fiber_signal_t* ready_signal,
+                                           uint64_t deadline_ns) {
+  if (ready_signal) {
+    return fiber_signal_timedwait(ready_signal, deadline_ns);
+  }
+  if (fiber_time_now_ns() >= deadline_ns) {
+    errno = ETIMEDOUT;
+    return FIBER_ERROR;
+  }
+  fiber_yield();
+  return FIBER_SUCCESS;
+}
+
+// fiber_bounded_channel_receive(), giving up once fiber_time_now_ns() >=
+// deadline_ns (UINT64_MAX waits forever). returns NULL with errno set to
+// ETIMEDOUT then.
+static inline void* fiber_bounded_channel_timed_receive(
+    fiber_bounded_channel_t* channel, uint64_t deadline_ns) {
+  assert(channel);
+
+  void* ret = NULL;
+  while (!fiber_bounded_channel_try_receive(channel, &ret)) {
+    if (!fiber_channel_wait_until(channel->ready_signal, deadline_ns)) {
+      return NULL;
+    }
+  }
+  return ret;
+}
+
 // a unbounded channel. send and receive will block. there can be many senders
 // but only one receiver
 typedef struct fiber_unbounded_channel {
@@ -204,6 +237,22 @@ static inline void* fiber_unbounded_channel_try_receive(
   return mpsc_fifo_trypop(&channel->queue);
 }
 
+// the caller owns the message when this function returns. gives up once
+// fiber_time_now_ns() >= deadline_ns (UINT64_MAX waits forever), returning NULL
+// with errno set to ETIMEDOUT.
+static inline void* fiber_unbounded_channel_timed_receive(
+    fiber_unbounded_channel_t* channel, uint64_t deadline_ns) {
+  assert(channel);
+
+  fiber_unbounded_channel_message_t* ret;
+  while (!(ret = mpsc_fifo_trypop(&channel->queue))) {
+    if (!fiber_channel_wait_until(channel->ready_signal, deadline_ns)) {
+      return NULL;
+    }
+  }
+  return ret;
+}
+
 // a unbounded channel. send and receive will block. there can be only one
 // sender and one receiver
 typedef struct fiber_unbounded_sp_channel {
@@ -267,4 +316,20 @@ static inline void* fiber_unbounded_sp_channel_try_receive(
   return spsc_fifo_trypop(&channel->queue);
 }
 
+// the caller owns the message when this function returns. gives up once
+// fiber_time_now_ns() >= deadline_ns (UINT64_MAX waits forever), returning NULL
+// with errno set to ETIMEDOUT.
+static inline void* fiber_unbounded_sp_channel_timed_receive(
+    fiber_unbounded_sp_channel_t* channel, uint64_t deadline_ns) {
+  assert(channel);
+
+  fiber_unbounded_sp_channel_message_t* ret;
+  while (!(ret = spsc_fifo_trypop(&channel->queue))) {
+    if (!fiber_channel_wait_until(channel->ready_signal, deadline_ns)) {
+      return NULL;
+    }
+  }
+  return ret;
+}
+
 #endif
@@ -11,14 +11,23 @@
 #include "mpsc_fifo.h"
 
 /*
-    Description: A condition variable structure for fibers.
+    Description: A condition variable structure for fibers. Signalling uses
+                 wait morphing: rather than being woken only to wait again for
+   the mutex, signalled waiters are moved onto the mutex's queue and woken
+   holding the lock (or, for a throughput mutex, to retry for it). A broadcast
+   moves every waiter across in one go, so only the first runs straight away.
+   Signallers don't lock anything: each claims the waiters it releases, and
+   one of them at a time moves every claimed waiter across. Waiters which time
+   out are released from the head of the queue by whoever moves next, which
+   includes the waiter timing out.
 */
 
 typedef struct fiber_cond {
   fiber_mutex_t* caller_mutex;
   _Atomic intptr_t waiter_count;
   mpsc_fifo_t waiters;
-  fiber_mutex_t internal_mutex;
+  _Atomic intptr_t to_move;  // claimed by signallers but not moved yet
+  _Atomic int moving;        // set while a signaller is moving waiters
 } fiber_cond_t;
 
 #ifdef __cplusplus
@@ -35,6 +44,11 @@ extern int fiber_cond_broadcast(fiber_cond_t* cond);
 
 extern int fiber_cond_wait(fiber_cond_t* cond, fiber_mutex_t* mutex);
 
+// fiber_cond_wait(), giving up with ETIMEDOUT once fiber_time_now_ns() >=
+// deadline_ns (UINT64_MAX waits forever). the mutex is held again either way.
+extern int fiber_cond_timedwait(fiber_cond_t* cond, fiber_mutex_t* mutex,
+                                uint64_t deadline_ns);
+
 #ifdef __cplusplus
 }
 #endif
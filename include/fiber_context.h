@@ -39,6 +39,10 @@ extern "C" {
 extern int fiber_context_init(fiber_context_t* context, size_t stack_size,
                               fiber_run_function_t run_function, void* param);
 
+// re-initializes a context whose function has completed, reusing its stack
+extern int fiber_context_reinit(fiber_context_t* context,
+                                fiber_run_function_t run_function, void* param);
+
 extern int fiber_context_init_from_thread(fiber_context_t* context);
 
 extern void fiber_context_swap(fiber_context_t* from_context,
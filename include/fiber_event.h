@@ -6,6 +6,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <time.h>
 
 // this variable controls how long idle threads wait for events, in
 // milliseconds. the value is important: high values may be better for workloads
@@ -14,6 +15,8 @@
 // TODO: make this a runtime config option?
 #define FIBER_TIME_RESOLUTION_MS 5  // ms
 
+struct fiber_wait;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -29,9 +32,18 @@ extern void fiber_event_shutdown();
 /* ABOUT EVENTS
 When a fiber manager thread is out of fibers to schedule, it will poll for
 events by calling fiber_poll_events(). if zero events are returned, it will
-enter a blocking poll by calling fiber_poll_events_blocking()
+park. engines with an event set per thread poll the calling thread's set and
+every parked thread blocks in fiber_poll_events_until_woken() on its own set.
+otherwise one parked thread at a time becomes the poller and blocks there; the
+others sleep until new work is scheduled. busy threads poll every
+FIBER_MANAGER_BUSY_POLL_INTERVAL yields so their events aren't starved.
 */
 
+// returns 1 if each fiber manager thread has its own event set. fds and
+// sleepers are then polled, and their fibers woken, by the thread the waiting
+// fiber ran on.
+extern int fiber_event_has_per_thread_sets();
+
 // called when a fiber manager thread is looking for events. returns the number
 // of events triggered or NOTINIT/TRYAGAIN
 extern int fiber_poll_events();
@@ -43,16 +55,66 @@ extern int fiber_poll_events();
 // triggered.
 extern size_t fiber_poll_events_blocking(uint32_t seconds, uint32_t useconds);
 
+// called by an idle fiber manager thread which is a poller. blocks until
+// events are triggered or fiber_event_wake_poller() is called. engines which
+// can't be woken return after FIBER_TIME_RESOLUTION_MS instead. returns the
+// number of events triggered.
+extern size_t fiber_poll_events_until_woken();
+
+// wakes the given manager thread if it's blocked in
+// fiber_poll_events_until_woken()
+extern void fiber_event_wake_poller(int manager_id);
+
 #define FIBER_POLL_IN (0x1)
 #define FIBER_POLL_OUT (0x2)
 
 // register to wait for an event. the calling fiber is suspended until the given
-// fd is ready to perform the operation(s) specified by events
+// fd is ready to perform the operation(s) specified by events. fails with errno
+// set if the fd can't be registered (ie. EPERM for a regular file), or EBADF
+// if it's closed while waiting.
 extern int fiber_wait_for_event(int fd, uint32_t events);
 
+// like fiber_wait_for_event(), but gives up once fiber_time_now_ns() >=
+// deadline_ns (UINT64_MAX waits forever), failing with errno set to ETIMEDOUT
+extern int fiber_wait_for_event_timeout(int fd, uint32_t events,
+                                        uint64_t deadline_ns);
+
+typedef struct fiber_event_fd {
+  int fd;
+  uint32_t events;  // FIBER_POLL_IN and/or FIBER_POLL_OUT
+} fiber_event_fd_t;
+
+// suspends the calling fiber until any of the fds may be ready for its events
+// or fiber_time_now_ns() >= deadline_ns (UINT64_MAX waits forever). readiness
+// is only a hint: callers check the fds themselves (ie. with a non-blocking
+// poll()) once this returns. fails like fiber_wait_for_event() if an fd can't
+// be registered.
+extern int fiber_wait_for_any_event(const fiber_event_fd_t* fds, size_t count,
+                                    uint64_t deadline_ns);
+
+// suspends the calling fiber, which is saving its state to wait and has queued
+// wait (see fiber_wait_t) for its waker, until the wait is claimed. if nobody
+// claims it by deadline_ns (UINT64_MAX waits forever) it's claimed as timed
+// out, failing with errno set to ETIMEDOUT.
+extern int fiber_event_wait_until(struct fiber_wait* wait,
+                                  uint64_t deadline_ns);
+
 // puts the calling fiber to sleep
 extern int fiber_sleep(uint32_t seconds, uint32_t useconds);
 
+// puts the calling fiber to sleep for at least the given number of nanoseconds
+extern int fiber_sleep_ns(uint64_t nanoseconds);
+
+// puts the calling fiber to sleep until fiber_time_now_ns() >= deadline_ns
+extern int fiber_sleep_until(uint64_t deadline_ns);
+
+// the clock used for sleeping: CLOCK_MONOTONIC, in nanoseconds
+static inline uint64_t fiber_time_now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
 // called when a file descriptor is closed
 extern void fiber_fd_closed(int fd);
 
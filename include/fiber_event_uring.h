@@ -0,0 +1,78 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#ifndef _FIBER_EVENT_URING_H_
+#define _FIBER_EVENT_URING_H_
+
+/*
+    Description: An io_uring extension to the native (epoll) event engine. Each
+                 fiber manager thread gets a ring next to its epoll set and
+                 socket IO is performed by the kernel as ring operations rather
+                 than waiting for readiness and then making the syscall.
+
+                 A fiber queues its operation on its thread's ring and is
+                 suspended until the completion arrives. Operations are
+                 submitted in batches whenever the thread polls for events
+                 (each pass of the scheduler loop, and every
+                 FIBER_MANAGER_BUSY_POLL_INTERVAL yields when busy), and the
+                 ring's fd sits in the thread's epoll set so a blocking poll
+                 wakes up for completions.
+
+                 Timers, wakeups and fiber_wait_for_event() stay with epoll.
+                 If the kernel lacks io_uring (or any operation used here) the
+                 rings are never set up and everything goes through epoll.
+*/
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fiber_manager.h"
+
+// the number of submission queue entries per ring. the completion queue is
+// four times as large.
+#define FIBER_URING_ENTRIES (256)
+// operations queued before a submission is forced outside of polling
+#define FIBER_URING_SUBMIT_BATCH (32)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// sets up a ring per fiber manager thread. returns FIBER_ERROR if io_uring
+// isn't usable, in which case nothing else here may be called.
+extern int fiber_uring_init(int num_rings);
+
+extern void fiber_uring_shutdown();
+
+// returns 1 if the rings are set up
+extern int fiber_uring_enabled();
+
+// the fd to watch for completions on the given manager's ring
+extern int fiber_uring_fd(int manager_id);
+
+// submits the operations queued on the calling manager's ring
+extern void fiber_uring_submit(fiber_manager_t* manager);
+
+// wakes the fibers whose operations have completed on the calling manager's
+// ring. returns the number of fibers woken.
+extern int fiber_uring_reap(fiber_manager_t* manager);
+
+// performs opcode (an IORING_OP_*) on fd, suspending the calling fiber until
+// it completes. the remaining parameters fill the submission entry's fields of
+// the same names. *result is set the way the equivalent syscall would return,
+// with errno set on failure. if the kernel reports EAGAIN the fiber waits for
+// events (FIBER_POLL_IN/OUT) with fiber_wait_for_event() and tries again.
+// returns FIBER_ERROR, leaving the caller to make the syscall itself, if the
+// operation couldn't be queued.
+extern int fiber_uring_perform(int fd, uint32_t events, uint8_t opcode,
+                               const void* addr, uint32_t len, uint64_t off,
+                               uint32_t op_flags, ssize_t* result);
+
+// cancels any operations in flight on fd. they complete with EBADF.
+extern void fiber_uring_fd_closed(int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
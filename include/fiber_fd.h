@@ -0,0 +1,92 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#ifndef _FIBER_FD_H_
+#define _FIBER_FD_H_
+
+/*
+    Description: The per-fd state shared by the io shims and the event engine,
+                 one cache line per fd so a blocking call does a single lookup.
+
+                 Records live in pages of FIBER_FD_PAGE_SIZE fds which are
+                 allocated the first time an fd in the page needs a record, so
+                 memory follows the fds a process actually uses rather than
+                 RLIMIT_NOFILE's hard limit. Pages are installed with a
+                 compare-and-swap and are never freed before
+                 fiber_fd_shutdown(), so lookups take no locks.
+*/
+
+#include <stdint.h>
+
+#include "fiber_qspinlock.h"
+#include "machine_specific.h"
+
+#define FIBER_FD_PAGE_BITS (8)
+#define FIBER_FD_PAGE_SIZE (1 << FIBER_FD_PAGE_BITS)
+
+// defined by the event engine
+struct fiber_fd_waiter;
+
+typedef struct fiber_fd {
+  // the event engine's wait state, protected by spinlock
+  fiber_qspinlock_t spinlock;
+  struct fiber_fd_waiter* waiters;
+  int events;  // one-shot: the events currently armed
+  int ready;   // edge triggered: the events reported and not yet consumed
+  int shard;   // the manager whose event set the fd is registered with
+  uint8_t added;
+  // the io shims' IO_FLAG_* bits (see fiber_io.c)
+  _Atomic uint8_t io_flags;
+  // io_uring operations in flight, so closing the fd only cancels when needed
+  _Atomic uint32_t uring_inflight;
+  // SO_RCVTIMEO and SO_SNDTIMEO, valid while the matching io flag is set
+  uint64_t recv_timeout_ns;
+  uint64_t send_timeout_ns;
+} __attribute__((aligned(FIBER_CACHELINE_SIZE))) fiber_fd_t;
+
+_Static_assert(sizeof(fiber_fd_t) == FIBER_CACHELINE_SIZE,
+               "expected fiber_fd_t to fill one cache line");
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// one past the largest fd with a record (RLIMIT_NOFILE's hard limit). 0 until
+// fiber_fd_init() is called.
+extern int fiber_fd_max;
+// the first level of the table, one pointer per FIBER_FD_PAGE_SIZE fds
+extern fiber_fd_t* _Atomic* fiber_fd_pages;
+
+// sizes the table from RLIMIT_NOFILE. no pages are allocated yet.
+extern int fiber_fd_init();
+
+extern void fiber_fd_shutdown();
+
+// allocates the page holding fd's record. returns NULL and sets errno if fd is
+// out of range or memory runs out.
+extern fiber_fd_t* fiber_fd_create(int fd);
+
+// returns fd's record, or NULL if its page hasn't been needed yet (nothing has
+// been recorded for it) or fd is out of range
+static inline fiber_fd_t* fiber_fd_find(int fd) {
+  if (fd < 0 || fd >= fiber_fd_max) {
+    return NULL;
+  }
+  fiber_fd_t* const page =
+      atomic_load_explicit(&fiber_fd_pages[fd >> FIBER_FD_PAGE_BITS],
+                           memory_order_acquire);
+  return page ? &page[fd & (FIBER_FD_PAGE_SIZE - 1)] : NULL;
+}
+
+// returns fd's record, allocating its page if needed. returns NULL and sets
+// errno on failure.
+static inline fiber_fd_t* fiber_fd_get(int fd) {
+  fiber_fd_t* const ret = fiber_fd_find(fd);
+  return ret ? ret : fiber_fd_create(fd);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,70 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#ifndef _FIBER_GROUP_H_
+#define _FIBER_GROUP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fiber.h"
+
+// a group runs detached child fibers and lets one fiber at a time wait for
+// all of them, or for any one of them, to finish. finishing children update a
+// single counter and only the child which satisfies the waiter wakes it;
+// children are reclaimed as they finish, without being joined.
+//
+// the state packs the number of children still running (low 32 bits), the
+// number finished but not yet reported to a waiter (FIBER_GROUP_FINISHED_*),
+// and what the waiter, if any, is waiting for (FIBER_GROUP_WAITING_*)
+#define FIBER_GROUP_RUNNING_MASK (0xFFFFFFFFULL)
+#define FIBER_GROUP_FINISHED_SHIFT (32)
+#define FIBER_GROUP_FINISHED_ONE (1ULL << FIBER_GROUP_FINISHED_SHIFT)
+#define FIBER_GROUP_FINISHED_MASK (0x3FFFFFFFULL << FIBER_GROUP_FINISHED_SHIFT)
+#define FIBER_GROUP_WAITING_ALL (1ULL << 62)
+#define FIBER_GROUP_WAITING_ANY (1ULL << 63)
+
+typedef struct fiber_group {
+  _Atomic uint64_t state;
+  fiber_t* waiter;  // valid while a FIBER_GROUP_WAITING_* bit is set
+} fiber_group_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int fiber_group_init(fiber_group_t* group);
+
+// every child must have finished
+extern void fiber_group_destroy(fiber_group_t* group);
+
+// runs run(param) in a new child of the group
+extern int fiber_group_spawn(fiber_group_t* group, size_t stack_size,
+                             fiber_run_function_t run, void* param);
+
+// runs run(params[i]) in count new children of the group, waking at most one
+// idle thread for all of them. if a child can't be created the ones before it
+// are left running and FIBER_ERROR is returned.
+extern int fiber_group_spawn_batch(fiber_group_t* group, size_t stack_size,
+                                   fiber_run_function_t run, void** params,
+                                   size_t count);
+
+// waits until every child has finished. all of them count as reported, so
+// fiber_group_wait_any() then only sees children spawned afterwards.
+extern int fiber_group_wait_all(fiber_group_t* group);
+
+// waits until a child which hasn't been reported yet has finished, and reports
+// it. fails with ECHILD if there are no children left to report.
+extern int fiber_group_wait_any(fiber_group_t* group);
+
+// the number of children which haven't finished yet
+extern size_t fiber_group_running(fiber_group_t* group);
+
+// called by a child of group as it finishes
+extern void fiber_group_child_finished(fiber_group_t* group);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -4,11 +4,15 @@
 #ifndef _FIBER_MANAGER_H_
 #define _FIBER_MANAGER_H_
 
+#include <signal.h>
+#include <time.h>
+
 #include "fiber.h"
 #include "fiber_mutex.h"
 #include "fiber_scheduler.h"
-#include "fiber_spinlock.h"
+#include "fiber_qspinlock.h"
 #include "mpmc_fifo.h"
+#include "mpmc_stack.h"
 #include "mpsc_fifo.h"
 #include "work_stealing_deque.h"
 
@@ -22,6 +26,107 @@ typedef struct fiber_mpmc_to_push {
   mpmc_fifo_node_t* node;
 } fiber_mpmc_to_push_t;
 
+// a timed wait (ie. fiber_mutex_timedlock) is queued as a fiber_wait_t rather
+// than the bare fiber. the wait is claimed exactly once, either by a waker
+// which takes it from the queue (FIBER_WAIT_WOKEN) or by the event engine once
+// the deadline passes (FIBER_WAIT_TIMED_OUT), and the claimer makes the fiber
+// runnable. a timed out wait stays queued: whoever takes it later skips it and
+// gives back whatever it had handed the waiter (a lock, a post), so the waiter
+// itself never has to find its way back into the queue.
+//
+// each fiber keeps its wait for reuse. the wait is shared by the fiber and the
+// queue it's in, and is freed by whichever lets go of it last.
+#define FIBER_WAIT_PENDING (0)
+#define FIBER_WAIT_WOKEN (1)
+#define FIBER_WAIT_TIMED_OUT (2)
+
+// marks a queued entry (ie. mpsc_fifo_node_t::data) as a fiber_wait_t
+#define FIBER_WAIT_TAG ((uintptr_t)1)
+
+typedef struct fiber_wait {
+  fiber_t* fiber;
+  _Atomic int state;       // FIBER_WAIT_*
+  _Atomic int refs;        // 2 while queued, otherwise 1
+  mpsc_fifo_node_t* node;  // pushed by mpsc waits, given back by the waker
+} fiber_wait_t;
+
+static inline void* fiber_wait_tag(fiber_wait_t* wait) {
+  return (void*)((uintptr_t)wait | FIBER_WAIT_TAG);
+}
+
+// returns the wait a queued entry holds, or NULL if it holds a fiber
+static inline fiber_wait_t* fiber_wait_untag(void* entry) {
+  return (uintptr_t)entry & FIBER_WAIT_TAG
+             ? (fiber_wait_t*)((uintptr_t)entry & ~FIBER_WAIT_TAG)
+             : NULL;
+}
+
+// returns 1 if the caller claimed wait, ending it with state
+static inline int fiber_wait_claim(fiber_wait_t* wait, int state) {
+  int expected = FIBER_WAIT_PENDING;
+  return atomic_compare_exchange_strong(&wait->state, &expected, state);
+}
+
+static inline void fiber_wait_release(fiber_wait_t* wait) {
+  if (atomic_fetch_sub_explicit(&wait->refs, 1, memory_order_acq_rel) == 1) {
+    free(wait->node);
+    free(wait);
+  }
+}
+
+// fibers are cached by power of 2 stack size class, from FIBER_MIN_STACK_SIZE
+// up to 1 << FIBER_CACHE_MAX_SHIFT bytes. larger stacks are never cached.
+#define FIBER_CACHE_MIN_SHIFT (10)
+#define FIBER_CACHE_MAX_SHIFT (23)
+#define FIBER_CACHE_NUM_CLASSES \
+  (FIBER_CACHE_MAX_SHIFT - FIBER_CACHE_MIN_SHIFT + 1)
+
+#define FIBER_CACHE_DEFAULT_LOW_WATERMARK (32)
+#define FIBER_CACHE_DEFAULT_HIGH_WATERMARK (128)
+
+// a fiber woken by another fiber goes in the waker's run_next slot and runs as
+// soon as the waker yields. other threads only steal it once it's been waiting
+// for FIBER_RUN_NEXT_GRACE_NS. after FIBER_RUN_NEXT_MAX_STREAK run_next fibers
+// in a row the scheduler's queue goes first, so fibers waking each other can't
+// starve the rest.
+#define FIBER_RUN_NEXT_GRACE_NS (5000)
+#define FIBER_RUN_NEXT_MAX_STREAK (64)
+
+// a manager which always has work polls for events every this many yields
+#define FIBER_MANAGER_BUSY_POLL_INTERVAL (256)
+
+// a monitor thread (sysmon) checks every interval for managers which haven't
+// switched fibers since the last check - blocked in a call the shims don't
+// cover, say - while fibers wait in their queues. those fibers are handed to
+// a parked manager, or failing that to one of up to FIBER_MANAGER_MAX_SPARES
+// spare threads started on demand. a spare only takes work from the manager
+// it's covering for and is retired once that manager switches fibers again.
+// while every manager is parked with nothing queued sysmon blocks instead,
+// until one of them is unparked.
+#define FIBER_MANAGER_SYSMON_DEFAULT_INTERVAL_NS (10000000ULL)
+#define FIBER_MANAGER_MAX_SPARES (4)
+
+// a fiber which has run for longer than its time slice yields at its next
+// fiber_maybe_yield(). slices are timed with the cpu's timestamp counter, from
+// the fiber's first check after being switched to. with preemption enabled a
+// timer on each manager thread also flags fibers which have used up their
+// slice, and the io shims yield for a flagged fiber on entry.
+#define FIBER_MANAGER_DEFAULT_TIME_SLICE_NS (10000000ULL)
+#ifndef FIBER_MANAGER_PREEMPT_SIGNAL
+#define FIBER_MANAGER_PREEMPT_SIGNAL (SIGURG)  // ignored by default
+#endif
+
+// work handed over by threads which aren't managers (see
+// fiber_spawn_external) is taken by one manager at a time, which spawns and
+// queues up to this many of its fibers whenever it looks for work. the rest
+// waits on that manager.
+#define FIBER_MANAGER_EXTERNAL_BATCH (64)
+
+typedef struct fiber_cache_bucket {
+  fiber_t* head;  // linked via fiber_t::scratch
+  size_t count;
+} fiber_cache_bucket_t;
+
 typedef struct fiber_manager {
   fiber_t* maintenance_fiber;
   fiber_t* volatile current_fiber;
@@ -32,13 +137,30 @@ typedef struct fiber_manager {
   hazard_pointer_thread_record_t* mpmc_hptr;
   fiber_mpmc_to_push_t mpmc_to_push;
   fiber_mutex_t* volatile mutex_to_unlock;
-  fiber_spinlock_t* volatile spinlock_to_unlock;
+  fiber_qspinlock_t* volatile spinlock_to_unlock;
   void** volatile set_wait_location;
   void* volatile set_wait_value;
   fiber_scheduler_t* scheduler;
   fiber_t* volatile done_fiber;
+  _Atomic(fiber_t*) run_next;
+  volatile uint64_t run_next_ns;  // when run_next was filled
+  int run_next_streak;
   int id;
+  int spare;                    // one of the threads started by sysmon
+  _Atomic int covering;         // a spare's stuck manager, or -1 if retired
+  mpmc_stack_node_t* external;  // taken from other threads, oldest first
+  uint64_t slice_start;         // when the current slice began, or 0
+  volatile int should_yield;    // set by the preemption timer
+  void* preempt_stack;          // set while this thread has a preemption timer
+  timer_t preempt_timer;
+  _Atomic uint32_t park_futex;  // 1 while parked waiting for work
+  volatile int polling;         // parked, blocked polling for events
+  int spinning;  // counted in fiber_manager_spinning_count while set
+  // set while a yield polls for events, where a spinlock waiter can't wait
+  // as a fiber (see fiber_qspinlock.h)
+  int polling_in_yield;
   uint64_t yield_count;
+  uint64_t busy_poll_yield_count;  // yield_count when last polled while busy
   uint64_t spin_count;
   uint64_t signal_spin_count;
   uint64_t multi_signal_spin_count;
@@ -47,26 +169,109 @@ typedef struct fiber_manager {
   uint64_t poll_count;
   uint64_t event_wait_count;
   uint64_t lock_contention_count;
+  uint64_t fiber_cache_hit_count;
+  uint64_t fiber_cache_miss_count;
+  uint64_t park_count;
+  uint64_t run_next_count;
+  uint64_t event_migrate_count;
+  uint64_t event_ctl_count;
+  uint64_t uring_op_count;
+  uint64_t uring_enter_count;
+  uint64_t blocking_count;
+  uint64_t sysmon_handoff_count;  // written by sysmon
+  uint64_t slice_yield_count;
+  uint64_t preempt_count;  // written by the preemption signal handler
+  uint64_t external_count;  // fibers spawned or woken by other threads
+  uint64_t spinlock_park_count;  // spinlock waiters which waited as fibers
+  fiber_cache_bucket_t fiber_cache[FIBER_CACHE_NUM_CLASSES];
 } fiber_manager_t;
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// idle managers park instead of polling for work. a manager looking for work
+// to steal is 'spinning'; while anyone spins, new work will be found without
+// waking a parked manager.
+extern _Atomic int fiber_manager_idle_count;
+extern _Atomic int fiber_manager_spinning_count;
+
+// wakes one parked manager (which then spins) if nobody is spinning
+extern void fiber_manager_wake_idle();
+
+// call after making a fiber runnable
+static inline void fiber_manager_wake_if_idle() {
+  // pairs with the barrier in fiber_manager_park: either the parking manager
+  // sees the runnable fiber or we see the parking manager
+  store_load_barrier();
+  if (atomic_load_explicit(&fiber_manager_idle_count, memory_order_relaxed) &&
+      !atomic_load_explicit(&fiber_manager_spinning_count,
+                            memory_order_relaxed)) {
+    fiber_manager_wake_idle();
+  }
+}
+
 static inline void fiber_manager_schedule(fiber_manager_t* manager,
                                           fiber_t* the_fiber) {
   assert(manager);
   assert(the_fiber);
   fiber_scheduler_schedule(manager->scheduler, the_fiber);
+  fiber_manager_wake_if_idle();
+}
+
+// fiber_manager_slice_expired() is true this many timestamp counter ticks into
+// a slice (see FIBER_MANAGER_DEFAULT_TIME_SLICE_NS)
+extern uint64_t fiber_manager_slice_cycles;
+
+// returns non-zero once the current fiber has used up its time slice, starting
+// the slice if this is the first check since the fiber was switched to
+static inline int fiber_manager_slice_expired(fiber_manager_t* manager) {
+  if (manager->should_yield) {
+    return 1;
+  }
+  const uint64_t now = cpu_timestamp();
+  if (!manager->slice_start) {
+    manager->slice_start = now;
+    return 0;
+  }
+  return now - manager->slice_start > fiber_manager_slice_cycles;
 }
 
+// schedules a fiber being woken by the current fiber in manager's run_next slot
+// (see FIBER_RUN_NEXT_GRACE_NS). any fiber already there is scheduled normally.
+extern void fiber_manager_schedule_next(fiber_manager_t* manager,
+                                        fiber_t* the_fiber);
+
 extern void fiber_manager_yield(fiber_manager_t* manager);
 
+// see fiber_yield_to
+extern void fiber_manager_yield_to(fiber_manager_t* manager, fiber_t* target);
+
+// the fiber most recently woken by this manager's fibers, if it hasn't run yet
+static inline fiber_t* fiber_manager_peek_run_next(fiber_manager_t* manager) {
+  assert(manager);
+  return atomic_load_explicit(&manager->run_next, memory_order_relaxed);
+}
+
 extern fiber_manager_t* fiber_manager_get();
 
 /* this should be called immediately when the applicaion starts */
 extern int fiber_manager_init(size_t num_threads);
 
+typedef struct fiber_manager_config {
+  size_t num_threads;
+  // NULL uses the built in scheduler named by the FIBER_SCHEDULER environment
+  // variable, or fiber_scheduler_wsd_ops if it isn't set
+  const fiber_scheduler_ops_t* scheduler;
+} fiber_manager_config_t;
+
+// fiber_manager_init(), choosing the scheduler too. fails with EINVAL if
+// FIBER_SCHEDULER names no built in scheduler.
+extern int fiber_manager_init_with_config(const fiber_manager_config_t* config);
+
+// the scheduler implementation the managers were started with
+extern const fiber_scheduler_ops_t* fiber_manager_get_scheduler();
+
 extern void fiber_shutdown();
 
 #define FIBER_MANAGER_STATE_NONE (0)
@@ -77,11 +282,37 @@ extern int fiber_manager_get_state();
 
 extern int fiber_manager_get_kernel_thread_count();
 
+// the managers plus their spare slots. every manager's id is below this.
+extern int fiber_manager_get_max_kernel_thread_count();
+
+// sets how long a manager may go without switching fibers before sysmon hands
+// its queued fibers to another thread. 0 disables sysmon; this must be done
+// before fiber_manager_init(), as that is when sysmon is started.
+extern int fiber_manager_set_sysmon_interval(uint64_t interval_ns);
+
+// sets how long a fiber runs before fiber_maybe_yield() yields. 0 disables time
+// slicing. this must be done before fiber_manager_init().
+extern int fiber_manager_set_time_slice(uint64_t slice_ns);
+
+extern uint64_t fiber_manager_get_time_slice();
+
+// starts a timer on each manager thread which flags fibers running past their
+// time slice, so they yield at the next shimmed io call as well as at
+// fiber_maybe_yield(). the timer counts the thread's cpu time and signals it
+// with FIBER_MANAGER_PREEMPT_SIGNAL. this must be done before
+// fiber_manager_init().
+extern int fiber_manager_set_preemption(int enabled);
+
 extern void fiber_manager_do_maintenance();
 
 extern void fiber_manager_wait_in_mpmc_queue(fiber_manager_t* manager,
                                              mpmc_fifo_t* fifo);
 
+// the wake functions take count waiters from the queue, waiting for them to
+// be queued if need be, and return how many fibers they woke. timed out waits
+// are skipped but count towards count. with a count of 0 they only try to take
+// one: they return 1 if it was woken, -1 if it had timed out and 0 if the queue
+// was empty.
 extern int fiber_manager_wake_from_mpmc_queue(fiber_manager_t* manager,
                                               mpmc_fifo_t* fifo, int count);
 
@@ -94,6 +325,34 @@ extern void fiber_manager_wait_in_mpsc_queue_and_unlock(
 extern int fiber_manager_wake_from_mpsc_queue(fiber_manager_t* manager,
                                               mpsc_fifo_t* fifo, int count);
 
+// readies the calling fiber's wait for a timed wait until deadline_ns (in
+// fiber_time_now_ns() time). call it before taking anything (a place in the
+// line for a lock, say) which the wait would have to give back. fails with
+// ETIMEDOUT if the deadline has already passed, or ENOMEM.
+extern fiber_wait_t* fiber_manager_get_wait(fiber_manager_t* manager,
+                                            uint64_t deadline_ns);
+
+// the timed waits. they fail with ETIMEDOUT if the deadline claimed the wait;
+// the wait is left in the queue for the waker to skip.
+extern int fiber_manager_wait_in_mpmc_queue_until(fiber_manager_t* manager,
+                                                  mpmc_fifo_t* fifo,
+                                                  fiber_wait_t* wait,
+                                                  uint64_t deadline_ns);
+
+extern int fiber_manager_wait_in_mpsc_queue_until(fiber_manager_t* manager,
+                                                  mpsc_fifo_t* fifo,
+                                                  fiber_wait_t* wait,
+                                                  uint64_t deadline_ns);
+
+extern int fiber_manager_wait_in_mpsc_queue_until_and_unlock(
+    fiber_manager_t* manager, mpsc_fifo_t* fifo, fiber_wait_t* wait,
+    uint64_t deadline_ns, fiber_mutex_t* mutex);
+
+// claims a queued wait for its waker and wakes its fiber. returns 0 if the
+// wait had timed out. the caller still holds the queue's reference.
+extern int fiber_manager_wake_wait(fiber_manager_t* manager,
+                                   fiber_wait_t* wait);
+
 extern void fiber_manager_set_and_wait(fiber_manager_t* manager,
                                        void** location, void* value);
 
@@ -111,6 +370,24 @@ extern mpmc_fifo_node_t* fiber_manager_get_mpmc_node();
 
 extern void fiber_manager_return_mpmc_node(mpmc_fifo_node_t* node);
 
+// returns the stack size actually used for a requested stack_size. while the
+// cache is enabled, stacks are rounded up to their cache size class; otherwise
+// stack_size is used as is.
+extern size_t fiber_manager_round_stack_size(size_t stack_size);
+
+// pops a completed fiber with a stack of exactly stack_size bytes from the
+// local cache (or the global overflow). returns NULL on a miss.
+extern fiber_t* fiber_manager_get_cached_fiber(fiber_manager_t* manager,
+                                               size_t stack_size);
+
+// caches a completed fiber for reuse, destroying it if the caches are full
+extern void fiber_manager_return_fiber(fiber_manager_t* manager, fiber_t* f);
+
+// each manager keeps up to 'high' fibers per stack size class. when a class
+// grows beyond 'high' it is trimmed back to 'low', with the excess moved to a
+// shared overflow. setting high to 0 disables caching.
+extern int fiber_manager_set_fiber_cache_watermarks(size_t low, size_t high);
+
 typedef struct fiber_manager_stats {
   uint64_t yield_count;
   uint64_t steal_count;
@@ -123,6 +400,21 @@ typedef struct fiber_manager_stats {
   uint64_t poll_count;
   uint64_t event_wait_count;
   uint64_t lock_contention_count;
+  uint64_t fiber_cache_hit_count;
+  uint64_t fiber_cache_miss_count;
+  uint64_t park_count;
+  uint64_t run_next_count;
+  uint64_t event_migrate_count;
+  uint64_t event_ctl_count;
+  uint64_t uring_op_count;
+  uint64_t uring_enter_count;
+  uint64_t blocking_count;
+  uint64_t sysmon_handoff_count;
+  uint64_t sysmon_check_count;  // how often sysmon has woken to check
+  uint64_t slice_yield_count;
+  uint64_t preempt_count;
+  uint64_t external_count;
+  uint64_t spinlock_park_count;
 } fiber_manager_stats_t;
 
 // stats are *added* to the values currently in *out
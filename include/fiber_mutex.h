@@ -12,29 +12,72 @@
    value below 0 must wait. Unlocking is done by atomically incrementing the
    counter. The unlocker must wake up a waiter if the counter is not 1 after an
    unlock operation (ie. other fibers were waiting).
+
+                 That is the default, fair mode: the lock is handed to the
+   longest waiting fiber. In throughput mode the counter instead holds a locked
+   bit, a bit set while a woken waiter is on its way to retry, and the number
+   of waiters. Unlocking clears the locked bit, so any fiber may take the lock
+   (barging), and wakes a waiter to try again if none is already on its way.
+
+                 In either mode a fiber finding the lock held by a fiber on
+   another thread spins for a while before waiting, in case it's released soon.
 */
 
 #include "mpsc_fifo.h"
 
+struct fiber_manager;
+
+#define FIBER_MUTEX_FAIR (0)
+#define FIBER_MUTEX_THROUGHPUT (1)
+
+#define FIBER_MUTEX_LOCKED (1)
+#define FIBER_MUTEX_WOKEN (2)
+#define FIBER_MUTEX_WAITER (4)
+
+// a fiber spins for at most this many checks of a held lock. the actual limit
+// follows how long recent lockers spun before getting it, so spinning stops
+// paying once critical sections get long.
+#define FIBER_MUTEX_MAX_SPIN (200)
+
 typedef struct fiber_mutex {
   _Atomic int counter;
   mpsc_fifo_t waiters;
+  int mode;                              // FIBER_MUTEX_FAIR or _THROUGHPUT
+  volatile int spin_estimate;            // recent spins, averaged
+  struct fiber_manager* volatile owner;  // the holder's manager, if known
 } fiber_mutex_t;
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// initializes a FIBER_MUTEX_FAIR mutex
 extern int fiber_mutex_init(fiber_mutex_t* mutex);
 
+// fails with EINVAL if mode isn't FIBER_MUTEX_FAIR or FIBER_MUTEX_THROUGHPUT
+extern int fiber_mutex_init_with_mode(fiber_mutex_t* mutex, int mode);
+
 extern int fiber_mutex_destroy(fiber_mutex_t* mutex);
 
 extern int fiber_mutex_lock(fiber_mutex_t* mutex);
 
 extern int fiber_mutex_trylock(fiber_mutex_t* mutex);
 
+// fiber_mutex_lock(), giving up with ETIMEDOUT once fiber_time_now_ns() >=
+// deadline_ns (UINT64_MAX waits forever)
+extern int fiber_mutex_timedlock(fiber_mutex_t* mutex, uint64_t deadline_ns);
+
 extern int fiber_mutex_unlock_internal(fiber_mutex_t* mutex);
 
+// wait morphing (see fiber_cond.c): moves count waiting fibers, queued as the
+// nodes linked from first to last, onto the mutex's queue as if each had gone
+// to wait for the lock itself. a fiber woken from there takes the lock with
+// fiber_mutex_lock_requeued() instead of fiber_mutex_lock().
+extern void fiber_mutex_requeue(fiber_mutex_t* mutex, mpsc_fifo_node_t* first,
+                                mpsc_fifo_node_t* last, int count);
+
+extern int fiber_mutex_lock_requeued(fiber_mutex_t* mutex);
+
 extern int fiber_mutex_unlock(fiber_mutex_t* mutex);
 
 #ifdef __cplusplus
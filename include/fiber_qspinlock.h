@@ -0,0 +1,77 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#ifndef _FIBER_QSPINLOCK_H_
+#define _FIBER_QSPINLOCK_H_
+
+/*
+    Description: A queued spin lock for fibers, in the style of MCS (and the
+                 Linux kernel's qspinlock). Rather than every waiter spinning on
+   the lock itself, each waiter queues a node and spins on its own node until
+   it's at the head of the queue; only the head spins on the lock. Releasing
+   the lock therefore touches one waiter's cache line, not all of them.
+
+                 A waiter which has spun for the spin budget (see
+   fiber_qspinlock_set_spin_budget) waits as a fiber instead, so its thread can
+   run other fibers (or park) while the lock is held for a long time, or by a
+   thread the OS has descheduled. It's woken by whoever makes it the head of
+   the queue, or by the unlocker once it's the head. Where a fiber can't wait
+   - in the scheduler, while polling for events, or on a thread which isn't a
+   fiber manager - the caller spins on the lock itself without queueing, since
+   the waiter ahead of it may be due to run on the same thread.
+
+                 The head takes the lock from the queue as it gets it, so
+   queue nodes live on the waiters' stacks, and the lock can be released from
+   any context (see fiber_manager_t.spinlock_to_unlock). Nodes are cache line
+   aligned, so the tail pointer shares a word with the lock bits, keeping the
+   lock to two words.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FIBER_QSPINLOCK_LOCKED (1)
+#define FIBER_QSPINLOCK_PARKED (2)  // the head of the queue is waiting
+#define FIBER_QSPINLOCK_BITS (FIBER_QSPINLOCK_LOCKED | FIBER_QSPINLOCK_PARKED)
+
+// checks of a held lock (or of a node before it's the head) before a waiter
+// waits as a fiber
+#define FIBER_QSPINLOCK_DEFAULT_SPIN_BUDGET (1000)
+
+typedef struct fiber_qspinlock_node fiber_qspinlock_node_t;
+
+typedef struct fiber_qspinlock {
+  // the last waiter queued (or NULL), ORed with the FIBER_QSPINLOCK_* bits
+  _Atomic uintptr_t state;
+  _Atomic(void*) parked;  // the head's fiber, once it waits
+} fiber_qspinlock_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FIBER_QSPINLOCK_INITIALIZER \
+  {}
+
+extern int fiber_qspinlock_init(fiber_qspinlock_t* spinlock);
+
+extern int fiber_qspinlock_destroy(fiber_qspinlock_t* spinlock);
+
+extern int fiber_qspinlock_lock(fiber_qspinlock_t* spinlock);
+
+// takes the lock if it's free, even if waiters are queued
+extern int fiber_qspinlock_trylock(fiber_qspinlock_t* spinlock);
+
+extern int fiber_qspinlock_unlock(fiber_qspinlock_t* spinlock);
+
+// sets how many times a waiter checks the lock before it waits as a fiber. 0
+// waits straight away.
+extern void fiber_qspinlock_set_spin_budget(uint32_t budget);
+
+extern uint32_t fiber_qspinlock_get_spin_budget();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -4,31 +4,72 @@
 #ifndef _FIBER_RWLOCK_H_
 #define _FIBER_RWLOCK_H_
 
+/*
+    Description: A read/write lock for fibers. By default every lock and unlock
+                 updates one shared word, which holds the lock's whole state.
+
+                 A FIBER_RWLOCK_READ_BIASED lock keeps a reader count for each
+   manager thread as well (in the style of BRAVO). While the lock is biased
+   towards readers they only touch their own thread's count, so readers on
+   different threads don't contend. A writer revokes the bias and waits for
+   those counts to drain; readers then use the shared word until they've gone
+   FIBER_RWLOCK_INHIBIT_MULTIPLIER times as long as revoking took, after which
+   the next reader to find the lock free restores the bias. Threads which
+   aren't managers share one extra count. A fiber may unlock on a different
+   thread to the one it locked on, so only the sum of the counts means
+   anything.
+*/
+
+#include "machine_specific.h"
 #include "mpsc_fifo.h"
 
-// 21 bits counters; supports up to roughly 2 million readers or writers
+#define FIBER_RWLOCK_DEFAULT (0)
+#define FIBER_RWLOCK_READ_BIASED (1)
+
+#define FIBER_RWLOCK_INHIBIT_MULTIPLIER (9)
+
+// supports up to roughly 1 million readers and 2 million waiting readers or
+// writers
 typedef union {
   struct {
     unsigned int write_locked : 1;
-    unsigned int reader_count : 21;
+    unsigned int biased : 1;  // readers are counted by their threads instead
+    unsigned int reader_count : 20;
     unsigned int waiting_readers : 21;
     unsigned int waiting_writers : 21;
   } __attribute__((packed)) state;
   uint64_t blob;
 } __attribute__((packed)) fiber_rwlock_state_t;
 
+// one manager thread's readers of a FIBER_RWLOCK_READ_BIASED lock
+typedef struct fiber_rwlock_indicator {
+  _Atomic intptr_t count;
+  char _cache_padding1[FIBER_CACHELINE_SIZE - sizeof(intptr_t)];
+} fiber_rwlock_indicator_t;
+
 typedef struct fiber_rwlock {
   fiber_rwlock_state_t state;
   mpsc_fifo_t write_waiters;
   mpsc_fifo_t read_waiters;
+  // indexed by manager id, followed by one for threads which aren't managers.
+  // NULL unless FIBER_RWLOCK_READ_BIASED.
+  fiber_rwlock_indicator_t* indicators;
+  int num_indicators;
+  volatile uint64_t inhibit_until_ns;  // the bias isn't restored before this
 } fiber_rwlock_t;
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// initializes a FIBER_RWLOCK_DEFAULT lock
 extern int fiber_rwlock_init(fiber_rwlock_t* rwlock);
 
+// fails with EINVAL if mode isn't FIBER_RWLOCK_DEFAULT or
+// FIBER_RWLOCK_READ_BIASED, or if a FIBER_RWLOCK_READ_BIASED lock is
+// initialized before the managers are started (see fiber_manager_init)
+extern int fiber_rwlock_init_with_mode(fiber_rwlock_t* rwlock, int mode);
+
 extern void fiber_rwlock_destroy(fiber_rwlock_t* rwlock);
 
 extern int fiber_rwlock_rdlock(fiber_rwlock_t* rwlock);
@@ -39,6 +80,14 @@ extern int fiber_rwlock_tryrdlock(fiber_rwlock_t* rwlock);
 
 extern int fiber_rwlock_trywrlock(fiber_rwlock_t* rwlock);
 
+// the timed lock functions give up with ETIMEDOUT once fiber_time_now_ns() >=
+// deadline_ns (UINT64_MAX waits forever)
+extern int fiber_rwlock_timedrdlock(fiber_rwlock_t* rwlock,
+                                    uint64_t deadline_ns);
+
+extern int fiber_rwlock_timedwrlock(fiber_rwlock_t* rwlock,
+                                    uint64_t deadline_ns);
+
 extern int fiber_rwlock_rdunlock(fiber_rwlock_t* rwlock);
 
 extern int fiber_rwlock_wrunlock(fiber_rwlock_t* rwlock);
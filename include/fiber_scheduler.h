@@ -5,27 +5,99 @@
 #define _FIBER_SCHEDULER_H_
 
 #include "fiber.h"
+#include "machine_specific.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-typedef void* fiber_scheduler_t;
+// each thread queues fibers by priority and runs the highest priority fiber
+// waiting. a lower level which has waited through this many picks from higher
+// levels in a row gets the next pick, so it can't be starved.
+#define FIBER_SCHEDULER_AGING_LIMIT (16)
 
-int fiber_scheduler_init(size_t num_threads);
+typedef struct fiber_scheduler_ops fiber_scheduler_ops_t;
 
-void fiber_scheduler_shutdown();
+// a thread's scheduler. each implementation's per-thread state starts with
+// this, and the operations are looked up through it.
+typedef struct fiber_scheduler {
+  const fiber_scheduler_ops_t* ops;
+} fiber_scheduler_t;
 
-fiber_scheduler_t* fiber_scheduler_for_thread(size_t thread_id);
+// a scheduler implementation, chosen when the managers are started (see
+// fiber_manager_init_with_config)
+struct fiber_scheduler_ops {
+  const char* name;
+  int (*init)(size_t num_threads);
+  void (*shutdown)();
+  fiber_scheduler_t* (*for_thread)(size_t thread_id);
+  void (*schedule)(fiber_scheduler_t* scheduler, fiber_t* the_fiber);
+  fiber_t* (*next)(fiber_scheduler_t* scheduler);
+  void (*load_balance)(fiber_scheduler_t* scheduler);
+  // takes work from one particular scheduler, whatever its load
+  void (*steal_from)(fiber_scheduler_t* scheduler, fiber_scheduler_t* victim);
+  // returns non-zero if fibers are waiting in the scheduler's queues. from
+  // another thread the answer may already be stale.
+  int (*has_work)(fiber_scheduler_t* scheduler);
+  void (*stats)(fiber_scheduler_t* scheduler, uint64_t* steal_count,
+                uint64_t* failed_steal_count);
+};
 
-void fiber_scheduler_schedule(fiber_scheduler_t* scheduler, fiber_t* the_fiber);
+// the built in schedulers. wsd (work stealing deques) is the default; dist
+// shares a multi-producer queue per thread.
+extern const fiber_scheduler_ops_t fiber_scheduler_wsd_ops;
+extern const fiber_scheduler_ops_t fiber_scheduler_dist_ops;
 
-fiber_t* fiber_scheduler_next(fiber_scheduler_t* scheduler);
+// returns the built in scheduler called name, or NULL if there isn't one
+extern const fiber_scheduler_ops_t* fiber_scheduler_find(const char* name);
 
-void fiber_scheduler_load_balance(fiber_scheduler_t* scheduler);
+extern int fiber_scheduler_init(const fiber_scheduler_ops_t* ops,
+                                size_t num_threads);
 
-void fiber_scheduler_stats(fiber_scheduler_t* scheduler, uint64_t* steal_count,
-                           uint64_t* failed_steal_count);
+extern void fiber_scheduler_shutdown();
+
+extern fiber_scheduler_t* fiber_scheduler_for_thread(size_t thread_id);
+
+// the default scheduler's hot operations are called directly rather than
+// through its ops, so they stay cheap when nothing else is configured
+extern void fiber_scheduler_wsd_schedule(fiber_scheduler_t* scheduler,
+                                         fiber_t* the_fiber);
+extern fiber_t* fiber_scheduler_wsd_next(fiber_scheduler_t* scheduler);
+
+static inline void fiber_scheduler_schedule(fiber_scheduler_t* scheduler,
+                                            fiber_t* the_fiber) {
+  if (fiber_likely(scheduler->ops == &fiber_scheduler_wsd_ops)) {
+    fiber_scheduler_wsd_schedule(scheduler, the_fiber);
+  } else {
+    scheduler->ops->schedule(scheduler, the_fiber);
+  }
+}
+
+static inline fiber_t* fiber_scheduler_next(fiber_scheduler_t* scheduler) {
+  if (fiber_likely(scheduler->ops == &fiber_scheduler_wsd_ops)) {
+    return fiber_scheduler_wsd_next(scheduler);
+  }
+  return scheduler->ops->next(scheduler);
+}
+
+static inline void fiber_scheduler_load_balance(fiber_scheduler_t* scheduler) {
+  scheduler->ops->load_balance(scheduler);
+}
+
+static inline void fiber_scheduler_steal_from(fiber_scheduler_t* scheduler,
+                                              fiber_scheduler_t* victim) {
+  scheduler->ops->steal_from(scheduler, victim);
+}
+
+static inline int fiber_scheduler_has_work(fiber_scheduler_t* scheduler) {
+  return scheduler->ops->has_work(scheduler);
+}
+
+static inline void fiber_scheduler_stats(fiber_scheduler_t* scheduler,
+                                         uint64_t* steal_count,
+                                         uint64_t* failed_steal_count) {
+  scheduler->ops->stats(scheduler, steal_count, failed_steal_count);
+}
 
 #ifdef __cplusplus
 }
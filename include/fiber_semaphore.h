@@ -23,6 +23,11 @@ extern int fiber_semaphore_wait(fiber_semaphore_t* semaphore);
 
 extern int fiber_semaphore_trywait(fiber_semaphore_t* semaphore);
 
+// fiber_semaphore_wait(), giving up with ETIMEDOUT once fiber_time_now_ns() >=
+// deadline_ns (UINT64_MAX waits forever)
+extern int fiber_semaphore_timedwait(fiber_semaphore_t* semaphore,
+                                     uint64_t deadline_ns);
+
 extern int fiber_semaphore_post(fiber_semaphore_t* semaphore);
 
 extern int fiber_semaphore_getvalue(fiber_semaphore_t* semaphore);
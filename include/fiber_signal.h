@@ -8,6 +8,8 @@
 #include <stdint.h>
 
 #include "fiber.h"
+#include "fiber_event.h"
+#include "fiber_manager.h"
 #include "machine_specific.h"
 
 // A signal can be waited on by exactly one fiber. Any number of threads can
@@ -55,25 +57,74 @@ static inline void fiber_signal_wait(fiber_signal_t* s) {
   s->waiter = FIBER_SIGNAL_NO_WAITER;
 }
 
+// fiber_signal_wait(), giving up with ETIMEDOUT once fiber_time_now_ns() >=
+// deadline_ns (UINT64_MAX waits forever). a timed waiter is stored as its
+// fiber_wait_t (see fiber_manager.h), tagged; a raise which finds it timed out
+// leaves the signal raised for the next wait.
+static inline int fiber_signal_timedwait(fiber_signal_t* s,
+                                         uint64_t deadline_ns) {
+  assert(s);
+
+  fiber_manager_t* const manager = fiber_manager_get();
+  if (atomic_load_explicit(&s->waiter, memory_order_acquire) !=
+      FIBER_SIGNAL_RAISED) {
+    fiber_wait_t* const wait = fiber_manager_get_wait(manager, deadline_ns);
+    if (!wait) {
+      return FIBER_ERROR;
+    }
+    fiber_t* const tagged = (fiber_t*)fiber_wait_tag(wait);
+    atomic_store_explicit(&wait->refs, 2, memory_order_relaxed);
+    wait->fiber->state = FIBER_STATE_SAVING_STATE_TO_WAIT;
+    fiber_t* expected = (fiber_t*)FIBER_SIGNAL_NO_WAITER;
+    if (atomic_compare_exchange_strong_explicit(&s->waiter, &expected, tagged,
+                                                memory_order_release,
+                                                memory_order_relaxed)) {
+      if (!fiber_event_wait_until(wait, deadline_ns)) {
+        // take the wait back, unless a raiser has it (and releases it)
+        expected = tagged;
+        if (atomic_compare_exchange_strong(&s->waiter, &expected,
+                                           FIBER_SIGNAL_NO_WAITER)) {
+          fiber_wait_release(wait);
+        }
+        return FIBER_ERROR;
+      }
+    } else {
+      // the signal was raised; nobody else has seen the wait
+      wait->fiber->state = FIBER_STATE_RUNNING;
+      atomic_store_explicit(&wait->refs, 1, memory_order_relaxed);
+    }
+  }
+  // the signal has been raised
+  s->waiter = FIBER_SIGNAL_NO_WAITER;
+  return FIBER_SUCCESS;
+}
+
 // returns 1 if a fiber was woken
 static inline int fiber_signal_raise(fiber_signal_t* s) {
   assert(s);
 
   fiber_t* const old = (fiber_t*)atomic_exchange_explicit(
       &s->waiter, FIBER_SIGNAL_RAISED, memory_order_release);
-  if (old != FIBER_SIGNAL_NO_WAITER && old != FIBER_SIGNAL_RAISED) {
-    // we successfully signalled while a fiber was waiting
-    s->waiter = FIBER_SIGNAL_NO_WAITER;
-    fiber_manager_t* const manager = fiber_manager_get();
-    while (old->scratch != FIBER_SIGNAL_READY_TO_WAKE) {
-      cpu_relax();  // the other fiber is still in the process of going to sleep
-      manager->signal_spin_count += 1;
-    }
-    old->state = FIBER_STATE_READY;
-    fiber_manager_schedule(manager, old);
-    return 1;
+  if (old == FIBER_SIGNAL_NO_WAITER || old == FIBER_SIGNAL_RAISED) {
+    return 0;
   }
-  return 0;
+  fiber_wait_t* const wait = fiber_wait_untag(old);
+  if (wait) {
+    // the raise stays pending if the waiter had timed out
+    const int woken = fiber_manager_wake_wait(fiber_manager_get(), wait);
+    fiber_wait_release(wait);
+    return woken;
+  }
+  // we successfully signalled while a fiber was waiting
+  s->waiter = FIBER_SIGNAL_NO_WAITER;
+  fiber_manager_t* const manager = fiber_manager_get();
+  while (old->scratch != FIBER_SIGNAL_READY_TO_WAKE) {
+    cpu_relax();  // the other fiber is still in the process of going to sleep
+    manager->signal_spin_count += 1;
+  }
+  old->state = FIBER_STATE_READY;
+  fiber_manager_schedule_next(manager, old);
+  return 1;
 }
 
 // A multi-signal allows any number of fibers to wait. Any number of fibers can
@@ -199,7 +250,7 @@ static inline int fiber_multi_signal_raise(fiber_multi_signal_t* s) {
           manager->multi_signal_spin_count += 1;
         }
         to_wake->state = FIBER_STATE_READY;
-        fiber_manager_schedule(manager, to_wake);
+        fiber_manager_schedule_next(manager, to_wake);
         return 1;
       }
     }
@@ -238,7 +289,7 @@ static inline void fiber_multi_signal_raise_strict(fiber_multi_signal_t* s) {
           manager->multi_signal_spin_count += 1;
         }
         to_wake->state = FIBER_STATE_READY;
-        fiber_manager_schedule(manager, to_wake);
+        fiber_manager_schedule_next(manager, to_wake);
         return;
       }
     }
@@ -0,0 +1,69 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#ifndef _FIBER_STACK_ARENA_H_
+#define _FIBER_STACK_ARENA_H_
+
+/*
+    Description: A stack allocator which carves fiber stacks out of a few large
+                 reserved regions instead of mapping each stack separately.
+                 Every slot is a guard page followed by the usable stack, and
+                 freed slots go onto a lock-free freelist for their size class,
+                 so allocating a stack is usually a single pop.
+
+                 Where the kernel supports MADV_GUARD_INSTALL (Linux 6.13+)
+                 the guard pages don't split the region, so a million stacks
+                 cost a handful of VMAs rather than two each. Older kernels
+                 fall back to mprotect(), which works but splits the region.
+
+                 Memory is never returned to the kernel - regions live for the
+                 lifetime of the process and freed slots are only reused.
+*/
+
+#include <stddef.h>
+
+// usable stack sizes are rounded up to page_size << k. stacks larger than the
+// biggest class get a mapping of their own.
+#define FIBER_STACK_ARENA_MAX_SHIFT (23)
+// the size of each reserved region. untouched pages in a region cost address
+// space but no memory.
+#define FIBER_STACK_ARENA_REGION_SIZE ((size_t)64 << 20)
+// the number of slots carved from a region each time a freelist runs dry
+#define FIBER_STACK_ARENA_CARVE_BATCH (32)
+
+typedef enum fiber_stack_arena_hugepage_policy {
+  // leave transparent huge pages up to the system setting
+  FIBER_STACK_ARENA_HUGEPAGE_DEFAULT = 0,
+  // MADV_NOHUGEPAGE - each small stack only touches a few pages, so huge
+  // pages mostly waste memory
+  FIBER_STACK_ARENA_HUGEPAGE_NEVER,
+  // MADV_HUGEPAGE - fewer TLB misses for fibers with large, deep stacks
+  FIBER_STACK_ARENA_HUGEPAGE_ALWAYS,
+} fiber_stack_arena_hugepage_policy_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// sets the huge page policy for regions reserved from now on. call it before
+// the first fiber is created for it to apply to every stack.
+extern void fiber_stack_arena_set_hugepage_policy(
+    fiber_stack_arena_hugepage_policy_t policy);
+
+// guards slots carved from now on with mprotect(), as on kernels without
+// MADV_GUARD_INSTALL. slots which already have guards keep them.
+extern void fiber_stack_arena_use_mprotect_guards();
+
+// allocates a stack with at least stack_size usable bytes. the first page of
+// the returned block is a guard page. *out_size is set to the size of the whole
+// block, which must be passed back to fiber_stack_arena_free(). returns NULL
+// and sets errno on failure.
+extern void* fiber_stack_arena_alloc(size_t stack_size, size_t* out_size);
+
+extern void fiber_stack_arena_free(void* stack, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
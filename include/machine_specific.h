@@ -63,6 +63,17 @@ static inline void cpu_relax() {
 #endif
 }
 
+/* reads the cpu's timestamp counter, which ticks at a constant rate */
+static inline uint64_t cpu_timestamp() {
+#if defined(__i386__) || defined(__x86_64__)
+  uint32_t low, high;
+  __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+  return ((uint64_t)high << 32) | low;
+#else
+#error please define a cpu_timestamp()
+#endif
+}
+
 typedef struct pointer_pair {
   void* low;
   void* high;
@@ -42,16 +42,24 @@ static inline void mpsc_fifo_destroy(mpsc_fifo_t* f) {
   }
 }
 
-// the FIFO owns new_node after pushing
-static inline void mpsc_fifo_push(mpsc_fifo_t* f, mpsc_fifo_node_t* new_node) {
+// pushes the nodes linked from first to last all at once. the FIFO owns them
+// after pushing
+static inline void mpsc_fifo_push_chain(mpsc_fifo_t* f, mpsc_fifo_node_t* first,
+                                        mpsc_fifo_node_t* last) {
   assert(f);
-  assert(new_node);
-  new_node->next = NULL;
+  assert(first);
+  assert(last);
+  last->next = NULL;
   // the node must be terminated before it's visible to the
   // reader as the new tail
   mpsc_fifo_node_t* const prev_tail =
-      atomic_exchange_explicit(&f->tail, new_node, memory_order_release);
-  prev_tail->next = new_node;
+      atomic_exchange_explicit(&f->tail, last, memory_order_release);
+  prev_tail->next = first;
+}
+
+// the FIFO owns new_node after pushing
+static inline void mpsc_fifo_push(mpsc_fifo_t* f, mpsc_fifo_node_t* new_node) {
+  mpsc_fifo_push_chain(f, new_node, new_node);
 }
 
 // returns 1 if a node is available, 0 otherwise
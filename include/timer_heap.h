@@ -0,0 +1,158 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#ifndef _TIMER_HEAP_H_
+#define _TIMER_HEAP_H_
+
+/*
+    Description: A 4-ary min-heap of timer nodes ordered by deadline. Nodes are
+                 owned by the caller (typically on a waiting fiber's stack) and
+                 track their own position, so any node can be removed in
+                 O(log n). The heap is not thread safe; callers provide their
+                 own locking.
+*/
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define TIMER_HEAP_ARITY (4)
+#define TIMER_HEAP_INVALID_INDEX ((size_t)-1)
+
+typedef struct timer_heap_node {
+  uint64_t deadline;
+  size_t index;  // position in the heap, TIMER_HEAP_INVALID_INDEX if not queued
+  void* data;
+} timer_heap_node_t;
+
+typedef struct timer_heap {
+  timer_heap_node_t** nodes;
+  size_t size;
+  size_t capacity;
+} timer_heap_t;
+
+static inline int timer_heap_init(timer_heap_t* heap, size_t initial_capacity) {
+  assert(heap);
+  assert(initial_capacity);
+  heap->nodes = (timer_heap_node_t**)malloc(initial_capacity *
+                                            sizeof(*heap->nodes));
+  heap->size = 0;
+  heap->capacity = heap->nodes ? initial_capacity : 0;
+  return heap->nodes ? 1 : 0;
+}
+
+static inline void timer_heap_destroy(timer_heap_t* heap) {
+  if (heap) {
+    free(heap->nodes);
+    heap->nodes = NULL;
+    heap->size = 0;
+    heap->capacity = 0;
+  }
+}
+
+static inline size_t timer_heap_size(const timer_heap_t* heap) {
+  assert(heap);
+  return heap->size;
+}
+
+static inline void timer_heap_place(timer_heap_t* heap, size_t index,
+                                    timer_heap_node_t* node) {
+  heap->nodes[index] = node;
+  node->index = index;
+}
+
+static inline void timer_heap_sift_up(timer_heap_t* heap, size_t index) {
+  timer_heap_node_t* const node = heap->nodes[index];
+  while (index > 0) {
+    const size_t parent = (index - 1) / TIMER_HEAP_ARITY;
+    if (heap->nodes[parent]->deadline <= node->deadline) {
+      break;
+    }
+    timer_heap_place(heap, index, heap->nodes[parent]);
+    index = parent;
+  }
+  timer_heap_place(heap, index, node);
+}
+
+static inline void timer_heap_sift_down(timer_heap_t* heap, size_t index) {
+  timer_heap_node_t* const node = heap->nodes[index];
+  while (1) {
+    const size_t first_child = index * TIMER_HEAP_ARITY + 1;
+    if (first_child >= heap->size) {
+      break;
+    }
+    size_t last_child = first_child + TIMER_HEAP_ARITY;
+    if (last_child > heap->size) {
+      last_child = heap->size;
+    }
+    size_t min_child = first_child;
+    size_t i;
+    for (i = first_child + 1; i < last_child; ++i) {
+      if (heap->nodes[i]->deadline < heap->nodes[min_child]->deadline) {
+        min_child = i;
+      }
+    }
+    if (node->deadline <= heap->nodes[min_child]->deadline) {
+      break;
+    }
+    timer_heap_place(heap, index, heap->nodes[min_child]);
+    index = min_child;
+  }
+  timer_heap_place(heap, index, node);
+}
+
+// returns 0 if the heap could not grow to hold the node
+static inline int timer_heap_push(timer_heap_t* heap, timer_heap_node_t* node) {
+  assert(heap);
+  assert(node);
+  if (heap->size == heap->capacity) {
+    const size_t new_capacity = heap->capacity ? heap->capacity * 2 : 16;
+    timer_heap_node_t** const new_nodes = (timer_heap_node_t**)realloc(
+        heap->nodes, new_capacity * sizeof(*heap->nodes));
+    if (!new_nodes) {
+      return 0;
+    }
+    heap->nodes = new_nodes;
+    heap->capacity = new_capacity;
+  }
+  const size_t index = heap->size;
+  heap->size += 1;
+  timer_heap_place(heap, index, node);
+  timer_heap_sift_up(heap, index);
+  return 1;
+}
+
+// returns the node with the earliest deadline, or NULL if the heap is empty
+static inline timer_heap_node_t* timer_heap_peek(const timer_heap_t* heap) {
+  assert(heap);
+  return heap->size ? heap->nodes[0] : NULL;
+}
+
+// removes a node which is currently in the heap
+static inline void timer_heap_remove(timer_heap_t* heap,
+                                     timer_heap_node_t* node) {
+  assert(heap);
+  assert(node);
+  const size_t index = node->index;
+  assert(index < heap->size);
+  assert(heap->nodes[index] == node);
+  heap->size -= 1;
+  if (index != heap->size) {
+    timer_heap_place(heap, index, heap->nodes[heap->size]);
+    timer_heap_sift_down(heap, index);
+    timer_heap_sift_up(heap, index);
+  }
+  node->index = TIMER_HEAP_INVALID_INDEX;
+}
+
+// removes and returns the node with the earliest deadline, or NULL if empty
+static inline timer_heap_node_t* timer_heap_pop(timer_heap_t* heap) {
+  timer_heap_node_t* const ret = timer_heap_peek(heap);
+  if (ret) {
+    timer_heap_remove(heap, ret);
+  }
+  return ret;
+}
+
+#endif
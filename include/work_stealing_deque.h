@@ -95,6 +95,15 @@ extern void* wsd_work_stealing_deque_pop_bottom(wsd_work_stealing_deque_t* d);
 
 extern void* wsd_work_stealing_deque_steal(wsd_work_stealing_deque_t* d);
 
+/* steals up to half of the elements in 'from' (rounded up, at most max) and
+   pushes them onto the bottom of 'to', which must be owned by the caller.
+   returns the number of elements moved. the owner of 'from' pops without a CAS
+   while more than one element remains, so a single CAS can't safely claim a
+   whole batch; the batch is sized once and claimed one element at a time,
+   stopping early on contention. */
+extern size_t wsd_work_stealing_deque_steal_half(
+    wsd_work_stealing_deque_t* from, wsd_work_stealing_deque_t* to, size_t max);
+
 #ifdef __cplusplus
 }
 #endif
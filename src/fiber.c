@@ -9,6 +9,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "fiber_group.h"
 #include "fiber_manager.h"
 #include "mpmc_lifo.h"
 
@@ -54,6 +55,9 @@ fiber_go_function(void* param) {
   fiber_manager_do_maintenance();
 
   void* const result = the_fiber->run_function(the_fiber->param);
+  if (the_fiber->group) {
+    fiber_group_child_finished(the_fiber->group);
+  }
 
   fiber_join_routine(the_fiber, result);
 
@@ -62,16 +66,27 @@ fiber_go_function(void* param) {
 
 fiber_t* fiber_create_no_sched(size_t stack_size,
                                fiber_run_function_t run_function, void* param) {
-  fiber_t* ret = calloc(1, sizeof(*ret));
-  if (!ret) {
-    errno = ENOMEM;
-    return NULL;
+  fiber_manager_t* const manager = fiber_manager_get();
+  if (manager) {
+    // a fiber which may come from (or go back to) the cache needs a stack of
+    // its size class
+    stack_size = fiber_manager_round_stack_size(stack_size);
   }
-  ret->mpsc_fifo_node = calloc(1, sizeof(*ret->mpsc_fifo_node));
-  if (!ret->mpsc_fifo_node) {
-    free(ret);
-    errno = ENOMEM;
-    return NULL;
+  fiber_t* ret =
+      manager ? fiber_manager_get_cached_fiber(manager, stack_size) : NULL;
+  const int from_cache = ret != NULL;
+  if (!ret) {
+    ret = calloc(1, sizeof(*ret));
+    if (!ret) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    ret->mpsc_fifo_node = calloc(1, sizeof(*ret->mpsc_fifo_node));
+    if (!ret->mpsc_fifo_node) {
+      free(ret);
+      errno = ENOMEM;
+      return NULL;
+    }
   }
 
   ret->run_function = run_function;
@@ -81,8 +96,19 @@ fiber_t* fiber_create_no_sched(size_t stack_size,
   ret->join_info = NULL;
   ret->result = NULL;
   ret->id += 1;
-  if (FIBER_SUCCESS !=
-      fiber_context_init(&ret->context, stack_size, &fiber_go_function, ret)) {
+  ret->stack_size = stack_size;
+  ret->priority = FIBER_PRIORITY_NORMAL;
+  ret->group = NULL;
+  if (from_cache) {
+    if (FIBER_SUCCESS !=
+        fiber_context_reinit(&ret->context, &fiber_go_function, ret)) {
+      ret->state = FIBER_STATE_DONE;
+      fiber_manager_return_fiber(manager, ret);
+      return NULL;
+    }
+  } else if (FIBER_SUCCESS != fiber_context_init(&ret->context, stack_size,
+                                                 &fiber_go_function, ret)) {
+    free(ret->mpsc_fifo_node);
     free(ret);
     return NULL;
   }
@@ -99,6 +125,46 @@ fiber_t* fiber_create(size_t stack_size, fiber_run_function_t run_function,
   return ret;
 }
 
+void fiber_attr_init(fiber_attr_t* attr) {
+  assert(attr);
+  attr->stack_size = FIBER_DEFAULT_STACK_SIZE;
+  attr->priority = FIBER_PRIORITY_NORMAL;
+}
+
+static inline int fiber_priority_valid(int priority) {
+  return priority >= 0 && priority < FIBER_NUM_PRIORITIES;
+}
+
+fiber_t* fiber_create_with_attr(const fiber_attr_t* attr,
+                                fiber_run_function_t run_function,
+                                void* param) {
+  if (!attr || !fiber_priority_valid(attr->priority)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  fiber_t* const ret =
+      fiber_create_no_sched(attr->stack_size, run_function, param);
+  if (ret) {
+    ret->priority = attr->priority;
+    fiber_manager_schedule(fiber_manager_get(), ret);
+  }
+  return ret;
+}
+
+int fiber_set_priority(fiber_t* f, int priority) {
+  if (!f || !fiber_priority_valid(priority)) {
+    errno = EINVAL;
+    return FIBER_ERROR;
+  }
+  f->priority = priority;
+  return FIBER_SUCCESS;
+}
+
+int fiber_get_priority(fiber_t* f) {
+  assert(f);
+  return f->priority;
+}
+
 fiber_t* fiber_create_from_thread() {
   fiber_t* const ret = calloc(1, sizeof(*ret));
   if (!ret) {
@@ -117,6 +183,7 @@ fiber_t* fiber_create_from_thread() {
   ret->join_info = NULL;
   ret->result = NULL;
   ret->id = 1;
+  ret->priority = FIBER_PRIORITY_NORMAL;
   if (FIBER_SUCCESS != fiber_context_init_from_thread(&ret->context)) {
     free(ret);
     return NULL;
@@ -201,6 +268,21 @@ int fiber_yield() {
   return 1;
 }
 
+int fiber_maybe_yield() {
+  fiber_manager_t* const manager = fiber_manager_get();
+  if (!manager || !fiber_manager_slice_expired(manager)) {
+    return 0;
+  }
+  manager->slice_yield_count += 1;
+  fiber_manager_yield(manager);
+  return 1;
+}
+
+int fiber_yield_to(fiber_t* target) {
+  fiber_manager_yield_to(fiber_manager_get(), target);
+  return 1;
+}
+
 int fiber_detach(fiber_t* f) {
   if (!f) {
     return FIBER_ERROR;
@@ -0,0 +1,233 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_blocking.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+
+#include "fiber_event.h"
+#include "fiber_io.h"
+#include "fiber_manager.h"
+
+// the helper writes to write_fd once the call is done. the two are the same
+// eventfd on Linux.
+typedef struct fiber_blocking_notifier {
+  int read_fd;
+  int write_fd;
+} fiber_blocking_notifier_t;
+
+// lives on the calling fiber's stack until the helper notifies it
+typedef struct fiber_blocking_call {
+  void* (*fn)(void*);
+  void* arg;
+  void* result;
+  int error;  // errno as fn left it
+  fiber_blocking_notifier_t notifier;
+  struct fiber_blocking_call* next;
+} fiber_blocking_call_t;
+
+typedef ssize_t (*readFnType)(int, void*, size_t);
+typedef ssize_t (*writeFnType)(int, const void*, size_t);
+static readFnType fibershim_read = NULL;
+static writeFnType fibershim_write = NULL;
+
+// protects everything below
+static pthread_mutex_t fiber_blocking_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fiber_blocking_cond = PTHREAD_COND_INITIALIZER;
+static fiber_blocking_call_t* fiber_blocking_head = NULL;
+static fiber_blocking_call_t* fiber_blocking_tail = NULL;
+static pthread_t fiber_blocking_threads[FIBER_BLOCKING_MAX_THREADS];
+static int fiber_blocking_num_threads = 0;
+static int fiber_blocking_idle_threads = 0;
+static int fiber_blocking_stopping = 0;
+static fiber_blocking_notifier_t
+    fiber_blocking_idle_fds[FIBER_BLOCKING_MAX_IDLE_FDS];
+static int fiber_blocking_num_idle_fds = 0;
+
+static void* fiber_blocking_thread_func(void* param) {
+  // the shims must never try to suspend a helper
+  fiber_io_lock_thread();
+
+  pthread_mutex_lock(&fiber_blocking_lock);
+  while (1) {
+    while (!fiber_blocking_head && !fiber_blocking_stopping) {
+      fiber_blocking_idle_threads += 1;
+      pthread_cond_wait(&fiber_blocking_cond, &fiber_blocking_lock);
+      fiber_blocking_idle_threads -= 1;
+    }
+    fiber_blocking_call_t* const call = fiber_blocking_head;
+    if (!call) {
+      break;  // stopping, and every queued call has run
+    }
+    fiber_blocking_head = call->next;
+    if (!fiber_blocking_head) {
+      fiber_blocking_tail = NULL;
+    }
+    pthread_mutex_unlock(&fiber_blocking_lock);
+
+    call->result = call->fn(call->arg);
+    call->error = errno;
+    // the call is gone as soon as its fiber sees the notification
+    const int write_fd = call->notifier.write_fd;
+    const uint64_t one = 1;
+    const ssize_t ret = fibershim_write(write_fd, &one, sizeof(one));
+    assert(ret == sizeof(one));
+    (void)ret;
+
+    pthread_mutex_lock(&fiber_blocking_lock);
+  }
+  pthread_mutex_unlock(&fiber_blocking_lock);
+  return NULL;
+}
+
+static int fiber_blocking_notifier_create(fiber_blocking_notifier_t* out) {
+#if defined(__linux__)
+  const int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd < 0) {
+    return FIBER_ERROR;
+  }
+  out->read_fd = fd;
+  out->write_fd = fd;
+#else
+  typedef int (*pipeFnType)(int[2]);
+  typedef int (*fcntlFnType)(int, int, ...);
+  // the real calls: the shims would track the pipe as a fiber's own
+  const pipeFnType real_pipe = (pipeFnType)fiber_load_symbol("pipe");
+  const fcntlFnType real_fcntl = (fcntlFnType)fiber_load_symbol("fcntl");
+  int fds[2];
+  if (real_pipe(fds)) {
+    return FIBER_ERROR;
+  }
+  real_fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  real_fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  real_fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  out->read_fd = fds[0];
+  out->write_fd = fds[1];
+#endif
+  return FIBER_SUCCESS;
+}
+
+static void fiber_blocking_notifier_destroy(fiber_blocking_notifier_t* n) {
+  // closed through the shim so the event engine forgets the fd
+  close(n->read_fd);
+  if (n->write_fd != n->read_fd) {
+    close(n->write_fd);
+  }
+}
+
+// not inlined: the fiber may wake on another thread, and errno's address
+// mustn't be cached across the wait
+static __attribute__((noinline)) void fiber_blocking_wait(int read_fd) {
+  uint64_t value;
+  // reading the notifier only fails with EAGAIN
+  while (fibershim_read(read_fd, &value, sizeof(value)) != sizeof(value)) {
+    if (!fiber_wait_for_event(read_fd, FIBER_POLL_IN)) {
+      fiber_yield();  // the event set won't take it (ie. ENOMEM); poll it
+    }
+  }
+}
+
+void* fiber_run_blocking(void* (*fn)(void*), void* arg) {
+  assert(fn);
+  fiber_manager_t* const manager = fiber_manager_get();
+  if (!manager || !manager->current_fiber ||
+      manager->current_fiber == manager->maintenance_fiber ||
+      fiber_manager_get_state() != FIBER_MANAGER_STATE_STARTED) {
+    return fn(arg);
+  }
+
+  if (!fibershim_read) {
+    fibershim_read = (readFnType)fiber_load_symbol("read");
+    fibershim_write = (writeFnType)fiber_load_symbol("write");
+  }
+
+  fiber_blocking_call_t call = {};
+  call.fn = fn;
+  call.arg = arg;
+
+  pthread_mutex_lock(&fiber_blocking_lock);
+  if (fiber_blocking_stopping) {
+    pthread_mutex_unlock(&fiber_blocking_lock);
+    return fn(arg);
+  }
+  const int have_notifier = fiber_blocking_num_idle_fds > 0;
+  if (have_notifier) {
+    fiber_blocking_num_idle_fds -= 1;
+    call.notifier = fiber_blocking_idle_fds[fiber_blocking_num_idle_fds];
+  }
+  pthread_mutex_unlock(&fiber_blocking_lock);
+  if (!have_notifier && !fiber_blocking_notifier_create(&call.notifier)) {
+    return fn(arg);
+  }
+
+  pthread_mutex_lock(&fiber_blocking_lock);
+  if (fiber_blocking_tail) {
+    fiber_blocking_tail->next = &call;
+  } else {
+    fiber_blocking_head = &call;
+  }
+  fiber_blocking_tail = &call;
+  if (!fiber_blocking_idle_threads &&
+      fiber_blocking_num_threads < FIBER_BLOCKING_MAX_THREADS &&
+      !pthread_create(&fiber_blocking_threads[fiber_blocking_num_threads],
+                      NULL, &fiber_blocking_thread_func, NULL)) {
+    fiber_blocking_num_threads += 1;
+  }
+  if (!fiber_blocking_num_threads) {
+    // no helper could be started, so nothing else is queued either
+    fiber_blocking_head = NULL;
+    fiber_blocking_tail = NULL;
+    pthread_mutex_unlock(&fiber_blocking_lock);
+    fiber_blocking_notifier_destroy(&call.notifier);
+    return fn(arg);
+  }
+  // with every helper busy the call waits its turn
+  pthread_cond_signal(&fiber_blocking_cond);
+  pthread_mutex_unlock(&fiber_blocking_lock);
+  manager->blocking_count += 1;
+
+  fiber_blocking_wait(call.notifier.read_fd);
+
+  pthread_mutex_lock(&fiber_blocking_lock);
+  const int keep = fiber_blocking_num_idle_fds < FIBER_BLOCKING_MAX_IDLE_FDS;
+  if (keep) {
+    fiber_blocking_idle_fds[fiber_blocking_num_idle_fds] = call.notifier;
+    fiber_blocking_num_idle_fds += 1;
+  }
+  pthread_mutex_unlock(&fiber_blocking_lock);
+  if (!keep) {
+    fiber_blocking_notifier_destroy(&call.notifier);
+  }
+
+  errno = call.error;
+  return call.result;
+}
+
+void fiber_blocking_shutdown() {
+  pthread_mutex_lock(&fiber_blocking_lock);
+  fiber_blocking_stopping = 1;
+  pthread_cond_broadcast(&fiber_blocking_cond);
+  pthread_mutex_unlock(&fiber_blocking_lock);
+
+  int i;
+  for (i = 0; i < fiber_blocking_num_threads; ++i) {
+    pthread_join(fiber_blocking_threads[i], NULL);
+  }
+  for (i = 0; i < fiber_blocking_num_idle_fds; ++i) {
+    fiber_blocking_notifier_destroy(&fiber_blocking_idle_fds[i]);
+  }
+
+  pthread_mutex_lock(&fiber_blocking_lock);
+  fiber_blocking_num_threads = 0;
+  fiber_blocking_num_idle_fds = 0;
+  fiber_blocking_stopping = 0;
+  pthread_mutex_unlock(&fiber_blocking_lock);
+}
@@ -3,6 +3,8 @@
 
 #include "fiber_cond.h"
 
+#include <errno.h>
+
 #include "fiber_manager.h"
 
 int fiber_cond_init(fiber_cond_t* cond) {
@@ -11,49 +13,181 @@ int fiber_cond_init(fiber_cond_t* cond) {
   if (!mpsc_fifo_init(&cond->waiters)) {
     return FIBER_ERROR;
   }
-  if (!fiber_mutex_init(&cond->internal_mutex)) {
-    mpsc_fifo_destroy(&cond->waiters);
-    return FIBER_ERROR;
-  }
   return FIBER_SUCCESS;
 }
 
 void fiber_cond_destroy(fiber_cond_t* cond) {
   assert(cond);
-  fiber_mutex_destroy(&cond->internal_mutex);
+  // only timed out waiters can be left, and their waits hold the nodes
+  mpsc_fifo_node_t* node;
+  while ((node = mpsc_fifo_trypop(&cond->waiters))) {
+    fiber_wait_t* const wait = fiber_wait_untag(node->data);
+    if (wait) {
+      wait->node = node;
+      fiber_wait_release(wait);
+    } else {
+      free(node);
+    }
+  }
   mpsc_fifo_destroy(&cond->waiters);
   memset(cond, 0, sizeof(*cond));
 }
 
-int fiber_cond_signal(fiber_cond_t* cond) {
-  assert(cond);
+// claims up to max of the counted waiters, returning how many were claimed
+static intptr_t fiber_cond_take(fiber_cond_t* cond, intptr_t max) {
+  intptr_t count = atomic_load(&cond->waiter_count);
+  while (count > 0 &&
+         !atomic_compare_exchange_weak(&cond->waiter_count, &count,
+                                       count > max ? count - max : 0)) {
+  }
+  return count > max ? max : count > 0 ? count : 0;
+}
+
+// readies a waiter's entry to be moved onto the mutex's queue. a timed waiter
+// can't time out once it's signalled, so its entry becomes an untimed one
+// (using the fiber's own node, which the wait takes in exchange). returns 0,
+// releasing the entry, if the waiter had already timed out.
+static int fiber_cond_claim(mpsc_fifo_node_t* node) {
+  fiber_wait_t* const wait = fiber_wait_untag(node->data);
+  if (!wait) {
+    return 1;
+  }
+  if (!fiber_wait_claim(wait, FIBER_WAIT_WOKEN)) {
+    wait->node = node;
+    fiber_wait_release(wait);
+    return 0;
+  }
+  fiber_t* const waiter = wait->fiber;
+  wait->node = waiter->mpsc_fifo_node;
+  waiter->mpsc_fifo_node = NULL;
+  node->data = waiter;
+  fiber_wait_release(wait);
+  return 1;
+}
+
+// takes one from counter if it's positive. returns 1 if it did.
+static int fiber_cond_take_one(_Atomic intptr_t* counter) {
+  intptr_t count = atomic_load(counter);
+  while (count > 0 &&
+         !atomic_compare_exchange_weak(counter, &count, count - 1)) {
+  }
+  return count > 0;
+}
 
-  fiber_mutex_lock(&cond->internal_mutex);
-  intptr_t new_val = atomic_fetch_sub(&cond->waiter_count, 1) - 1;
-  if (new_val >= 0) {
-    fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &cond->waiters, 1);
-  } else {
-    new_val = atomic_fetch_add(&cond->waiter_count, 1) + 1;
-    assert(new_val >= 0);
+// releases the timed out waiters at the head of the queue, so a condition which
+// is never signalled doesn't collect them. each is still counted, by
+// waiter_count or by a signaller's to_move (which would only have skipped it);
+// one not counted by either yet is left to its signaller. must be moving.
+static void fiber_cond_prune(fiber_cond_t* cond) {
+  void* entry;
+  while (mpsc_fifo_peek(&cond->waiters, &entry)) {
+    fiber_wait_t* const wait = fiber_wait_untag(entry);
+    if (!wait || atomic_load(&wait->state) == FIBER_WAIT_PENDING ||
+        (!fiber_cond_take_one(&cond->waiter_count) &&
+         !fiber_cond_take_one(&cond->to_move))) {
+      break;
+    }
+    mpsc_fifo_node_t* const node = mpsc_fifo_trypop(&cond->waiters);
+    wait->node = node;
+    fiber_wait_release(wait);
   }
-  fiber_mutex_unlock(&cond->internal_mutex);
+}
 
+// moves count claimed waiters onto the mutex's queue (none, to just release
+// timed out waiters). the waiters queue has a single consumer, so if another
+// signaller is already moving waiters it's left to move these too.
+static void fiber_cond_move(fiber_cond_t* cond, intptr_t count) {
+  atomic_fetch_add(&cond->to_move, count);
+  int expected = 0;
+  while (atomic_compare_exchange_strong(&cond->moving, &expected, 1)) {
+    while ((count = atomic_exchange(&cond->to_move, 0))) {
+      mpsc_fifo_node_t* first = NULL;
+      mpsc_fifo_node_t* last = NULL;
+      int moved = 0;
+      while (count > 0) {
+        mpsc_fifo_node_t* out;
+        while (!(out = mpsc_fifo_trypop(&cond->waiters))) {
+          // a waiter has been counted but is still being queued
+          fiber_manager_get()->wake_mpsc_spin_count += 1;
+          cpu_relax();
+        }
+        count -= 1;
+        if (!fiber_cond_claim(out)) {
+          // that waiter had timed out - take the next one instead
+          count += fiber_cond_take(cond, 1);
+          continue;
+        }
+        if (last) {
+          last->next = out;
+        } else {
+          first = out;
+        }
+        last = out;
+        moved += 1;
+      }
+      if (moved) {
+        fiber_mutex_requeue(cond->caller_mutex, first, last, moved);
+      }
+    }
+    fiber_cond_prune(cond);
+    atomic_store(&cond->moving, 0);
+    // a signaller which found moving set added its waiters first, so either
+    // they're seen here or it sees moving cleared and moves them itself
+    store_load_barrier();
+    if (!atomic_load(&cond->to_move)) {
+      break;
+    }
+    expected = 0;
+  }
+}
+
+int fiber_cond_signal(fiber_cond_t* cond) {
+  assert(cond);
+  if (fiber_cond_take(cond, 1)) {
+    fiber_cond_move(cond, 1);
+  }
   return FIBER_SUCCESS;
 }
 
 int fiber_cond_broadcast(fiber_cond_t* cond) {
   assert(cond);
+  // the waiters are chained together and moved onto the mutex's queue in one
+  // push. nobody is woken but the first.
+  const intptr_t count = fiber_cond_take(cond, INTPTR_MAX);
+  if (count) {
+    fiber_cond_move(cond, count);
+  }
+  return FIBER_SUCCESS;
+}
+
+int fiber_cond_timedwait(fiber_cond_t* cond, fiber_mutex_t* mutex,
+                         uint64_t deadline_ns) {
+  assert(cond);
+  assert(mutex);
 
-  fiber_mutex_lock(&cond->internal_mutex);
-  const intptr_t original =
-      atomic_exchange_explicit(&cond->waiter_count, 0, memory_order_acquire);
-  if (original) {
-    fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &cond->waiters,
-                                       original);
+  fiber_manager_t* const manager = fiber_manager_get();
+  fiber_wait_t* const wait = fiber_manager_get_wait(manager, deadline_ns);
+  if (!wait) {
+    return FIBER_ERROR;
   }
-  fiber_mutex_unlock(&cond->internal_mutex);
 
-  return FIBER_SUCCESS;
+  assert(!cond->caller_mutex || cond->caller_mutex == mutex);
+  cond->caller_mutex = mutex;
+  atomic_fetch_add_explicit(&cond->waiter_count, 1, memory_order_release);
+
+  // a waiter which times out stays counted until it's skipped by a signal or
+  // released from the head of the queue
+  if (fiber_manager_wait_in_mpsc_queue_until_and_unlock(
+          manager, &cond->waiters, wait, deadline_ns, mutex)) {
+    return fiber_mutex_lock_requeued(mutex);
+  }
+  fiber_cond_move(cond, 0);
+  fiber_mutex_lock(mutex);
+  // set again after relocking, which may have moved the fiber to a thread with
+  // its own errno
+  errno = ETIMEDOUT;
+
+  return FIBER_ERROR;
 }
 
 int fiber_cond_wait(fiber_cond_t* cond, fiber_mutex_t* mutex) {
@@ -64,9 +198,8 @@ int fiber_cond_wait(fiber_cond_t* cond, fiber_mutex_t* mutex) {
   cond->caller_mutex = mutex;
   atomic_fetch_add_explicit(&cond->waiter_count, 1, memory_order_release);
 
+  // woken from the mutex's queue (see fiber_cond_signal())
   fiber_manager_wait_in_mpsc_queue_and_unlock(fiber_manager_get(),
                                               &cond->waiters, mutex);
-  fiber_mutex_lock(mutex);
-
-  return FIBER_SUCCESS;
+  return fiber_mutex_lock_requeued(mutex);
 }
@@ -14,6 +14,9 @@
 #ifdef FIBER_STACK_MALLOC
 #include <stdlib.h>
 #endif
+#ifdef FIBER_STACK_ARENA
+#include "fiber_stack_arena.h"
+#endif
 
 #ifdef USE_VALGRIND
 #include <valgrind/valgrind.h>
@@ -54,6 +57,8 @@ extern void* __splitstack_makecontext(size_t stack_size,
                                       splitstack_context_t context,
                                       size_t* size);
 extern void __splitstack_releasecontext(splitstack_context_t context);
+extern void* __splitstack_resetcontext(splitstack_context_t context,
+                                       size_t* size);
 #endif
 
 #ifdef FIBER_STACK_MMAP
@@ -94,12 +99,23 @@ static int fiber_context_alloc_stack(fiber_context_t* context,
     munmap(context->ctx_stack, context->ctx_stack_size);
     return 0;
   }
+#elif defined(FIBER_STACK_ARENA)
+  context->ctx_stack =
+      fiber_stack_arena_alloc(stack_size, &context->ctx_stack_size);
 #else
 #error select a stack allocation strategy
 #endif
   return context->ctx_stack ? 1 : 0;
 }
 
+// rewinds a stack which has finished running so it can be used from the top
+static void fiber_reset_stack(fiber_context_t* context) {
+#if defined(FIBER_STACK_SPLIT)
+  context->ctx_stack = __splitstack_resetcontext(context->splitstack_context,
+                                                 &context->ctx_stack_size);
+#endif
+}
+
 static void fiber_free_stack(fiber_context_t* context) {
 #if defined(FIBER_STACK_SPLIT)
   __splitstack_releasecontext(context->splitstack_context);
@@ -107,6 +123,8 @@ static void fiber_free_stack(fiber_context_t* context) {
   free(context->ctx_stack);
 #elif defined(FIBER_STACK_MMAP)
   munmap(context->ctx_stack, context->ctx_stack_size);
+#elif defined(FIBER_STACK_ARENA)
+  fiber_stack_arena_free(context->ctx_stack, context->ctx_stack_size);
 #else
 #error select a stack allocation strategy
 #endif
@@ -114,17 +132,11 @@ static void fiber_free_stack(fiber_context_t* context) {
 
 #if defined(__GNUC__) && defined(__i386__) && defined(FIBER_FAST_SWITCHING)
 
-int fiber_context_init(fiber_context_t* context, size_t stack_size,
-                       fiber_run_function_t run_function, void* param) {
-  if (!context || !stack_size || !run_function) {
-    errno = EINVAL;
-    return FIBER_ERROR;
-  }
-
-  if (!fiber_context_alloc_stack(context, stack_size)) {
-    return FIBER_ERROR;
-  }
-
+// lays out the initial frame so that the first swap into the context calls
+// run_function(param)
+static void fiber_context_prepare_stack(fiber_context_t* context,
+                                        fiber_run_function_t run_function,
+                                        void* param) {
   context->ctx_stack_pointer =
       (void**)((char*)context->ctx_stack + context->ctx_stack_size) - 1;
   context->ctx_stack_pointer = (void*)((uintptr_t)context->ctx_stack_pointer &
@@ -139,6 +151,20 @@ int fiber_context_init(fiber_context_t* context, size_t stack_size,
 
   assert(((uintptr_t)context->ctx_stack_pointer & 0x0f) ==
          0);  // verify 16 byte alignment
+}
+
+int fiber_context_init(fiber_context_t* context, size_t stack_size,
+                       fiber_run_function_t run_function, void* param) {
+  if (!context || !stack_size || !run_function) {
+    errno = EINVAL;
+    return FIBER_ERROR;
+  }
+
+  if (!fiber_context_alloc_stack(context, stack_size)) {
+    return FIBER_ERROR;
+  }
+
+  fiber_context_prepare_stack(context, run_function, param);
 
   STACK_REGISTER(context, context->ctx_stack, context->ctx_stack_size);
 
@@ -146,6 +172,18 @@ int fiber_context_init(fiber_context_t* context, size_t stack_size,
   return FIBER_SUCCESS;
 }
 
+int fiber_context_reinit(fiber_context_t* context,
+                         fiber_run_function_t run_function, void* param) {
+  if (!context || context->is_thread || !run_function) {
+    errno = EINVAL;
+    return FIBER_ERROR;
+  }
+
+  fiber_reset_stack(context);
+  fiber_context_prepare_stack(context, run_function, param);
+  return FIBER_SUCCESS;
+}
+
 int fiber_context_init_from_thread(fiber_context_t* context) {
   if (!context) {
     errno = EINVAL;
@@ -261,17 +299,11 @@ void fiber_context_swap(fiber_context_t* from_context,
 #elif defined(__x86_64__) && defined(FIBER_FAST_SWITCHING)
 #include <stdlib.h>
 
-int fiber_context_init(fiber_context_t* context, size_t stack_size,
-                       fiber_run_function_t run_function, void* param) {
-  if (!context || !stack_size || !run_function) {
-    errno = EINVAL;
-    return FIBER_ERROR;
-  }
-
-  if (!fiber_context_alloc_stack(context, stack_size)) {
-    return FIBER_ERROR;
-  }
-
+// lays out the initial frame so that the first swap into the context calls
+// run_function(param)
+static void fiber_context_prepare_stack(fiber_context_t* context,
+                                        fiber_run_function_t run_function,
+                                        void* param) {
   context->ctx_stack_pointer =
       (void**)((char*)context->ctx_stack + context->ctx_stack_size) - 1;
   context->ctx_stack_pointer = (void*)((uintptr_t)context->ctx_stack_pointer &
@@ -292,6 +324,20 @@ int fiber_context_init(fiber_context_t* context, size_t stack_size,
 
   assert(((uintptr_t)context->ctx_stack_pointer & 0x0f) ==
          0);  // verify 16 byte alignment
+}
+
+int fiber_context_init(fiber_context_t* context, size_t stack_size,
+                       fiber_run_function_t run_function, void* param) {
+  if (!context || !stack_size || !run_function) {
+    errno = EINVAL;
+    return FIBER_ERROR;
+  }
+
+  if (!fiber_context_alloc_stack(context, stack_size)) {
+    return FIBER_ERROR;
+  }
+
+  fiber_context_prepare_stack(context, run_function, param);
 
   STACK_REGISTER(context, context->ctx_stack, context->ctx_stack_size);
 
@@ -303,6 +349,23 @@ int fiber_context_init(fiber_context_t* context, size_t stack_size,
   return FIBER_SUCCESS;
 }
 
+int fiber_context_reinit(fiber_context_t* context,
+                         fiber_run_function_t run_function, void* param) {
+  if (!context || context->is_thread || !run_function) {
+    errno = EINVAL;
+    return FIBER_ERROR;
+  }
+
+  fiber_reset_stack(context);
+  fiber_context_prepare_stack(context, run_function, param);
+
+#if __SANITIZE_THREAD__
+  __tsan_destroy_fiber(context->tsan_fiber);
+  context->tsan_fiber = __tsan_create_fiber(0);
+#endif
+  return FIBER_SUCCESS;
+}
+
 int fiber_context_init_from_thread(fiber_context_t* context) {
   if (!context) {
     errno = EINVAL;
@@ -479,6 +542,24 @@ int fiber_context_init(fiber_context_t* context, size_t stack_size,
   return FIBER_SUCCESS;
 }
 
+int fiber_context_reinit(fiber_context_t* context,
+                         fiber_run_function_t run_function, void* param) {
+  if (!context || context->is_thread || !run_function) {
+    errno = EINVAL;
+    return FIBER_ERROR;
+  }
+
+  fiber_reset_stack(context);
+  ucontext_t* const uctx = (ucontext_t*)context->ctx_stack_pointer;
+  getcontext(uctx);
+  uctx->uc_link = 0;
+  uctx->uc_stack.ss_sp = (int*)context->ctx_stack;
+  uctx->uc_stack.ss_size = context->ctx_stack_size;
+  uctx->uc_stack.ss_flags = 0;
+  makecontext(uctx, (void (*)())run_function, 1, param);
+  return FIBER_SUCCESS;
+}
+
 int fiber_context_init_from_thread(fiber_context_t* context) {
   if (!context) {
     errno = EINVAL;
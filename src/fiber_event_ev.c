@@ -2,13 +2,14 @@
 // SPDX-License-Identifier: MIT
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <unistd.h>
 
 #include "fiber.h"
 #include "fiber_event.h"
 #include "fiber_manager.h"
-#include "fiber_spinlock.h"
+#include "fiber_qspinlock.h"
 #ifndef __USE_GNU
 #define __USE_GNU
 #endif
@@ -18,12 +19,12 @@
 #include <ev.h>
 
 static struct ev_loop* volatile fiber_loop = NULL;
-static fiber_spinlock_t fiber_loop_spinlock = FIBER_SPINLOCK_INITIALIER;
+static fiber_qspinlock_t fiber_loop_spinlock = FIBER_QSPINLOCK_INITIALIZER;
 static volatile int num_events_triggered = 0;
 static _Atomic int active_threads = 0;
 
 int fiber_event_init() {
-  fiber_spinlock_lock(&fiber_loop_spinlock);
+  fiber_qspinlock_lock(&fiber_loop_spinlock);
 
   assert("libev version mismatch" && ev_version_major() == EV_VERSION_MAJOR &&
          ev_version_minor() >= EV_VERSION_MINOR);
@@ -37,31 +38,33 @@ int fiber_event_init() {
   fiber_loop = ev_loop_new(EVFLAG_AUTO);
   assert(fiber_loop);
 
-  fiber_spinlock_unlock(&fiber_loop_spinlock);
+  fiber_qspinlock_unlock(&fiber_loop_spinlock);
 
   return fiber_loop ? FIBER_SUCCESS : FIBER_ERROR;
 }
 
 void fiber_event_shutdown() {
-  fiber_spinlock_lock(&fiber_loop_spinlock);
+  fiber_qspinlock_lock(&fiber_loop_spinlock);
   if (fiber_loop) {
     ev_loop_destroy(fiber_loop);
     fiber_loop = NULL;
   }
-  fiber_spinlock_unlock(&fiber_loop_spinlock);
+  fiber_qspinlock_unlock(&fiber_loop_spinlock);
 }
 
+int fiber_event_has_per_thread_sets() { return 0; }
+
 int fiber_poll_events() {
   if (!fiber_loop) {
     return FIBER_EVENT_NOTINIT;
   }
 
-  if (!fiber_spinlock_trylock(&fiber_loop_spinlock)) {
+  if (!fiber_qspinlock_trylock(&fiber_loop_spinlock)) {
     return FIBER_EVENT_TRYAGAIN;
   }
 
   if (!fiber_loop) {
-    fiber_spinlock_unlock(&fiber_loop_spinlock);
+    fiber_qspinlock_unlock(&fiber_loop_spinlock);
     return FIBER_EVENT_NOTINIT;
   }
 
@@ -69,7 +72,7 @@ int fiber_poll_events() {
   num_events_triggered = 0;
   ev_run(fiber_loop, EVRUN_NOWAIT);
   const int local_copy = num_events_triggered;
-  fiber_spinlock_unlock(&fiber_loop_spinlock);
+  fiber_qspinlock_unlock(&fiber_loop_spinlock);
 
   return local_copy;
 }
@@ -95,11 +98,11 @@ size_t fiber_poll_events_blocking(uint32_t seconds, uint32_t useconds) {
     return 0;
   }
 
-  fiber_spinlock_lock(&fiber_loop_spinlock);
+  fiber_qspinlock_lock(&fiber_loop_spinlock);
 
   if (!fiber_loop) {
     atomic_fetch_add(&active_threads, 1);
-    fiber_spinlock_unlock(&fiber_loop_spinlock);
+    fiber_qspinlock_unlock(&fiber_loop_spinlock);
     return 0;
   }
 
@@ -107,12 +110,26 @@ size_t fiber_poll_events_blocking(uint32_t seconds, uint32_t useconds) {
   fiber_manager_get()->poll_count += 1;
   ev_run(fiber_loop, EVRUN_ONCE);
   const int local_copy = num_events_triggered;
-  fiber_spinlock_unlock(&fiber_loop_spinlock);
+  fiber_qspinlock_unlock(&fiber_loop_spinlock);
 
   atomic_fetch_add(&active_threads, 1);
   return local_copy;
 }
 
+size_t fiber_poll_events_until_woken() {
+  // the loop can't block indefinitely - it would lock out fibers registering
+  // for events - so the poller wakes up every FIBER_TIME_RESOLUTION_MS instead
+  const int num_events = fiber_poll_events();
+  if (num_events > 0) {
+    return num_events;
+  }
+  return fiber_poll_events_blocking(0, FIBER_TIME_RESOLUTION_MS * 1000);
+}
+
+void fiber_event_wake_poller(int manager_id) {
+  // nothing - the poller never blocks for longer than FIBER_TIME_RESOLUTION_MS
+}
+
 static void fd_ready(struct ev_loop* loop, ev_io* watcher, int revents) {
   ev_io_stop(loop, watcher);
   fiber_manager_t* const manager = fiber_manager_get();
@@ -136,7 +153,7 @@ int fiber_wait_for_event(int fd, uint32_t events) {
   ev_set_cb(&fd_event, &fd_ready);
   ev_io_set(&fd_event, fd, poll_events);
 
-  fiber_spinlock_lock(&fiber_loop_spinlock);
+  fiber_qspinlock_lock(&fiber_loop_spinlock);
 
   fiber_manager_t* const manager = fiber_manager_get();
   manager->event_wait_count += 1;
@@ -153,6 +170,108 @@ int fiber_wait_for_event(int fd, uint32_t events) {
   return FIBER_SUCCESS;
 }
 
+// a fiber waiting on several fds and maybe a deadline. every watcher lives in
+// the one loop, so whichever fires first stops the rest.
+typedef struct any_event_wait {
+  fiber_t* fiber;
+  ev_io* fd_events;
+  size_t count;
+  ev_timer timer_event;
+  int timed;
+} any_event_wait_t;
+
+static void any_event_wake(struct ev_loop* loop, any_event_wait_t* wait) {
+  size_t i;
+  for (i = 0; i < wait->count; ++i) {
+    ev_io_stop(loop, &wait->fd_events[i]);
+  }
+  if (wait->timed) {
+    ev_timer_stop(loop, &wait->timer_event);
+  }
+  fiber_manager_t* const manager = fiber_manager_get();
+  fiber_t* const the_fiber = wait->fiber;
+  the_fiber->state = FIBER_STATE_READY;
+  fiber_manager_schedule(manager, the_fiber);
+  ++num_events_triggered;
+}
+
+static void any_fd_ready(struct ev_loop* loop, ev_io* watcher, int revents) {
+  any_event_wake(loop, watcher->data);
+}
+
+static void any_timer_trigger(struct ev_loop* loop, ev_timer* watcher,
+                              int revents) {
+  any_event_wake(loop, watcher->data);
+}
+
+#define ANY_EVENT_STACK_WATCHERS (8)
+
+int fiber_wait_for_any_event(const fiber_event_fd_t* fds, size_t count,
+                             uint64_t deadline_ns) {
+  if (!fiber_loop) {
+    const uint64_t resolution_deadline =
+        fiber_time_now_ns() + FIBER_TIME_RESOLUTION_MS * 1000000ULL;
+    return fiber_sleep_until(deadline_ns < resolution_deadline
+                                 ? deadline_ns
+                                 : resolution_deadline);
+  }
+
+  ev_io stack_events[ANY_EVENT_STACK_WATCHERS] = {};
+  any_event_wait_t wait = {};
+  wait.count = count;
+  wait.fd_events = count <= ANY_EVENT_STACK_WATCHERS
+                       ? stack_events
+                       : calloc(count, sizeof(*wait.fd_events));
+  if (!wait.fd_events) {
+    errno = ENOMEM;
+    return FIBER_ERROR;
+  }
+  size_t i;
+  for (i = 0; i < count; ++i) {
+    int poll_events = 0;
+    if (fds[i].events & FIBER_POLL_IN) {
+      poll_events |= EV_READ;
+    }
+    if (fds[i].events & FIBER_POLL_OUT) {
+      poll_events |= EV_WRITE;
+    }
+    ev_set_cb(&wait.fd_events[i], &any_fd_ready);
+    ev_io_set(&wait.fd_events[i], fds[i].fd, poll_events);
+    wait.fd_events[i].data = &wait;
+  }
+
+  fiber_qspinlock_lock(&fiber_loop_spinlock);
+
+  fiber_manager_t* const manager = fiber_manager_get();
+  manager->event_wait_count += 1;
+  fiber_t* const this_fiber = manager->current_fiber;
+  wait.fiber = this_fiber;
+
+  for (i = 0; i < count; ++i) {
+    ev_io_start(fiber_loop, &wait.fd_events[i]);
+  }
+  if (deadline_ns != UINT64_MAX) {
+    const uint64_t now = fiber_time_now_ns();
+    ev_set_cb(&wait.timer_event, &any_timer_trigger);
+    wait.timer_event.at =
+        deadline_ns > now ? (deadline_ns - now) * 0.000000001 : 0;
+    wait.timer_event.repeat = 0;
+    wait.timer_event.data = &wait;
+    wait.timed = 1;
+    ev_timer_start(fiber_loop, &wait.timer_event);
+  }
+
+  this_fiber->state = FIBER_STATE_WAITING;
+  manager->spinlock_to_unlock = &fiber_loop_spinlock;
+
+  fiber_manager_yield(manager);
+
+  if (wait.fd_events != stack_events) {
+    free(wait.fd_events);
+  }
+  return FIBER_SUCCESS;
+}
+
 static void timer_trigger(struct ev_loop* loop, ev_timer* watcher,
                           int revents) {
   ev_timer_stop(loop, watcher);
@@ -163,9 +282,90 @@ static void timer_trigger(struct ev_loop* loop, ev_timer* watcher,
   ++num_events_triggered;
 }
 
+int fiber_wait_for_event_timeout(int fd, uint32_t events,
+                                 uint64_t deadline_ns) {
+  if (deadline_ns == UINT64_MAX) {
+    return fiber_wait_for_event(fd, events);
+  }
+  if (fiber_time_now_ns() >= deadline_ns) {
+    errno = ETIMEDOUT;
+    return FIBER_ERROR;
+  }
+  const fiber_event_fd_t wait_fd = {fd, events};
+  if (!fiber_wait_for_any_event(&wait_fd, 1, deadline_ns)) {
+    return FIBER_ERROR;
+  }
+  if (fiber_time_now_ns() >= deadline_ns) {
+    errno = ETIMEDOUT;
+    return FIBER_ERROR;
+  }
+  return FIBER_SUCCESS;
+}
+
+static void wait_timer_trigger(struct ev_loop* loop, ev_timer* watcher,
+                               int revents) {
+  ev_timer_stop(loop, watcher);
+  fiber_wait_t* const wait = watcher->data;
+  if (fiber_wait_claim(wait, FIBER_WAIT_TIMED_OUT)) {
+    fiber_t* const the_fiber = wait->fiber;
+    if (the_fiber->state == FIBER_STATE_WAITING) {
+      the_fiber->state = FIBER_STATE_READY;
+    }
+    fiber_manager_schedule(fiber_manager_get(), the_fiber);
+    ++num_events_triggered;
+  }
+}
+
+int fiber_event_wait_until(fiber_wait_t* wait, uint64_t deadline_ns) {
+  fiber_manager_t* manager = fiber_manager_get();
+  assert(wait->fiber == manager->current_fiber);
+  ev_timer timer_event = {};
+  int timed = 0;
+  if (deadline_ns != UINT64_MAX) {
+    fiber_qspinlock_lock(&fiber_loop_spinlock);
+    if (fiber_loop) {
+      const uint64_t now = fiber_time_now_ns();
+      ev_set_cb(&timer_event, &wait_timer_trigger);
+      timer_event.at =
+          deadline_ns > now ? (deadline_ns - now) * 0.000000001 : 0;
+      timer_event.repeat = 0;
+      timer_event.data = wait;
+      ev_timer_start(fiber_loop, &timer_event);
+      timed = 1;
+    }
+    fiber_qspinlock_unlock(&fiber_loop_spinlock);
+    manager = fiber_manager_get();  // the lock may have moved us
+    if (!timed && fiber_wait_claim(wait, FIBER_WAIT_TIMED_OUT)) {
+      // nothing can time the wait; give up straight away. the scheduler holds
+      // on to the fiber until it has switched out.
+      fiber_manager_schedule(manager, wait->fiber);
+    }
+  }
+
+  fiber_manager_yield(manager);
+
+  if (timed) {
+    fiber_qspinlock_lock(&fiber_loop_spinlock);
+    if (fiber_loop && ev_is_active(&timer_event)) {
+      ev_timer_stop(fiber_loop, &timer_event);
+    }
+    fiber_qspinlock_unlock(&fiber_loop_spinlock);
+  }
+  if (atomic_load(&wait->state) == FIBER_WAIT_TIMED_OUT) {
+    errno = ETIMEDOUT;
+    return FIBER_ERROR;
+  }
+  return FIBER_SUCCESS;
+}
+
 int fiber_sleep(uint32_t seconds, uint32_t useconds) {
+  return fiber_sleep_ns(seconds * 1000000000ULL + useconds * 1000ULL);
+}
+
+int fiber_sleep_ns(uint64_t nanoseconds) {
   if (!fiber_loop) {
-    fiber_do_real_sleep(seconds, useconds);
+    const uint64_t useconds = (nanoseconds + 999) / 1000;
+    fiber_do_real_sleep(useconds / 1000000, useconds % 1000000);
     return FIBER_SUCCESS;
   }
 
@@ -173,11 +373,11 @@ int fiber_sleep(uint32_t seconds, uint32_t useconds) {
   // warnings.
   ev_timer timer_event = {};
   ev_set_cb(&timer_event, &timer_trigger);
-  const double sleep_time = seconds + useconds * 0.000001;
+  const double sleep_time = nanoseconds * 0.000000001;
   timer_event.at = sleep_time;
   timer_event.repeat = 0;
 
-  fiber_spinlock_lock(&fiber_loop_spinlock);
+  fiber_qspinlock_lock(&fiber_loop_spinlock);
 
   fiber_manager_t* const manager = fiber_manager_get();
   fiber_t* const this_fiber = manager->current_fiber;
@@ -194,6 +394,15 @@ int fiber_sleep(uint32_t seconds, uint32_t useconds) {
   return FIBER_SUCCESS;
 }
 
+int fiber_sleep_until(uint64_t deadline_ns) {
+  const uint64_t now = fiber_time_now_ns();
+  if (deadline_ns <= now) {
+    fiber_yield();
+    return FIBER_SUCCESS;
+  }
+  return fiber_sleep_ns(deadline_ns - now);
+}
+
 void fiber_fd_closed(int fd) {
   // NOP
 }
@@ -4,15 +4,20 @@
 #include <errno.h>
 #include <stdio.h>
 #include <sys/poll.h>
-#include <sys/resource.h>
 #include <unistd.h>
 
 #include "fiber.h"
 #include "fiber_event.h"
+#include "fiber_fd.h"
+#if defined(FIBER_EVENT_URING)
+#include "fiber_event_uring.h"
+#endif
 #include "fiber_manager.h"
-#include "fiber_spinlock.h"
+#include "fiber_qspinlock.h"
+#include "timer_heap.h"
 #if defined(__linux__)
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/timerfd.h>
 #elif defined(SOLARIS)
 #include <port.h>
@@ -22,203 +27,326 @@
 #error OS not supported
 #endif
 
-typedef struct fd_wait_info {
-  int events;
-  int added;
-  fiber_spinlock_t spinlock;
-  void* waiters;
-} fd_wait_info_t;
+// with edge triggered events each fd is registered once, for both directions,
+// on its first wait. readiness is cached so a fiber only parks if nothing has
+// been reported since the caller last saw EAGAIN. otherwise the fd is armed
+// with a one-shot registration every time a fiber waits on it.
+#if defined(__linux__) && !defined(FIBER_EVENT_EDGE_TRIGGERED)
+#define FIBER_EVENT_EDGE_TRIGGERED 1
+#endif
 
-static fd_wait_info_t* wait_info = NULL;
-static int max_fd = 0;
-static int event_fd = -1;
-static fiber_spinlock_t sleep_spinlock = FIBER_SPINLOCK_INITIALIER;
-static uint64_t timer_trigger_count = 0;
+// a fiber suspended until an fd or deadline it waits for fires is waiting on a
+// fiber_wait_t (see fiber_manager.h). a fiber waiting on several fds (see
+// fiber_wait_for_any_event) is only woken by whichever claims the wait first.
+// fd and sleep waits live on the waiting fiber's stack.
 
+// lives on the waiting fiber's stack. linked from the fd's record in the fd
+// table (see fiber_fd.h), which holds the rest of the fd's wait state.
+typedef struct fiber_fd_waiter {
+  fiber_wait_t* wait;
+  int events;
+  intptr_t result;  // -1 if the fd was closed
+  struct fiber_fd_waiter* next;
+} fd_waiter_t;
+
+// each fiber manager thread has its own event set, so fds and sleepers are
+// polled (and their fibers woken) by the thread they last ran on. an fd moves
+// to the waiting fiber's manager when nobody else is waiting on it.
+//
+// sleepers are kept in a timer heap per manager too. each shard has its own
+// one-shot timer which is armed for the earliest deadline in the heap, so
+// nothing fires while nobody is sleeping.
+typedef struct fiber_event_shard {
+  int poll_fd;  // the epoll instance or event port
+  fiber_qspinlock_t spinlock;  // protects the timer heap
+  timer_heap_t heap;
+  uint64_t armed_deadline;  // UINT64_MAX when the timer is disarmed
 #if defined(__linux__)
-static int timer_fd = -1;
-typedef ssize_t (*readFnType)(int, void*, size_t);
-static readFnType fibershim_read = NULL;
+  int timer_fd;
+  int wake_fd;  // written to interrupt a blocking poll
 #elif defined(SOLARIS)
-static timer_t timer_id = -1;
-static hrtime_t last_timer_trigger = 0;
+  timer_t timer_id;
+  port_notify_t notify_info;
 #else
 #error OS not supported
 #endif
+} fiber_event_shard_t;
 
-// a tree of linked lists
-typedef struct waiter_el {
-  uint64_t wake_time;
-  void* waiter;
-  struct waiter_el* next;
-  struct waiter_el* left;
-  struct waiter_el* right;
-} waiter_el_t;
+static fiber_event_shard_t* event_shards = NULL;
+static int num_event_shards = 0;
 
-static waiter_el_t* sleepers = NULL;
+#if defined(__linux__)
+// epoll data for a shard's timer and wake fds. fd events carry the
+// (non-negative) fd itself
+#define FIBER_EVENT_TIMER_TAG ((uint64_t)1 << 32)
+#define FIBER_EVENT_WAKE_TAG ((uint64_t)2 << 32)
+#define FIBER_EVENT_URING_TAG ((uint64_t)3 << 32)
+typedef ssize_t (*readFnType)(int, void*, size_t);
+static readFnType fibershim_read = NULL;
+typedef ssize_t (*writeFnType)(int, const void*, size_t);
+static writeFnType fibershim_write = NULL;
+// epoll_wait is shimmed for fibers (see fiber_io.c); the engine needs the real
+// thing
+typedef int (*epollWaitFnType)(int, struct epoll_event*, int, int);
+static epollWaitFnType fibershim_epoll_wait = NULL;
+#endif
 
-void waiter_insert(waiter_el_t** tree, waiter_el_t* node) {
-  if (!(*tree)) {
-    *tree = node;
-    return;
+static void fiber_event_shard_arm(fiber_event_shard_t* shard,
+                                  uint64_t deadline) {
+  shard->armed_deadline = deadline;
+#if defined(__linux__)
+  struct itimerspec in = {};
+  if (deadline != UINT64_MAX) {
+    // a zero it_value disarms the timer, so never ask for time 0
+    deadline = deadline ? deadline : 1;
+    in.it_value.tv_sec = deadline / 1000000000;
+    in.it_value.tv_nsec = deadline % 1000000000;
   }
-
-  while (1) {
-    if (node->wake_time < (*tree)->wake_time) {
-      tree = &(*tree)->left;
-    } else if (node->wake_time == (*tree)->wake_time) {
-      node->next = (*tree)->next;
-      (*tree)->next = node;
-      break;
-    } else {
-      tree = &(*tree)->right;
-    }
-    if (!(*tree)) {
-      *tree = node;
-      break;
-    }
+  const int ret =
+      timerfd_settime(shard->timer_fd, TFD_TIMER_ABSTIME, &in, NULL);
+  assert(!ret);
+  (void)ret;
+#elif defined(SOLARIS)
+  itimerspec_t in = {};
+  if (deadline != UINT64_MAX) {
+    deadline = deadline ? deadline : 1;
+    in.it_value.tv_sec = deadline / 1000000000;
+    in.it_value.tv_nsec = deadline % 1000000000;
   }
+  const int ret = timer_settime(shard->timer_id, TIMER_ABSTIME, &in, NULL);
+  assert(!ret);
+  (void)ret;
+#else
+#error OS not supported
+#endif
 }
 
-waiter_el_t* waiter_remove_less_than(waiter_el_t** tree,
-                                     const uint64_t wake_time) {
-  while (*tree) {
-    if ((*tree)->left) {
-      tree = &(*tree)->left;
-    } else if (wake_time > (*tree)->wake_time) {
-      waiter_el_t* const ret = *tree;
-      *tree = (*tree)->right;
-      return ret;
-    } else {
-      return NULL;
-    }
+static int fiber_event_shard_init(fiber_event_shard_t* shard) {
+  fiber_qspinlock_init(&shard->spinlock);
+  if (!timer_heap_init(&shard->heap, 64)) {
+    return FIBER_ERROR;
   }
-  return NULL;
-}
-
-int fiber_event_init() {
-  if (event_fd >= 0) {
+  shard->armed_deadline = UINT64_MAX;
+#if defined(__linux__)
+  shard->timer_fd = -1;
+  shard->wake_fd = -1;
+  shard->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (shard->poll_fd < 0) {
     return FIBER_ERROR;
   }
 
-  struct rlimit file_lim;
-  if (getrlimit(RLIMIT_NOFILE, &file_lim)) {
+  shard->timer_fd =
+      timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (shard->timer_fd < 0) {
     return FIBER_ERROR;
   }
-  max_fd = file_lim.rlim_max;
-
-  assert(!wait_info);
-  wait_info = calloc(max_fd, sizeof(*wait_info));
-  assert(wait_info);
-
-#if defined(__linux__)
-  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
-  assert(timer_fd >= 0);
-  struct itimerspec in = {};
-  in.it_interval.tv_nsec = FIBER_TIME_RESOLUTION_MS * 1000000;  // ms
-  in.it_value.tv_nsec = FIBER_TIME_RESOLUTION_MS * 1000000;     // ms
-  struct itimerspec out;
-  int ret = timerfd_settime(timer_fd, 0, &in, &out);
-  assert(!ret);
-
-  fibershim_read = (readFnType)fiber_load_symbol("read");
-
-  const int the_event_fd = epoll_create(1);
-  assert(the_event_fd >= 0);
   struct epoll_event e = {};
   e.events = EPOLLIN;
-  e.data.fd = timer_fd;
-  ret = epoll_ctl(the_event_fd, EPOLL_CTL_ADD, timer_fd, &e);
-  assert(!ret);
-#elif defined(SOLARIS)
-  const int the_event_fd = port_create();
-  assert(the_event_fd >= 0);
-
-  port_notify_t notify_info = {};
-  notify_info.portnfy_port = the_event_fd;
+  e.data.u64 = FIBER_EVENT_TIMER_TAG;
+  if (epoll_ctl(shard->poll_fd, EPOLL_CTL_ADD, shard->timer_fd, &e)) {
+    return FIBER_ERROR;
+  }
 
-  struct sigevent evp;
+  shard->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (shard->wake_fd < 0) {
+    return FIBER_ERROR;
+  }
+  e.data.u64 = FIBER_EVENT_WAKE_TAG;
+  if (epoll_ctl(shard->poll_fd, EPOLL_CTL_ADD, shard->wake_fd, &e)) {
+    return FIBER_ERROR;
+  }
+#elif defined(SOLARIS)
+  shard->poll_fd = port_create();
+  if (shard->poll_fd < 0) {
+    return FIBER_ERROR;
+  }
+  shard->notify_info.portnfy_port = shard->poll_fd;
+  shard->notify_info.portnfy_user = shard;
+  struct sigevent evp = {};
   evp.sigev_notify = SIGEV_PORT;
-  evp.sigev_value.sival_ptr = &notify_info;
-  int ret = timer_create(CLOCK_REALTIME, &evp, &timer_id);
-  assert(!ret);
-
-  last_timer_trigger = gethrtime();
-
-  itimerspec_t itimeout = {};
-  itimeout.it_value.tv_sec = 0;
-  itimeout.it_value.tv_nsec = FIBER_TIME_RESOLUTION_MS * 1000000;     // ms
-  itimeout.it_interval.tv_sec = 0;
-  itimeout.it_interval.tv_nsec = FIBER_TIME_RESOLUTION_MS * 1000000;  // ms
-  ret = timer_settime(timer_id, 0, &itimeout, NULL);
-  assert(!ret);
+  evp.sigev_value.sival_ptr = &shard->notify_info;
+  if (timer_create(CLOCK_MONOTONIC, &evp, &shard->timer_id)) {
+    return FIBER_ERROR;
+  }
 #else
 #error OS not supported
 #endif
-
-  event_fd = the_event_fd;
   return FIBER_SUCCESS;
 }
 
-void fiber_event_shutdown() {
-  if (event_fd < 0) {
-    return;
-  }
-
+static void fiber_event_shard_destroy(fiber_event_shard_t* shard) {
 #if defined(__linux__)
-  close(timer_fd);
-  timer_fd = -1;
-  close(event_fd);
-  event_fd = -1;
+  if (shard->timer_fd >= 0) {
+    close(shard->timer_fd);
+  }
+  if (shard->wake_fd >= 0) {
+    close(shard->wake_fd);
+  }
 #elif defined(SOLARIS)
-  timer_delete(timer_id);
-  timer_id = -1;
-  close(event_fd);
-  event_fd = -1;
+  timer_delete(shard->timer_id);
 #else
 #error OS not supported
 #endif
-
-  free(wait_info);
-  wait_info = NULL;
+  if (shard->poll_fd >= 0) {
+    close(shard->poll_fd);
+  }
+  timer_heap_destroy(&shard->heap);
 }
 
-static void fiber_event_wake_waiters(fiber_manager_t* manager,
-                                     fd_wait_info_t* info, intptr_t result) {
-  while (info->waiters) {
-    fiber_t* const to_schedule = (fiber_t*)info->waiters;
-    info->waiters = to_schedule->scratch;
-    to_schedule->scratch = NULL;
+// claims the wait with state (FIBER_WAIT_*) and schedules the waiting fiber,
+// unless something else already has. returns 1 if this call woke it.
+static int fiber_event_wake(fiber_manager_t* manager, fiber_wait_t* wait,
+                            int state) {
+  if (!fiber_wait_claim(wait, state)) {
+    return 0;
+  }
+  // the wait is gone once the fiber runs. a fiber still saving its state is
+  // held by the scheduler until it has switched out.
+  fiber_t* const to_schedule = wait->fiber;
+  if (!manager) {
+    // a thread which isn't a manager (closing an fd) hands it to the managers
+    fiber_wake_external(to_schedule);
+    return 1;
+  }
+  if (to_schedule->state == FIBER_STATE_WAITING) {
     to_schedule->state = FIBER_STATE_READY;
-    to_schedule->scratch = (void*)result;
-    fiber_manager_schedule(manager, to_schedule);
   }
+  fiber_manager_schedule(manager, to_schedule);
+  return 1;
+}
+
+// wakes every sleeper in the shard whose deadline has passed, then re-arms the
+// shard's timer for the next deadline (if any)
+static int fiber_event_shard_expire(fiber_manager_t* manager,
+                                    fiber_event_shard_t* shard) {
+  int count = 0;
+  fiber_qspinlock_lock(&shard->spinlock);
+  const uint64_t now = fiber_time_now_ns();
+  timer_heap_node_t* node;
+  while ((node = timer_heap_peek(&shard->heap)) && node->deadline <= now) {
+    timer_heap_remove(&shard->heap, node);
+    // the node lives on the sleeper's stack; it's gone once the sleeper runs
+    count += fiber_event_wake(manager, (fiber_wait_t*)node->data,
+                              FIBER_WAIT_TIMED_OUT);
+  }
+  const uint64_t next_deadline = node ? node->deadline : UINT64_MAX;
+  if (next_deadline == UINT64_MAX && shard->armed_deadline <= now) {
+    // the one-shot timer already fired; there's nothing to disarm
+    shard->armed_deadline = UINT64_MAX;
+  } else if (next_deadline != shard->armed_deadline) {
+    fiber_event_shard_arm(shard, next_deadline);
+  }
+  fiber_qspinlock_unlock(&shard->spinlock);
+  return count;
+}
+
+int fiber_event_init() {
+  if (event_shards) {
+    return FIBER_ERROR;
+  }
+
+#if defined(__linux__)
+  fibershim_read = (readFnType)fiber_load_symbol("read");
+  fibershim_write = (writeFnType)fiber_load_symbol("write");
+  fibershim_epoll_wait = (epollWaitFnType)fiber_load_symbol("epoll_wait");
+#endif
+
+  // one per manager, spares included
+  const int the_num_shards = fiber_manager_get_max_kernel_thread_count();
+  fiber_event_shard_t* const shards = calloc(the_num_shards, sizeof(*shards));
+  assert(shards);
+  int i;
+  for (i = 0; i < the_num_shards; ++i) {
+    const int ret = fiber_event_shard_init(&shards[i]);
+    assert(ret);
+    (void)ret;
+  }
+
+#if defined(FIBER_EVENT_URING)
+  // socket io goes through a ring per manager when the kernel supports it.
+  // completions make the ring's fd readable.
+  if (fiber_uring_init(the_num_shards)) {
+    for (i = 0; i < the_num_shards; ++i) {
+      struct epoll_event e = {};
+      e.events = EPOLLIN;
+      e.data.u64 = FIBER_EVENT_URING_TAG;
+      const int ret = epoll_ctl(shards[i].poll_fd, EPOLL_CTL_ADD,
+                                fiber_uring_fd(i), &e);
+      assert(!ret);
+      (void)ret;
+    }
+  }
+#endif
+
+  num_event_shards = the_num_shards;
+  write_barrier();  // the shards must be initialized before they're visible
+  event_shards = shards;
+  return FIBER_SUCCESS;
 }
 
-static void fiber_event_wake_sleepers(fiber_manager_t* manager,
-                                      uint64_t trigger_count) {
-  fiber_spinlock_lock(&sleep_spinlock);
-  timer_trigger_count += trigger_count;
+void fiber_event_shutdown() {
+  if (!event_shards) {
+    return;
+  }
 
-  waiter_el_t* to_wake = NULL;
-  while ((to_wake = waiter_remove_less_than(&sleepers, timer_trigger_count))) {
-    do {
-      assert(to_wake->waiter);
-      fiber_t* const to_schedule = (fiber_t*)to_wake->waiter;
-      to_schedule->state = FIBER_STATE_READY;
-      fiber_manager_schedule(manager, to_schedule);
-      to_wake = to_wake->next;
-    } while (to_wake);
+  int i;
+  for (i = 0; i < num_event_shards; ++i) {
+    fiber_event_shard_destroy(&event_shards[i]);
   }
+  free(event_shards);
+  event_shards = NULL;
+  num_event_shards = 0;
+#if defined(FIBER_EVENT_URING)
+  fiber_uring_shutdown();
+#endif
+}
 
-  fiber_spinlock_unlock(&sleep_spinlock);
+int fiber_event_has_per_thread_sets() { return 1; }
+
+// wakes the fibers waiting for any of events. returns the events which woke a
+// waiter.
+static int fiber_event_wake_waiters(fiber_manager_t* manager,
+                                    fiber_fd_t* info, int events,
+                                    intptr_t result) {
+  int woken = 0;
+  fd_waiter_t** link = &info->waiters;
+  while (*link) {
+    fd_waiter_t* const waiter = *link;
+    if (!(waiter->events & events)) {
+      link = &waiter->next;
+      continue;
+    }
+    *link = waiter->next;
+    waiter->result = result;
+    if (fiber_event_wake(manager, waiter->wait, FIBER_WAIT_WOKEN)) {
+      woken |= waiter->events & events;
+    }
+  }
+  return woken;
 }
 
-static int fiber_poll_events_internal(uint32_t seconds, uint32_t useconds) {
+// polls the calling manager's event set. a negative timeout_ms blocks until an
+// event is triggered.
+static int fiber_poll_events_internal(int timeout_ms) {
+  fiber_manager_t* const manager = fiber_manager_get();
+  assert(manager->id < num_event_shards);
+  fiber_event_shard_t* const shard = &event_shards[manager->id];
 #if defined(__linux__)
+  int reaped = 0;
+#if defined(FIBER_EVENT_URING)
+  if (fiber_uring_enabled()) {
+    // this is where queued operations are submitted in a batch. completions
+    // which are already in the ring need no wait.
+    fiber_uring_submit(manager);
+    reaped = fiber_uring_reap(manager);
+    if (reaped) {
+      timeout_ms = 0;
+    }
+  }
+#endif
   struct epoll_event events[64];
   const int count =
-      epoll_wait(event_fd, events, 64, seconds * 1000 + useconds / 1000);
+      fibershim_epoll_wait(shard->poll_fd, events, 64, timeout_ms);
   if (count < 0) {
     if (errno ==
         EINTR) {  // interrupted, just try again later (could be gdb'ing etc)
@@ -230,64 +358,90 @@ static int fiber_poll_events_internal(uint32_t seconds, uint32_t useconds) {
     (void)ret;
     abort();
   }
-  fiber_manager_t* const manager = fiber_manager_get();
   manager->poll_count += 1;
+  int ret = count + reaped;
   int i;
   for (i = 0; i < count; ++i) {
-    const int the_fd = events[i].data.fd;
-    if (the_fd == timer_fd) {
+    const uint64_t data = events[i].data.u64;
+    if (data == FIBER_EVENT_WAKE_TAG) {
+      // wake_fd is level triggered, so drain it. wakes aren't events.
+      uint64_t wake_count = 0;
+      const ssize_t read_ret =
+          fibershim_read(shard->wake_fd, &wake_count, sizeof(wake_count));
+      (void)read_ret;
+      --ret;
+    } else if (data == FIBER_EVENT_TIMER_TAG) {
       uint64_t timer_count = 0;
       const int ret =
-          fibershim_read(timer_fd, &timer_count, sizeof(timer_count));
+          fibershim_read(shard->timer_fd, &timer_count, sizeof(timer_count));
       if (ret != sizeof(timer_count)) {
         assert(errno == EWOULDBLOCK || errno == EAGAIN);
         continue;
       }
-      fiber_event_wake_sleepers(manager, timer_count);
+      fiber_event_shard_expire(manager, shard);
+#if defined(FIBER_EVENT_URING)
+    } else if (data == FIBER_EVENT_URING_TAG) {
+      ret += fiber_uring_reap(manager) - 1;
+#endif
     } else {
-      fd_wait_info_t* const info = &wait_info[the_fd];
-      fiber_spinlock_lock(&info->spinlock);
+      const int the_fd = (int)data;
+      fiber_fd_t* const info = fiber_fd_find(the_fd);
+      fiber_qspinlock_lock(&info->spinlock);
+#if FIBER_EVENT_EDGE_TRIGGERED
+      // errors and hangups wake readers and writers alike
+      const int fired = events[i].events & (EPOLLERR | EPOLLHUP)
+                            ? EPOLLIN | EPOLLOUT
+                            : events[i].events & (EPOLLIN | EPOLLOUT);
+      // remember readiness nobody was waiting for
+      info->ready |=
+          fired & ~fiber_event_wake_waiters(manager, info, fired, 0);
+#else
       info->events &= ~events[i].events;
       info->events &= EPOLLIN | EPOLLOUT;
       if (info->events) {
-        struct epoll_event e;
+        // the fd may have moved to another manager since this event was
+        // reported, so re-arm it wherever it lives now
+        struct epoll_event e = {};
         e.events = EPOLLONESHOT | info->events;
-        e.data.fd = the_fd;
-        epoll_ctl(event_fd, EPOLL_CTL_MOD, e.data.fd, &e);
+        e.data.u64 = the_fd;
+        epoll_ctl(event_shards[info->shard].poll_fd, EPOLL_CTL_MOD, the_fd,
+                  &e);
+        manager->event_ctl_count += 1;
       }
-      fiber_event_wake_waiters(manager, info, 0);
-      fiber_spinlock_unlock(&info->spinlock);
+      fiber_event_wake_waiters(manager, info, -1, 0);
+#endif
+      fiber_qspinlock_unlock(&info->spinlock);
     }
   }
-  return count;
+  return ret;
 #elif defined(SOLARIS)
   port_event_t events[64];
   uint_t nget = 1;
   errno = 0;
-  timespec_t timeout = {seconds, useconds * 1000};
-  const int ret = port_getn(event_fd, events, 64, &nget, &timeout);
-  fiber_manager_t* const manager = fiber_manager_get();
+  timespec_t timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000};
+  const int ret = port_getn(shard->poll_fd, events, 64, &nget,
+                            timeout_ms < 0 ? NULL : &timeout);
   manager->poll_count += 1;
+  int count = nget;
   uint_t i;
   for (i = 0; i < nget; ++i) {
     port_event_t* const this_event = &events[i];
-    if (this_event->portev_source == PORT_SOURCE_TIMER) {
-      hrtime_t const now = gethrtime();
-      const int timer_count =
-          (now - last_timer_trigger) / (FIBER_TIME_RESOLUTION_MS * 1000000);
-      last_timer_trigger += timer_count * (FIBER_TIME_RESOLUTION_MS * 1000000);
-      fiber_event_wake_sleepers(manager, timer_count);
+    if (this_event->portev_source == PORT_SOURCE_USER) {
+      --count;  // sent by fiber_event_wake_poller
+    } else if (this_event->portev_source == PORT_SOURCE_TIMER) {
+      fiber_event_shard_expire(manager,
+                               (fiber_event_shard_t*)this_event->portev_user);
     } else if (this_event->portev_source == PORT_SOURCE_FD) {
-      fd_wait_info_t* const info = &wait_info[this_event->portev_object];
-      fiber_spinlock_lock(&info->spinlock);
+      fiber_fd_t* const info = fiber_fd_find(this_event->portev_object);
+      fiber_qspinlock_lock(&info->spinlock);
       info->events &= ~this_event->portev_events;
       info->events &= POLLIN | POLLOUT;
       if (info->events) {
-        port_associate(event_fd, PORT_SOURCE_FD, this_event->portev_object,
-                       info->events, NULL);
+        port_associate(event_shards[info->shard].poll_fd, PORT_SOURCE_FD,
+                       this_event->portev_object, info->events, NULL);
       }
-      fiber_event_wake_waiters(manager, info, 0);
-      fiber_spinlock_unlock(&info->spinlock);
+      fiber_event_wake_waiters(manager, info, -1, 0);
+      fiber_qspinlock_unlock(&info->spinlock);
     }
   }
   if (ret == -1 && errno != ETIME) {
@@ -297,130 +451,491 @@ static int fiber_poll_events_internal(uint32_t seconds, uint32_t useconds) {
     (void)ret;
     abort();
   }
-  return nget;
+  return count;
 #else
 #error OS not supported
 #endif
 }
 
 int fiber_poll_events() {
-  if (event_fd < 0) {
+  if (!event_shards) {
     return FIBER_EVENT_NOTINIT;
   }
 
-  return fiber_poll_events_internal(0, 0);
+  return fiber_poll_events_internal(0);
 }
 
 size_t fiber_poll_events_blocking(uint32_t seconds, uint32_t useconds) {
-  if (event_fd < 0) {
+  if (!event_shards) {
     fiber_do_real_sleep(seconds, useconds);
     return 0;
   }
 
-  return fiber_poll_events_internal(seconds, useconds);
+  return fiber_poll_events_internal(seconds * 1000 + useconds / 1000);
 }
 
-int fiber_wait_for_event(int fd, uint32_t events) {
-  assert(fd >= 0);
-  assert(fd < max_fd);
+size_t fiber_poll_events_until_woken() {
+  if (!event_shards) {
+    fiber_do_real_sleep(0, FIBER_TIME_RESOLUTION_MS * 1000);
+    return 0;
+  }
 
-  fd_wait_info_t* const info = &wait_info[fd];
-  fiber_spinlock_lock(&info->spinlock);
+  return fiber_poll_events_internal(-1);
+}
+
+void fiber_event_wake_poller(int manager_id) {
+  if (!event_shards) {
+    return;
+  }
+  assert(manager_id >= 0 && manager_id < num_event_shards);
+  fiber_event_shard_t* const shard = &event_shards[manager_id];
+#if defined(__linux__)
+  const uint64_t one = 1;
+  const ssize_t ret = fibershim_write(shard->wake_fd, &one, sizeof(one));
+  (void)ret;
+#elif defined(SOLARIS)
+  port_send(shard->poll_fd, 0, NULL);
+#else
+#error OS not supported
+#endif
+}
 
+// converts FIBER_POLL_IN/OUT to the event set's flags
+static int fiber_event_native_events(uint32_t events) {
+  int ret = 0;
 #if defined(__linux__)
   if (events & FIBER_POLL_IN) {
-    info->events |= EPOLLIN;
+    ret |= EPOLLIN;
   }
   if (events & FIBER_POLL_OUT) {
-    info->events |= EPOLLOUT;
+    ret |= EPOLLOUT;
   }
+#elif defined(SOLARIS)
+  if (events & FIBER_POLL_IN) {
+    ret |= POLLIN;
+  }
+  if (events & FIBER_POLL_OUT) {
+    ret |= POLLOUT;
+  }
+#else
+#error OS not supported
+#endif
+  return ret;
+}
+
+#if defined(__linux__)
+// applies op (EPOLL_CTL_ADD or EPOLL_CTL_MOD) to fd in poll_fd, retrying with
+// the other if the set disagrees about holding fd (ie. the fd number was
+// reused after a close the shims didn't see). fails with errno set.
+static int fiber_event_epoll_ctl(fiber_manager_t* manager, int poll_fd,
+                                 int op, int fd, struct epoll_event* e) {
+  manager->event_ctl_count += 1;
+  if (!epoll_ctl(poll_fd, op, fd, e)) {
+    return FIBER_SUCCESS;
+  }
+  const int retry_op = op == EPOLL_CTL_ADD ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (errno != (op == EPOLL_CTL_ADD ? EEXIST : ENOENT)) {
+    return FIBER_ERROR;
+  }
+  manager->event_ctl_count += 1;
+  return !epoll_ctl(poll_fd, retry_op, fd, e);
+}
+#endif
+
+// registers fd with the calling manager's event set for native_events. if the
+// fd lives elsewhere (ie. the fiber was stolen) it follows the fiber, unless
+// another fiber is waiting on it there too. fails with errno set if the event
+// set won't take the fd, leaving it unregistered (or where it was). must hold
+// info->spinlock.
+static int fiber_event_register(fiber_manager_t* manager, fiber_fd_t* info,
+                                int fd, int native_events) {
+  const int old_shard = info->shard;
+  const int migrate = info->added && old_shard != manager->id && !info->waiters;
+  const int shard = !info->added || migrate ? manager->id : old_shard;
+  const int poll_fd = event_shards[shard].poll_fd;
+
+#if defined(__linux__)
   struct epoll_event e = {};
+#if FIBER_EVENT_EDGE_TRIGGERED
+  (void)native_events;
+  e.events = EPOLLIN | EPOLLOUT | EPOLLET;
+#else
+  info->events |= native_events;
   e.events = EPOLLONESHOT | info->events;
-  e.data.fd = fd;
-
-  if (!info->added) {
-    epoll_ctl(event_fd, EPOLL_CTL_ADD, fd, &e);
-    info->added = 1;
-  } else {
-    epoll_ctl(event_fd, EPOLL_CTL_MOD, fd, &e);
+#endif
+  e.data.u64 = fd;
+
+  int op = EPOLL_CTL_ADD;
+  if (migrate) {
+    // adding an fd which is already ready reports it again, so no edge is
+    // lost. the fd may already have left the old set if it was reopened.
+    epoll_ctl(event_shards[old_shard].poll_fd, EPOLL_CTL_DEL, fd, NULL);
+    manager->event_ctl_count += 1;
+    manager->event_migrate_count += 1;
+    info->added = 0;
+  } else if (info->added) {
+    if (FIBER_EVENT_EDGE_TRIGGERED) {
+      return FIBER_SUCCESS;
+    }
+    op = EPOLL_CTL_MOD;
+  }
+  if (!fiber_event_epoll_ctl(manager, poll_fd, op, fd, &e)) {
+    return FIBER_ERROR;
   }
 #elif defined(SOLARIS)
-  if (events & FIBER_POLL_IN) {
-    info->events |= POLLIN;
+  info->events |= native_events;
+  if (migrate) {
+    port_dissociate(event_shards[old_shard].poll_fd, PORT_SOURCE_FD, fd);
+    manager->event_migrate_count += 1;
+    info->added = 0;
   }
-  if (events & FIBER_POLL_OUT) {
-    info->events |= POLLOUT;
+  manager->event_ctl_count += 1;
+  if (port_associate(poll_fd, PORT_SOURCE_FD, fd, info->events, NULL)) {
+    return FIBER_ERROR;
   }
-  port_associate(event_fd, PORT_SOURCE_FD, fd, info->events, NULL);
 #else
 #error OS not supported
 #endif
+  info->shard = shard;
+  info->added = 1;
+  return FIBER_SUCCESS;
+}
 
+// consumes readiness reported while nobody was waiting (edge triggered only).
+// must hold info->spinlock.
+static int fiber_event_take_ready(fiber_fd_t* info, int native_events) {
+  if (info->ready & native_events) {
+    info->ready &= ~native_events;
+    return 1;
+  }
+  return 0;
+}
+
+int fiber_wait_for_event(int fd, uint32_t events) {
+  fiber_fd_t* const info = fiber_fd_get(fd);
+  if (!info) {
+    return FIBER_ERROR;
+  }
+
+  fiber_wait_t wait = {};
+  fd_waiter_t waiter = {};
+  waiter.wait = &wait;
+  waiter.events = fiber_event_native_events(events);
+
+  fiber_qspinlock_lock(&info->spinlock);
+  // the lock may have waited for us, and we may have woken on another thread
   fiber_manager_t* const manager = fiber_manager_get();
+  wait.fiber = manager->current_fiber;
+  if (!fiber_event_register(manager, info, fd, waiter.events)) {
+    const int error = errno;
+    fiber_qspinlock_unlock(&info->spinlock);
+    errno = error;
+    return FIBER_ERROR;
+  }
+  if (fiber_event_take_ready(info, waiter.events)) {
+    // the fd became ready after the caller saw EAGAIN
+    fiber_qspinlock_unlock(&info->spinlock);
+    return FIBER_SUCCESS;
+  }
+
   manager->event_wait_count += 1;
-  fiber_t* const this_fiber = manager->current_fiber;
-  this_fiber->scratch =
-      info->waiters;  // use scratch field as a linked list of waiters
-  info->waiters = this_fiber;
-  this_fiber->state = FIBER_STATE_WAITING;
+  waiter.next = info->waiters;
+  info->waiters = &waiter;
+  wait.fiber->state = FIBER_STATE_WAITING;
   manager->spinlock_to_unlock = &info->spinlock;
   fiber_manager_yield(manager);
 
-  // if the fd is closed while we're polling, this_fiber->scratch will be
-  // non-NULL (see fiber_fd_closed)
-  return this_fiber->scratch ? FIBER_ERROR : FIBER_SUCCESS;
+  // waiter.result is -1 if the fd was closed while we were waiting (see
+  // fiber_fd_closed)
+  if (waiter.result) {
+    errno = EBADF;
+    return FIBER_ERROR;
+  }
+  return FIBER_SUCCESS;
 }
 
-int fiber_sleep(uint32_t seconds, uint32_t useconds) {
-  if (event_fd < 0) {
-    fiber_do_real_sleep(seconds, useconds);
-    return FIBER_SUCCESS;
+// unlinks a waiter which may already have been woken (and unlinked)
+static void fiber_event_unlink_waiter(fiber_fd_t* info,
+                                      fd_waiter_t* waiter) {
+  fiber_qspinlock_lock(&info->spinlock);
+  fd_waiter_t** link = &info->waiters;
+  while (*link && *link != waiter) {
+    link = &(*link)->next;
+  }
+  if (*link) {
+    *link = waiter->next;
   }
+  fiber_qspinlock_unlock(&info->spinlock);
+}
 
-  const uint64_t sleep_ms = seconds * 1000 + useconds / 1000 + 1;  // ms
-  waiter_el_t wake_info = {};
+// waits with at most this many fds use waiters on the fiber's stack
+#define FIBER_EVENT_STACK_WAITERS (8)
+
+int fiber_wait_for_any_event(const fiber_event_fd_t* fds, size_t count,
+                             uint64_t deadline_ns) {
+  if (!event_shards) {
+    const uint64_t resolution_deadline =
+        fiber_time_now_ns() + FIBER_TIME_RESOLUTION_MS * 1000000ULL;
+    return fiber_sleep_until(deadline_ns < resolution_deadline
+                                 ? deadline_ns
+                                 : resolution_deadline);
+  }
 
-  fiber_spinlock_lock(&sleep_spinlock);
+  load_load_barrier();  // pairs with the write_barrier in fiber_event_init
 
-  const uint64_t wake_time = timer_trigger_count + sleep_ms;
-  wake_info.wake_time = wake_time;
-  waiter_insert(&sleepers, &wake_info);
+  fd_waiter_t stack_waiters[FIBER_EVENT_STACK_WAITERS];
+  fd_waiter_t* const waiters =
+      count <= FIBER_EVENT_STACK_WAITERS ? stack_waiters
+                                         : malloc(count * sizeof(*waiters));
+  if (!waiters) {
+    errno = ENOMEM;
+    return FIBER_ERROR;
+  }
 
   fiber_manager_t* const manager = fiber_manager_get();
   fiber_t* const this_fiber = manager->current_fiber;
-  wake_info.waiter = this_fiber;
+  fiber_wait_t wait = {};
+  wait.fiber = this_fiber;
+  // the fiber can be woken as soon as it's registered for the first fd, and
+  // it can't hold every fd's lock until it switches out. the scheduler holds
+  // on to a fiber which is still saving its state instead.
+  this_fiber->state = FIBER_STATE_SAVING_STATE_TO_WAIT;
+
+  int ready = 0;
+  int error = 0;  // the errno of a failed registration
+  size_t linked;
+  for (linked = 0; linked < count; ++linked) {
+    const int fd = fds[linked].fd;
+    fiber_fd_t* const info = fiber_fd_get(fd);
+    if (!info) {
+      // a bad fd is "ready" - the caller's own check will report it
+      ready = 1;
+      break;
+    }
+    fd_waiter_t* const waiter = &waiters[linked];
+    memset(waiter, 0, sizeof(*waiter));
+    waiter->wait = &wait;
+    waiter->events = fiber_event_native_events(fds[linked].events);
+
+    fiber_qspinlock_lock(&info->spinlock);
+    if (!fiber_event_register(manager, info, fd, waiter->events)) {
+      // stop as if it were ready, then fail once the wait is taken back
+      error = errno;
+      fiber_qspinlock_unlock(&info->spinlock);
+      ready = 1;
+      break;
+    }
+    ready = fiber_event_take_ready(info, waiter->events);
+    if (!ready) {
+      waiter->next = info->waiters;
+      info->waiters = waiter;
+    }
+    fiber_qspinlock_unlock(&info->spinlock);
+    if (ready) {
+      break;
+    }
+  }
+
+  fiber_event_shard_t* shard = NULL;
+  timer_heap_node_t wake_info = {};
+  wake_info.index = TIMER_HEAP_INVALID_INDEX;
+  if (!ready && deadline_ns != UINT64_MAX) {
+    assert(manager->id < num_event_shards);
+    shard = &event_shards[manager->id];
+    wake_info.deadline = deadline_ns;
+    wake_info.data = &wait;
+    fiber_qspinlock_lock(&shard->spinlock);
+    if (timer_heap_push(&shard->heap, &wake_info)) {
+      if (deadline_ns < shard->armed_deadline) {
+        fiber_event_shard_arm(shard, deadline_ns);
+      }
+    } else {
+      ready = 1;  // out of memory - let the caller poll again instead
+    }
+    fiber_qspinlock_unlock(&shard->spinlock);
+  }
+
+  if (ready && fiber_wait_claim(&wait, FIBER_WAIT_WOKEN)) {
+    this_fiber->state = FIBER_STATE_RUNNING;
+  } else {
+    // still waiting, or another thread has already scheduled us
+    manager->event_wait_count += 1;
+    fiber_manager_yield(manager);
+  }
+
+  // take back whatever didn't fire
+  size_t i;
+  for (i = 0; i < linked; ++i) {
+    fiber_event_unlink_waiter(fiber_fd_find(fds[i].fd), &waiters[i]);
+  }
+  if (shard) {
+    fiber_qspinlock_lock(&shard->spinlock);
+    if (wake_info.index != TIMER_HEAP_INVALID_INDEX) {
+      timer_heap_remove(&shard->heap, &wake_info);
+    }
+    fiber_qspinlock_unlock(&shard->spinlock);
+  }
+  if (waiters != stack_waiters) {
+    free(waiters);
+  }
+  if (error) {
+    errno = error;
+    return FIBER_ERROR;
+  }
+  return FIBER_SUCCESS;
+}
+
+int fiber_wait_for_event_timeout(int fd, uint32_t events,
+                                 uint64_t deadline_ns) {
+  if (deadline_ns == UINT64_MAX) {
+    return fiber_wait_for_event(fd, events);
+  }
+  if (fiber_time_now_ns() >= deadline_ns) {
+    errno = ETIMEDOUT;
+    return FIBER_ERROR;
+  }
+  const fiber_event_fd_t wait_fd = {fd, events};
+  if (!fiber_wait_for_any_event(&wait_fd, 1, deadline_ns)) {
+    return FIBER_ERROR;
+  }
+  if (fiber_time_now_ns() >= deadline_ns) {
+    errno = ETIMEDOUT;
+    return FIBER_ERROR;
+  }
+  return FIBER_SUCCESS;
+}
+
+int fiber_sleep(uint32_t seconds, uint32_t useconds) {
+  return fiber_sleep_ns(seconds * 1000000000ULL + useconds * 1000ULL);
+}
+
+int fiber_sleep_ns(uint64_t nanoseconds) {
+  return fiber_sleep_until(fiber_time_now_ns() + nanoseconds);
+}
+
+int fiber_sleep_until(uint64_t deadline_ns) {
+  if (!event_shards) {
+    const uint64_t now = fiber_time_now_ns();
+    if (deadline_ns > now) {
+      const uint64_t useconds = (deadline_ns - now + 999) / 1000;
+      fiber_do_real_sleep(useconds / 1000000, useconds % 1000000);
+    }
+    return FIBER_SUCCESS;
+  }
+
+  load_load_barrier();  // pairs with the write_barrier in fiber_event_init
+
+  fiber_manager_t* manager = fiber_manager_get();
+  if (deadline_ns <= fiber_time_now_ns()) {
+    fiber_manager_yield(manager);
+    return FIBER_SUCCESS;
+  }
+
+  assert(manager->id < num_event_shards);
+  fiber_event_shard_t* const shard = &event_shards[manager->id];
+  fiber_t* const this_fiber = manager->current_fiber;
+  fiber_wait_t wait = {};
+  wait.fiber = this_fiber;
+  timer_heap_node_t wake_info = {};
+  wake_info.deadline = deadline_ns;
+  wake_info.data = &wait;
+
+  fiber_qspinlock_lock(&shard->spinlock);
+  if (!timer_heap_push(&shard->heap, &wake_info)) {
+    fiber_qspinlock_unlock(&shard->spinlock);
+    errno = ENOMEM;
+    return FIBER_ERROR;
+  }
+  if (deadline_ns < shard->armed_deadline) {
+    fiber_event_shard_arm(shard, deadline_ns);
+  }
+
   this_fiber->state = FIBER_STATE_WAITING;
-  manager->spinlock_to_unlock = &sleep_spinlock;
+  manager = fiber_manager_get();  // the lock may have moved us
+  manager->spinlock_to_unlock = &shard->spinlock;
   fiber_manager_yield(manager);
 
   return FIBER_SUCCESS;
 }
 
+int fiber_event_wait_until(fiber_wait_t* wait, uint64_t deadline_ns) {
+  fiber_manager_t* manager = fiber_manager_get();
+  assert(wait->fiber == manager->current_fiber);
+  fiber_event_shard_t* shard = NULL;
+  timer_heap_node_t wake_info = {};
+  wake_info.index = TIMER_HEAP_INVALID_INDEX;
+  if (deadline_ns != UINT64_MAX) {
+    if (event_shards) {
+      load_load_barrier();  // pairs with the write_barrier in fiber_event_init
+      assert(manager->id < num_event_shards);
+      fiber_event_shard_t* const timer_shard = &event_shards[manager->id];
+      wake_info.deadline = deadline_ns;
+      wake_info.data = wait;
+      fiber_qspinlock_lock(&timer_shard->spinlock);
+      if (timer_heap_push(&timer_shard->heap, &wake_info)) {
+        if (deadline_ns < timer_shard->armed_deadline) {
+          fiber_event_shard_arm(timer_shard, deadline_ns);
+        }
+        shard = timer_shard;
+      }
+      fiber_qspinlock_unlock(&timer_shard->spinlock);
+      manager = fiber_manager_get();  // the lock may have moved us
+    }
+    if (!shard) {
+      // nothing can time the wait (or we're out of memory); give up straight
+      // away. the scheduler holds on to the fiber until it has switched out.
+      fiber_event_wake(manager, wait, FIBER_WAIT_TIMED_OUT);
+    }
+  }
+
+  fiber_manager_yield(manager);
+
+  if (shard) {
+    fiber_qspinlock_lock(&shard->spinlock);
+    if (wake_info.index != TIMER_HEAP_INVALID_INDEX) {
+      timer_heap_remove(&shard->heap, &wake_info);
+    }
+    fiber_qspinlock_unlock(&shard->spinlock);
+  }
+  if (atomic_load(&wait->state) == FIBER_WAIT_TIMED_OUT) {
+    errno = ETIMEDOUT;
+    return FIBER_ERROR;
+  }
+  return FIBER_SUCCESS;
+}
+
 void fiber_fd_closed(int fd) {
-  if (event_fd < 0) {
+  if (!event_shards) {
     return;
   }
 
-  assert(fd >= 0);
-  assert(fd < max_fd);
-  fd_wait_info_t* const info = &wait_info[fd];
-  fiber_spinlock_lock(&info->spinlock);
+  fiber_fd_t* const info = fiber_fd_find(fd);
+  if (!info) {
+    return;  // nobody has ever waited on it
+  }
+  fiber_qspinlock_lock(&info->spinlock);
+  const int poll_fd = event_shards[info->shard].poll_fd;
 #if defined(__linux__)
   if (info->events || info->added) {
-    epoll_ctl(event_fd, EPOLL_CTL_DEL, fd, NULL);
+    epoll_ctl(poll_fd, EPOLL_CTL_DEL, fd, NULL);
     info->events = 0;
     info->added = 0;
   }
+  info->ready = 0;
 #elif defined(SOLARIS)
   if (info->events) {
-    port_dissociate(event_fd, PORT_SOURCE_FD, fd);
+    port_dissociate(poll_fd, PORT_SOURCE_FD, fd);
     info->events = 0;
   }
+  info->added = 0;
 #else
 #error OS not supported
 #endif
   // setting result to -1 indicates to fiber_wait_for_event that the fd was
   // closed
-  fiber_event_wake_waiters(fiber_manager_get(), info, -1);
-  fiber_spinlock_unlock(&info->spinlock);
+  fiber_event_wake_waiters(fiber_manager_get(), info, -1, -1);
+  fiber_qspinlock_unlock(&info->spinlock);
+#if defined(FIBER_EVENT_URING)
+  fiber_uring_fd_closed(fd);
+#endif
 }
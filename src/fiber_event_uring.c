@@ -0,0 +1,399 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_event_uring.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "fiber.h"
+#include "fiber_event.h"
+#include "fiber_fd.h"
+
+// lives on the waiting fiber's stack. its address is the operation's
+// user_data.
+typedef struct fiber_uring_waiter {
+  fiber_t* fiber;
+  fiber_fd_t* info;  // counts the operation in uring_inflight
+  int fd;
+  int32_t result;
+} fiber_uring_waiter_t;
+
+typedef struct fiber_uring {
+  int ring_fd;
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;  // the same mapping as sq_ring with IORING_FEAT_SINGLE_MMAP
+  size_t cq_ring_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  // only the owning thread queues operations and reaps completions, so the
+  // tail of the submission queue and the head of the completion queue are
+  // only written here
+  _Atomic unsigned* sq_head;
+  _Atomic unsigned* sq_tail;
+  _Atomic unsigned* sq_flags;  // IORING_SQ_*, written by the kernel
+  unsigned sq_mask;
+  unsigned sq_entries;
+  _Atomic unsigned* cq_head;
+  _Atomic unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+  unsigned to_submit;  // queued but not yet passed to io_uring_enter
+} fiber_uring_t;
+
+static fiber_uring_t* rings = NULL;
+static int num_rings = 0;
+
+// the operations performed through the rings
+static const uint8_t fiber_uring_required_ops[] = {
+    IORING_OP_RECV,    IORING_OP_SEND,   IORING_OP_RECVMSG,
+    IORING_OP_SENDMSG, IORING_OP_ACCEPT, IORING_OP_CONNECT,
+};
+
+static void fiber_uring_destroy(fiber_uring_t* ring) {
+  if (ring->sqes) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  if (ring->sq_ring) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  }
+  if (ring->ring_fd >= 0) {
+    close(ring->ring_fd);
+  }
+}
+
+static int fiber_uring_probe(int ring_fd) {
+  const size_t probe_size =
+      sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe* const probe = calloc(1, probe_size);
+  if (!probe) {
+    return FIBER_ERROR;
+  }
+  int ret = !syscall(SYS_io_uring_register, ring_fd, IORING_REGISTER_PROBE,
+                     probe, 256);
+  size_t i;
+  for (i = 0; ret && i < sizeof(fiber_uring_required_ops); ++i) {
+    const uint8_t op = fiber_uring_required_ops[i];
+    ret = op <= probe->last_op &&
+          (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(probe);
+  if (!ret) {
+    return FIBER_ERROR;
+  }
+
+  // closing an fd cancels its operations from whichever thread closes it,
+  // which needs IORING_REGISTER_SYNC_CANCEL (Linux 6.0). older kernels reject
+  // the opcode with EINVAL; newer ones fail to find the (invalid) fd.
+  struct io_uring_sync_cancel_reg reg = {};
+  reg.fd = -1;
+  reg.flags = IORING_ASYNC_CANCEL_FD;
+  if (!syscall(SYS_io_uring_register, ring_fd, IORING_REGISTER_SYNC_CANCEL,
+               &reg, 1) ||
+      errno == EINVAL) {
+    return FIBER_ERROR;
+  }
+  return FIBER_SUCCESS;
+}
+
+static int fiber_uring_create(fiber_uring_t* ring) {
+  ring->ring_fd = -1;
+
+  struct io_uring_params params = {};
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+  params.cq_entries = 4 * FIBER_URING_ENTRIES;
+  ring->ring_fd = syscall(SYS_io_uring_setup, FIBER_URING_ENTRIES, &params);
+  if (ring->ring_fd < 0) {
+    return FIBER_ERROR;
+  }
+  if (!(params.features & IORING_FEAT_NODROP) ||
+      !fiber_uring_probe(ring->ring_fd)) {
+    return FIBER_ERROR;
+  }
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(__u32);
+  ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  const int single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap && ring->cq_ring_size > ring->sq_ring_size) {
+    ring->sq_ring_size = ring->cq_ring_size;
+  }
+
+  void* const sq_ring =
+      mmap(0, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED) {
+    return FIBER_ERROR;
+  }
+  ring->sq_ring = sq_ring;
+
+  if (single_mmap) {
+    ring->cq_ring = sq_ring;
+  } else {
+    void* const cq_ring =
+        mmap(0, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED) {
+      return FIBER_ERROR;
+    }
+    ring->cq_ring = cq_ring;
+  }
+
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* const sqes =
+      mmap(0, ring->sqes_size, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return FIBER_ERROR;
+  }
+  ring->sqes = sqes;
+
+  char* const sq = ring->sq_ring;
+  ring->sq_head = (_Atomic unsigned*)(sq + params.sq_off.head);
+  ring->sq_tail = (_Atomic unsigned*)(sq + params.sq_off.tail);
+  ring->sq_flags = (_Atomic unsigned*)(sq + params.sq_off.flags);
+  ring->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  // entries are always queued in order, so the index array never changes
+  unsigned* const sq_array = (unsigned*)(sq + params.sq_off.array);
+  unsigned i;
+  for (i = 0; i < params.sq_entries; ++i) {
+    sq_array[i] = i;
+  }
+
+  char* const cq = ring->cq_ring;
+  ring->cq_head = (_Atomic unsigned*)(cq + params.cq_off.head);
+  ring->cq_tail = (_Atomic unsigned*)(cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+  return FIBER_SUCCESS;
+}
+
+int fiber_uring_init(int the_num_rings) {
+  assert(!rings);
+  assert(the_num_rings > 0);
+
+  fiber_uring_t* const the_rings = calloc(the_num_rings, sizeof(*the_rings));
+  assert(the_rings);
+  int i;
+  for (i = 0; i < the_num_rings; ++i) {
+    if (!fiber_uring_create(&the_rings[i])) {
+      // io_uring is unavailable (or too old). the caller carries on with
+      // epoll alone.
+      int j;
+      for (j = 0; j <= i; ++j) {
+        fiber_uring_destroy(&the_rings[j]);
+      }
+      free(the_rings);
+      return FIBER_ERROR;
+    }
+  }
+
+  num_rings = the_num_rings;
+  rings = the_rings;
+  return FIBER_SUCCESS;
+}
+
+void fiber_uring_shutdown() {
+  if (!rings) {
+    return;
+  }
+  int i;
+  for (i = 0; i < num_rings; ++i) {
+    fiber_uring_destroy(&rings[i]);
+  }
+  free(rings);
+  rings = NULL;
+  num_rings = 0;
+}
+
+int fiber_uring_enabled() { return rings != NULL; }
+
+int fiber_uring_fd(int manager_id) {
+  assert(rings);
+  assert(manager_id >= 0 && manager_id < num_rings);
+  return rings[manager_id].ring_fd;
+}
+
+// completions which didn't fit in the completion queue wait on the kernel's
+// overflow list, and only move into the queue when an enter asks for events
+static inline int fiber_uring_cq_overflowed(fiber_uring_t* ring) {
+  return atomic_load_explicit(ring->sq_flags, memory_order_relaxed) &
+         IORING_SQ_CQ_OVERFLOW;
+}
+
+static void fiber_uring_submit_internal(fiber_manager_t* manager,
+                                        fiber_uring_t* ring) {
+  if (!ring->to_submit) {
+    return;
+  }
+  // the kernel refuses new submissions while completions are backed up
+  const unsigned flags =
+      fiber_uring_cq_overflowed(ring) ? IORING_ENTER_GETEVENTS : 0;
+  const int ret = syscall(SYS_io_uring_enter, ring->ring_fd, ring->to_submit,
+                          0, flags, NULL, 0);
+  manager->uring_enter_count += 1;
+  // on failure (ie. EBUSY while completions are backed up) the entries stay
+  // queued and are submitted next time
+  if (ret > 0) {
+    assert((unsigned)ret <= ring->to_submit);
+    ring->to_submit -= ret;
+  }
+}
+
+void fiber_uring_submit(fiber_manager_t* manager) {
+  assert(rings);
+  assert(manager->id < num_rings);
+  fiber_uring_submit_internal(manager, &rings[manager->id]);
+}
+
+int fiber_uring_reap(fiber_manager_t* manager) {
+  assert(rings);
+  assert(manager->id < num_rings);
+  fiber_uring_t* const ring = &rings[manager->id];
+  int count = 0;
+  while (1) {
+    unsigned head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    const unsigned tail =
+        atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+    for (; head != tail; ++head) {
+      const struct io_uring_cqe* const cqe =
+          &ring->cqes[head & ring->cq_mask];
+      fiber_uring_waiter_t* const waiter =
+          (fiber_uring_waiter_t*)(uintptr_t)cqe->user_data;
+      atomic_fetch_sub_explicit(&waiter->info->uring_inflight, 1,
+                                memory_order_relaxed);
+      waiter->result = cqe->res;
+      // the waiter is gone once its fiber runs
+      fiber_t* const to_schedule = waiter->fiber;
+      to_schedule->state = FIBER_STATE_READY;
+      fiber_manager_schedule(manager, to_schedule);
+      ++count;
+    }
+    atomic_store_explicit(ring->cq_head, head, memory_order_release);
+
+    if (!fiber_uring_cq_overflowed(ring)) {
+      break;
+    }
+    // move the overflow into the (now empty) completion queue and go again
+    const int ret = syscall(SYS_io_uring_enter, ring->ring_fd, 0, 0,
+                            IORING_ENTER_GETEVENTS, NULL, 0);
+    manager->uring_enter_count += 1;
+    if (ret < 0 && errno != EINTR) {
+      break;
+    }
+  }
+  return count;
+}
+
+// queues an operation on the calling manager's ring. returns FIBER_ERROR if
+// the submission queue is full even after submitting.
+static int fiber_uring_queue(fiber_manager_t* manager,
+                             fiber_uring_waiter_t* waiter, uint8_t opcode,
+                             const void* addr, uint32_t len, uint64_t off,
+                             uint32_t op_flags) {
+  assert(manager->id < num_rings);
+  fiber_uring_t* const ring = &rings[manager->id];
+  const unsigned tail =
+      atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+  if (tail - atomic_load_explicit(ring->sq_head, memory_order_acquire) >=
+      ring->sq_entries) {
+    fiber_uring_submit_internal(manager, ring);
+    if (tail - atomic_load_explicit(ring->sq_head, memory_order_acquire) >=
+        ring->sq_entries) {
+      return FIBER_ERROR;
+    }
+  }
+
+  struct io_uring_sqe* const sqe = &ring->sqes[tail & ring->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = waiter->fd;
+  sqe->addr = (uintptr_t)addr;
+  sqe->len = len;
+  sqe->off = off;
+  sqe->msg_flags = op_flags;
+  sqe->user_data = (uintptr_t)waiter;
+  atomic_fetch_add_explicit(&waiter->info->uring_inflight, 1,
+                            memory_order_relaxed);
+  atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+  ring->to_submit += 1;
+  manager->uring_op_count += 1;
+
+  if (ring->to_submit >= FIBER_URING_SUBMIT_BATCH) {
+    fiber_uring_submit_internal(manager, ring);
+  }
+  return FIBER_SUCCESS;
+}
+
+int fiber_uring_perform(int fd, uint32_t events, uint8_t opcode,
+                        const void* addr, uint32_t len, uint64_t off,
+                        uint32_t op_flags, ssize_t* result) {
+  assert(rings);
+  assert(result);
+  fiber_fd_t* const info = fiber_fd_get(fd);
+  if (!info) {
+    return FIBER_ERROR;
+  }
+
+  while (1) {
+    fiber_manager_t* const manager = fiber_manager_get();
+    fiber_uring_waiter_t waiter = {};
+    waiter.fiber = manager->current_fiber;
+    waiter.info = info;
+    waiter.fd = fd;
+    if (!fiber_uring_queue(manager, &waiter, opcode, addr, len, off,
+                           op_flags)) {
+      return FIBER_ERROR;
+    }
+
+    // the completion is reaped by this thread when it next polls, which is
+    // only after this fiber has switched out
+    waiter.fiber->state = FIBER_STATE_WAITING;
+    fiber_manager_yield(manager);
+
+    if (waiter.result >= 0) {
+      *result = waiter.result;
+      return FIBER_SUCCESS;
+    }
+    if (waiter.result == -EAGAIN) {
+      // older kernels don't wait on O_NONBLOCK files
+      if (fiber_wait_for_event(fd, events)) {
+        continue;
+      }
+      waiter.result = -errno;
+    }
+    // operations cancelled by fiber_uring_fd_closed() report ECANCELED
+    errno = waiter.result == -ECANCELED ? EBADF : -waiter.result;
+    *result = -1;
+    return FIBER_SUCCESS;
+  }
+}
+
+void fiber_uring_fd_closed(int fd) {
+  const fiber_fd_t* const info = fiber_fd_find(fd);
+  if (!rings || !info ||
+      !atomic_load_explicit(&info->uring_inflight, memory_order_relaxed)) {
+    return;
+  }
+  // the operations hold a reference to the file, so closing the fd wouldn't
+  // finish them. the cancelled operations complete on their own rings.
+  struct io_uring_sync_cancel_reg reg = {};
+  reg.fd = fd;
+  reg.flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  reg.timeout.tv_sec = -1;
+  reg.timeout.tv_nsec = -1;
+  int i;
+  for (i = 0; i < num_rings; ++i) {
+    syscall(SYS_io_uring_register, rings[i].ring_fd,
+            IORING_REGISTER_SYNC_CANCEL, &reg, 1);
+  }
+}
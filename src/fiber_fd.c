@@ -0,0 +1,80 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_fd.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "fiber.h"
+
+int fiber_fd_max = 0;
+fiber_fd_t* _Atomic* fiber_fd_pages = NULL;
+
+int fiber_fd_init() {
+  if (fiber_fd_pages) {
+    return FIBER_ERROR;
+  }
+
+  struct rlimit file_lim;
+  if (getrlimit(RLIMIT_NOFILE, &file_lim)) {
+    return FIBER_ERROR;
+  }
+  const rlim_t limit =
+      file_lim.rlim_max == RLIM_INFINITY || file_lim.rlim_max > INT_MAX
+          ? INT_MAX
+          : file_lim.rlim_max;
+
+  const size_t num_pages =
+      (limit + FIBER_FD_PAGE_SIZE - 1) >> FIBER_FD_PAGE_BITS;
+  fiber_fd_pages = calloc(num_pages, sizeof(*fiber_fd_pages));
+  if (!fiber_fd_pages) {
+    return FIBER_ERROR;
+  }
+  fiber_fd_max = limit;
+  return FIBER_SUCCESS;
+}
+
+void fiber_fd_shutdown() {
+  if (!fiber_fd_pages) {
+    return;
+  }
+  const size_t num_pages =
+      ((size_t)fiber_fd_max + FIBER_FD_PAGE_SIZE - 1) >> FIBER_FD_PAGE_BITS;
+  fiber_fd_max = 0;
+  size_t i;
+  for (i = 0; i < num_pages; ++i) {
+    free(fiber_fd_pages[i]);
+  }
+  free(fiber_fd_pages);
+  fiber_fd_pages = NULL;
+}
+
+fiber_fd_t* fiber_fd_create(int fd) {
+  if (fd < 0 || fd >= fiber_fd_max) {
+    errno = EBADF;
+    return NULL;
+  }
+
+  fiber_fd_t* _Atomic* const slot = &fiber_fd_pages[fd >> FIBER_FD_PAGE_BITS];
+  fiber_fd_t* page = atomic_load_explicit(slot, memory_order_acquire);
+  if (!page) {
+    const size_t size = FIBER_FD_PAGE_SIZE * sizeof(fiber_fd_t);
+    fiber_fd_t* new_page = NULL;
+    if (posix_memalign((void**)&new_page, FIBER_CACHELINE_SIZE, size)) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    memset(new_page, 0, size);
+    // whoever loses the race frees its page and uses the winner's
+    if (atomic_compare_exchange_strong(slot, &page, new_page)) {
+      page = new_page;
+    } else {
+      free(new_page);
+    }
+  }
+  return &page[fd & (FIBER_FD_PAGE_SIZE - 1)];
+}
@@ -0,0 +1,172 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_group.h"
+
+#include <errno.h>
+
+#include "fiber_manager.h"
+
+#define FIBER_GROUP_WAITING (FIBER_GROUP_WAITING_ALL | FIBER_GROUP_WAITING_ANY)
+
+int fiber_group_init(fiber_group_t* group) {
+  assert(group);
+  group->state = 0;
+  group->waiter = NULL;
+  return FIBER_SUCCESS;
+}
+
+void fiber_group_destroy(fiber_group_t* group) {
+  assert(group);
+  assert(!(group->state & (FIBER_GROUP_RUNNING_MASK | FIBER_GROUP_WAITING)));
+}
+
+// whether a waiter waiting for flag can stop waiting. nothing is left to wait
+// for once every child has finished.
+static inline int fiber_group_satisfied(uint64_t state, uint64_t flag) {
+  return !(state & FIBER_GROUP_RUNNING_MASK) ||
+         (flag == FIBER_GROUP_WAITING_ANY &&
+          (state & FIBER_GROUP_FINISHED_MASK));
+}
+
+// takes running children off the count, adding finished ones to be reported.
+// whoever satisfies the waiter clears its flag and wakes it.
+static void fiber_group_release(fiber_group_t* group, uint64_t running,
+                                uint64_t finished) {
+  uint64_t state = atomic_load(&group->state);
+  uint64_t new_state;
+  do {
+    assert((state & FIBER_GROUP_RUNNING_MASK) >= running);
+    new_state = state - running;
+    if ((state & FIBER_GROUP_FINISHED_MASK) != FIBER_GROUP_FINISHED_MASK) {
+      new_state += finished << FIBER_GROUP_FINISHED_SHIFT;
+    }
+    if ((new_state & FIBER_GROUP_WAITING) &&
+        fiber_group_satisfied(new_state, new_state & FIBER_GROUP_WAITING)) {
+      new_state &= ~FIBER_GROUP_WAITING;
+    }
+  } while (!atomic_compare_exchange_weak(&group->state, &state, new_state));
+
+  if ((state ^ new_state) & FIBER_GROUP_WAITING) {
+    // the waiter can't return until it's woken, so the group is still there
+    fiber_t* const waiter = group->waiter;
+    if (waiter->state == FIBER_STATE_WAITING) {
+      waiter->state = FIBER_STATE_READY;
+    }
+    fiber_manager_schedule_next(fiber_manager_get(), waiter);
+  }
+}
+
+void fiber_group_child_finished(fiber_group_t* group) {
+  assert(group);
+  fiber_group_release(group, 1, 1);
+}
+
+static fiber_t* fiber_group_create_child(fiber_group_t* group,
+                                         size_t stack_size,
+                                         fiber_run_function_t run,
+                                         void* param) {
+  fiber_t* const child = fiber_create_no_sched(stack_size, run, param);
+  if (child) {
+    child->group = group;
+    fiber_detach(child);
+  }
+  return child;
+}
+
+int fiber_group_spawn(fiber_group_t* group, size_t stack_size,
+                      fiber_run_function_t run, void* param) {
+  assert(group);
+  assert(run);
+  fiber_t* const child =
+      fiber_group_create_child(group, stack_size, run, param);
+  if (!child) {
+    return FIBER_ERROR;
+  }
+  atomic_fetch_add(&group->state, 1);
+  fiber_manager_schedule(fiber_manager_get(), child);
+  return FIBER_SUCCESS;
+}
+
+int fiber_group_spawn_batch(fiber_group_t* group, size_t stack_size,
+                            fiber_run_function_t run, void** params,
+                            size_t count) {
+  assert(group);
+  assert(run);
+  assert(params || !count);
+  if (!count) {
+    return FIBER_SUCCESS;
+  }
+  // counted up front, so a waiter can't see the group empty part way through
+  atomic_fetch_add(&group->state, count);
+  fiber_manager_t* const manager = fiber_manager_get();
+  size_t i;
+  for (i = 0; i < count; ++i) {
+    fiber_t* const child =
+        fiber_group_create_child(group, stack_size, run, params[i]);
+    if (!child) {
+      // the rest never run, so they never finish either
+      fiber_group_release(group, count - i, 0);
+      break;
+    }
+    fiber_scheduler_schedule(manager->scheduler, child);
+  }
+  fiber_manager_wake_if_idle();
+  return i == count ? FIBER_SUCCESS : FIBER_ERROR;
+}
+
+// waits until the group's state satisfies flag (FIBER_GROUP_WAITING_*),
+// returning that state
+static uint64_t fiber_group_wait(fiber_group_t* group, uint64_t flag) {
+  uint64_t state = atomic_load(&group->state);
+  while (!fiber_group_satisfied(state, flag)) {
+    // only one fiber may wait at a time
+    assert(!(state & FIBER_GROUP_WAITING));
+    fiber_manager_t* const manager = fiber_manager_get();
+    fiber_t* const this_fiber = manager->current_fiber;
+    group->waiter = this_fiber;
+    // a child can wake the fiber as soon as the flag is set; the scheduler
+    // holds on to it until it has switched out
+    this_fiber->state = FIBER_STATE_SAVING_STATE_TO_WAIT;
+    if (atomic_compare_exchange_weak(&group->state, &state, state | flag)) {
+      fiber_manager_yield(manager);
+      state = atomic_load(&group->state);
+    } else {
+      this_fiber->state = FIBER_STATE_RUNNING;
+    }
+  }
+  return state;
+}
+
+int fiber_group_wait_all(fiber_group_t* group) {
+  assert(group);
+  uint64_t state = fiber_group_wait(group, FIBER_GROUP_WAITING_ALL);
+  // report everything which has finished
+  while (!atomic_compare_exchange_weak(&group->state, &state,
+                                       state & ~FIBER_GROUP_FINISHED_MASK)) {
+  }
+  return FIBER_SUCCESS;
+}
+
+int fiber_group_wait_any(fiber_group_t* group) {
+  assert(group);
+  uint64_t state = atomic_load(&group->state);
+  while (1) {
+    if (state & FIBER_GROUP_FINISHED_MASK) {
+      if (atomic_compare_exchange_weak(&group->state, &state,
+                                       state - FIBER_GROUP_FINISHED_ONE)) {
+        return FIBER_SUCCESS;
+      }
+    } else if (state & FIBER_GROUP_RUNNING_MASK) {
+      state = fiber_group_wait(group, FIBER_GROUP_WAITING_ANY);
+    } else {
+      errno = ECHILD;
+      return FIBER_ERROR;
+    }
+  }
+}
+
+size_t fiber_group_running(fiber_group_t* group) {
+  assert(group);
+  return atomic_load(&group->state) & FIBER_GROUP_RUNNING_MASK;
+}
@@ -8,16 +8,25 @@
 #include <poll.h>
 #include <stdarg.h>
 #include <sys/ioctl.h>
-#include <sys/resource.h>
+#include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
 #include "fiber.h"
+#include "fiber_blocking.h"
 #include "fiber_event.h"
+#include "fiber_fd.h"
 #include "fiber_manager.h"
+#if defined(FIBER_EVENT_URING)
+#include <linux/io_uring.h>
+
+#include "fiber_event_uring.h"
+#endif
 #ifndef __USE_GNU
 #define __USE_GNU
 #endif
@@ -68,6 +77,8 @@ typedef int (*ioctlFnType)(int d, int request, ...);
 
 #elif defined(__linux__)
 
+#include <sys/epoll.h>
+
 typedef int (*acceptFnType)(int, struct sockaddr*, socklen_t*);
 #define ACCEPTPARAMS int sockfd, struct sockaddr *addr, socklen_t *addrlen
 
@@ -93,6 +104,9 @@ typedef ssize_t (*readFnType)(int, void*, size_t);
 typedef ssize_t (*readvFnType)(int, const struct iovec*, int);
 typedef ssize_t (*writeFnType)(int, const void*, size_t);
 typedef ssize_t (*writevFnType)(int, const struct iovec*, int);
+typedef ssize_t (*preadvFnType)(int, const struct iovec*, int, off_t);
+typedef ssize_t (*pwritevFnType)(int, const struct iovec*, int, off_t);
+typedef int (*fsyncFnType)(int);
 typedef int (*selectFnType)(int, fd_set*, fd_set*, fd_set*, struct timeval*);
 typedef int (*pollFnType)(struct pollfd* fds, nfds_t nfds, int timeout);
 typedef int (*socketFnType)(int socket_family, int socket_type, int protocol);
@@ -107,14 +121,31 @@ typedef ssize_t (*sendmsgFnType)(int sockfd, const struct msghdr* msg,
 typedef ssize_t (*recvFnType)(int, void*, size_t, int);
 typedef ssize_t (*recvmsgFnType)(int sockfd, struct msghdr* msg, int flags);
 typedef int (*closeFnType)(int fd);
+typedef int (*setsockoptFnType)(int sockfd, int level, int optname,
+                                const void* optval, socklen_t optlen);
+#if defined(__linux__)
+typedef int (*ppollFnType)(struct pollfd* fds, nfds_t nfds,
+                           const struct timespec* tmo_p,
+                           const sigset_t* sigmask);
+typedef int (*epollWaitFnType)(int epfd, struct epoll_event* events,
+                               int maxevents, int timeout);
+#endif
 
-/*static openFnType fibershim_open = NULL;
+/*static openFnType fibershim_open = NULL;*/
 static pollFnType fibershim_poll = NULL;
-static selectFnType fibershim_select = NULL;*/
+static selectFnType fibershim_select = NULL;
+#if defined(__linux__)
+static ppollFnType fibershim_ppoll = NULL;
+static epollWaitFnType fibershim_epoll_wait = NULL;
+#endif
 static readFnType fibershim_read = NULL;
 static readvFnType fibershim_readv = NULL;
 static writeFnType fibershim_write = NULL;
 static writevFnType fibershim_writev = NULL;
+static preadvFnType fibershim_preadv = NULL;
+static pwritevFnType fibershim_pwritev = NULL;
+static fsyncFnType fibershim_fsync = NULL;
+static fsyncFnType fibershim_fdatasync = NULL;
 static socketFnType fibershim_socket = NULL;
 static socketpairFnType fibershim_socketpair = NULL;
 static acceptFnType fibershim_accept = NULL;
@@ -129,6 +160,7 @@ static pipeFnType fibershim_pipe = NULL;
 static fcntlFnType fibershim_fcntl = NULL;
 static ioctlFnType fibershim_ioctl = NULL;
 static closeFnType fibershim_close = NULL;
+static setsockoptFnType fibershim_setsockopt = NULL;
 
 #define STRINGIFY(x) XSTRINGIFY(x)
 #define XSTRINGIFY(x) #x
@@ -148,13 +180,18 @@ selectFnType get_select_fn() {
 
 #define IO_FLAG_BLOCKING 1
 #define IO_FLAG_WAITABLE 2
-
-typedef struct fiber_fd_info {
-  _Atomic uint8_t flags_;
-} fiber_fd_info_t;
-
-static fiber_fd_info_t* fd_info = NULL;
-static rlim_t max_fd = 0;
+#define IO_FLAG_SOCKET 4
+#define IO_FLAG_RECV_TIMEOUT 8
+#define IO_FLAG_SEND_TIMEOUT 16
+// set once fstat() has said whether the fd is a regular file
+#define IO_FLAG_CHECKED 32
+#define IO_FLAG_FILE 64
+// the file system doesn't support RWF_NOWAIT
+#define IO_FLAG_NO_NOWAIT 128
+
+#ifndef RWF_NOWAIT
+#define RWF_NOWAIT 0x00000008
+#endif
 
 int fiber_io_init() {
   // fibershim_open = (openFnType)dlsym(RTLD_NEXT, "open");
@@ -163,8 +200,16 @@ int fiber_io_init() {
   fibershim_readv = (readvFnType)dlsym(RTLD_NEXT, "readv");
   fibershim_write = (writeFnType)dlsym(RTLD_NEXT, "write");
   fibershim_writev = (writevFnType)dlsym(RTLD_NEXT, "writev");
-  // fibershim_select = get_select_fn();
-  // fibershim_poll = (pollFnType)dlsym(RTLD_NEXT,"poll");
+  fibershim_preadv = (preadvFnType)dlsym(RTLD_NEXT, "preadv");
+  fibershim_pwritev = (pwritevFnType)dlsym(RTLD_NEXT, "pwritev");
+  fibershim_fsync = (fsyncFnType)dlsym(RTLD_NEXT, "fsync");
+  fibershim_fdatasync = (fsyncFnType)dlsym(RTLD_NEXT, "fdatasync");
+  fibershim_select = get_select_fn();
+  fibershim_poll = (pollFnType)dlsym(RTLD_NEXT, "poll");
+#if defined(__linux__)
+  fibershim_ppoll = (ppollFnType)dlsym(RTLD_NEXT, "ppoll");
+  fibershim_epoll_wait = (epollWaitFnType)dlsym(RTLD_NEXT, "epoll_wait");
+#endif
   fibershim_socket = (socketFnType)dlsym(RTLD_NEXT, "socket");
   fibershim_socketpair = (socketpairFnType)dlsym(RTLD_NEXT, "socketpair");
   fibershim_connect = (connectFnType)dlsym(RTLD_NEXT, "connect");
@@ -176,29 +221,12 @@ int fiber_io_init() {
   fibershim_recvfrom = (recvfromFnType)dlsym(RTLD_NEXT, "recvfrom");
   fibershim_recvmsg = (recvmsgFnType)dlsym(RTLD_NEXT, "recvmsg");
   fibershim_close = (closeFnType)dlsym(RTLD_NEXT, "close");
-
-  if (fd_info) {
-    return FIBER_ERROR;
-  }
-
-  struct rlimit file_lim;
-  if (getrlimit(RLIMIT_NOFILE, &file_lim)) {
-    return FIBER_ERROR;
-  }
-  max_fd = file_lim.rlim_max;
-
-  fd_info = calloc(max_fd, sizeof(*fd_info));
-  if (!fd_info) {
-    return FIBER_ERROR;
-  }
-
+  fibershim_setsockopt = (setsockoptFnType)dlsym(RTLD_NEXT, "setsockopt");
   return FIBER_SUCCESS;
 }
 
-void fiber_io_shutdown() {
-  free(fd_info);
-  fd_info = NULL;
-}
+// the flags live in the fd table, which fiber_fd_shutdown() frees
+void fiber_io_shutdown() {}
 
 static __thread int thread_locked = 0;
 
@@ -214,22 +242,212 @@ int fiber_io_unlock_thread() {
 
 static inline int should_block(int fd) {
   assert(fd >= 0);
-  if (!thread_locked && fd_info && fd < max_fd &&
-      fd_info[fd].flags_ & (IO_FLAG_BLOCKING | IO_FLAG_WAITABLE)) {
+  const fiber_fd_t* const info = fiber_fd_find(fd);
+  if (!thread_locked && info &&
+      info->io_flags & (IO_FLAG_BLOCKING | IO_FLAG_WAITABLE)) {
     return 1;
   }
   return 0;
 }
 
+// a thread which isn't a manager (one handing work to fibers with
+// fiber_spawn_external, say) has no fiber to suspend, so it blocks in poll()
+static int wait_for_io_in_thread(int fd, uint32_t events, uint64_t deadline) {
+  struct pollfd pfd = {fd, events == FIBER_POLL_IN ? POLLIN : POLLOUT, 0};
+  while (1) {
+    int timeout_ms = -1;
+    if (deadline != UINT64_MAX) {
+      const uint64_t now = fiber_time_now_ns();
+      if (now >= deadline) {
+        errno = EAGAIN;
+        return FIBER_ERROR;
+      }
+      timeout_ms = (deadline - now + 999999) / 1000000;
+    }
+    const int ret = fibershim_poll(&pfd, 1, timeout_ms);
+    if (ret > 0) {
+      return FIBER_SUCCESS;
+    }
+    if (ret < 0 && errno != EINTR) {
+      return FIBER_ERROR;
+    }
+  }
+}
+
+// waits for fd to be ready for events (FIBER_POLL_IN or FIBER_POLL_OUT),
+// honouring the socket's SO_RCVTIMEO or SO_SNDTIMEO. *deadline starts at 0
+// and is set on the first wait, so the timeout covers the whole call. fails
+// with errno set to EAGAIN once the timeout expires, as the kernel does.
+static int wait_for_io(int fd, uint32_t events, uint64_t* deadline) {
+  if (!*deadline) {
+    // only called once should_block() has found the record
+    const fiber_fd_t* const info = fiber_fd_find(fd);
+    const uint8_t timeout_flag =
+        events == FIBER_POLL_IN ? IO_FLAG_RECV_TIMEOUT : IO_FLAG_SEND_TIMEOUT;
+    if (info->io_flags & timeout_flag) {
+      *deadline = fiber_time_now_ns() + (events == FIBER_POLL_IN
+                                             ? info->recv_timeout_ns
+                                             : info->send_timeout_ns);
+    } else {
+      *deadline = UINT64_MAX;
+    }
+  }
+  if (!fiber_manager_get()) {
+    return wait_for_io_in_thread(fd, events, *deadline);
+  }
+  if (fiber_wait_for_event_timeout(fd, events, *deadline)) {
+    return FIBER_SUCCESS;
+  }
+  if (errno == ETIMEDOUT) {
+    errno = EAGAIN;
+  }
+  return FIBER_ERROR;
+}
+
+// the event engine polls from the scheduler itself (libev calls poll() or
+// epoll_wait() there), so only fibers other than the maintenance fiber are
+// suspended by the multiplexing shims and the blocking pool
+static inline int should_wait_in_fiber() {
+  if (thread_locked || !fiber_fd_max) {
+    return 0;
+  }
+  fiber_manager_t* const manager = fiber_manager_get();
+  return manager && manager->current_fiber &&
+         manager->current_fiber != manager->maintenance_fiber;
+}
+
+// blocking sockets are read and written by the kernel through the calling
+// thread's ring, when the event engine has one and there's a fiber to suspend.
+// ring operations can't time out, so a socket with a timeout in that direction
+// waits for readiness.
+static inline int should_use_ring(int fd, uint8_t timeout_flag) {
+#if defined(FIBER_EVENT_URING)
+  const int flags = IO_FLAG_BLOCKING | IO_FLAG_SOCKET | timeout_flag;
+  const fiber_fd_t* const info = fiber_fd_find(fd);
+  return info && (info->io_flags & flags) == (flags & ~timeout_flag) &&
+         fiber_uring_enabled() && should_wait_in_fiber();
+#else
+  (void)fd;
+  (void)timeout_flag;
+  return 0;
+#endif
+}
+
+// not inlined, so the shim calling this doesn't cache thread local addresses
+// from before the fiber yields (and possibly moves to another thread)
+static __attribute__((noinline)) void yield_if_preempted() {
+  if (should_wait_in_fiber()) {
+    fiber_maybe_yield();
+  }
+}
+
+// a fiber flagged by the preemption timer yields on entering the io shims
+static inline void honour_preemption() {
+  fiber_manager_t* const manager = fiber_manager_get();
+  if (fiber_unlikely(manager && manager->should_yield)) {
+    yield_if_preempted();
+  }
+}
+
+// regular files are never ready or not ready - reading or writing one blocks
+// the calling thread. returns fd's record if it's a regular file the calling
+// fiber should hand to the blocking pool, NULL otherwise.
+static fiber_fd_t* file_to_offload(int fd) {
+  const fiber_fd_t* const found = fiber_fd_find(fd);
+  if (found && (found->io_flags & IO_FLAG_WAITABLE ||
+                (found->io_flags & (IO_FLAG_CHECKED | IO_FLAG_FILE)) ==
+                    IO_FLAG_CHECKED)) {
+    return NULL;
+  }
+  if (!should_wait_in_fiber()) {
+    return NULL;
+  }
+
+  fiber_fd_t* const info = fiber_fd_get(fd);
+  if (!info) {
+    return NULL;
+  }
+  uint8_t flags = info->io_flags;
+  if (!(flags & IO_FLAG_CHECKED)) {
+    struct stat st;
+    if (fstat(fd, &st)) {
+      return NULL;
+    }
+    const uint8_t found_flags =
+        IO_FLAG_CHECKED | (S_ISREG(st.st_mode) ? IO_FLAG_FILE : 0);
+    flags = atomic_fetch_or(&info->io_flags, found_flags) | found_flags;
+  }
+  return (flags & (IO_FLAG_FILE | IO_FLAG_WAITABLE)) == IO_FLAG_FILE ? info
+                                                                      : NULL;
+}
+
+typedef struct file_io {
+  int fd;
+  int write;
+  const struct iovec* iov;
+  int iovcnt;
+  off_t offset;  // -1 to use (and move) the file position
+  ssize_t result;
+} file_io_t;
+
+static void* file_io_blocking(void* param) {
+  file_io_t* const io = (file_io_t*)param;
+  if (io->offset < 0) {
+    io->result = io->write ? fibershim_writev(io->fd, io->iov, io->iovcnt)
+                           : fibershim_readv(io->fd, io->iov, io->iovcnt);
+  } else {
+    io->result =
+        io->write ? fibershim_pwritev(io->fd, io->iov, io->iovcnt, io->offset)
+                  : fibershim_preadv(io->fd, io->iov, io->iovcnt, io->offset);
+  }
+  return NULL;
+}
+
+// tries the page cache first with RWF_NOWAIT, which succeeds without blocking
+// when the data is already there. otherwise a helper makes the call.
+static ssize_t file_io(fiber_fd_t* info, file_io_t* io) {
+#if defined(__linux__) && defined(SYS_preadv2)
+  if (!(info->io_flags & IO_FLAG_NO_NOWAIT)) {
+    // the offset is passed as two longs, low half first
+    const ssize_t ret =
+        syscall(io->write ? SYS_pwritev2 : SYS_preadv2, io->fd, io->iov,
+                io->iovcnt, (long)io->offset,
+                (long)((uint64_t)io->offset >> 32), RWF_NOWAIT);
+    if (ret >= 0 || (errno != EAGAIN && errno != EOPNOTSUPP &&
+                     errno != ENOSYS && errno != EINVAL)) {
+      return ret;
+    }
+    if (errno != EAGAIN) {
+      atomic_fetch_or(&info->io_flags, IO_FLAG_NO_NOWAIT);
+    }
+  }
+#else
+  (void)info;
+#endif
+  fiber_run_blocking(&file_io_blocking, io);
+  return io->result;
+}
+
+#if defined(FIBER_EVENT_URING)
+// ring operations take a 32 bit length. a shorter transfer is fine for
+// sockets.
+static inline uint32_t ring_len(size_t len) {
+  return len > UINT32_MAX ? UINT32_MAX : (uint32_t)len;
+}
+#endif
+
 static int setup_socket(int sock) {
-  if (thread_locked) {
+  // sockets made before fiber_manager_init() are left alone
+  if (thread_locked || !fiber_fd_max) {
     return 0;
   }
 
-  assert(sock < max_fd);
-  atomic_fetch_or(&fd_info[sock].flags_, IO_FLAG_BLOCKING | IO_FLAG_WAITABLE);
-  assert(fd_info[sock].flags_ & IO_FLAG_BLOCKING);
-  assert(fd_info[sock].flags_ & IO_FLAG_WAITABLE);
+  fiber_fd_t* const info = fiber_fd_get(sock);
+  if (!info) {
+    return -1;
+  }
+  atomic_fetch_or(&info->io_flags,
+                  IO_FLAG_BLOCKING | IO_FLAG_WAITABLE | IO_FLAG_SOCKET);
 
   if (!fibershim_fcntl) {
     fibershim_fcntl = (fcntlFnType)dlsym(RTLD_NEXT, "fcntl");
@@ -244,6 +462,26 @@ static int setup_socket(int sock) {
   return setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
 }
 
+// accepted sockets inherit the listener's timeouts, as they do in the kernel
+static int setup_accepted_socket(int listener, int sock) {
+  const int ret = setup_socket(sock);
+  if (ret < 0 || thread_locked) {
+    return ret;
+  }
+
+  const fiber_fd_t* const from = fiber_fd_find(listener);
+  if (!from) {
+    return ret;
+  }
+  fiber_fd_t* const to = fiber_fd_find(sock);
+  const uint8_t timeouts =
+      from->io_flags & (IO_FLAG_RECV_TIMEOUT | IO_FLAG_SEND_TIMEOUT);
+  to->recv_timeout_ns = from->recv_timeout_ns;
+  to->send_timeout_ns = from->send_timeout_ns;
+  atomic_fetch_or(&to->io_flags, timeouts);
+  return ret;
+}
+
 int socket(int domain, int type, int protocol) {
   if (!fibershim_socket) {
     fibershim_socket = (socketFnType)dlsym(RTLD_NEXT, "socket");
@@ -284,10 +522,24 @@ int accept(ACCEPTPARAMS) {
     fibershim_accept = (acceptFnType)dlsym(RTLD_NEXT, "accept");
   }
 
+#if defined(FIBER_EVENT_URING)
+  ssize_t result;
+  if (should_use_ring(sockfd, IO_FLAG_RECV_TIMEOUT) &&
+      fiber_uring_perform(sockfd, FIBER_POLL_IN, IORING_OP_ACCEPT, addr, 0,
+                          (uintptr_t)addrlen, 0, &result)) {
+    if (result >= 0 && setup_accepted_socket(sockfd, result) < 0) {
+      close(result);
+      return -1;
+    }
+    return result;
+  }
+#endif
+
   int sock = fibershim_accept(sockfd, addr, addrlen);
-  if (sock < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) &&
-      should_block(sockfd)) {
-    if (!fiber_wait_for_event(sockfd, FIBER_POLL_IN)) {
+  uint64_t deadline = 0;
+  while (sock < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) &&
+         should_block(sockfd)) {
+    if (!wait_for_io(sockfd, FIBER_POLL_IN, &deadline)) {
       return -1;
     }
 
@@ -295,7 +547,7 @@ int accept(ACCEPTPARAMS) {
   }
 
   if (sock > 0) {
-    if (setup_socket(sock) < 0) {
+    if (setup_accepted_socket(sockfd, sock) < 0) {
       close(sock);
       return -1;
     }
@@ -308,17 +560,33 @@ ssize_t read(int fd, void* buf, size_t count) {
   if (!fibershim_read) {
     fibershim_read = (readFnType)dlsym(RTLD_NEXT, "read");
   }
+  honour_preemption();
+
+#if defined(FIBER_EVENT_URING)
+  ssize_t result;
+  if (should_use_ring(fd, IO_FLAG_RECV_TIMEOUT) &&
+      fiber_uring_perform(fd, FIBER_POLL_IN, IORING_OP_RECV, buf,
+                          ring_len(count), 0, 0, &result)) {
+    return result;
+  }
+#endif
 
-  int ret;
-  do {
-    if (should_block(fd)) {
-      if (!fiber_wait_for_event(fd, FIBER_POLL_IN)) {
-        return -1;
-      }
+  fiber_fd_t* const file = file_to_offload(fd);
+  if (file) {
+    const struct iovec iov = {buf, count};
+    file_io_t io = {fd, 0, &iov, 1, -1};
+    return file_io(file, &io);
+  }
+
+  int ret = fibershim_read(fd, buf, count);
+  uint64_t deadline = 0;
+  while (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) &&
+         should_block(fd)) {
+    if (!wait_for_io(fd, FIBER_POLL_IN, &deadline)) {
+      return -1;
     }
     ret = fibershim_read(fd, buf, count);
-  } while (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) &&
-           should_block(fd));
+  }
 
   return ret;
 }
@@ -327,36 +595,80 @@ ssize_t readv(int fd, const struct iovec* iov, int iovcnt) {
   if (!fibershim_readv) {
     fibershim_readv = (readvFnType)dlsym(RTLD_NEXT, "readv");
   }
+  honour_preemption();
+
+#if defined(FIBER_EVENT_URING)
+  ssize_t result;
+  struct msghdr msg = {};
+  msg.msg_iov = (struct iovec*)iov;
+  msg.msg_iovlen = iovcnt;
+  if (should_use_ring(fd, IO_FLAG_RECV_TIMEOUT) &&
+      fiber_uring_perform(fd, FIBER_POLL_IN, IORING_OP_RECVMSG, &msg, 1, 0, 0,
+                          &result)) {
+    return result;
+  }
+#endif
 
-  int ret;
-  do {
-    if (should_block(fd)) {
-      if (!fiber_wait_for_event(fd, FIBER_POLL_IN)) {
-        return -1;
-      }
+  fiber_fd_t* const file = file_to_offload(fd);
+  if (file) {
+    file_io_t io = {fd, 0, iov, iovcnt, -1};
+    return file_io(file, &io);
+  }
+
+  int ret = fibershim_readv(fd, iov, iovcnt);
+  uint64_t deadline = 0;
+  while (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) &&
+         should_block(fd)) {
+    if (!wait_for_io(fd, FIBER_POLL_IN, &deadline)) {
+      return -1;
     }
     ret = fibershim_readv(fd, iov, iovcnt);
-  } while (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) &&
-           should_block(fd));
+  }
 
   return ret;
 }
 
+// only regular files are affected. pread() and pwrite() on anything else
+// can't wait for readiness, as they're not allowed on sockets and pipes.
+ssize_t pread(int fd, void* buf, size_t count, off_t offset) {
+  if (!fibershim_preadv) {
+    fibershim_preadv = (preadvFnType)dlsym(RTLD_NEXT, "preadv");
+  }
+  honour_preemption();
+
+  const struct iovec iov = {buf, count};
+  fiber_fd_t* const file = offset >= 0 ? file_to_offload(fd) : NULL;
+  if (file) {
+    file_io_t io = {fd, 0, &iov, 1, offset};
+    return file_io(file, &io);
+  }
+  return fibershim_preadv(fd, &iov, 1, offset);
+}
+
 ssize_t recv(int fd, void* buf, size_t len, int flags) {
   if (!fibershim_recv) {
     fibershim_recv = (recvFnType)dlsym(RTLD_NEXT, "recv");
   }
+  honour_preemption();
+
+#if defined(FIBER_EVENT_URING)
+  ssize_t result;
+  if (!(flags & MSG_DONTWAIT) && should_use_ring(fd, IO_FLAG_RECV_TIMEOUT) &&
+      fiber_uring_perform(fd, FIBER_POLL_IN, IORING_OP_RECV, buf,
+                          ring_len(len), 0, flags, &result)) {
+    return result;
+  }
+#endif
 
-  int ret;
-  do {
-    if (!(flags & MSG_DONTWAIT) && should_block(fd)) {
-      if (!fiber_wait_for_event(fd, FIBER_POLL_IN)) {
-        return -1;
-      }
+  int ret = fibershim_recv(fd, buf, len, flags);
+  uint64_t deadline = 0;
+  while (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) &&
+         !(flags & MSG_DONTWAIT) && should_block(fd)) {
+    if (!wait_for_io(fd, FIBER_POLL_IN, &deadline)) {
+      return -1;
     }
     ret = fibershim_recv(fd, buf, len, flags);
-  } while (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) &&
-           !(flags & MSG_DONTWAIT) && should_block(fd));
+  }
 
   return ret;
 }
@@ -365,17 +677,39 @@ ssize_t recvfrom(RECVFROMPARAMS) {
   if (!fibershim_recvfrom) {
     fibershim_recvfrom = (recvfromFnType)dlsym(RTLD_NEXT, "recvfrom");
   }
-
-  int ret;
-  do {
-    if (!(flags & MSG_DONTWAIT) && should_block(sockfd)) {
-      if (!fiber_wait_for_event(sockfd, FIBER_POLL_IN)) {
-        return -1;
+  honour_preemption();
+
+#if defined(FIBER_EVENT_URING)
+  if (!(flags & MSG_DONTWAIT) &&
+      should_use_ring(sockfd, IO_FLAG_RECV_TIMEOUT)) {
+    ssize_t result;
+    struct iovec iov = {buf, len};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (src_addr && addrlen) {
+      msg.msg_name = src_addr;
+      msg.msg_namelen = *addrlen;
+    }
+    if (fiber_uring_perform(sockfd, FIBER_POLL_IN, IORING_OP_RECVMSG, &msg, 1,
+                            0, flags, &result)) {
+      if (result >= 0 && src_addr && addrlen) {
+        *addrlen = msg.msg_namelen;
       }
+      return result;
+    }
+  }
+#endif
+
+  int ret = fibershim_recvfrom(sockfd, buf, len, flags, src_addr, addrlen);
+  uint64_t deadline = 0;
+  while (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) &&
+         !(flags & MSG_DONTWAIT) && should_block(sockfd)) {
+    if (!wait_for_io(sockfd, FIBER_POLL_IN, &deadline)) {
+      return -1;
     }
     ret = fibershim_recvfrom(sockfd, buf, len, flags, src_addr, addrlen);
-  } while (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) &&
-           !(flags & MSG_DONTWAIT) && should_block(sockfd));
+  }
 
   return ret;
 }
@@ -384,17 +718,27 @@ ssize_t recvmsg(int sockfd, struct msghdr* msg, int flags) {
   if (!fibershim_recvmsg) {
     fibershim_recvmsg = (recvmsgFnType)dlsym(RTLD_NEXT, "recvmsg");
   }
+  honour_preemption();
+
+#if defined(FIBER_EVENT_URING)
+  ssize_t result;
+  if (!(flags & MSG_DONTWAIT) &&
+      should_use_ring(sockfd, IO_FLAG_RECV_TIMEOUT) &&
+      fiber_uring_perform(sockfd, FIBER_POLL_IN, IORING_OP_RECVMSG, msg, 1, 0,
+                          flags, &result)) {
+    return result;
+  }
+#endif
 
-  int ret;
-  do {
-    if (!(flags & MSG_DONTWAIT) && should_block(sockfd)) {
-      if (!fiber_wait_for_event(sockfd, FIBER_POLL_IN)) {
-        return -1;
-      }
+  int ret = fibershim_recvmsg(sockfd, msg, flags);
+  uint64_t deadline = 0;
+  while (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) &&
+         !(flags & MSG_DONTWAIT) && should_block(sockfd)) {
+    if (!wait_for_io(sockfd, FIBER_POLL_IN, &deadline)) {
+      return -1;
     }
     ret = fibershim_recvmsg(sockfd, msg, flags);
-  } while (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) &&
-           !(flags & MSG_DONTWAIT) && should_block(sockfd));
+  }
 
   return ret;
 }
@@ -403,11 +747,29 @@ ssize_t write(int fd, const void* buf, size_t count) {
   if (!fibershim_write) {
     fibershim_write = (writeFnType)dlsym(RTLD_NEXT, "write");
   }
+  honour_preemption();
+
+#if defined(FIBER_EVENT_URING)
+  ssize_t result;
+  if (should_use_ring(fd, IO_FLAG_SEND_TIMEOUT) &&
+      fiber_uring_perform(fd, FIBER_POLL_OUT, IORING_OP_SEND, buf,
+                          ring_len(count), 0, 0, &result)) {
+    return result;
+  }
+#endif
+
+  fiber_fd_t* const file = file_to_offload(fd);
+  if (file) {
+    const struct iovec iov = {(void*)buf, count};
+    file_io_t io = {fd, 1, &iov, 1, -1};
+    return file_io(file, &io);
+  }
 
   int ret = fibershim_write(fd, buf, count);
+  uint64_t deadline = 0;
   while (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) &&
          should_block(fd)) {
-    if (!fiber_wait_for_event(fd, FIBER_POLL_OUT)) {
+    if (!wait_for_io(fd, FIBER_POLL_OUT, &deadline)) {
       return -1;
     }
     ret = fibershim_write(fd, buf, count);
@@ -420,11 +782,31 @@ ssize_t writev(int fd, const struct iovec* iov, int iovcnt) {
   if (!fibershim_writev) {
     fibershim_writev = (writevFnType)dlsym(RTLD_NEXT, "writev");
   }
+  honour_preemption();
+
+#if defined(FIBER_EVENT_URING)
+  ssize_t result;
+  struct msghdr msg = {};
+  msg.msg_iov = (struct iovec*)iov;
+  msg.msg_iovlen = iovcnt;
+  if (should_use_ring(fd, IO_FLAG_SEND_TIMEOUT) &&
+      fiber_uring_perform(fd, FIBER_POLL_OUT, IORING_OP_SENDMSG, &msg, 1, 0, 0,
+                          &result)) {
+    return result;
+  }
+#endif
+
+  fiber_fd_t* const file = file_to_offload(fd);
+  if (file) {
+    file_io_t io = {fd, 1, iov, iovcnt, -1};
+    return file_io(file, &io);
+  }
 
   int ret = fibershim_writev(fd, iov, iovcnt);
+  uint64_t deadline = 0;
   while (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) &&
          should_block(fd)) {
-    if (!fiber_wait_for_event(fd, FIBER_POLL_OUT)) {
+    if (!wait_for_io(fd, FIBER_POLL_OUT, &deadline)) {
       return -1;
     }
     ret = fibershim_writev(fd, iov, iovcnt);
@@ -433,15 +815,74 @@ ssize_t writev(int fd, const struct iovec* iov, int iovcnt) {
   return ret;
 }
 
+ssize_t pwrite(int fd, const void* buf, size_t count, off_t offset) {
+  if (!fibershim_pwritev) {
+    fibershim_pwritev = (pwritevFnType)dlsym(RTLD_NEXT, "pwritev");
+  }
+  honour_preemption();
+
+  const struct iovec iov = {(void*)buf, count};
+  fiber_fd_t* const file = offset >= 0 ? file_to_offload(fd) : NULL;
+  if (file) {
+    file_io_t io = {fd, 1, &iov, 1, offset};
+    return file_io(file, &io);
+  }
+  return fibershim_pwritev(fd, &iov, 1, offset);
+}
+
+static void* fsync_blocking(void* param) {
+  return (void*)(intptr_t)fibershim_fsync((intptr_t)param);
+}
+
+static void* fdatasync_blocking(void* param) {
+  return (void*)(intptr_t)fibershim_fdatasync((intptr_t)param);
+}
+
+// flushing waits on the disk whatever the fd is (directories are commonly
+// synced too), so any fd a fiber syncs goes to the blocking pool
+int fsync(int fd) {
+  if (!fibershim_fsync) {
+    fibershim_fsync = (fsyncFnType)dlsym(RTLD_NEXT, "fsync");
+  }
+
+  if (!should_wait_in_fiber()) {
+    return fibershim_fsync(fd);
+  }
+  return (intptr_t)fiber_run_blocking(&fsync_blocking, (void*)(intptr_t)fd);
+}
+
+int fdatasync(int fd) {
+  if (!fibershim_fdatasync) {
+    fibershim_fdatasync = (fsyncFnType)dlsym(RTLD_NEXT, "fdatasync");
+  }
+
+  if (!should_wait_in_fiber()) {
+    return fibershim_fdatasync(fd);
+  }
+  return (intptr_t)fiber_run_blocking(&fdatasync_blocking, (void*)(intptr_t)fd);
+}
+
 ssize_t send(int sockfd, const void* buf, size_t len, int flags) {
   if (!fibershim_send) {
     fibershim_send = (sendFnType)dlsym(RTLD_NEXT, "send");
   }
+  honour_preemption();
+
+#if defined(FIBER_EVENT_URING)
+  ssize_t result;
+  if (!(flags & MSG_DONTWAIT) &&
+      should_use_ring(sockfd, IO_FLAG_SEND_TIMEOUT) &&
+      fiber_uring_perform(sockfd, FIBER_POLL_OUT, IORING_OP_SEND, buf,
+                          ring_len(len), 0, flags, &result)) {
+    return result;
+  }
+#endif
 
   ssize_t ret = fibershim_send(sockfd, buf, len, flags);
+  uint64_t deadline = 0;
   while (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) &&
          !(flags & MSG_DONTWAIT) && should_block(sockfd)) {
-    if (!fiber_wait_for_event(sockfd, FIBER_POLL_OUT)) {
+    if (!wait_for_io(sockfd, FIBER_POLL_OUT, &deadline)) {
       return -1;
     }
     ret = fibershim_send(sockfd, buf, len, flags);
@@ -455,11 +896,30 @@ ssize_t sendto(int sockfd, const void* buf, size_t len, int flags,
   if (!fibershim_sendto) {
     fibershim_sendto = (sendtoFnType)dlsym(RTLD_NEXT, "sendto");
   }
+  honour_preemption();
+
+#if defined(FIBER_EVENT_URING)
+  if (!(flags & MSG_DONTWAIT) &&
+      should_use_ring(sockfd, IO_FLAG_SEND_TIMEOUT)) {
+    ssize_t result;
+    struct iovec iov = {(void*)buf, len};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_name = (void*)dest_addr;
+    msg.msg_namelen = dest_addr ? addrlen : 0;
+    if (fiber_uring_perform(sockfd, FIBER_POLL_OUT, IORING_OP_SENDMSG, &msg, 1,
+                            0, flags, &result)) {
+      return result;
+    }
+  }
+#endif
 
   ssize_t ret = fibershim_sendto(sockfd, buf, len, flags, dest_addr, addrlen);
+  uint64_t deadline = 0;
   while (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) &&
          !(flags & MSG_DONTWAIT) && should_block(sockfd)) {
-    if (!fiber_wait_for_event(sockfd, FIBER_POLL_OUT)) {
+    if (!wait_for_io(sockfd, FIBER_POLL_OUT, &deadline)) {
       return -1;
     }
     ret = fibershim_sendto(sockfd, buf, len, flags, dest_addr, addrlen);
@@ -472,11 +932,23 @@ ssize_t sendmsg(int sockfd, const struct msghdr* msg, int flags) {
   if (!fibershim_sendmsg) {
     fibershim_sendmsg = (sendmsgFnType)dlsym(RTLD_NEXT, "sendmsg");
   }
+  honour_preemption();
+
+#if defined(FIBER_EVENT_URING)
+  ssize_t result;
+  if (!(flags & MSG_DONTWAIT) &&
+      should_use_ring(sockfd, IO_FLAG_SEND_TIMEOUT) &&
+      fiber_uring_perform(sockfd, FIBER_POLL_OUT, IORING_OP_SENDMSG, msg, 1, 0,
+                          flags, &result)) {
+    return result;
+  }
+#endif
 
   ssize_t ret = fibershim_sendmsg(sockfd, msg, flags);
+  uint64_t deadline = 0;
   while (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) &&
          !(flags & MSG_DONTWAIT) && should_block(sockfd)) {
-    if (!fiber_wait_for_event(sockfd, FIBER_POLL_OUT)) {
+    if (!wait_for_io(sockfd, FIBER_POLL_OUT, &deadline)) {
       return -1;
     }
     ret = fibershim_sendmsg(sockfd, msg, flags);
@@ -490,9 +962,23 @@ int connect(int sockfd, const struct sockaddr* addr, socklen_t addrlen) {
     fibershim_connect = (connectFnType)dlsym(RTLD_NEXT, "connect");
   }
 
+#if defined(FIBER_EVENT_URING)
+  ssize_t result;
+  if (should_use_ring(sockfd, IO_FLAG_SEND_TIMEOUT) &&
+      fiber_uring_perform(sockfd, FIBER_POLL_OUT, IORING_OP_CONNECT, addr, 0,
+                          addrlen, 0, &result)) {
+    return result;
+  }
+#endif
+
   int ret = fibershim_connect(sockfd, addr, addrlen);
   if (ret < 0 && errno == EINPROGRESS && should_block(sockfd)) {
-    if (!fiber_wait_for_event(sockfd, FIBER_POLL_OUT)) {
+    uint64_t deadline = 0;
+    if (!wait_for_io(sockfd, FIBER_POLL_OUT, &deadline)) {
+      if (errno == EAGAIN) {
+        // a connect that times out carries on in the background
+        errno = EINPROGRESS;
+      }
       return -1;
     }
 
@@ -513,6 +999,257 @@ int connect(int sockfd, const struct sockaddr* addr, socklen_t addrlen) {
   return ret;
 }
 
+int setsockopt(int sockfd, int level, int optname, const void* optval,
+               socklen_t optlen) {
+  if (!fibershim_setsockopt) {
+    fibershim_setsockopt = (setsockoptFnType)dlsym(RTLD_NEXT, "setsockopt");
+  }
+
+  const int ret = fibershim_setsockopt(sockfd, level, optname, optval, optlen);
+  // the kernel keeps the timeouts too (for getsockopt), but it never blocks
+  // on the socket since it's non-blocking underneath
+  if (ret || thread_locked || level != SOL_SOCKET ||
+      (optname != SO_RCVTIMEO && optname != SO_SNDTIMEO)) {
+    return ret;
+  }
+  fiber_fd_t* const info = fiber_fd_get(sockfd);
+  if (!info) {
+    return ret;  // the fd isn't tracked, so the shims never wait on it
+  }
+
+  const struct timeval* const tv = optval;
+  const uint64_t timeout_ns =
+      tv->tv_sec * 1000000000ULL + tv->tv_usec * 1000ULL;
+  const uint8_t flag =
+      optname == SO_RCVTIMEO ? IO_FLAG_RECV_TIMEOUT : IO_FLAG_SEND_TIMEOUT;
+  if (!timeout_ns) {
+    // a zero timeout blocks forever
+    atomic_fetch_and(&info->io_flags, ~flag);
+    return ret;
+  }
+  if (optname == SO_RCVTIMEO) {
+    info->recv_timeout_ns = timeout_ns;
+  } else {
+    info->send_timeout_ns = timeout_ns;
+  }
+  atomic_fetch_or(&info->io_flags, flag);
+  return ret;
+}
+
+static inline uint64_t deadline_after_ms(int timeout_ms) {
+  return timeout_ms < 0 ? UINT64_MAX
+                        : fiber_time_now_ns() + timeout_ms * 1000000ULL;
+}
+
+static inline uint64_t deadline_after_ts(const struct timespec* timeout) {
+  return timeout ? fiber_time_now_ns() + timeout->tv_sec * 1000000000ULL +
+                       timeout->tv_nsec
+                 : UINT64_MAX;
+}
+
+// waits with at most this many fds don't allocate
+#define POLL_STACK_FDS (8)
+
+// suspends the calling fiber until one of the fds is ready or the deadline
+// passes, checking with a non-blocking poll() whenever the event engine wakes
+// it. returns as poll() would.
+static int poll_in_fiber(struct pollfd* fds, nfds_t nfds,
+                         uint64_t deadline_ns) {
+  fiber_event_fd_t stack_fds[POLL_STACK_FDS];
+  fiber_event_fd_t* const wait_fds =
+      nfds <= POLL_STACK_FDS ? stack_fds : malloc(nfds * sizeof(*wait_fds));
+  if (!wait_fds) {
+    errno = ENOMEM;
+    return -1;
+  }
+  size_t count = 0;
+  nfds_t i;
+  for (i = 0; i < nfds; ++i) {
+    if (fds[i].fd < 0 || fds[i].fd >= fiber_fd_max) {
+      continue;  // poll() ignores negative fds
+    }
+    wait_fds[count].fd = fds[i].fd;
+    wait_fds[count].events = 0;
+    if (fds[i].events & (POLLIN | POLLPRI | POLLRDNORM | POLLRDBAND)) {
+      wait_fds[count].events |= FIBER_POLL_IN;
+    }
+    if (fds[i].events & (POLLOUT | POLLWRNORM | POLLWRBAND)) {
+      wait_fds[count].events |= FIBER_POLL_OUT;
+    }
+    if (!wait_fds[count].events) {
+      // errors and hangups are always reported; they wake readers
+      wait_fds[count].events = FIBER_POLL_IN;
+    }
+    ++count;
+  }
+
+  int ret;
+  while (1) {
+    ret = fibershim_poll(fds, nfds, 0);
+    if (ret != 0 || fiber_time_now_ns() >= deadline_ns) {
+      break;
+    }
+    if (!fiber_wait_for_any_event(wait_fds, count, deadline_ns)) {
+      ret = -1;
+      break;
+    }
+  }
+
+  if (wait_fds != stack_fds) {
+    free(wait_fds);
+  }
+  return ret;
+}
+
+int poll(struct pollfd* fds, nfds_t nfds, int timeout) {
+  if (!fibershim_poll) {
+    fibershim_poll = (pollFnType)dlsym(RTLD_NEXT, "poll");
+  }
+
+  if (timeout == 0 || !should_wait_in_fiber()) {
+    return fibershim_poll(fds, nfds, timeout);
+  }
+  return poll_in_fiber(fds, nfds, deadline_after_ms(timeout));
+}
+
+int select(int nfds, fd_set* readfds, fd_set* writefds, fd_set* exceptfds,
+           struct timeval* timeout) {
+  if (!fibershim_select) {
+    fibershim_select = get_select_fn();
+  }
+
+  if ((timeout && !timeout->tv_sec && !timeout->tv_usec) || nfds < 0 ||
+      nfds > FD_SETSIZE || !should_wait_in_fiber()) {
+    return fibershim_select(nfds, readfds, writefds, exceptfds, timeout);
+  }
+
+  const uint64_t deadline =
+      timeout ? fiber_time_now_ns() + timeout->tv_sec * 1000000000ULL +
+                    timeout->tv_usec * 1000ULL
+              : UINT64_MAX;
+
+  struct pollfd* const fds = calloc(nfds ? nfds : 1, sizeof(*fds));
+  if (!fds) {
+    errno = ENOMEM;
+    return -1;
+  }
+  nfds_t count = 0;
+  int fd;
+  for (fd = 0; fd < nfds; ++fd) {
+    short events = 0;
+    if (readfds && FD_ISSET(fd, readfds)) {
+      events |= POLLIN;
+    }
+    if (writefds && FD_ISSET(fd, writefds)) {
+      events |= POLLOUT;
+    }
+    if (exceptfds && FD_ISSET(fd, exceptfds)) {
+      events |= POLLPRI;
+    }
+    if (events) {
+      fds[count].fd = fd;
+      fds[count].events = events;
+      ++count;
+    }
+  }
+
+  int ret = poll_in_fiber(fds, count, deadline);
+  if (ret > 0) {
+    // select() counts each set bit and fails on a bad fd
+    ret = 0;
+    nfds_t i;
+    for (i = 0; i < count; ++i) {
+      const short revents = fds[i].revents;
+      if (revents & POLLNVAL) {
+        free(fds);
+        errno = EBADF;
+        return -1;
+      }
+      if (readfds && FD_ISSET(fds[i].fd, readfds) &&
+          !(revents & (POLLIN | POLLHUP | POLLERR))) {
+        FD_CLR(fds[i].fd, readfds);
+      }
+      if (writefds && FD_ISSET(fds[i].fd, writefds) &&
+          !(revents & (POLLOUT | POLLERR))) {
+        FD_CLR(fds[i].fd, writefds);
+      }
+      if (exceptfds && FD_ISSET(fds[i].fd, exceptfds) &&
+          !(revents & POLLPRI)) {
+        FD_CLR(fds[i].fd, exceptfds);
+      }
+      ret += (readfds && FD_ISSET(fds[i].fd, readfds)) +
+             (writefds && FD_ISSET(fds[i].fd, writefds)) +
+             (exceptfds && FD_ISSET(fds[i].fd, exceptfds));
+    }
+  } else if (ret == 0) {
+    if (readfds) {
+      FD_ZERO(readfds);
+    }
+    if (writefds) {
+      FD_ZERO(writefds);
+    }
+    if (exceptfds) {
+      FD_ZERO(exceptfds);
+    }
+  }
+  free(fds);
+
+  if (timeout && ret >= 0) {
+    // like Linux, leave the time remaining in *timeout
+    const uint64_t now = fiber_time_now_ns();
+    const uint64_t remaining = deadline > now ? deadline - now : 0;
+    timeout->tv_sec = remaining / 1000000000ULL;
+    timeout->tv_usec = remaining % 1000000000ULL / 1000;
+  }
+  return ret;
+}
+
+#if defined(__linux__)
+
+int ppoll(struct pollfd* fds, nfds_t nfds, const struct timespec* tmo_p,
+          const sigset_t* sigmask) {
+  if (!fibershim_ppoll) {
+    fibershim_ppoll = (ppollFnType)dlsym(RTLD_NEXT, "ppoll");
+  }
+  if (!fibershim_poll) {
+    fibershim_poll = (pollFnType)dlsym(RTLD_NEXT, "poll");
+  }
+
+  // the signal mask can't be swapped atomically around a fiber's wait
+  if (sigmask || (tmo_p && !tmo_p->tv_sec && !tmo_p->tv_nsec) ||
+      !should_wait_in_fiber()) {
+    return fibershim_ppoll(fds, nfds, tmo_p, sigmask);
+  }
+  return poll_in_fiber(fds, nfds, deadline_after_ts(tmo_p));
+}
+
+int epoll_wait(int epfd, struct epoll_event* events, int maxevents,
+               int timeout) {
+  if (!fibershim_epoll_wait) {
+    fibershim_epoll_wait = (epollWaitFnType)dlsym(RTLD_NEXT, "epoll_wait");
+  }
+
+  if (timeout == 0 || epfd < 0 || epfd >= fiber_fd_max ||
+      !should_wait_in_fiber()) {
+    return fibershim_epoll_wait(epfd, events, maxevents, timeout);
+  }
+
+  // an epoll instance is readable while it has events to report
+  const uint64_t deadline = deadline_after_ms(timeout);
+  const fiber_event_fd_t wait_fd = {epfd, FIBER_POLL_IN};
+  while (1) {
+    const int ret = fibershim_epoll_wait(epfd, events, maxevents, 0);
+    if (ret != 0 || fiber_time_now_ns() >= deadline) {
+      return ret;
+    }
+    if (!fiber_wait_for_any_event(&wait_fd, 1, deadline)) {
+      return -1;
+    }
+  }
+}
+
+#endif
+
 typedef unsigned int (*sleepFnType)(unsigned int);
 typedef int (*usleepFnType)(useconds_t);
 typedef int (*nanosleepFnType)(const struct timespec*, struct timespec*);
@@ -535,7 +1272,7 @@ unsigned int sleep(unsigned int seconds) {
 
 int usleep(useconds_t useconds) {
   if (!thread_locked && fiber_manager_get()) {
-    fiber_sleep(useconds / 1000000, useconds % 1000000);
+    fiber_sleep_ns(useconds * 1000ULL);
   } else {
     if (!fibershim_usleep) {
       fibershim_usleep = (usleepFnType)dlsym(RTLD_NEXT, "usleep");
@@ -547,7 +1284,7 @@ int usleep(useconds_t useconds) {
 
 int nanosleep(const struct timespec* rqtp, struct timespec* rmtp) {
   if (!thread_locked && fiber_manager_get()) {
-    fiber_sleep(rqtp->tv_sec, rqtp->tv_nsec / 1000 + 1);
+    fiber_sleep_ns(rqtp->tv_sec * 1000000000ULL + rqtp->tv_nsec);
     if (rmtp) {
       rmtp->tv_sec = 0;
       rmtp->tv_nsec = 0;
@@ -567,7 +1304,7 @@ int pipe(int pipefd[2]) {
   }
 
   int ret = fibershim_pipe(pipefd);
-  if (ret == 0 && fd_info && !thread_locked) {
+  if (ret == 0 && fiber_fd_max && !thread_locked) {
     if (!fibershim_fcntl) {
       fibershim_fcntl = (fcntlFnType)dlsym(RTLD_NEXT, "fcntl");
     }
@@ -586,16 +1323,17 @@ int pipe(int pipefd[2]) {
       return ret;
     }
 
-    assert(pipefd[0] < max_fd);
-    atomic_fetch_or(&fd_info[pipefd[0]].flags_,
-                    IO_FLAG_BLOCKING | IO_FLAG_WAITABLE);
-    assert(fd_info[pipefd[0]].flags_ & IO_FLAG_BLOCKING);
-    assert(fd_info[pipefd[0]].flags_ & IO_FLAG_WAITABLE);
-    assert(pipefd[1] < max_fd);
-    atomic_fetch_or(&fd_info[pipefd[1]].flags_,
-                    IO_FLAG_BLOCKING | IO_FLAG_WAITABLE);
-    assert(fd_info[pipefd[1]].flags_ & IO_FLAG_BLOCKING);
-    assert(fd_info[pipefd[1]].flags_ & IO_FLAG_WAITABLE);
+    fiber_fd_t* const read_info = fiber_fd_get(pipefd[0]);
+    fiber_fd_t* const write_info = fiber_fd_get(pipefd[1]);
+    if (!read_info || !write_info) {
+      const int error = errno;
+      close(pipefd[0]);
+      close(pipefd[1]);
+      errno = error;
+      return -1;
+    }
+    atomic_fetch_or(&read_info->io_flags, IO_FLAG_BLOCKING | IO_FLAG_WAITABLE);
+    atomic_fetch_or(&write_info->io_flags, IO_FLAG_BLOCKING | IO_FLAG_WAITABLE);
   }
 
   return ret;
@@ -610,10 +1348,11 @@ int fcntl(int fd, int cmd, ...) {
 
   if (!thread_locked) {
     if (cmd == F_SETFL && (val == O_NONBLOCK || val == O_NDELAY)) {
-      assert(fd < max_fd);
-      atomic_fetch_and(&fd_info[fd].flags_, ~IO_FLAG_BLOCKING);
-      assert(!(fd_info[fd].flags_ & IO_FLAG_BLOCKING));
-      return 0;
+      fiber_fd_t* const info = fiber_fd_get(fd);
+      if (info) {
+        atomic_fetch_and(&info->io_flags, ~IO_FLAG_BLOCKING);
+        return 0;
+      }
     }
     // make sure O_NONBLOCK stays set
     if (cmd == F_SETFL) {
@@ -639,15 +1378,15 @@ int ioctl(IOCTLPARAMS) {
       errno = EINVAL;
       return -1;
     }
-    assert(d < max_fd);
-    if (*(int*)val) {
-      atomic_fetch_and(&fd_info[d].flags_, ~IO_FLAG_BLOCKING);
-      assert(!(fd_info[d].flags_ & IO_FLAG_BLOCKING));
-    } else {
-      atomic_fetch_or(&fd_info[d].flags_, IO_FLAG_BLOCKING);
-      assert(fd_info[d].flags_ & IO_FLAG_BLOCKING);
+    fiber_fd_t* const info = fiber_fd_get(d);
+    if (info) {
+      if (*(int*)val) {
+        atomic_fetch_and(&info->io_flags, ~IO_FLAG_BLOCKING);
+      } else {
+        atomic_fetch_or(&info->io_flags, IO_FLAG_BLOCKING);
+      }
+      return 0;
     }
-    return 0;
   }
 
   if (!fibershim_ioctl) {
@@ -663,8 +1402,9 @@ int close(int fd) {
   }
 
   fiber_fd_closed(fd);
-  if (fd_info && fd < max_fd) {
-    fd_info[fd].flags_ = 0;
+  fiber_fd_t* const info = fiber_fd_find(fd);
+  if (info) {
+    info->io_flags = 0;
   }
   return fibershim_close(fd);
 }
@@ -6,12 +6,20 @@
 #include <assert.h>
 #include <errno.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
+#include "fiber_blocking.h"
 #include "fiber_event.h"
+#include "fiber_fd.h"
 #include "fiber_io.h"
 #include "mpmc_lifo.h"
 #ifndef __USE_GNU
@@ -38,22 +46,75 @@ void splitstack_disable_block_signals() {
 
 static int fiber_manager_state = FIBER_MANAGER_STATE_NONE;
 static int fiber_manager_num_threads = 0;
+// the managers plus the spares sysmon may start (see FIBER_MANAGER_MAX_SPARES)
+static int fiber_manager_max_threads = 0;
 static pthread_t* fiber_manager_threads = NULL;
-static __thread volatile pthread_t this_thread;
 static fiber_manager_t** fiber_managers = NULL;
 static volatile int fiber_shutting_down = 0;
 static _Atomic(lockfree_ring_buffer_t*) fiber_free_mpmc_nodes = NULL;
 static _Atomic(hazard_pointer_thread_record_t*) fiber_hazard_head = NULL;
+static _Atomic(lockfree_ring_buffer_t*)
+    fiber_cache_overflow[FIBER_CACHE_NUM_CLASSES] = {NULL};
+static volatile size_t fiber_cache_low_watermark =
+    FIBER_CACHE_DEFAULT_LOW_WATERMARK;
+static volatile size_t fiber_cache_high_watermark =
+    FIBER_CACHE_DEFAULT_HIGH_WATERMARK;
+// a parked manager has its bit set in fiber_manager_idle_mask. whoever clears
+// the bit is responsible for waking the manager, which then counts as spinning.
+_Atomic int fiber_manager_idle_count = 0;
+_Atomic int fiber_manager_spinning_count = 0;
+static _Atomic uint64_t* fiber_manager_idle_mask = NULL;
+// set while a parked manager is blocked polling for events
+static _Atomic int fiber_manager_has_poller = 0;
+static volatile uint64_t fiber_manager_sysmon_interval_ns =
+    FIBER_MANAGER_SYSMON_DEFAULT_INTERVAL_NS;
+static pthread_t fiber_manager_sysmon_thread;
+static int fiber_manager_sysmon_started = 0;
+// set while sysmon is blocked because every manager is parked. whoever unparks
+// a manager clears it and wakes sysmon.
+static _Atomic int fiber_manager_sysmon_futex = 0;
+static uint64_t fiber_manager_sysmon_check_count = 0;  // written by sysmon
+// spares are started in id order, and only by sysmon
+static int fiber_manager_num_spares = 0;
+uint64_t fiber_manager_slice_cycles = UINT64_MAX;
+static volatile uint64_t fiber_manager_slice_ns =
+    FIBER_MANAGER_DEFAULT_TIME_SLICE_NS;
+static int fiber_manager_preemption = 0;
+static struct sigaction fiber_manager_old_preempt_action;
+
+// work handed to the managers by other threads (see fiber_spawn_external). the
+// stack is only ever flushed whole, so it needs no hazard pointers and anyone
+// can push to it.
+typedef struct fiber_external {
+  mpmc_stack_node_t node;
+  fiber_t* fiber;  // the fiber to wake, or NULL to spawn one
+  fiber_run_function_t run_function;
+  void* param;
+} fiber_external_t;
+
+static mpmc_stack_t fiber_manager_external = {NULL};
 
 void fiber_destroy(fiber_t* f) {
   if (f) {
     assert(f->state == FIBER_STATE_DONE);
     fiber_context_destroy(&f->context);
     free(f->mpsc_fifo_node);
+    if (f->wait) {
+      fiber_wait_release(f->wait);
+    }
     free(f);
   }
 }
 
+// drops requests from other threads which were never taken up
+static void fiber_manager_free_external(mpmc_stack_node_t* node) {
+  while (node) {
+    mpmc_stack_node_t* const next = node->next;
+    free(mpmc_stack_node_get_data(node));
+    node = next;
+  }
+}
+
 fiber_manager_t* fiber_manager_create(fiber_scheduler_t* scheduler) {
   fiber_manager_t* const manager = calloc(1, sizeof(*manager));
   if (!manager) {
@@ -75,12 +136,93 @@ fiber_manager_t* fiber_manager_create(fiber_scheduler_t* scheduler) {
 }
 
 static void fiber_manager_destroy(fiber_manager_t* manager) {
+  if (manager->preempt_stack) {
+    timer_delete(manager->preempt_timer);
+    free(manager->preempt_stack);
+  }
+  int i;
+  for (i = 0; i < FIBER_CACHE_NUM_CLASSES; ++i) {
+    fiber_t* f = manager->fiber_cache[i].head;
+    while (f) {
+      fiber_t* const next = (fiber_t*)f->scratch;
+      fiber_destroy(f);
+      f = next;
+    }
+  }
+  fiber_manager_free_external(manager->external);
   fiber_destroy(manager->thread_fiber);
   free(manager);
 }
 
 static void* fiber_manager_thread_func(void* param);
 
+void fiber_manager_schedule_next(fiber_manager_t* manager, fiber_t* the_fiber) {
+  assert(manager);
+  assert(the_fiber);
+  if (the_fiber->priority > FIBER_PRIORITY_NORMAL) {
+    // low priority fibers don't jump the queue
+    fiber_manager_schedule(manager, the_fiber);
+    return;
+  }
+  manager->run_next_ns = fiber_time_now_ns();
+  fiber_t* const old = atomic_exchange(&manager->run_next, the_fiber);
+  if (old) {
+    fiber_manager_schedule(manager, old);
+  }
+}
+
+// a fiber still saving its state on another thread can't run yet; the
+// scheduler holds on to it until it can
+static fiber_t* fiber_manager_check_run_next(fiber_manager_t* manager,
+                                             fiber_t* the_fiber) {
+  if (the_fiber->state == FIBER_STATE_SAVING_STATE_TO_WAIT) {
+    fiber_scheduler_schedule(manager->scheduler, the_fiber);
+    return NULL;
+  }
+  manager->run_next_count += 1;
+  return the_fiber;
+}
+
+static fiber_t* fiber_manager_take_run_next(fiber_manager_t* manager) {
+  if (!atomic_load_explicit(&manager->run_next, memory_order_relaxed)) {
+    return NULL;
+  }
+  fiber_t* const ret = atomic_exchange(&manager->run_next, NULL);
+  return ret ? fiber_manager_check_run_next(manager, ret) : NULL;
+}
+
+// takes another manager's run_next fiber once its grace period is over
+static fiber_t* fiber_manager_steal_run_next(fiber_manager_t* manager) {
+  const uint64_t now = fiber_time_now_ns();
+  int i;
+  for (i = 1; i < fiber_manager_num_threads; ++i) {
+    fiber_manager_t* const victim =
+        fiber_managers[(manager->id + i) % fiber_manager_num_threads];
+    fiber_t* the_fiber =
+        atomic_load_explicit(&victim->run_next, memory_order_relaxed);
+    const uint64_t since = victim->run_next_ns;
+    if (the_fiber && now > since && now - since > FIBER_RUN_NEXT_GRACE_NS &&
+        atomic_compare_exchange_strong(&victim->run_next, &the_fiber, NULL)) {
+      return fiber_manager_check_run_next(manager, the_fiber);
+    }
+  }
+  return NULL;
+}
+
+// picks the next fiber to run, preferring the run_next slot
+static fiber_t* fiber_manager_next(fiber_manager_t* manager) {
+  if (manager->run_next_streak < FIBER_RUN_NEXT_MAX_STREAK) {
+    fiber_t* const ret = fiber_manager_take_run_next(manager);
+    if (ret) {
+      manager->run_next_streak += 1;
+      return ret;
+    }
+  }
+  manager->run_next_streak = 0;
+  fiber_t* const ret = fiber_scheduler_next(manager->scheduler);
+  return ret ? ret : fiber_manager_take_run_next(manager);
+}
+
 static inline void fiber_manager_switch_to(fiber_manager_t* manager,
                                            fiber_t* old_fiber,
                                            fiber_t* new_fiber) {
@@ -90,12 +232,16 @@ static inline void fiber_manager_switch_to(fiber_manager_t* manager,
   }
   manager->current_fiber = new_fiber;
   manager->old_fiber = old_fiber;
+  manager->slice_start = 0;
+  manager->should_yield = 0;
   new_fiber->state = FIBER_STATE_RUNNING;
   fiber_context_swap(&old_fiber->context, &new_fiber->context);
 
   fiber_manager_do_maintenance();
 }
 
+static int fiber_manager_busy_poll(fiber_manager_t* manager);
+
 void fiber_manager_yield(fiber_manager_t* manager) {
   assert(fiber_manager_state == FIBER_MANAGER_STATE_STARTED);
   assert(manager);
@@ -105,7 +251,7 @@ void fiber_manager_yield(fiber_manager_t* manager) {
     manager->yield_count += 1;
     const fiber_state_t state = current_fiber->state;
 
-    fiber_t* const new_fiber = fiber_scheduler_next(manager->scheduler);
+    fiber_t* const new_fiber = fiber_manager_next(manager);
     if (new_fiber) {
       fiber_manager_switch_to(manager, current_fiber, new_fiber);
       break;
@@ -121,15 +267,42 @@ void fiber_manager_yield(fiber_manager_t* manager) {
       // re-grab the manager, since we could be on a different thread now
       manager = fiber_manager_get();
     } else {
-      // occasionally steal some work from threads with more load
-      if ((manager->yield_count & 1023) == 0) {
+      // a fiber yielding with nobody else to run still has to poll now and
+      // then, otherwise fibers waiting for events on this thread starve
+      if (fiber_manager_busy_poll(manager) > 0) {
+        continue;
+      }
+      // occasionally steal some work from threads with more load. spares
+      // only take work from the manager they're covering for.
+      if (!manager->spare && (manager->yield_count & 1023) == 0) {
         fiber_scheduler_load_balance(manager->scheduler);
       }
+      // nobody is waiting, so the caller gets a fresh slice
+      manager->slice_start = 0;
+      manager->should_yield = 0;
       break;
     }
   }
 }
 
+void fiber_manager_yield_to(fiber_manager_t* manager, fiber_t* target) {
+  assert(fiber_manager_state == FIBER_MANAGER_STATE_STARTED);
+  assert(manager);
+  assert(manager->current_fiber->state == FIBER_STATE_RUNNING);
+
+  // only a fiber taken from the slot is ours to run; anywhere else it could be
+  // picked up by another thread
+  fiber_t* expected = target;
+  if (target && target != manager->current_fiber &&
+      atomic_compare_exchange_strong(&manager->run_next, &expected, NULL) &&
+      fiber_manager_check_run_next(manager, target)) {
+    manager->yield_count += 1;
+    fiber_manager_switch_to(manager, manager->current_fiber, target);
+    return;
+  }
+  fiber_manager_yield(manager);
+}
+
 void* fiber_load_symbol(const char* symbol) {
   void* ret = dlsym(RTLD_NEXT, symbol);
   if (!ret) {
@@ -145,8 +318,387 @@ static __thread bool should_check_events = true;
 
 fiber_manager_t* fiber_manager_get() { return fiber_the_manager; }
 
+// with an event set per thread nobody else polls this thread's set, so it's
+// polled even after the thread is asked to stop (see fiber_shutdown)
+static inline bool fiber_manager_checks_events() {
+  return should_check_events || fiber_event_has_per_thread_sets();
+}
+
 extern void fiber_mark_completed(fiber_t* the_fiber, void* result);
 
+static void fiber_manager_set_idle(fiber_manager_t* manager) {
+  atomic_fetch_add(&fiber_manager_idle_count, 1);
+  atomic_fetch_or(&fiber_manager_idle_mask[manager->id / 64],
+                  (uint64_t)1 << (manager->id % 64));
+}
+
+static void fiber_manager_wake_sysmon() {
+  if (atomic_load(&fiber_manager_sysmon_futex) &&
+      atomic_exchange(&fiber_manager_sysmon_futex, 0)) {
+#if defined(__linux__)
+    syscall(SYS_futex, &fiber_manager_sysmon_futex, FUTEX_WAKE_PRIVATE, 1,
+            NULL, NULL, 0);
+#endif
+  }
+}
+
+// returns 1 if the manager was still idle (ie. nobody has woken it)
+static int fiber_manager_clear_idle(int id) {
+  const uint64_t bit = (uint64_t)1 << (id % 64);
+  if (!(atomic_fetch_and(&fiber_manager_idle_mask[id / 64], ~bit) & bit)) {
+    return 0;
+  }
+  atomic_fetch_sub(&fiber_manager_idle_count, 1);
+  // a manager which isn't parked may get stuck, so sysmon has to watch it
+  fiber_manager_wake_sysmon();
+  return 1;
+}
+
+static void fiber_manager_unpark(fiber_manager_t* manager) {
+  if (manager->polling) {
+    fiber_event_wake_poller(manager->id);
+  } else {
+    atomic_store(&manager->park_futex, 0);
+#if defined(__linux__)
+    syscall(SYS_futex, &manager->park_futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL,
+            0);
+#endif
+  }
+}
+
+void fiber_manager_wake_idle() {
+  // the woken manager counts as spinning, so nobody else wakes one until it
+  // either finds work or parks again
+  int expected = 0;
+  if (!atomic_compare_exchange_strong(&fiber_manager_spinning_count, &expected,
+                                      1)) {
+    return;
+  }
+  // prefer managers which aren't polling; the poller is kept for events. with
+  // an event set per thread, every parked manager is polling its own.
+  const int num_words = (fiber_manager_num_threads + 63) / 64;
+  int pass;
+  for (pass = fiber_event_has_per_thread_sets(); pass < 2; ++pass) {
+    int i;
+    for (i = 0; i < num_words; ++i) {
+      uint64_t bits = atomic_load(&fiber_manager_idle_mask[i]);
+      while (bits) {
+        const int id = i * 64 + __builtin_ctzll(bits);
+        bits &= bits - 1;
+        fiber_manager_t* const manager = fiber_managers[id];
+        if ((pass == 0 && manager->polling) || !fiber_manager_clear_idle(id)) {
+          continue;
+        }
+        fiber_manager_unpark(manager);
+        return;
+      }
+    }
+  }
+  atomic_fetch_sub(&fiber_manager_spinning_count, 1);
+}
+
+static void fiber_manager_wake_all() {
+  int i;
+  for (i = 0; i < fiber_manager_max_threads; ++i) {
+    fiber_event_wake_poller(i);
+    fiber_managers[i]->polling = 0;
+    fiber_manager_unpark(fiber_managers[i]);
+  }
+}
+
+// a spare takes work from the manager it's covering for, including its
+// run_next fiber (which would otherwise wait for the stuck manager), and none
+// once it's retired
+static fiber_t* fiber_manager_spare_steal(fiber_manager_t* manager) {
+  const int covering = atomic_load(&manager->covering);
+  if (covering < 0) {
+    return NULL;
+  }
+  fiber_manager_t* const victim = fiber_managers[covering];
+  fiber_scheduler_steal_from(manager->scheduler, victim->scheduler);
+  fiber_t* const ret = fiber_scheduler_next(manager->scheduler);
+  if (ret) {
+    return ret;
+  }
+  fiber_t* the_fiber =
+      atomic_load_explicit(&victim->run_next, memory_order_relaxed);
+  if (the_fiber &&
+      atomic_compare_exchange_strong(&victim->run_next, &the_fiber, NULL)) {
+    return fiber_manager_check_run_next(manager, the_fiber);
+  }
+  return NULL;
+}
+
+// spawns or wakes a batch of the fibers handed over by other threads, in the
+// order they were handed over, and queues them here. returns the number of
+// fibers queued. spares leave the work to the managers.
+static int fiber_manager_take_external(fiber_manager_t* manager) {
+  if (manager->spare) {
+    return 0;
+  }
+  if (!manager->external) {
+    if (!atomic_load_explicit(&fiber_manager_external.head,
+                              memory_order_relaxed)) {
+      return 0;
+    }
+    manager->external = mpmc_stack_fifo_flush(&fiber_manager_external);
+  }
+  int count = 0;
+  while (manager->external && count < FIBER_MANAGER_EXTERNAL_BATCH) {
+    fiber_external_t* const external =
+        mpmc_stack_node_get_data(manager->external);
+    fiber_t* the_fiber = external->fiber;
+    if (!the_fiber) {
+      the_fiber = fiber_create_no_sched(FIBER_DEFAULT_STACK_SIZE,
+                                        external->run_function,
+                                        external->param);
+      if (!the_fiber) {
+        break;  // try again next time
+      }
+      fiber_detach(the_fiber);
+    } else if (the_fiber->state == FIBER_STATE_WAITING) {
+      the_fiber->state = FIBER_STATE_READY;
+    }
+    manager->external = manager->external->next;
+    free(external);
+    fiber_scheduler_schedule(manager->scheduler, the_fiber);
+    count += 1;
+  }
+  manager->external_count += count;
+  if (count > 1) {
+    // let a parked manager share them
+    fiber_manager_wake_if_idle();
+  }
+  return count;
+}
+
+static fiber_t* fiber_manager_find_work(fiber_manager_t* manager) {
+  fiber_t* ret = fiber_manager_next(manager);
+  if (ret) {
+    return ret;
+  }
+  if (fiber_manager_take_external(manager)) {
+    return fiber_manager_next(manager);
+  }
+  if (manager->spare) {
+    return fiber_manager_spare_steal(manager);
+  }
+  if (!manager->spinning) {
+    // don't let more than half of the busy managers look for work to steal
+    const int busy = fiber_manager_num_threads -
+                     atomic_load_explicit(&fiber_manager_idle_count,
+                                          memory_order_relaxed);
+    if (2 * atomic_load_explicit(&fiber_manager_spinning_count,
+                                 memory_order_relaxed) >=
+        busy) {
+      return NULL;
+    }
+    manager->spinning = 1;
+    atomic_fetch_add(&fiber_manager_spinning_count, 1);
+  }
+  fiber_scheduler_load_balance(manager->scheduler);
+  ret = fiber_scheduler_next(manager->scheduler);
+  return ret ? ret : fiber_manager_steal_run_next(manager);
+}
+
+static void fiber_manager_stop_spinning(fiber_manager_t* manager) {
+  if (manager->spinning) {
+    manager->spinning = 0;
+    // the last spinner found work; there may be more, so wake someone else to
+    // look for it
+    if (atomic_fetch_sub(&fiber_manager_spinning_count, 1) == 1 &&
+        atomic_load_explicit(&fiber_manager_idle_count,
+                             memory_order_relaxed)) {
+      fiber_manager_wake_idle();
+    }
+  }
+}
+
+// blocks a spare with nothing to run until sysmon unparks it. it isn't counted
+// as idle, so nothing else wakes it, but it keeps polling its own event set:
+// fibers which ran on it may be waiting for events registered there.
+static void fiber_manager_park_spare(fiber_manager_t* manager) {
+  const int poller = fiber_event_has_per_thread_sets();
+  manager->polling = poller;
+  atomic_store(&manager->park_futex, 1);
+  // sysmon sets covering before unparking, so look again
+  store_load_barrier();
+  fiber_t* const new_fiber = fiber_manager_spare_steal(manager);
+  if (new_fiber) {
+    fiber_scheduler_schedule(manager->scheduler, new_fiber);
+  } else if (!fiber_shutting_down) {
+    manager->park_count += 1;
+    if (poller) {
+      fiber_poll_events_until_woken();
+    } else {
+#if defined(__linux__)
+      while (atomic_load(&manager->park_futex) && !fiber_shutting_down) {
+        syscall(SYS_futex, &manager->park_futex, FUTEX_WAIT_PRIVATE, 1, NULL,
+                NULL, 0);
+      }
+#else
+      fiber_do_real_sleep(0, FIBER_TIME_RESOLUTION_MS * 1000);
+#endif
+    }
+  }
+  manager->polling = 0;
+}
+
+// blocks the manager's thread until it's woken by fiber_manager_wake_idle. a
+// manager with its own event set blocks polling it; otherwise one parked
+// manager at a time blocks polling for events instead.
+static void fiber_manager_park(fiber_manager_t* manager) {
+  if (manager->spare) {
+    fiber_manager_park_spare(manager);
+    return;
+  }
+  if (manager->spinning) {
+    manager->spinning = 0;
+    atomic_fetch_sub(&fiber_manager_spinning_count, 1);
+  }
+
+  const int per_thread_sets = fiber_event_has_per_thread_sets();
+  int expected = 0;
+  const int poller =
+      fiber_manager_checks_events() &&
+      (per_thread_sets || atomic_compare_exchange_strong(
+                              &fiber_manager_has_poller, &expected, 1));
+  if (!fiber_manager_checks_events() &&
+      !atomic_load(&fiber_manager_has_poller)) {
+    // make sure someone is left to poll for events (see fiber_shutdown)
+    fiber_manager_wake_idle();
+  }
+  manager->polling = poller;
+  atomic_store(&manager->park_futex, 1);
+  fiber_manager_set_idle(manager);
+
+  // look again now that anyone scheduling work will see this manager parked.
+  // work which is found goes back on the local queue to be picked up next.
+  fiber_t* new_fiber = fiber_manager_next(manager);
+  if (!new_fiber) {
+    fiber_manager_take_external(manager);
+    fiber_scheduler_load_balance(manager->scheduler);
+    new_fiber = fiber_scheduler_next(manager->scheduler);
+  }
+  if (new_fiber) {
+    fiber_scheduler_schedule(manager->scheduler, new_fiber);
+  } else if (fiber_scheduler_has_work(manager->scheduler)) {
+    // only fibers still saving their state on another thread, which will be
+    // runnable in a moment. parking would leave them stranded here.
+  } else if (!fiber_shutting_down) {
+    manager->park_count += 1;
+    if (poller) {
+      fiber_poll_events_until_woken();
+    } else {
+#if defined(__linux__)
+      while (atomic_load(&manager->park_futex) && !fiber_shutting_down) {
+        syscall(SYS_futex, &manager->park_futex, FUTEX_WAIT_PRIVATE, 1, NULL,
+                NULL, 0);
+      }
+#else
+      fiber_do_real_sleep(0, FIBER_TIME_RESOLUTION_MS * 1000);
+#endif
+    }
+  }
+
+  if (!fiber_manager_clear_idle(manager->id)) {
+    manager->spinning = 1;  // counted by whoever woke us
+  }
+  manager->polling = 0;
+  if (poller && !per_thread_sets) {
+    atomic_store(&fiber_manager_has_poller, 0);
+    // hand the poller role to another parked manager
+    if (atomic_load(&fiber_manager_idle_count)) {
+      fiber_manager_wake_idle();
+    }
+  }
+}
+
+// flags the current fiber once it has used up its slice. this runs on the
+// thread's alternate signal stack, as the fiber's own stack may be nearly full.
+#ifdef FIBER_STACK_SPLIT
+__attribute__((__no_split_stack__))
+#endif
+static void
+fiber_manager_preempt_handler(int signum) {
+  (void)signum;
+  fiber_manager_t* const manager = fiber_the_manager;
+  if (manager && !manager->should_yield &&
+      fiber_manager_slice_expired(manager)) {
+    manager->should_yield = 1;
+    manager->preempt_count += 1;
+  }
+}
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// gives the calling thread a timer which checks its manager's current fiber
+// every time slice of cpu time. without one, the thread's fibers just aren't
+// preempted.
+static void fiber_manager_start_preemption(fiber_manager_t* manager) {
+#if defined(__linux__)
+  if (!fiber_manager_preemption || !fiber_manager_slice_ns) {
+    return;
+  }
+  void* const stack = malloc(SIGSTKSZ);
+  struct sigevent sev;
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = FIBER_MANAGER_PREEMPT_SIGNAL;
+  sev.sigev_notify_thread_id = syscall(SYS_gettid);
+  if (!stack || timer_create(CLOCK_THREAD_CPUTIME_ID, &sev,
+                             &manager->preempt_timer)) {
+    free(stack);
+    return;
+  }
+  // without the alternate stack the handler would run on the interrupted
+  // fiber's stack, which may be nearly full
+  stack_t ss;
+  memset(&ss, 0, sizeof(ss));
+  ss.ss_sp = stack;
+  ss.ss_size = SIGSTKSZ;
+  if (sigaltstack(&ss, NULL)) {
+    timer_delete(manager->preempt_timer);
+    free(stack);
+    return;
+  }
+
+  struct itimerspec its;
+  its.it_value.tv_sec = fiber_manager_slice_ns / 1000000000;
+  its.it_value.tv_nsec = fiber_manager_slice_ns % 1000000000;
+  its.it_interval = its.it_value;
+  if (timer_settime(manager->preempt_timer, 0, &its, NULL)) {
+    memset(&ss, 0, sizeof(ss));
+    ss.ss_flags = SS_DISABLE;
+    sigaltstack(&ss, NULL);
+    timer_delete(manager->preempt_timer);
+    free(stack);
+    return;
+  }
+  manager->preempt_stack = stack;
+#endif
+}
+
+// the timestamp counter's rate isn't known up front, so it's timed against
+// the clock for a moment
+#define FIBER_MANAGER_TSC_CALIBRATION_NS (100000)
+
+static uint64_t fiber_manager_slice_to_cycles(uint64_t slice_ns) {
+  if (!slice_ns) {
+    return UINT64_MAX;
+  }
+  const uint64_t start_ns = fiber_time_now_ns();
+  const uint64_t start = cpu_timestamp();
+  uint64_t elapsed_ns;
+  do {
+    cpu_relax();
+    elapsed_ns = fiber_time_now_ns() - start_ns;
+  } while (elapsed_ns < FIBER_MANAGER_TSC_CALIBRATION_NS);
+  return slice_ns * (cpu_timestamp() - start) / elapsed_ns;
+}
+
 static void* fiber_manager_thread_func(void* param) {
   // set the thread local, then start running fibers
   fiber_the_manager = (fiber_manager_t*)param;
@@ -157,25 +709,19 @@ static void* fiber_manager_thread_func(void* param) {
   if (!manager->maintenance_fiber) {
     manager->maintenance_fiber = manager->thread_fiber;
     should_check_events = true;
-    this_thread = pthread_self();
+    fiber_manager_start_preemption(manager);
   }
 
   while (!fiber_shutting_down) {
-    fiber_scheduler_load_balance(manager->scheduler);
-
-    fiber_t* const new_fiber = fiber_scheduler_next(manager->scheduler);
+    fiber_t* const new_fiber = fiber_manager_find_work(manager);
     if (new_fiber) {
+      fiber_manager_stop_spinning(manager);
       // make this fiber wait so we aren't scheduled again until all work is
       // done
       manager->maintenance_fiber->state = FIBER_STATE_SAVING_STATE_TO_WAIT;
       fiber_manager_switch_to(manager, manager->maintenance_fiber, new_fiber);
-    } else if (should_check_events) {
-      const int num_events = fiber_poll_events();
-      if (num_events == 0) {
-        fiber_poll_events_blocking(0, FIBER_TIME_RESOLUTION_MS * 1000);
-      }
-    } else {
-      fiber_do_real_sleep(/*seconds=*/0, /*useconds=*/10000);
+    } else if (!fiber_manager_checks_events() || fiber_poll_events() <= 0) {
+      fiber_manager_park(manager);
     }
   }
   fiber_mark_completed(manager->maintenance_fiber, NULL);
@@ -194,47 +740,217 @@ static void* fiber_manager_thread_func(void* param) {
   return NULL;
 }
 
+static int fiber_manager_is_idle(int id) {
+  const uint64_t bit = (uint64_t)1 << (id % 64);
+  return (atomic_load(&fiber_manager_idle_mask[id / 64]) & bit) != 0;
+}
+
+static int fiber_manager_has_work(fiber_manager_t* manager) {
+  return fiber_scheduler_has_work(manager->scheduler) ||
+         atomic_load_explicit(&manager->run_next, memory_order_relaxed) ||
+         manager->external;
+}
+
+// returns the id of a spare which now covers for manager id, starting a new
+// one if every spare is busy. returns -1 if no more can be started.
+static int fiber_manager_start_spare(int id) {
+  int i;
+  for (i = 0; i < fiber_manager_num_spares; ++i) {
+    fiber_manager_t* const spare =
+        fiber_managers[fiber_manager_num_threads + i];
+    int expected = -1;
+    if (atomic_compare_exchange_strong(&spare->covering, &expected, id)) {
+      return spare->id;
+    }
+  }
+  if (fiber_manager_num_spares == FIBER_MANAGER_MAX_SPARES) {
+    return -1;
+  }
+
+  fiber_manager_t* const spare =
+      fiber_managers[fiber_manager_num_threads + fiber_manager_num_spares];
+  atomic_store(&spare->covering, id);
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, 1024000);
+  const int ret = pthread_create(&fiber_manager_threads[spare->id], &attr,
+                                 &fiber_manager_thread_func, spare);
+  pthread_attr_destroy(&attr);
+  if (ret) {
+    atomic_store(&spare->covering, -1);
+    return -1;
+  }
+  fiber_manager_num_spares += 1;
+  return spare->id;
+}
+
+// blocks sysmon while every manager is parked with nothing queued, as none of
+// them can be stuck. an idle process takes no timer wake ups for it.
+static void fiber_manager_sysmon_park() {
+  atomic_store(&fiber_manager_sysmon_futex, 1);
+  // pairs with clearing an idle bit before fiber_manager_wake_sysmon
+  store_load_barrier();
+  int i;
+  for (i = 0; i < fiber_manager_num_threads; ++i) {
+    if (!fiber_manager_is_idle(i) ||
+        fiber_manager_has_work(fiber_managers[i])) {
+      break;
+    }
+  }
+#if defined(__linux__)
+  while (i == fiber_manager_num_threads &&
+         atomic_load(&fiber_manager_sysmon_futex) && !fiber_shutting_down) {
+    syscall(SYS_futex, &fiber_manager_sysmon_futex, FUTEX_WAIT_PRIVATE, 1,
+            NULL, NULL, 0);
+  }
+#endif
+  atomic_store(&fiber_manager_sysmon_futex, 0);
+}
+
+static void* fiber_manager_sysmon_func(void* param) {
+  // which yield_count each manager had at the last check, and which spare
+  // covers for it (or -1)
+  uint64_t* const last_yield_count =
+      calloc(fiber_manager_num_threads, sizeof(*last_yield_count));
+  int* const covered_by =
+      malloc(fiber_manager_num_threads * sizeof(*covered_by));
+  assert(last_yield_count && covered_by);
+  int i;
+  for (i = 0; i < fiber_manager_num_threads; ++i) {
+    covered_by[i] = -1;
+  }
+
+  while (!fiber_shutting_down) {
+    const uint64_t interval_us = fiber_manager_sysmon_interval_ns / 1000;
+    fiber_do_real_sleep(interval_us / 1000000, interval_us % 1000000);
+    fiber_manager_sysmon_check_count += 1;
+    for (i = 0; i < fiber_manager_num_threads && !fiber_shutting_down; ++i) {
+      fiber_manager_t* const manager = fiber_managers[i];
+      const uint64_t yield_count = manager->yield_count;
+      const int progressed = yield_count != last_yield_count[i];
+      last_yield_count[i] = yield_count;
+      if (progressed || fiber_manager_is_idle(i) ||
+          !fiber_manager_has_work(manager)) {
+        if (progressed && covered_by[i] >= 0) {
+          // retire the spare. it runs whatever it already took, then parks.
+          atomic_store(&fiber_managers[covered_by[i]]->covering, -1);
+          covered_by[i] = -1;
+        }
+        continue;
+      }
+
+      // stuck with fibers waiting. a parked manager steals them if there is
+      // one; otherwise a spare takes them.
+      if (atomic_load(&fiber_manager_idle_count)) {
+        manager->sysmon_handoff_count += 1;
+        fiber_manager_wake_idle();
+        continue;
+      }
+      if (covered_by[i] < 0) {
+        covered_by[i] = fiber_manager_start_spare(i);
+        if (covered_by[i] < 0) {
+          continue;
+        }
+        manager->sysmon_handoff_count += 1;
+      }
+      fiber_manager_unpark(fiber_managers[covered_by[i]]);
+    }
+    fiber_manager_sysmon_park();
+  }
+
+  free(last_yield_count);
+  free(covered_by);
+  return NULL;
+}
+
 int fiber_manager_init(size_t num_threads) {
+  fiber_manager_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.num_threads = num_threads;
+  return fiber_manager_init_with_config(&config);
+}
+
+int fiber_manager_init_with_config(const fiber_manager_config_t* config) {
+  assert(config);
+  const size_t num_threads = config->num_threads;
   splitstack_disable_block_signals();
   fiber_shutting_down = 0;
   should_check_events = true;
-  this_thread = pthread_self();
 
   if (fiber_manager_get_state() != FIBER_MANAGER_STATE_NONE) {
     errno = EINVAL;
     return FIBER_ERROR;
   }
 
-  const int sched_ret = fiber_scheduler_init(num_threads);
+  const fiber_scheduler_ops_t* scheduler = config->scheduler;
+  if (!scheduler) {
+    const char* const name = getenv("FIBER_SCHEDULER");
+    scheduler = name ? fiber_scheduler_find(name) : &fiber_scheduler_wsd_ops;
+    if (!scheduler) {
+      errno = EINVAL;
+      return FIBER_ERROR;
+    }
+  }
+
+  // spares get a scheduler and an event set of their own, like any manager
+  const size_t max_threads =
+      num_threads +
+      (fiber_manager_sysmon_interval_ns ? FIBER_MANAGER_MAX_SPARES : 0);
+  const int sched_ret = fiber_scheduler_init(scheduler, max_threads);
   if (!sched_ret) {
     return FIBER_ERROR;
   }
 
   assert(!fiber_manager_threads);
-  fiber_manager_threads = calloc(num_threads, sizeof(*fiber_manager_threads));
+  fiber_manager_threads = calloc(max_threads, sizeof(*fiber_manager_threads));
   assert(fiber_manager_threads);
   fiber_manager_num_threads = num_threads;
+  fiber_manager_max_threads = max_threads;
+  fiber_manager_num_spares = 0;
   assert(!fiber_managers);
-  fiber_managers = calloc(num_threads, sizeof(*fiber_managers));
+  fiber_managers = calloc(max_threads, sizeof(*fiber_managers));
   assert(fiber_managers);
+  assert(!fiber_manager_idle_mask);
+  fiber_manager_idle_mask =
+      calloc((num_threads + 63) / 64, sizeof(*fiber_manager_idle_mask));
+  assert(fiber_manager_idle_mask);
+  fiber_manager_idle_count = 0;
+  fiber_manager_spinning_count = 0;
+  fiber_manager_has_poller = 0;
+
+  fiber_manager_slice_cycles =
+      fiber_manager_slice_to_cycles(fiber_manager_slice_ns);
+  if (fiber_manager_preemption) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &fiber_manager_preempt_handler;
+    action.sa_flags = SA_RESTART | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    sigaction(FIBER_MANAGER_PREEMPT_SIGNAL, &action,
+              &fiber_manager_old_preempt_action);
+  }
 
   fiber_manager_t* const main_manager =
       fiber_manager_create(fiber_scheduler_for_thread(0));
   assert(main_manager);
 
   fiber_the_manager = main_manager;
+  fiber_manager_start_preemption(main_manager);
 
   fiber_managers[0] = main_manager;
   fiber_manager_threads[0] = pthread_self();
 
   fiber_manager_state = FIBER_MANAGER_STATE_STARTED;
 
+  main_manager->covering = -1;
   size_t i;
-  for (i = 1; i < num_threads; ++i) {
+  for (i = 1; i < max_threads; ++i) {
     fiber_manager_t* const new_manager =
         fiber_manager_create(fiber_scheduler_for_thread(i));
     assert(new_manager);
     new_manager->id = i;
+    new_manager->spare = i >= num_threads;
+    new_manager->covering = -1;
     fiber_managers[i] = new_manager;
   }
 
@@ -255,6 +971,9 @@ int fiber_manager_init(size_t num_threads) {
 
   pthread_attr_destroy(&attr);
 
+  if (!fiber_fd_init()) {
+    return FIBER_ERROR;
+  }
   if (!fiber_io_init()) {
     return FIBER_ERROR;
   }
@@ -262,21 +981,45 @@ int fiber_manager_init(size_t num_threads) {
     return FIBER_ERROR;
   }
 
+  if (fiber_manager_sysmon_interval_ns) {
+    if (pthread_create(&fiber_manager_sysmon_thread, NULL,
+                       &fiber_manager_sysmon_func, NULL)) {
+      return FIBER_ERROR;
+    }
+    fiber_manager_sysmon_started = 1;
+  }
+
   return FIBER_SUCCESS;
 }
 
+// not inlined: gcc caches thread local addresses within a function, which is
+// wrong once the calling fiber migrates to another thread
+static __attribute__((noinline)) void fiber_manager_stop_checking_events() {
+  should_check_events = false;
+}
+
 void fiber_shutdown() {
-  // Note: 'this_thread' is used instead of simply calling pthread_self()
-  // because gcc will hoist the call to pthread_self() out of the loop and we'll
-  // never terminate.
-  while (!pthread_equal(this_thread, fiber_manager_threads[0])) {
-    should_check_events = false;
+  // Note: the main thread's manager is checked instead of comparing thread
+  // locals or pthread_self() because gcc will hoist those out of the loop and
+  // we'll never terminate. sleeping lets whichever thread still checks events
+  // (ideally the main thread) pick this fiber back up.
+  fiber_t* const this_fiber = fiber_manager_get()->current_fiber;
+  while (fiber_managers[0]->current_fiber != this_fiber) {
+    fiber_manager_stop_checking_events();
     fiber_yield();
     usleep(1000);
   }
   fiber_shutting_down = 1;
+  store_load_barrier();  // parking managers must see fiber_shutting_down
+  if (fiber_manager_sysmon_started) {
+    // sysmon starts spares, so it has to stop before they're joined
+    fiber_manager_wake_sysmon();
+    pthread_join(fiber_manager_sysmon_thread, NULL);
+    fiber_manager_sysmon_started = 0;
+  }
+  fiber_manager_wake_all();
   int i;
-  for (i = 1; i < fiber_manager_num_threads; ++i) {
+  for (i = 1; i < fiber_manager_num_threads + fiber_manager_num_spares; ++i) {
     pthread_join(fiber_manager_threads[i], NULL);
   }
 
@@ -286,21 +1029,115 @@ void fiber_shutdown() {
     fiber_destroy(maintenance_fiber);
   }
   fiber_mark_completed(fiber_managers[0]->thread_fiber, NULL);
+  if (fiber_manager_preemption) {
+    // this is the main thread, and its alternate stack is about to be freed
+    if (fiber_managers[0]->preempt_stack) {
+      stack_t ss;
+      memset(&ss, 0, sizeof(ss));
+      ss.ss_flags = SS_DISABLE;
+      sigaltstack(&ss, NULL);
+    }
+    sigaction(FIBER_MANAGER_PREEMPT_SIGNAL, &fiber_manager_old_preempt_action,
+              NULL);
+  }
+  // spares which were never started never completed their thread fiber
+  for (i = fiber_manager_num_threads + fiber_manager_num_spares;
+       i < fiber_manager_max_threads; ++i) {
+    fiber_mark_completed(fiber_managers[i]->thread_fiber, NULL);
+  }
 
-  for (i = 0; i < fiber_manager_num_threads; ++i) {
+  for (i = 0; i < fiber_manager_max_threads; ++i) {
     fiber_manager_destroy(fiber_managers[i]);
   }
+  fiber_scheduler_shutdown();
+  fiber_manager_free_external(mpmc_stack_lifo_flush(&fiber_manager_external));
+  fiber_manager_num_spares = 0;
   free(fiber_managers);
   fiber_managers = NULL;
   free(fiber_manager_threads);
   fiber_manager_threads = NULL;
+  free(fiber_manager_idle_mask);
+  fiber_manager_idle_mask = NULL;
   lockfree_ring_buffer_destroy(fiber_free_mpmc_nodes);
   fiber_free_mpmc_nodes = NULL;
   hazard_pointer_thread_record_destroy_all(fiber_hazard_head);
   fiber_hazard_head = NULL;
+  for (i = 0; i < FIBER_CACHE_NUM_CLASSES; ++i) {
+    lockfree_ring_buffer_t* const overflow = fiber_cache_overflow[i];
+    if (overflow) {
+      fiber_t* f;
+      while ((f = lockfree_ring_buffer_trypop(overflow))) {
+        fiber_destroy(f);
+      }
+      lockfree_ring_buffer_destroy(overflow);
+      fiber_cache_overflow[i] = NULL;
+    }
+  }
 
+  fiber_blocking_shutdown();
   fiber_io_shutdown();
   fiber_event_shutdown();
+  fiber_fd_shutdown();
+}
+
+static int fiber_manager_push_external(fiber_t* the_fiber,
+                                       fiber_run_function_t run_function,
+                                       void* param) {
+  if (fiber_manager_state != FIBER_MANAGER_STATE_STARTED) {
+    errno = EINVAL;
+    return FIBER_ERROR;
+  }
+  fiber_external_t* const external = malloc(sizeof(*external));
+  if (!external) {
+    errno = ENOMEM;
+    return FIBER_ERROR;
+  }
+  external->fiber = the_fiber;
+  external->run_function = run_function;
+  external->param = param;
+  mpmc_stack_node_init(&external->node, external);
+  // whoever takes the first request takes everything pushed after it, so only
+  // the first push needs to wake a manager
+  mpmc_stack_node_t* head = atomic_load_explicit(&fiber_manager_external.head,
+                                                 memory_order_relaxed);
+  do {
+    external->node.next = head;
+  } while (!atomic_compare_exchange_weak_explicit(
+      &fiber_manager_external.head, &head, &external->node,
+      memory_order_release, memory_order_relaxed));
+  if (!head) {
+    fiber_manager_wake_if_idle();
+  }
+  return FIBER_SUCCESS;
+}
+
+int fiber_spawn_external(fiber_run_function_t run_function, void* param) {
+  assert(run_function);
+  fiber_manager_t* const manager = fiber_manager_get();
+  if (!manager) {
+    return fiber_manager_push_external(NULL, run_function, param);
+  }
+  fiber_t* const the_fiber =
+      fiber_create_no_sched(FIBER_DEFAULT_STACK_SIZE, run_function, param);
+  if (!the_fiber) {
+    return FIBER_ERROR;
+  }
+  fiber_detach(the_fiber);
+  fiber_manager_schedule(manager, the_fiber);
+  return FIBER_SUCCESS;
+}
+
+int fiber_wake_external(fiber_t* the_fiber) {
+  assert(the_fiber);
+  fiber_manager_t* const manager = fiber_manager_get();
+  if (!manager) {
+    return fiber_manager_push_external(the_fiber, NULL, NULL);
+  }
+  if (the_fiber->state == FIBER_STATE_WAITING) {
+    the_fiber->state = FIBER_STATE_READY;
+  }
+  fiber_manager_schedule(manager, the_fiber);
+  return FIBER_SUCCESS;
 }
 
 int fiber_manager_get_state() { return fiber_manager_state; }
@@ -309,18 +1146,82 @@ int fiber_manager_get_kernel_thread_count() {
   return fiber_manager_num_threads;
 }
 
+const fiber_scheduler_ops_t* fiber_manager_get_scheduler() {
+  return fiber_managers ? fiber_managers[0]->scheduler->ops : NULL;
+}
+
+int fiber_manager_get_max_kernel_thread_count() {
+  return fiber_manager_max_threads;
+}
+
+int fiber_manager_set_sysmon_interval(uint64_t interval_ns) {
+  if (fiber_manager_get_state() != FIBER_MANAGER_STATE_NONE) {
+    errno = EINVAL;
+    return FIBER_ERROR;
+  }
+  fiber_manager_sysmon_interval_ns = interval_ns;
+  return FIBER_SUCCESS;
+}
+
+int fiber_manager_set_time_slice(uint64_t slice_ns) {
+  if (fiber_manager_get_state() != FIBER_MANAGER_STATE_NONE) {
+    errno = EINVAL;
+    return FIBER_ERROR;
+  }
+  fiber_manager_slice_ns = slice_ns;
+  return FIBER_SUCCESS;
+}
+
+uint64_t fiber_manager_get_time_slice() { return fiber_manager_slice_ns; }
+
+int fiber_manager_set_preemption(int enabled) {
+#if defined(__linux__)
+  if (fiber_manager_get_state() != FIBER_MANAGER_STATE_NONE) {
+    errno = EINVAL;
+    return FIBER_ERROR;
+  }
+  fiber_manager_preemption = enabled;
+  return FIBER_SUCCESS;
+#else
+  errno = ENOSYS;
+  return FIBER_ERROR;
+#endif
+}
+
 extern int fiber_mutex_unlock_internal(fiber_mutex_t* mutex);
 
+// a busy manager never runs out of work to go and poll for events, or to pick
+// up work from other threads. with an event set per thread nobody else polls
+// its set, so check now and then. returns the number of fibers woken, or 0 if
+// it isn't time to check yet.
+static int fiber_manager_busy_poll(fiber_manager_t* manager) {
+  if (manager->yield_count - manager->busy_poll_yield_count <
+      FIBER_MANAGER_BUSY_POLL_INTERVAL) {
+    return 0;
+  }
+  manager->busy_poll_yield_count = manager->yield_count;
+  const int count = fiber_manager_take_external(manager);
+  if (!fiber_manager_checks_events()) {
+    return count;
+  }
+  manager->polling_in_yield = 1;
+  const int woken = fiber_poll_events();
+  manager->polling_in_yield = 0;
+  return count + woken;
+}
+
 void fiber_manager_do_maintenance() {
   fiber_manager_t* const manager = fiber_manager_get();
 
   fiber_t* const old_fiber = manager->old_fiber;
   if (old_fiber->state == FIBER_STATE_SAVING_STATE_TO_WAIT) {
+    // if the fiber was woken while it was saving its state, whoever skipped
+    // it still has it queued, and won't park (see fiber_manager_park)
     old_fiber->state = FIBER_STATE_WAITING;
   }
 
   if (manager->done_fiber) {
-    fiber_destroy(manager->done_fiber);
+    fiber_manager_return_fiber(manager, manager->done_fiber);
     manager->done_fiber = NULL;
   }
 
@@ -348,9 +1249,9 @@ void fiber_manager_do_maintenance() {
   }
 
   if (manager->spinlock_to_unlock) {
-    fiber_spinlock_t* const to_unlock = manager->spinlock_to_unlock;
+    fiber_qspinlock_t* const to_unlock = manager->spinlock_to_unlock;
     manager->spinlock_to_unlock = NULL;
-    fiber_spinlock_unlock(to_unlock);
+    fiber_qspinlock_unlock(to_unlock);
   }
 
   if (manager->set_wait_location) {
@@ -358,6 +1259,8 @@ void fiber_manager_do_maintenance() {
     manager->set_wait_location = NULL;
     manager->set_wait_value = NULL;
   }
+
+  fiber_manager_busy_poll(manager);
 }
 
 void fiber_manager_wait_in_mpmc_queue(fiber_manager_t* manager,
@@ -377,22 +1280,35 @@ int fiber_manager_wake_from_mpmc_queue(fiber_manager_t* manager,
                                        mpmc_fifo_t* fifo, int count) {
   // wake at least 'count' fibers; if count == 0, simply attempt to wake a fiber
   void* out = NULL;
+  int take_count = 0;
   int wake_count = 0;
   hazard_pointer_thread_record_t* hptr =
       fiber_manager_get_hazard_record(manager);
   do {
     if ((out = mpmc_fifo_trypop(hptr, fifo))) {
-      count -= 1;
-      fiber_t* const to_schedule = (fiber_t*)out;
-      assert(to_schedule->state == FIBER_STATE_WAITING);
-      to_schedule->state = FIBER_STATE_READY;
-      fiber_manager_schedule(manager, to_schedule);
+      take_count += 1;
+      fiber_wait_t* const wait = fiber_wait_untag(out);
+      if (wait) {
+        const int woken = fiber_manager_wake_wait(manager, wait);
+        fiber_wait_release(wait);
+        if (!woken) {
+          if (!count) {
+            return -1;
+          }
+          continue;
+        }
+      } else {
+        fiber_t* const to_schedule = (fiber_t*)out;
+        assert(to_schedule->state == FIBER_STATE_WAITING);
+        to_schedule->state = FIBER_STATE_READY;
+        fiber_manager_schedule_next(manager, to_schedule);
+      }
       wake_count += 1;
     } else if (count > 0) {
       cpu_relax();  // back off if we failed to pop something
       manager->wake_mpmc_spin_count += 1;
     }
-  } while (wake_count < count);
+  } while (take_count < count);
   return wake_count;
 }
 
@@ -423,25 +1339,133 @@ int fiber_manager_wake_from_mpsc_queue(fiber_manager_t* manager,
   // wake at least 'count' fibers; if count == 0, simply attempt to wake a fiber
   mpsc_fifo_node_t* out = NULL;
   int wake_count = 0;
+  int take_count = 0;
   do {
     if ((out = mpsc_fifo_trypop(fifo))) {
-      fiber_t* const to_schedule = (fiber_t*)out->data;
-      assert(!to_schedule->mpsc_fifo_node);
-      to_schedule->mpsc_fifo_node = out;
-      if (to_schedule->state == FIBER_STATE_WAITING) {
-        to_schedule->state = FIBER_STATE_READY;
+      take_count += 1;
+      fiber_wait_t* const wait = fiber_wait_untag(out->data);
+      if (wait) {
+        // the waiter kept its own node; the popped one goes back to the wait
+        assert(!wait->node);
+        wait->node = out;
+        const int woken = fiber_manager_wake_wait(manager, wait);
+        fiber_wait_release(wait);
+        if (!woken) {
+          if (!count) {
+            return -1;
+          }
+          continue;
+        }
+      } else {
+        fiber_t* const to_schedule = (fiber_t*)out->data;
+        assert(!to_schedule->mpsc_fifo_node);
+        to_schedule->mpsc_fifo_node = out;
+        if (to_schedule->state == FIBER_STATE_WAITING) {
+          to_schedule->state = FIBER_STATE_READY;
+        }
+        fiber_manager_schedule_next(manager, to_schedule);
       }
-      fiber_manager_schedule(manager, to_schedule);
       wake_count += 1;
     } else if (count > 0) {
       manager->wake_mpsc_spin_count += 1;
       fiber_manager_yield(manager);
       manager = fiber_manager_get();
     }
-  } while (wake_count < count);
+  } while (take_count < count);
   return wake_count;
 }
 
+int fiber_manager_wake_wait(fiber_manager_t* manager, fiber_wait_t* wait) {
+  assert(manager);
+  assert(wait);
+  if (!fiber_wait_claim(wait, FIBER_WAIT_WOKEN)) {
+    return 0;
+  }
+  fiber_t* const to_schedule = wait->fiber;
+  if (to_schedule->state == FIBER_STATE_WAITING) {
+    to_schedule->state = FIBER_STATE_READY;
+  }
+  fiber_manager_schedule_next(manager, to_schedule);
+  return 1;
+}
+
+fiber_wait_t* fiber_manager_get_wait(fiber_manager_t* manager,
+                                     uint64_t deadline_ns) {
+  assert(manager);
+  if (deadline_ns != UINT64_MAX && fiber_time_now_ns() >= deadline_ns) {
+    errno = ETIMEDOUT;
+    return NULL;
+  }
+  fiber_t* const this_fiber = manager->current_fiber;
+  fiber_wait_t* wait = this_fiber->wait;
+  if (wait &&
+      atomic_load_explicit(&wait->refs, memory_order_acquire) != 1) {
+    // it timed out and is still queued; whoever takes it frees it
+    fiber_wait_release(wait);
+    wait = NULL;
+  }
+  if (!wait) {
+    wait = (fiber_wait_t*)malloc(sizeof(*wait));
+    mpsc_fifo_node_t* const node = calloc(1, sizeof(*node));
+    this_fiber->wait = wait && node ? wait : NULL;
+    if (!this_fiber->wait) {
+      free(node);
+      free(wait);
+      errno = ENOMEM;
+      return NULL;
+    }
+    wait->node = node;
+    atomic_init(&wait->refs, 1);
+  }
+  wait->fiber = this_fiber;
+  atomic_store_explicit(&wait->state, FIBER_WAIT_PENDING,
+                        memory_order_relaxed);
+  return wait;
+}
+
+int fiber_manager_wait_in_mpmc_queue_until(fiber_manager_t* manager,
+                                           mpmc_fifo_t* fifo,
+                                           fiber_wait_t* wait,
+                                           uint64_t deadline_ns) {
+  assert(manager);
+  assert(fifo);
+  assert(wait && wait->fiber == manager->current_fiber);
+  // the queue's reference is published by the push
+  atomic_store_explicit(&wait->refs, 2, memory_order_relaxed);
+  mpmc_fifo_node_t* const node = fiber_manager_get_mpmc_node();
+  node->value = fiber_wait_tag(wait);
+  wait->fiber->state = FIBER_STATE_SAVING_STATE_TO_WAIT;
+  mpmc_fifo_push(fiber_manager_get_hazard_record(manager), fifo, node);
+  return fiber_event_wait_until(wait, deadline_ns);
+}
+
+int fiber_manager_wait_in_mpsc_queue_until(fiber_manager_t* manager,
+                                           mpsc_fifo_t* fifo,
+                                           fiber_wait_t* wait,
+                                           uint64_t deadline_ns) {
+  assert(manager);
+  assert(fifo);
+  assert(wait && wait->fiber == manager->current_fiber);
+  assert(wait->node);
+  // the wait pushes its own node, so the fiber keeps its node to be scheduled
+  // with if it times out
+  atomic_store_explicit(&wait->refs, 2, memory_order_relaxed);
+  mpsc_fifo_node_t* const node = wait->node;
+  wait->node = NULL;
+  node->data = fiber_wait_tag(wait);
+  wait->fiber->state = FIBER_STATE_SAVING_STATE_TO_WAIT;
+  mpsc_fifo_push(fifo, node);
+  return fiber_event_wait_until(wait, deadline_ns);
+}
+
+int fiber_manager_wait_in_mpsc_queue_until_and_unlock(
+    fiber_manager_t* manager, mpsc_fifo_t* fifo, fiber_wait_t* wait,
+    uint64_t deadline_ns, fiber_mutex_t* mutex) {
+  manager->mutex_to_unlock = mutex;
+  return fiber_manager_wait_in_mpsc_queue_until(manager, fifo, wait,
+                                                deadline_ns);
+}
+
 void fiber_manager_set_and_wait(fiber_manager_t* manager, void** location,
                                 void* value) {
   assert(manager);
@@ -534,6 +1558,119 @@ mpmc_fifo_node_t* fiber_manager_get_mpmc_node() {
   return ret;
 }
 
+// returns the cache size class for stack_size, or -1 if it's not cacheable
+static int fiber_cache_class(size_t stack_size) {
+  int shift = FIBER_CACHE_MIN_SHIFT;
+  while (((size_t)1 << shift) < stack_size) {
+    if (++shift > FIBER_CACHE_MAX_SHIFT) {
+      return -1;
+    }
+  }
+  return shift - FIBER_CACHE_MIN_SHIFT;
+}
+
+size_t fiber_manager_round_stack_size(size_t stack_size) {
+  const int size_class = fiber_cache_class(stack_size);
+  if (!stack_size || size_class < 0 || !fiber_cache_high_watermark) {
+    return stack_size;
+  }
+  return (size_t)1 << (size_class + FIBER_CACHE_MIN_SHIFT);
+}
+
+static lockfree_ring_buffer_t* fiber_cache_get_overflow(int size_class) {
+  lockfree_ring_buffer_t* overflow = atomic_load_explicit(
+      &fiber_cache_overflow[size_class], memory_order_acquire);
+  if (!overflow) {
+    lockfree_ring_buffer_t* new_overflow = lockfree_ring_buffer_create(10);
+    if (!new_overflow) {
+      return NULL;
+    }
+    if (!atomic_compare_exchange_strong(&fiber_cache_overflow[size_class],
+                                        &overflow, new_overflow)) {
+      lockfree_ring_buffer_destroy(new_overflow);
+    } else {
+      overflow = new_overflow;
+    }
+  }
+  return overflow;
+}
+
+fiber_t* fiber_manager_get_cached_fiber(fiber_manager_t* manager,
+                                        size_t stack_size) {
+  assert(manager);
+  const int size_class = fiber_cache_class(stack_size);
+  if (size_class < 0 || !fiber_cache_high_watermark) {
+    return NULL;
+  }
+
+  fiber_cache_bucket_t* const bucket = &manager->fiber_cache[size_class];
+  fiber_t* ret = bucket->head;
+  if (ret) {
+    bucket->head = (fiber_t*)ret->scratch;
+    bucket->count -= 1;
+  } else {
+    lockfree_ring_buffer_t* const overflow = atomic_load_explicit(
+        &fiber_cache_overflow[size_class], memory_order_acquire);
+    if (overflow) {
+      ret = lockfree_ring_buffer_trypop(overflow);
+    }
+  }
+
+  if (ret) {
+    assert(ret->state == FIBER_STATE_DONE);
+    assert(ret->stack_size == stack_size);
+    ret->scratch = NULL;
+    manager->fiber_cache_hit_count += 1;
+  } else {
+    manager->fiber_cache_miss_count += 1;
+  }
+  return ret;
+}
+
+void fiber_manager_return_fiber(fiber_manager_t* manager, fiber_t* f) {
+  assert(manager);
+  assert(f);
+  assert(f->state == FIBER_STATE_DONE);
+  const size_t high = fiber_cache_high_watermark;
+  const int size_class = fiber_cache_class(f->stack_size);
+  if (size_class < 0 || !high || !f->mpsc_fifo_node ||
+      fiber_manager_round_stack_size(f->stack_size) != f->stack_size) {
+    fiber_destroy(f);
+    return;
+  }
+
+  fiber_cache_bucket_t* const bucket = &manager->fiber_cache[size_class];
+  f->scratch = bucket->head;
+  bucket->head = f;
+  bucket->count += 1;
+  if (bucket->count <= high) {
+    return;
+  }
+
+  // trim back to the low watermark, handing the excess to other threads
+  const size_t low = fiber_cache_low_watermark;
+  lockfree_ring_buffer_t* const overflow = fiber_cache_get_overflow(size_class);
+  while (bucket->count > low) {
+    fiber_t* const to_move = bucket->head;
+    bucket->head = (fiber_t*)to_move->scratch;
+    bucket->count -= 1;
+    to_move->scratch = NULL;
+    if (!overflow || !lockfree_ring_buffer_trypush(overflow, to_move)) {
+      fiber_destroy(to_move);
+    }
+  }
+}
+
+int fiber_manager_set_fiber_cache_watermarks(size_t low, size_t high) {
+  if (low > high) {
+    errno = EINVAL;
+    return FIBER_ERROR;
+  }
+  fiber_cache_low_watermark = low;
+  fiber_cache_high_watermark = high;
+  return FIBER_SUCCESS;
+}
+
 void fiber_manager_stats(fiber_manager_t* manager, fiber_manager_stats_t* out) {
   assert(manager);
   assert(out);
@@ -548,14 +1685,29 @@ void fiber_manager_stats(fiber_manager_t* manager, fiber_manager_stats_t* out) {
   out->poll_count += manager->poll_count;
   out->event_wait_count += manager->event_wait_count;
   out->lock_contention_count += manager->lock_contention_count;
+  out->fiber_cache_hit_count += manager->fiber_cache_hit_count;
+  out->fiber_cache_miss_count += manager->fiber_cache_miss_count;
+  out->park_count += manager->park_count;
+  out->run_next_count += manager->run_next_count;
+  out->event_migrate_count += manager->event_migrate_count;
+  out->event_ctl_count += manager->event_ctl_count;
+  out->uring_op_count += manager->uring_op_count;
+  out->uring_enter_count += manager->uring_enter_count;
+  out->blocking_count += manager->blocking_count;
+  out->sysmon_handoff_count += manager->sysmon_handoff_count;
+  out->slice_yield_count += manager->slice_yield_count;
+  out->preempt_count += manager->preempt_count;
+  out->external_count += manager->external_count;
+  out->spinlock_park_count += manager->spinlock_park_count;
 }
 
 void fiber_manager_all_stats(fiber_manager_stats_t* out) {
   memset(out, 0, sizeof(*out));
   if (fiber_managers) {
     int i;
-    for (i = 0; i < fiber_manager_num_threads; ++i) {
+    for (i = 0; i < fiber_manager_max_threads; ++i) {
       fiber_manager_stats(fiber_managers[i], out);
     }
   }
+  out->sysmon_check_count = fiber_manager_sysmon_check_count;
 }
@@ -3,11 +3,29 @@
 
 #include "fiber_mutex.h"
 
+#include <errno.h>
+#include <unistd.h>
+
 #include "fiber_manager.h"
 
+// the number of cpus, or 0 until it's looked up. spinning is pointless with
+// only one, as the holder can't run until the spinner stops.
+static int fiber_mutex_num_cpus = 0;
+
 int fiber_mutex_init(fiber_mutex_t* mutex) {
+  return fiber_mutex_init_with_mode(mutex, FIBER_MUTEX_FAIR);
+}
+
+int fiber_mutex_init_with_mode(fiber_mutex_t* mutex, int mode) {
   assert(mutex);
-  mutex->counter = 1;
+  if (mode != FIBER_MUTEX_FAIR && mode != FIBER_MUTEX_THROUGHPUT) {
+    errno = EINVAL;
+    return FIBER_ERROR;
+  }
+  mutex->mode = mode;
+  mutex->counter = mode == FIBER_MUTEX_FAIR ? 1 : 0;
+  mutex->spin_estimate = 0;
+  mutex->owner = NULL;
   if (!mpsc_fifo_init(&mutex->waiters)) {
     return FIBER_ERROR;
   }
@@ -16,61 +34,279 @@ int fiber_mutex_init(fiber_mutex_t* mutex) {
 
 int fiber_mutex_destroy(fiber_mutex_t* mutex) {
   assert(mutex);
-  mutex->counter = 1;
+  mutex->counter = mutex->mode == FIBER_MUTEX_FAIR ? 1 : 0;
   mpsc_fifo_destroy(&mutex->waiters);
   return FIBER_SUCCESS;
 }
 
-int fiber_mutex_lock(fiber_mutex_t* mutex) {
-  assert(mutex);
+static inline int fiber_mutex_trylock_fair(fiber_mutex_t* mutex) {
+  int old = 1;
+  return atomic_compare_exchange_weak_explicit(&mutex->counter, &old, 0,
+                                               memory_order_acquire,
+                                               memory_order_relaxed);
+}
+
+static inline int fiber_mutex_trylock_throughput(fiber_mutex_t* mutex) {
+  int old = atomic_load_explicit(&mutex->counter, memory_order_relaxed);
+  return !(old & FIBER_MUTEX_LOCKED) &&
+         atomic_compare_exchange_weak_explicit(
+             &mutex->counter, &old, old | FIBER_MUTEX_LOCKED,
+             memory_order_acquire, memory_order_relaxed);
+}
+
+// spins while the lock is held by a fiber on another thread, which may release
+// it shortly. returns 1 if the lock was taken. spinning stops early on a fair
+// lock which has waiters, as they get the lock first.
+static int fiber_mutex_spin(fiber_mutex_t* mutex, fiber_manager_t* manager) {
+  fiber_manager_t* const owner = mutex->owner;
+  if (!owner || owner == manager) {
+    return 0;
+  }
+  if (!fiber_mutex_num_cpus) {
+    const long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    fiber_mutex_num_cpus = num_cpus > 0 ? num_cpus : 1;
+  }
+  if (fiber_mutex_num_cpus < 2) {
+    return 0;
+  }
+  const int fair = mutex->mode == FIBER_MUTEX_FAIR;
+  const int estimate = mutex->spin_estimate;
+  int limit = 2 * estimate + 10;
+  if (limit > FIBER_MUTEX_MAX_SPIN) {
+    limit = FIBER_MUTEX_MAX_SPIN;
+  }
+  int i;
+  for (i = 0; i < limit; ++i) {
+    cpu_relax();
+    const int counter =
+        atomic_load_explicit(&mutex->counter, memory_order_relaxed);
+    if (fair ? counter == 1 && fiber_mutex_trylock_fair(mutex)
+             : !(counter & FIBER_MUTEX_LOCKED) &&
+                   fiber_mutex_trylock_throughput(mutex)) {
+      mutex->spin_estimate = estimate + (i - estimate) / 8;
+      return 1;
+    }
+    if (fair && counter < 0) {
+      break;
+    }
+  }
+  mutex->spin_estimate = estimate + (limit - estimate) / 8;
+  return 0;
+}
+
+// the lock functions wait forever if deadline_ns is UINT64_MAX
+static int fiber_mutex_lock_fair(fiber_mutex_t* mutex,
+                                 fiber_manager_t* manager,
+                                 uint64_t deadline_ns) {
+  if (fiber_mutex_trylock_fair(mutex) || fiber_mutex_spin(mutex, manager)) {
+    return FIBER_SUCCESS;
+  }
+
+  fiber_wait_t* wait = NULL;
+  if (deadline_ns != UINT64_MAX &&
+      !(wait = fiber_manager_get_wait(manager, deadline_ns))) {
+    return FIBER_ERROR;
+  }
 
   const int val = atomic_fetch_sub(&mutex->counter, 1) - 1;
   if (val == 0) {
-    // we just got the lock, there was no contention
+    // released while we spun
     return FIBER_SUCCESS;
   }
 
-  // we failed to acquire the lock (there's contention). we'll wait.
-  fiber_manager_t* const manager = fiber_manager_get();
+  // we failed to acquire the lock (there's contention). we'll wait, and the
+  // unlocker hands us the lock.
   manager->lock_contention_count += 1;
+  if (wait) {
+    return fiber_manager_wait_in_mpsc_queue_until(manager, &mutex->waiters,
+                                                  wait, deadline_ns);
+  }
   fiber_manager_wait_in_mpsc_queue(manager, &mutex->waiters);
-
   return FIBER_SUCCESS;
 }
 
+// a woken waiter clears FIBER_MUTEX_WOKEN, set by its waker, once it has taken
+// the lock, gone back to waiting or given up
+static int fiber_mutex_wait_throughput(fiber_mutex_t* mutex,
+                                       fiber_manager_t* manager,
+                                       uint64_t deadline_ns, int woken) {
+  int old = atomic_load(&mutex->counter);
+  while (1) {
+    const int clear = woken ? FIBER_MUTEX_WOKEN : 0;
+    if (!(old & FIBER_MUTEX_LOCKED)) {
+      if (atomic_compare_exchange_weak(&mutex->counter, &old,
+                                       (old | FIBER_MUTEX_LOCKED) & ~clear)) {
+        return FIBER_SUCCESS;
+      }
+      continue;
+    }
+    fiber_wait_t* wait = NULL;
+    if (deadline_ns != UINT64_MAX &&
+        !(wait = fiber_manager_get_wait(manager, deadline_ns))) {
+      if (!clear ||
+          atomic_compare_exchange_weak(&mutex->counter, &old, old & ~clear)) {
+        return FIBER_ERROR;
+      }
+      continue;
+    }
+    if (atomic_compare_exchange_weak(&mutex->counter, &old,
+                                     (old + FIBER_MUTEX_WAITER) & ~clear)) {
+      manager->lock_contention_count += 1;
+      if (wait) {
+        if (!fiber_manager_wait_in_mpsc_queue_until(
+                manager, &mutex->waiters, wait, deadline_ns)) {
+          // the unlocker which finds the wait takes it off the count
+          return FIBER_ERROR;
+        }
+      } else {
+        fiber_manager_wait_in_mpsc_queue(manager, &mutex->waiters);
+      }
+      manager = fiber_manager_get();
+      woken = 1;
+      old = atomic_load(&mutex->counter);
+    }
+  }
+}
+
+static int fiber_mutex_lock_throughput(fiber_mutex_t* mutex,
+                                       fiber_manager_t* manager,
+                                       uint64_t deadline_ns) {
+  if (fiber_mutex_trylock_throughput(mutex) ||
+      fiber_mutex_spin(mutex, manager)) {
+    return FIBER_SUCCESS;
+  }
+  return fiber_mutex_wait_throughput(mutex, manager, deadline_ns, 0);
+}
+
+static int fiber_mutex_lock_until(fiber_mutex_t* mutex, uint64_t deadline_ns) {
+  assert(mutex);
+  fiber_manager_t* const manager = fiber_manager_get();
+  const int ret = mutex->mode == FIBER_MUTEX_FAIR
+                      ? fiber_mutex_lock_fair(mutex, manager, deadline_ns)
+                      : fiber_mutex_lock_throughput(mutex, manager,
+                                                    deadline_ns);
+  if (ret) {
+    // the lock may have been handed over while waiting on another thread
+    mutex->owner = fiber_manager_get();
+  }
+  return ret;
+}
+
+int fiber_mutex_lock(fiber_mutex_t* mutex) {
+  return fiber_mutex_lock_until(mutex, UINT64_MAX);
+}
+
+int fiber_mutex_timedlock(fiber_mutex_t* mutex, uint64_t deadline_ns) {
+  return fiber_mutex_lock_until(mutex, deadline_ns);
+}
+
 int fiber_mutex_trylock(fiber_mutex_t* mutex) {
   assert(mutex);
-  int old = 1;
-  if (atomic_compare_exchange_weak_explicit(&mutex->counter, &old, 0,
-                                            memory_order_acquire,
-                                            memory_order_relaxed)) {
+  if (mutex->mode == FIBER_MUTEX_FAIR ? fiber_mutex_trylock_fair(mutex)
+                                      : fiber_mutex_trylock_throughput(mutex)) {
     // we just got the lock, there was no contention
+    mutex->owner = fiber_manager_get();
     return FIBER_SUCCESS;
   }
   return FIBER_ERROR;
 }
 
+// given the counter's value old, wakes a waiter to retry unless one is already
+// on its way or the lock is held
+static int fiber_mutex_wake_throughput(fiber_mutex_t* mutex, int old) {
+  while (old >= FIBER_MUTEX_WAITER &&
+         !(old & (FIBER_MUTEX_LOCKED | FIBER_MUTEX_WOKEN))) {
+    if (atomic_compare_exchange_weak(
+            &mutex->counter, &old,
+            (old - FIBER_MUTEX_WAITER) | FIBER_MUTEX_WOKEN)) {
+      if (fiber_manager_wake_from_mpsc_queue(fiber_manager_get(),
+                                             &mutex->waiters, 1)) {
+        return 1;
+      }
+      // the waiter had timed out, so nobody is on their way after all
+      old = atomic_fetch_and(&mutex->counter, ~FIBER_MUTEX_WOKEN) &
+            ~FIBER_MUTEX_WOKEN;
+    }
+  }
+  return 0;
+}
+
+static int fiber_mutex_unlock_throughput(fiber_mutex_t* mutex) {
+  return fiber_mutex_wake_throughput(
+      mutex, atomic_fetch_sub(&mutex->counter, FIBER_MUTEX_LOCKED) -
+                 FIBER_MUTEX_LOCKED);
+}
+
+// hands the lock to the longest waiting fiber. a waiter which had timed out
+// can't take the lock, so it's released again on its behalf.
+static int fiber_mutex_hand_over_fair(fiber_mutex_t* mutex) {
+  do {
+    if (fiber_manager_wake_from_mpsc_queue(fiber_manager_get(),
+                                           &mutex->waiters, 1)) {
+      return 1;
+    }
+  } while (atomic_fetch_add(&mutex->counter, 1) + 1 != 1);
+  return 0;
+}
+
 int fiber_mutex_unlock_internal(fiber_mutex_t* mutex) {
   assert(mutex);
 
+  mutex->owner = NULL;
+  if (mutex->mode == FIBER_MUTEX_THROUGHPUT) {
+    return fiber_mutex_unlock_throughput(mutex);
+  }
+
   // assumption: the atomic operation below provides read/write ordering (ie.
   // read and writes performed before unlocking actually occur before unlocking)
 
   // unlock and wake a waiting fiber if there is one
-  const int new_val = atomic_fetch_add(&mutex->counter, 1) + 1;
-  if (new_val != 1) {
-    fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &mutex->waiters, 1);
-    return 1;
+  if (atomic_fetch_add(&mutex->counter, 1) + 1 == 1) {
+    return 0;
   }
+  return fiber_mutex_hand_over_fair(mutex);
+}
 
-  return 0;
+void fiber_mutex_requeue(fiber_mutex_t* mutex, mpsc_fifo_node_t* first,
+                         mpsc_fifo_node_t* last, int count) {
+  assert(mutex);
+  assert(count > 0);
+  if (mutex->mode == FIBER_MUTEX_THROUGHPUT) {
+    const int old = atomic_fetch_add(&mutex->counter,
+                                     count * FIBER_MUTEX_WAITER) +
+                    count * FIBER_MUTEX_WAITER;
+    mpsc_fifo_push_chain(&mutex->waiters, first, last);
+    fiber_mutex_wake_throughput(mutex, old);
+    return;
+  }
+
+  // counted as if each had failed to take the lock. if it was free, the first
+  // in line gets it.
+  const int old = atomic_fetch_sub(&mutex->counter, count);
+  mpsc_fifo_push_chain(&mutex->waiters, first, last);
+  if (old == 1) {
+    fiber_mutex_hand_over_fair(mutex);
+  }
+}
+
+int fiber_mutex_lock_requeued(fiber_mutex_t* mutex) {
+  assert(mutex);
+  if (mutex->mode == FIBER_MUTEX_THROUGHPUT) {
+    // woken to retry, like any other waiter
+    fiber_mutex_wait_throughput(mutex, fiber_manager_get(), UINT64_MAX, 1);
+  }
+  // a fair lock is handed over along with the wake up
+  mutex->owner = fiber_manager_get();
+  return FIBER_SUCCESS;
 }
 
 int fiber_mutex_unlock(fiber_mutex_t* mutex) {
+  const int fair = mutex->mode == FIBER_MUTEX_FAIR;
   const int contended = fiber_mutex_unlock_internal(mutex);
-  if (contended) {
-    // the lock was contended - be nice and let the waiter run
-    fiber_yield();
+  if (contended && fair) {
+    // the lock was contended - be nice and hand off to the waiter we woke
+    fiber_manager_t* const manager = fiber_manager_get();
+    fiber_manager_yield_to(manager, fiber_manager_peek_run_next(manager));
   }
 
   return FIBER_SUCCESS;
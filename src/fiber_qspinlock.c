@@ -0,0 +1,233 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_qspinlock.h"
+
+#include "fiber.h"
+#include "fiber_manager.h"
+
+#define FIBER_QSPINLOCK_NODE_WAITING (0)
+#define FIBER_QSPINLOCK_NODE_HEAD (1)
+#define FIBER_QSPINLOCK_NODE_PARKED (2)
+
+// a waiter's place in the queue, on its stack. each node has a cache line to
+// itself, so a waiter spinning on it doesn't disturb the others.
+struct fiber_qspinlock_node {
+  _Atomic(fiber_qspinlock_node_t*) next;
+  _Atomic int state;     // FIBER_QSPINLOCK_NODE_*
+  _Atomic(void*) fiber;  // the waiter's fiber, once it waits
+  _Atomic int waited;    // set once the waiter has waited as a fiber
+} __attribute__((__aligned__(FIBER_CACHELINE_SIZE)));
+
+static volatile uint32_t fiber_qspinlock_spin_budget =
+    FIBER_QSPINLOCK_DEFAULT_SPIN_BUDGET;
+
+void fiber_qspinlock_set_spin_budget(uint32_t budget) {
+  fiber_qspinlock_spin_budget = budget;
+}
+
+uint32_t fiber_qspinlock_get_spin_budget() {
+  return fiber_qspinlock_spin_budget;
+}
+
+int fiber_qspinlock_init(fiber_qspinlock_t* spinlock) {
+  assert(spinlock);
+  atomic_store(&spinlock->state, 0);
+  atomic_store(&spinlock->parked, NULL);
+  return FIBER_SUCCESS;
+}
+
+int fiber_qspinlock_destroy(fiber_qspinlock_t* spinlock) {
+  assert(spinlock);
+  assert(!(atomic_load(&spinlock->state) & ~FIBER_QSPINLOCK_BITS));
+  return FIBER_SUCCESS;
+}
+
+// a waiter may only wait as a fiber where the scheduler can switch away from
+// it, which rules out the maintenance fiber, polling done by a yield, and a
+// fiber already on its way to wait for something else
+static inline int fiber_qspinlock_can_wait(fiber_manager_t* manager) {
+  return manager && !manager->polling_in_yield &&
+         manager->current_fiber != manager->maintenance_fiber &&
+         manager->current_fiber->state == FIBER_STATE_RUNNING;
+}
+
+// waits for *location to be set by a waiter which is still switching away,
+// and wakes it
+static void fiber_qspinlock_wake(_Atomic(void*)* location) {
+  fiber_t* to_wake;
+  while (!(to_wake = atomic_exchange(location, NULL))) {
+    cpu_relax();
+  }
+  fiber_wake_external(to_wake);
+}
+
+// switches away until woken, publishing the fiber at location once it's safe
+// to wake
+static void fiber_qspinlock_wait(fiber_manager_t* manager,
+                                 _Atomic(void*)* location) {
+  manager->spinlock_park_count += 1;
+  fiber_manager_set_and_wait(manager, (void**)location,
+                             manager->current_fiber);
+}
+
+// counted once a wait is over, rather than looking up the manager every spin
+static inline void fiber_qspinlock_count_spins(uint32_t spins) {
+  fiber_manager_t* const manager = spins ? fiber_manager_get() : NULL;
+  if (manager) {
+    manager->spin_count += spins;
+  }
+}
+
+// spins (then waits) until node is the head of the queue
+static void fiber_qspinlock_wait_for_head(fiber_manager_t* manager,
+                                          fiber_qspinlock_node_t* node,
+                                          uint32_t budget) {
+  uint32_t spins = 0;
+  while (atomic_load_explicit(&node->state, memory_order_acquire) ==
+         FIBER_QSPINLOCK_NODE_WAITING) {
+    int expected = FIBER_QSPINLOCK_NODE_WAITING;
+    if (spins >= budget &&
+        atomic_compare_exchange_strong(&node->state, &expected,
+                                       FIBER_QSPINLOCK_NODE_PARKED)) {
+      atomic_store_explicit(&node->waited, 1, memory_order_relaxed);
+      fiber_qspinlock_wait(manager, &node->fiber);
+      break;
+    }
+    cpu_relax();
+    spins += 1;
+  }
+  fiber_qspinlock_count_spins(spins);
+}
+
+// spins (then waits, given a manager and node) until the lock is free, and
+// takes it
+static void fiber_qspinlock_take(fiber_manager_t* manager,
+                                 fiber_qspinlock_t* spinlock,
+                                 fiber_qspinlock_node_t* node,
+                                 uint32_t budget) {
+  uint32_t spins = 0;
+  while (1) {
+    uintptr_t state = atomic_load_explicit(&spinlock->state,
+                                           memory_order_relaxed);
+    if (!(state & FIBER_QSPINLOCK_LOCKED)) {
+      if (atomic_compare_exchange_weak_explicit(
+              &spinlock->state, &state, state | FIBER_QSPINLOCK_LOCKED,
+              memory_order_acquire, memory_order_relaxed)) {
+        break;
+      }
+      // taken by a trylock, or a waiter queued
+      continue;
+    }
+    if (manager && spins >= budget &&
+        atomic_compare_exchange_weak(&spinlock->state, &state,
+                                     state | FIBER_QSPINLOCK_PARKED)) {
+      // the unlocker clears the lock and wakes us to retry
+      atomic_store_explicit(&node->waited, 1, memory_order_relaxed);
+      fiber_qspinlock_wait(manager, &spinlock->parked);
+      manager = fiber_manager_get();
+      spins = 0;
+      continue;
+    }
+    cpu_relax();
+    spins += 1;
+  }
+  fiber_qspinlock_count_spins(spins);
+}
+
+int fiber_qspinlock_lock(fiber_qspinlock_t* spinlock) {
+  assert(spinlock);
+
+  uintptr_t state = 0;
+  if (atomic_compare_exchange_strong_explicit(
+          &spinlock->state, &state, FIBER_QSPINLOCK_LOCKED,
+          memory_order_acquire, memory_order_relaxed)) {
+    return FIBER_SUCCESS;
+  }
+
+  fiber_manager_t* manager = fiber_manager_get();
+  if (!fiber_qspinlock_can_wait(manager)) {
+    // the head of the queue may have been woken onto this very thread, and
+    // can't run until we're done, so don't queue behind it
+    fiber_qspinlock_take(NULL, spinlock, NULL, 0);
+    return FIBER_SUCCESS;
+  }
+
+  uint32_t budget = fiber_qspinlock_spin_budget;
+  fiber_qspinlock_node_t node;
+  atomic_store_explicit(&node.next, NULL, memory_order_relaxed);
+  atomic_store_explicit(&node.state, FIBER_QSPINLOCK_NODE_WAITING,
+                        memory_order_relaxed);
+  atomic_store_explicit(&node.fiber, NULL, memory_order_relaxed);
+  atomic_store_explicit(&node.waited, 0, memory_order_relaxed);
+
+  // become the tail, keeping the lock bits
+  while (!atomic_compare_exchange_weak(
+      &spinlock->state, &state,
+      (uintptr_t)&node | (state & FIBER_QSPINLOCK_BITS))) {
+  }
+  fiber_qspinlock_node_t* const prev =
+      (fiber_qspinlock_node_t*)(state & ~(uintptr_t)FIBER_QSPINLOCK_BITS);
+  if (prev) {
+    // a waiter which has waited as a fiber has to be woken and switched to
+    // before it can pass the lock on, which is far longer than we'd spin. (its
+    // node stays put until we're linked in behind it.)
+    if (atomic_load_explicit(&prev->waited, memory_order_relaxed)) {
+      budget = 0;
+    }
+    atomic_store_explicit(&prev->next, &node, memory_order_release);
+    fiber_qspinlock_wait_for_head(manager, &node, budget);
+    manager = fiber_manager_get();
+  }
+
+  fiber_qspinlock_take(manager, spinlock, &node, budget);
+
+  // leave the queue, so the node can go once we return. the next waiter (if
+  // any) becomes the head.
+  fiber_qspinlock_node_t* next =
+      atomic_load_explicit(&node.next, memory_order_acquire);
+  if (!next) {
+    state = atomic_load(&spinlock->state);
+    while ((state & ~(uintptr_t)FIBER_QSPINLOCK_BITS) == (uintptr_t)&node) {
+      if (atomic_compare_exchange_weak(&spinlock->state, &state,
+                                       state & FIBER_QSPINLOCK_BITS)) {
+        return FIBER_SUCCESS;
+      }
+    }
+    // a waiter is linking itself in behind us
+    while (!(next = atomic_load_explicit(&node.next, memory_order_acquire))) {
+      cpu_relax();
+    }
+  }
+  if (atomic_exchange(&next->state, FIBER_QSPINLOCK_NODE_HEAD) ==
+      FIBER_QSPINLOCK_NODE_PARKED) {
+    fiber_qspinlock_wake(&next->fiber);
+  }
+  return FIBER_SUCCESS;
+}
+
+int fiber_qspinlock_trylock(fiber_qspinlock_t* spinlock) {
+  assert(spinlock);
+  uintptr_t state = atomic_load_explicit(&spinlock->state,
+                                         memory_order_relaxed);
+  while (!(state & FIBER_QSPINLOCK_LOCKED)) {
+    if (atomic_compare_exchange_weak_explicit(
+            &spinlock->state, &state, state | FIBER_QSPINLOCK_LOCKED,
+            memory_order_acquire, memory_order_relaxed)) {
+      return FIBER_SUCCESS;
+    }
+  }
+  return FIBER_ERROR;
+}
+
+int fiber_qspinlock_unlock(fiber_qspinlock_t* spinlock) {
+  assert(spinlock);
+  const uintptr_t old = atomic_fetch_and_explicit(
+      &spinlock->state, ~(uintptr_t)FIBER_QSPINLOCK_BITS,
+      memory_order_release);
+  assert(old & FIBER_QSPINLOCK_LOCKED);
+  if (old & FIBER_QSPINLOCK_PARKED) {
+    fiber_qspinlock_wake(&spinlock->parked);
+  }
+  return FIBER_SUCCESS;
+}
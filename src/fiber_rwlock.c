@@ -3,6 +3,11 @@
 
 #include "fiber_rwlock.h"
 
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fiber_event.h"
 #include "fiber_manager.h"
 
 #ifdef __GNUC__
@@ -20,14 +25,42 @@ STATIC_ASSERT(sizeof(fiber_rwlock_state_t) == sizeof(uint64_t),
               state_is_not_sized_properly);
 
 int fiber_rwlock_init(fiber_rwlock_t* rwlock) {
+  return fiber_rwlock_init_with_mode(rwlock, FIBER_RWLOCK_DEFAULT);
+}
+
+int fiber_rwlock_init_with_mode(fiber_rwlock_t* rwlock, int mode) {
   assert(rwlock);
+  const int max_threads = fiber_manager_get_max_kernel_thread_count();
+  if ((mode != FIBER_RWLOCK_DEFAULT && mode != FIBER_RWLOCK_READ_BIASED) ||
+      (mode == FIBER_RWLOCK_READ_BIASED && max_threads <= 0)) {
+    errno = EINVAL;
+    return FIBER_ERROR;
+  }
+  // one count per manager, and one shared by every other thread
+  const int num_indicators =
+      mode == FIBER_RWLOCK_READ_BIASED ? max_threads + 1 : 0;
+  rwlock->indicators = NULL;
+  rwlock->num_indicators = num_indicators;
+  rwlock->inhibit_until_ns = 0;
+  if (num_indicators) {
+    const size_t size = num_indicators * sizeof(*rwlock->indicators);
+    if (posix_memalign((void**)&rwlock->indicators, FIBER_CACHELINE_SIZE,
+                       size)) {
+      errno = ENOMEM;
+      return FIBER_ERROR;
+    }
+    memset(rwlock->indicators, 0, size);
+  }
   if (!mpsc_fifo_init(&rwlock->write_waiters) ||
       !mpsc_fifo_init(&rwlock->read_waiters)) {
     mpsc_fifo_destroy(&rwlock->write_waiters);
     mpsc_fifo_destroy(&rwlock->read_waiters);
+    free(rwlock->indicators);
+    rwlock->indicators = NULL;
     return FIBER_ERROR;
   }
   rwlock->state.blob = 0;
+  rwlock->state.state.biased = num_indicators > 0;
   return FIBER_SUCCESS;
 }
 
@@ -35,28 +68,135 @@ void fiber_rwlock_destroy(fiber_rwlock_t* rwlock) {
   if (rwlock) {
     mpsc_fifo_destroy(&rwlock->write_waiters);
     mpsc_fifo_destroy(&rwlock->read_waiters);
+    free(rwlock->indicators);
+    rwlock->indicators = NULL;
   }
 }
 
-int fiber_rwlock_rdlock(fiber_rwlock_t* rwlock) {
+// the calling thread's reader count. threads which aren't managers share the
+// last one.
+static inline _Atomic intptr_t* fiber_rwlock_indicator(fiber_rwlock_t* rwlock) {
+  fiber_manager_t* const manager = fiber_manager_get();
+  const int id = manager ? manager->id : rwlock->num_indicators - 1;
+  assert(id < rwlock->num_indicators);
+  return &rwlock->indicators[id].count;
+}
+
+// the number of readers counted by their threads. a reader which moved thread
+// while it held the lock leaves one count high and another low, so only the
+// sum is meaningful.
+static intptr_t fiber_rwlock_biased_readers(fiber_rwlock_t* rwlock) {
+  intptr_t sum = 0;
+  int i;
+  for (i = 0; i < rwlock->num_indicators; ++i) {
+    sum += atomic_load(&rwlock->indicators[i].count);
+  }
+  return sum;
+}
+
+// takes a read lock through the calling thread's count, which works while the
+// lock is biased and not write locked. a writer sets write_locked before it
+// drains the counts, so a reader which sees neither after counting itself is
+// seen by the writer.
+static int fiber_rwlock_tryrdlock_biased(fiber_rwlock_t* rwlock) {
+  _Atomic intptr_t* const indicator = fiber_rwlock_indicator(rwlock);
+  atomic_fetch_add(indicator, 1);
+  store_load_barrier();
+  fiber_rwlock_state_t current_state;
+  current_state.blob = rwlock->state.blob;
+  if (current_state.state.biased && !current_state.state.write_locked) {
+    return 1;
+  }
+  atomic_fetch_sub(indicator, 1);
+  return 0;
+}
+
+static int fiber_rwlock_unlock(fiber_rwlock_t* rwlock, int writer);
+
+// called by a writer once it has the write lock. if the lock is biased it waits
+// for the readers counted by their threads to finish (giving up, and releasing
+// the lock, at deadline_ns) before clearing the bias.
+static int fiber_rwlock_revoke(fiber_rwlock_t* rwlock, uint64_t deadline_ns) {
+  fiber_rwlock_state_t current_state;
+  current_state.blob = rwlock->state.blob;
+  if (!current_state.state.biased) {
+    return FIBER_SUCCESS;
+  }
+  const uint64_t start = fiber_time_now_ns();
+  while (fiber_rwlock_biased_readers(rwlock)) {
+    if (deadline_ns != UINT64_MAX && fiber_time_now_ns() >= deadline_ns) {
+      fiber_rwlock_unlock(rwlock, 1);
+      return FIBER_ERROR;
+    }
+    fiber_yield();
+  }
+  while (1) {
+    const uint64_t snapshot = rwlock->state.blob;
+    current_state.blob = snapshot;
+    current_state.state.biased = 0;
+    if (__sync_bool_compare_and_swap(&rwlock->state.blob, snapshot,
+                                     current_state.blob)) {
+      break;
+    }
+  }
+  const uint64_t now = fiber_time_now_ns();
+  rwlock->inhibit_until_ns =
+      now + (now - start) * FIBER_RWLOCK_INHIBIT_MULTIPLIER;
+  return FIBER_SUCCESS;
+}
+
+// restores the bias of a free FIBER_RWLOCK_READ_BIASED lock once readers have
+// used the shared word for long enough. snapshot is the lock's state.
+static int fiber_rwlock_rebias(fiber_rwlock_t* rwlock, uint64_t snapshot) {
+  if (!rwlock->indicators || snapshot != 0 ||
+      fiber_time_now_ns() < rwlock->inhibit_until_ns) {
+    return 0;
+  }
+  fiber_rwlock_state_t biased_state;
+  biased_state.blob = 0;
+  biased_state.state.biased = 1;
+  return __sync_bool_compare_and_swap(&rwlock->state.blob, snapshot,
+                                      biased_state.blob);
+}
+
+// the lock functions wait forever if deadline_ns is UINT64_MAX. a waiter which
+// times out stays counted as waiting, and is handed the lock like any other;
+// the unlocker which finds it gone releases the lock again on its behalf.
+static int fiber_rwlock_rdlock_until(fiber_rwlock_t* rwlock,
+                                     uint64_t deadline_ns) {
   assert(rwlock);
 
+  fiber_wait_t* wait = NULL;
   fiber_rwlock_state_t current_state;
   while (1) {
     const uint64_t snapshot = rwlock->state.blob;
     current_state.blob = snapshot;
+    if (current_state.state.biased && !current_state.state.write_locked) {
+      if (fiber_rwlock_tryrdlock_biased(rwlock)) {
+        break;
+      }
+      continue;
+    }
     if (current_state.state.waiting_writers ||
         current_state.state.write_locked ||
         current_state.state.waiting_readers) {
+      fiber_manager_t* const manager = fiber_manager_get();
+      if (deadline_ns != UINT64_MAX && !wait &&
+          !(wait = fiber_manager_get_wait(manager, deadline_ns))) {
+        return FIBER_ERROR;
+      }
       current_state.state.waiting_readers += 1;
       if (__sync_bool_compare_and_swap(&rwlock->state.blob, snapshot,
                                        current_state.blob)) {
         // currently write locked or a writer is waiting - be friendly and wait
-        fiber_manager_wait_in_mpsc_queue(fiber_manager_get(),
-                                         &rwlock->read_waiters);
+        if (wait) {
+          return fiber_manager_wait_in_mpsc_queue_until(
+              manager, &rwlock->read_waiters, wait, deadline_ns);
+        }
+        fiber_manager_wait_in_mpsc_queue(manager, &rwlock->read_waiters);
         break;
       }
-    } else {
+    } else if (!fiber_rwlock_rebias(rwlock, snapshot)) {
       current_state.state.reader_count += 1;
       if (__sync_bool_compare_and_swap(&rwlock->state.blob, snapshot,
                                        current_state.blob)) {
@@ -68,24 +208,41 @@ int fiber_rwlock_rdlock(fiber_rwlock_t* rwlock) {
   return FIBER_SUCCESS;
 }
 
-int fiber_rwlock_wrlock(fiber_rwlock_t* rwlock) {
+static int fiber_rwlock_wrlock_until(fiber_rwlock_t* rwlock,
+                                     uint64_t deadline_ns) {
   assert(rwlock);
 
+  fiber_wait_t* wait = NULL;
   fiber_rwlock_state_t current_state;
   while (1) {
     const uint64_t snapshot = rwlock->state.blob;
     current_state.blob = snapshot;
+    const int biased = current_state.state.biased;
+    current_state.state.biased = 0;
     if (current_state.blob != 0) {
+      current_state.state.biased = biased;
+      fiber_manager_t* const manager = fiber_manager_get();
+      if (deadline_ns != UINT64_MAX && !wait &&
+          !(wait = fiber_manager_get_wait(manager, deadline_ns))) {
+        return FIBER_ERROR;
+      }
       current_state.state.waiting_writers += 1;
       if (__sync_bool_compare_and_swap(&rwlock->state.blob, snapshot,
                                        current_state.blob)) {
         // currently locked or a reader is waiting - be friendly and wait
-        fiber_manager_wait_in_mpsc_queue(fiber_manager_get(),
-                                         &rwlock->write_waiters);
+        if (wait) {
+          if (!fiber_manager_wait_in_mpsc_queue_until(
+                  manager, &rwlock->write_waiters, wait, deadline_ns)) {
+            return FIBER_ERROR;
+          }
+          break;
+        }
+        fiber_manager_wait_in_mpsc_queue(manager, &rwlock->write_waiters);
         break;
       }
     } else {
       current_state.state.write_locked = 1;
+      current_state.state.biased = biased;
       if (__sync_bool_compare_and_swap(&rwlock->state.blob, snapshot,
                                        current_state.blob)) {
         // currently write locked
@@ -93,9 +250,29 @@ int fiber_rwlock_wrlock(fiber_rwlock_t* rwlock) {
       }
     }
   }
+  if (!fiber_rwlock_revoke(rwlock, deadline_ns)) {
+    errno = ETIMEDOUT;
+    return FIBER_ERROR;
+  }
   return FIBER_SUCCESS;
 }
 
+int fiber_rwlock_rdlock(fiber_rwlock_t* rwlock) {
+  return fiber_rwlock_rdlock_until(rwlock, UINT64_MAX);
+}
+
+int fiber_rwlock_wrlock(fiber_rwlock_t* rwlock) {
+  return fiber_rwlock_wrlock_until(rwlock, UINT64_MAX);
+}
+
+int fiber_rwlock_timedrdlock(fiber_rwlock_t* rwlock, uint64_t deadline_ns) {
+  return fiber_rwlock_rdlock_until(rwlock, deadline_ns);
+}
+
+int fiber_rwlock_timedwrlock(fiber_rwlock_t* rwlock, uint64_t deadline_ns) {
+  return fiber_rwlock_wrlock_until(rwlock, deadline_ns);
+}
+
 int fiber_rwlock_tryrdlock(fiber_rwlock_t* rwlock) {
   assert(rwlock);
 
@@ -103,11 +280,20 @@ int fiber_rwlock_tryrdlock(fiber_rwlock_t* rwlock) {
   while (1) {
     const uint64_t snapshot = rwlock->state.blob;
     current_state.blob = snapshot;
+    if (current_state.state.biased && !current_state.state.write_locked) {
+      if (fiber_rwlock_tryrdlock_biased(rwlock)) {
+        break;
+      }
+      continue;
+    }
     if (current_state.state.waiting_writers ||
         current_state.state.write_locked ||
         current_state.state.waiting_readers) {
       return FIBER_ERROR;
     }
+    if (fiber_rwlock_rebias(rwlock, snapshot)) {
+      continue;
+    }
     current_state.state.reader_count += 1;
     if (__sync_bool_compare_and_swap(&rwlock->state.blob, snapshot,
                                      current_state.blob)) {
@@ -124,25 +310,44 @@ int fiber_rwlock_trywrlock(fiber_rwlock_t* rwlock) {
   while (1) {
     const uint64_t snapshot = rwlock->state.blob;
     current_state.blob = snapshot;
+    const int biased = current_state.state.biased;
+    current_state.state.biased = 0;
     if (current_state.blob != 0) {
       return FIBER_ERROR;
     }
     current_state.state.write_locked = 1;
+    current_state.state.biased = biased;
     if (__sync_bool_compare_and_swap(&rwlock->state.blob, snapshot,
                                      current_state.blob)) {
       break;
     }
   }
-  return FIBER_SUCCESS;
+  // fails, releasing the lock again, if readers still hold it
+  return fiber_rwlock_revoke(rwlock, 0);
 }
 
-int fiber_rwlock_rdunlock(fiber_rwlock_t* rwlock) {
-  assert(rwlock);
+// hands the lock to count waiters chosen by an unlock. returns how many of them
+// had timed out.
+static int fiber_rwlock_hand_over(mpsc_fifo_t* waiters, int count) {
+  const int woken =
+      fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), waiters, count);
+  return count - woken;
+}
 
+// the unlock functions release one read lock or the write lock, handing the
+// lock on to any waiters. they return how many of those had timed out, setting
+// *to_writer if they were writers.
+static int fiber_rwlock_rdunlock_once(fiber_rwlock_t* rwlock, int* to_writer) {
   fiber_rwlock_state_t current_state;
   while (1) {
     const uint64_t snapshot = rwlock->state.blob;
     current_state.blob = snapshot;
+    if (current_state.state.biased) {
+      // counted by its thread. a writer waiting on the count clears the bias
+      // only once it has drained, so this reader's count is still there.
+      atomic_fetch_sub(fiber_rwlock_indicator(rwlock), 1);
+      return 0;
+    }
     assert(current_state.state.reader_count > 0);
     assert(!current_state.state.write_locked);
     current_state.state.reader_count -= 1;
@@ -155,9 +360,8 @@ int fiber_rwlock_rdunlock(fiber_rwlock_t* rwlock) {
         current_state.state.waiting_writers -= 1;
         if (__sync_bool_compare_and_swap(&rwlock->state.blob, snapshot,
                                          current_state.blob)) {
-          fiber_manager_wake_from_mpsc_queue(fiber_manager_get(),
-                                             &rwlock->write_waiters, 1);
-          break;
+          *to_writer = 1;
+          return fiber_rwlock_hand_over(&rwlock->write_waiters, 1);
         }
         continue;
       }
@@ -167,25 +371,20 @@ int fiber_rwlock_rdunlock(fiber_rwlock_t* rwlock) {
         current_state.state.waiting_readers = 0;
         if (__sync_bool_compare_and_swap(&rwlock->state.blob, snapshot,
                                          current_state.blob)) {
-          fiber_manager_wake_from_mpsc_queue(fiber_manager_get(),
-                                             &rwlock->read_waiters,
-                                             current_state.state.reader_count);
-          break;
+          return fiber_rwlock_hand_over(&rwlock->read_waiters,
+                                        current_state.state.reader_count);
         }
         continue;
       }
     }
     if (__sync_bool_compare_and_swap(&rwlock->state.blob, snapshot,
                                      current_state.blob)) {
-      break;
+      return 0;
     }
   }
-  return FIBER_SUCCESS;
 }
 
-int fiber_rwlock_wrunlock(fiber_rwlock_t* rwlock) {
-  assert(rwlock);
-
+static int fiber_rwlock_wrunlock_once(fiber_rwlock_t* rwlock, int* to_writer) {
   fiber_rwlock_state_t current_state;
   while (1) {
     const uint64_t snapshot = rwlock->state.blob;
@@ -201,10 +400,23 @@ int fiber_rwlock_wrunlock(fiber_rwlock_t* rwlock) {
       current_state.state.waiting_writers -= 1;
       if (__sync_bool_compare_and_swap(&rwlock->state.blob, snapshot,
                                        current_state.blob)) {
-        fiber_manager_wake_from_mpsc_queue(fiber_manager_get(),
-                                           &rwlock->write_waiters, 1);
-        break;
+        *to_writer = 1;
+        return fiber_rwlock_hand_over(&rwlock->write_waiters, 1);
+      }
+      continue;
+    }
+    if (current_state.state.waiting_readers && current_state.state.biased) {
+      // a writer which gave up revoking the bias. the readers are counted by
+      // this thread before anyone can see the lock unlocked.
+      const int count = current_state.state.waiting_readers;
+      current_state.state.waiting_readers = 0;
+      _Atomic intptr_t* const indicator = fiber_rwlock_indicator(rwlock);
+      atomic_fetch_add(indicator, count);
+      if (__sync_bool_compare_and_swap(&rwlock->state.blob, snapshot,
+                                       current_state.blob)) {
+        return fiber_rwlock_hand_over(&rwlock->read_waiters, count);
       }
+      atomic_fetch_sub(indicator, count);
       continue;
     }
     if (current_state.state.waiting_readers) {
@@ -213,17 +425,42 @@ int fiber_rwlock_wrunlock(fiber_rwlock_t* rwlock) {
       current_state.state.waiting_readers = 0;
       if (__sync_bool_compare_and_swap(&rwlock->state.blob, snapshot,
                                        current_state.blob)) {
-        fiber_manager_wake_from_mpsc_queue(fiber_manager_get(),
-                                           &rwlock->read_waiters,
-                                           current_state.state.reader_count);
-        break;
+        return fiber_rwlock_hand_over(&rwlock->read_waiters,
+                                      current_state.state.reader_count);
       }
       continue;
     }
     if (__sync_bool_compare_and_swap(&rwlock->state.blob, snapshot,
                                      current_state.blob)) {
-      break;
+      return 0;
+    }
+  }
+}
+
+// waiters which had timed out were still handed the lock, so it's released
+// again on their behalf
+static int fiber_rwlock_unlock(fiber_rwlock_t* rwlock, int writer) {
+  assert(rwlock);
+  int count = 1;
+  while (count) {
+    int to_writer = 0;
+    const int skipped = writer ? fiber_rwlock_wrunlock_once(rwlock, &to_writer)
+                               : fiber_rwlock_rdunlock_once(rwlock, &to_writer);
+    count -= 1;
+    if (skipped) {
+      // the lock was only handed on once nobody else held it
+      assert(!count);
+      count = skipped;
+      writer = to_writer;
     }
   }
   return FIBER_SUCCESS;
 }
+
+int fiber_rwlock_rdunlock(fiber_rwlock_t* rwlock) {
+  return fiber_rwlock_unlock(rwlock, 0);
+}
+
+int fiber_rwlock_wrunlock(fiber_rwlock_t* rwlock) {
+  return fiber_rwlock_unlock(rwlock, 1);
+}
@@ -0,0 +1,51 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_scheduler.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+
+static const fiber_scheduler_ops_t* const fiber_scheduler_builtins[] = {
+    &fiber_scheduler_wsd_ops,
+    &fiber_scheduler_dist_ops,
+};
+
+// the implementation the managers' schedulers were created with
+static const fiber_scheduler_ops_t* fiber_scheduler_ops = NULL;
+
+const fiber_scheduler_ops_t* fiber_scheduler_find(const char* name) {
+  assert(name);
+  size_t i;
+  for (i = 0; i < sizeof(fiber_scheduler_builtins) /
+                      sizeof(*fiber_scheduler_builtins);
+       ++i) {
+    if (!strcmp(fiber_scheduler_builtins[i]->name, name)) {
+      return fiber_scheduler_builtins[i];
+    }
+  }
+  return NULL;
+}
+
+int fiber_scheduler_init(const fiber_scheduler_ops_t* ops,
+                         size_t num_threads) {
+  assert(ops);
+  assert(!fiber_scheduler_ops);
+  if (!ops->init(num_threads)) {
+    return 0;
+  }
+  fiber_scheduler_ops = ops;
+  return 1;
+}
+
+void fiber_scheduler_shutdown() {
+  assert(fiber_scheduler_ops);
+  fiber_scheduler_ops->shutdown();
+  fiber_scheduler_ops = NULL;
+}
+
+fiber_scheduler_t* fiber_scheduler_for_thread(size_t thread_id) {
+  assert(fiber_scheduler_ops);
+  return fiber_scheduler_ops->for_thread(thread_id);
+}
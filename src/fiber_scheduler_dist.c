@@ -8,7 +8,10 @@
 #include "fiber_scheduler.h"
 
 typedef struct fiber_scheduler_dist {
-  dist_fifo_t queue;
+  fiber_scheduler_t base;
+  dist_fifo_t queues[FIBER_NUM_PRIORITIES];  // one per priority level
+  // picks from a higher level since each level last ran while it had work
+  uint32_t passed_over[FIBER_NUM_PRIORITIES];
   size_t id;
   uint64_t steal_count;
   uint64_t failed_steal_count;
@@ -17,23 +20,35 @@ typedef struct fiber_scheduler_dist {
 static size_t fiber_scheduler_num_threads = 0;
 static fiber_scheduler_dist_t* fiber_schedulers = NULL;
 
-static int fiber_scheduler_dist_init(fiber_scheduler_dist_t* scheduler,
-                                     size_t id) {
+static int fiber_scheduler_dist_init_one(fiber_scheduler_dist_t* scheduler,
+                                         size_t id) {
   assert(scheduler);
+  scheduler->base.ops = &fiber_scheduler_dist_ops;
   scheduler->id = id;
   scheduler->steal_count = 0;
   scheduler->failed_steal_count = 0;
-  if (!dist_fifo_init(&scheduler->queue)) {
-    return 0;
+  int i;
+  for (i = 0; i < FIBER_NUM_PRIORITIES; ++i) {
+    if (!dist_fifo_init(&scheduler->queues[i])) {
+      while (i--) {
+        dist_fifo_destroy(&scheduler->queues[i]);
+      }
+      return 0;
+    }
+    scheduler->passed_over[i] = 0;
   }
   return 1;
 }
 
-static void fiber_scheduler_dist_destroy(fiber_scheduler_dist_t* scheduler) {
-  dist_fifo_destroy(&scheduler->queue);
+static void fiber_scheduler_dist_destroy_one(
+    fiber_scheduler_dist_t* scheduler) {
+  int i;
+  for (i = 0; i < FIBER_NUM_PRIORITIES; ++i) {
+    dist_fifo_destroy(&scheduler->queues[i]);
+  }
 }
 
-int fiber_scheduler_init(size_t num_threads) {
+static int fiber_scheduler_dist_init(size_t num_threads) {
   assert(num_threads > 0);
   fiber_scheduler_num_threads = num_threads;
 
@@ -43,53 +58,59 @@ int fiber_scheduler_init(size_t num_threads) {
 
   size_t i;
   for (i = 0; i < num_threads; ++i) {
-    const int ret = fiber_scheduler_dist_init(&fiber_schedulers[i], i);
+    const int ret = fiber_scheduler_dist_init_one(&fiber_schedulers[i], i);
     (void)ret;
     assert(ret);
   }
   return 1;
 }
 
-void fiber_scheduler_shutdown() {
+static void fiber_scheduler_dist_shutdown() {
   size_t i;
   for (i = 0; i < fiber_scheduler_num_threads; ++i) {
-    fiber_scheduler_dist_destroy(&fiber_schedulers[i]);
+    fiber_scheduler_dist_destroy_one(&fiber_schedulers[i]);
   }
   free(fiber_schedulers);
   fiber_schedulers = NULL;
 }
 
-fiber_scheduler_t* fiber_scheduler_for_thread(size_t thread_id) {
+static fiber_scheduler_t* fiber_scheduler_dist_for_thread(size_t thread_id) {
   assert(fiber_schedulers);
   assert(thread_id < fiber_scheduler_num_threads);
   return (fiber_scheduler_t*)&fiber_schedulers[thread_id];
 }
 
-void fiber_scheduler_schedule(fiber_scheduler_t* scheduler,
-                              fiber_t* the_fiber) {
+static void fiber_scheduler_dist_schedule(fiber_scheduler_t* scheduler,
+                                          fiber_t* the_fiber) {
   assert(scheduler);
   assert(the_fiber);
+  assert(the_fiber->priority >= 0 &&
+         the_fiber->priority < FIBER_NUM_PRIORITIES);
   mpsc_fifo_node_t* const node = the_fiber->mpsc_fifo_node;
   assert(node);
   the_fiber->mpsc_fifo_node = NULL;
   node->data = the_fiber;
-  dist_fifo_push(&((fiber_scheduler_dist_t*)scheduler)->queue, node);
+  dist_fifo_push(
+      &((fiber_scheduler_dist_t*)scheduler)->queues[the_fiber->priority],
+      node);
 }
 
-fiber_t* fiber_scheduler_next(fiber_scheduler_t* sched) {
-  fiber_scheduler_dist_t* const scheduler = (fiber_scheduler_dist_t*)sched;
-  assert(scheduler);
+static inline int fiber_scheduler_dist_queue_has_work(dist_fifo_t* queue) {
+  return queue->head.pointer.node->next != NULL;
+}
+
+static fiber_t* fiber_scheduler_dist_queue_next(dist_fifo_t* queue) {
   dist_fifo_node_t* node = NULL;
   while (1) {
     do {
-      node = dist_fifo_trypop(&scheduler->queue);
+      node = dist_fifo_trypop(queue);
     } while (node == DIST_FIFO_RETRY);
     if (!node) {
       break;
     }
     fiber_t* const new_fiber = (fiber_t*)node->data;
     if (new_fiber->state == FIBER_STATE_SAVING_STATE_TO_WAIT) {
-      dist_fifo_push(&scheduler->queue, node);
+      dist_fifo_push(queue, node);
     } else {
       new_fiber->mpsc_fifo_node = node;
       return new_fiber;
@@ -98,36 +119,117 @@ fiber_t* fiber_scheduler_next(fiber_scheduler_t* sched) {
   return NULL;
 }
 
-void fiber_scheduler_load_balance(fiber_scheduler_t* sched) {
+static fiber_t* fiber_scheduler_dist_next(fiber_scheduler_t* sched) {
+  fiber_scheduler_dist_t* const scheduler = (fiber_scheduler_dist_t*)sched;
+  assert(scheduler);
+  // a level which has been passed over for too long goes first
+  int level;
+  for (level = FIBER_NUM_PRIORITIES - 1; level > 0; --level) {
+    if (scheduler->passed_over[level] >= FIBER_SCHEDULER_AGING_LIMIT) {
+      scheduler->passed_over[level] = 0;
+      fiber_t* const new_fiber =
+          fiber_scheduler_dist_queue_next(&scheduler->queues[level]);
+      if (new_fiber) {
+        return new_fiber;
+      }
+    }
+  }
+
+  for (level = 0; level < FIBER_NUM_PRIORITIES; ++level) {
+    fiber_t* const new_fiber =
+        fiber_scheduler_dist_queue_next(&scheduler->queues[level]);
+    if (new_fiber) {
+      scheduler->passed_over[level] = 0;
+      int lower;
+      for (lower = level + 1; lower < FIBER_NUM_PRIORITIES; ++lower) {
+        if (fiber_scheduler_dist_queue_has_work(&scheduler->queues[lower])) {
+          ++scheduler->passed_over[lower];
+        }
+      }
+      return new_fiber;
+    }
+  }
+  return NULL;
+}
+
+// moves up to *max_steal fibers from one queue to another
+static void fiber_scheduler_dist_steal(fiber_scheduler_dist_t* scheduler,
+                                       dist_fifo_t* from, dist_fifo_t* to,
+                                       size_t* max_steal) {
+  while (*max_steal > 0) {
+    dist_fifo_node_t* const stolen = dist_fifo_trypop(from);
+    if (stolen == DIST_FIFO_EMPTY || stolen == DIST_FIFO_RETRY) {
+      ++scheduler->failed_steal_count;
+      break;
+    }
+    dist_fifo_push(to, stolen);
+    --*max_steal;
+    ++scheduler->steal_count;
+  }
+}
+
+static void fiber_scheduler_dist_load_balance(fiber_scheduler_t* sched) {
   fiber_scheduler_dist_t* const scheduler = (fiber_scheduler_dist_t*)sched;
   size_t max_steal = 16;
-  size_t i = scheduler->id + 1;
-  const size_t end = i + fiber_scheduler_num_threads - 1;
   const size_t mod = fiber_scheduler_num_threads;
-  for (; i < end; ++i) {
-    const size_t index = i % mod;
-    dist_fifo_t* const remote_queue = &fiber_schedulers[index].queue;
-    assert(remote_queue != &scheduler->queue);
-    if (!remote_queue) {
-      continue;
+  // every victim's high priority work is taken before any lower work
+  int level;
+  for (level = 0; level < FIBER_NUM_PRIORITIES; ++level) {
+    size_t i = scheduler->id + 1;
+    const size_t end = i + fiber_scheduler_num_threads - 1;
+    for (; i < end; ++i) {
+      const size_t index = i % mod;
+      dist_fifo_t* const remote_queue = &fiber_schedulers[index].queues[level];
+      assert(remote_queue != &scheduler->queues[level]);
+      fiber_scheduler_dist_steal(scheduler, remote_queue,
+                                 &scheduler->queues[level], &max_steal);
     }
-    while (max_steal > 0) {
-      dist_fifo_node_t* const stolen = dist_fifo_trypop(remote_queue);
-      if (stolen == DIST_FIFO_EMPTY || stolen == DIST_FIFO_RETRY) {
-        ++scheduler->failed_steal_count;
-        break;
-      }
-      dist_fifo_push(&scheduler->queue, stolen);
-      --max_steal;
-      ++scheduler->steal_count;
+  }
+}
+
+static void fiber_scheduler_dist_steal_from(fiber_scheduler_t* sched,
+                                            fiber_scheduler_t* victim_sched) {
+  fiber_scheduler_dist_t* const scheduler = (fiber_scheduler_dist_t*)sched;
+  fiber_scheduler_dist_t* const victim = (fiber_scheduler_dist_t*)victim_sched;
+  assert(scheduler != victim);
+  size_t max_steal = 16;
+  int level;
+  for (level = 0; level < FIBER_NUM_PRIORITIES; ++level) {
+    fiber_scheduler_dist_steal(scheduler, &victim->queues[level],
+                               &scheduler->queues[level], &max_steal);
+  }
+}
+
+static int fiber_scheduler_dist_has_work(fiber_scheduler_t* sched) {
+  fiber_scheduler_dist_t* const scheduler = (fiber_scheduler_dist_t*)sched;
+  assert(scheduler);
+  int level;
+  for (level = 0; level < FIBER_NUM_PRIORITIES; ++level) {
+    if (fiber_scheduler_dist_queue_has_work(&scheduler->queues[level])) {
+      return 1;
     }
   }
+  return 0;
 }
 
-void fiber_scheduler_stats(fiber_scheduler_t* sched, uint64_t* steal_count,
-                           uint64_t* failed_steal_count) {
+static void fiber_scheduler_dist_stats(fiber_scheduler_t* sched,
+                                       uint64_t* steal_count,
+                                       uint64_t* failed_steal_count) {
   fiber_scheduler_dist_t* const scheduler = (fiber_scheduler_dist_t*)sched;
   assert(scheduler);
   *steal_count += scheduler->steal_count;
   *failed_steal_count += scheduler->failed_steal_count;
 }
+
+const fiber_scheduler_ops_t fiber_scheduler_dist_ops = {
+    "dist",
+    &fiber_scheduler_dist_init,
+    &fiber_scheduler_dist_shutdown,
+    &fiber_scheduler_dist_for_thread,
+    &fiber_scheduler_dist_schedule,
+    &fiber_scheduler_dist_next,
+    &fiber_scheduler_dist_load_balance,
+    &fiber_scheduler_dist_steal_from,
+    &fiber_scheduler_dist_has_work,
+    &fiber_scheduler_dist_stats,
+};
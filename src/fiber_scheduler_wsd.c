@@ -7,44 +7,96 @@
 #include "fiber_scheduler.h"
 #include "work_stealing_deque.h"
 
-typedef struct fiber_scheduler_wsd {
+// the most fibers taken from a victim in one load balancing pass
+#define FIBER_SCHEDULER_MAX_STEAL (64)
+// the most load balancing passes skipped after repeated failed passes
+#define FIBER_SCHEDULER_MAX_BACKOFF (1024)
+
+// each priority level has its own pair of queues
+typedef struct fiber_scheduler_wsd_level {
   wsd_work_stealing_deque_t* queue_one;
   wsd_work_stealing_deque_t* queue_two;
   wsd_work_stealing_deque_t* volatile schedule_from;
   wsd_work_stealing_deque_t* volatile store_to;
+} fiber_scheduler_wsd_level_t;
+
+typedef struct fiber_scheduler_wsd {
+  fiber_scheduler_t base;
+  fiber_scheduler_wsd_level_t levels[FIBER_NUM_PRIORITIES];
+  // picks from a higher level since each level last ran while it had work
+  uint32_t passed_over[FIBER_NUM_PRIORITIES];
+  // a bit for each level a fiber has ever been queued at. while only the
+  // normal level is used, picking a fiber doesn't look at the others.
+  volatile uint32_t levels_used;
   size_t id;
   uint64_t steal_count;
   uint64_t failed_steal_count;
+  uint64_t rand_state;     // xorshift state used to pick victims
+  uint32_t backoff;        // passes left to skip while there's local work
+  uint32_t backoff_limit;  // doubles with each consecutive failed pass
 } fiber_scheduler_wsd_t;
 
 static size_t fiber_scheduler_num_threads = 0;
 static fiber_scheduler_wsd_t* fiber_schedulers = NULL;
+// both queues of each level of each thread, indexed by
+// fiber_scheduler_wsd_queue_index()
 static wsd_work_stealing_deque_t** fiber_scheduler_thread_queues = NULL;
 
-int fiber_scheduler_wsd_init(fiber_scheduler_wsd_t* scheduler, size_t id) {
+static inline size_t fiber_scheduler_wsd_queue_index(size_t thread_id,
+                                                     int level, int which) {
+  return (thread_id * FIBER_NUM_PRIORITIES + level) * 2 + which;
+}
+
+static void fiber_scheduler_wsd_level_destroy(
+    fiber_scheduler_wsd_level_t* level) {
+  wsd_work_stealing_deque_destroy(level->queue_one);
+  wsd_work_stealing_deque_destroy(level->queue_two);
+}
+
+static int fiber_scheduler_wsd_level_init(fiber_scheduler_wsd_level_t* level) {
+  level->queue_one = wsd_work_stealing_deque_create();
+  level->queue_two = wsd_work_stealing_deque_create();
+  level->schedule_from = level->queue_one;
+  level->store_to = level->queue_two;
+  if (!level->queue_one || !level->queue_two) {
+    fiber_scheduler_wsd_level_destroy(level);
+    return 0;
+  }
+  return 1;
+}
+
+static int fiber_scheduler_wsd_init_one(fiber_scheduler_wsd_t* scheduler,
+                                        size_t id) {
   assert(scheduler);
-  scheduler->queue_one = wsd_work_stealing_deque_create();
-  scheduler->queue_two = wsd_work_stealing_deque_create();
-  scheduler->schedule_from = scheduler->queue_one;
-  scheduler->store_to = scheduler->queue_two;
+  scheduler->base.ops = &fiber_scheduler_wsd_ops;
+  int i;
+  for (i = 0; i < FIBER_NUM_PRIORITIES; ++i) {
+    if (!fiber_scheduler_wsd_level_init(&scheduler->levels[i])) {
+      while (i--) {
+        fiber_scheduler_wsd_level_destroy(&scheduler->levels[i]);
+      }
+      return 0;
+    }
+    scheduler->passed_over[i] = 0;
+  }
+  scheduler->levels_used = 1 << FIBER_PRIORITY_NORMAL;
   scheduler->id = id;
   scheduler->steal_count = 0;
   scheduler->failed_steal_count = 0;
-
-  if (!scheduler->queue_one || !scheduler->queue_two) {
-    wsd_work_stealing_deque_destroy(scheduler->queue_one);
-    wsd_work_stealing_deque_destroy(scheduler->queue_two);
-    return 0;
-  }
+  scheduler->rand_state = 0x9E3779B97F4A7C15ULL * (id + 1);
+  scheduler->backoff = 0;
+  scheduler->backoff_limit = 0;
   return 1;
 }
 
-void fiber_scheduler_wsd_destroy(fiber_scheduler_wsd_t* scheduler) {
-  wsd_work_stealing_deque_destroy(scheduler->queue_one);
-  wsd_work_stealing_deque_destroy(scheduler->queue_two);
+static void fiber_scheduler_wsd_destroy_one(fiber_scheduler_wsd_t* scheduler) {
+  int i;
+  for (i = 0; i < FIBER_NUM_PRIORITIES; ++i) {
+    fiber_scheduler_wsd_level_destroy(&scheduler->levels[i]);
+  }
 }
 
-int fiber_scheduler_init(size_t num_threads) {
+static int fiber_scheduler_wsd_init(size_t num_threads) {
   assert(num_threads > 0);
   fiber_scheduler_num_threads = num_threads;
 
@@ -53,24 +105,30 @@ int fiber_scheduler_init(size_t num_threads) {
   assert(fiber_schedulers);
   assert(!fiber_scheduler_thread_queues);
   fiber_scheduler_thread_queues =
-      calloc(2 * num_threads, sizeof(*fiber_scheduler_thread_queues));
+      calloc(2 * FIBER_NUM_PRIORITIES * num_threads,
+             sizeof(*fiber_scheduler_thread_queues));
   assert(fiber_scheduler_thread_queues);
 
   size_t i;
   for (i = 0; i < num_threads; ++i) {
-    const int ret = fiber_scheduler_wsd_init(&fiber_schedulers[i], i);
+    const int ret = fiber_scheduler_wsd_init_one(&fiber_schedulers[i], i);
     (void)ret;
     assert(ret);
-    fiber_scheduler_thread_queues[i * 2] = fiber_schedulers[i].queue_one;
-    fiber_scheduler_thread_queues[i * 2 + 1] = fiber_schedulers[i].queue_two;
+    int level;
+    for (level = 0; level < FIBER_NUM_PRIORITIES; ++level) {
+      fiber_scheduler_thread_queues[fiber_scheduler_wsd_queue_index(
+          i, level, 0)] = fiber_schedulers[i].levels[level].queue_one;
+      fiber_scheduler_thread_queues[fiber_scheduler_wsd_queue_index(
+          i, level, 1)] = fiber_schedulers[i].levels[level].queue_two;
+    }
   }
   return 1;
 }
 
-void fiber_scheduler_shutdown() {
+static void fiber_scheduler_wsd_shutdown() {
   size_t i;
   for (i = 0; i < fiber_scheduler_num_threads; ++i) {
-    fiber_scheduler_wsd_destroy(&fiber_schedulers[i]);
+    fiber_scheduler_wsd_destroy_one(&fiber_schedulers[i]);
   }
   free(fiber_schedulers);
   fiber_schedulers = NULL;
@@ -78,35 +136,50 @@ void fiber_scheduler_shutdown() {
   fiber_scheduler_thread_queues = NULL;
 }
 
-fiber_scheduler_t* fiber_scheduler_for_thread(size_t thread_id) {
+static fiber_scheduler_t* fiber_scheduler_wsd_for_thread(size_t thread_id) {
   assert(fiber_schedulers);
   assert(thread_id < fiber_scheduler_num_threads);
   return (fiber_scheduler_t*)&fiber_schedulers[thread_id];
 }
 
-void fiber_scheduler_schedule(fiber_scheduler_t* scheduler,
-                              fiber_t* the_fiber) {
+void fiber_scheduler_wsd_schedule(fiber_scheduler_t* scheduler,
+                                  fiber_t* the_fiber) {
   assert(scheduler);
   assert(the_fiber);
+  assert(the_fiber->priority >= 0 &&
+         the_fiber->priority < FIBER_NUM_PRIORITIES);
+  fiber_scheduler_wsd_t* const wsd = (fiber_scheduler_wsd_t*)scheduler;
+  const uint32_t bit = 1 << the_fiber->priority;
+  if (!(wsd->levels_used & bit)) {
+    wsd->levels_used |= bit;
+  }
   wsd_work_stealing_deque_push_bottom(
-      ((fiber_scheduler_wsd_t*)scheduler)->schedule_from, the_fiber);
+      wsd->levels[the_fiber->priority].schedule_from, the_fiber);
 }
 
-fiber_t* fiber_scheduler_next(fiber_scheduler_t* sched) {
-  fiber_scheduler_wsd_t* const scheduler = (fiber_scheduler_wsd_t*)sched;
-  assert(scheduler);
-  if (wsd_work_stealing_deque_size(scheduler->schedule_from) == 0) {
-    wsd_work_stealing_deque_t* const temp = scheduler->schedule_from;
-    scheduler->schedule_from = scheduler->store_to;
-    scheduler->store_to = temp;
+static inline int fiber_scheduler_wsd_level_has_work(
+    fiber_scheduler_wsd_level_t* level) {
+  return wsd_work_stealing_deque_size(level->queue_one) ||
+         wsd_work_stealing_deque_size(level->queue_two);
+}
+
+static fiber_t* fiber_scheduler_wsd_level_next(
+    fiber_scheduler_wsd_level_t* level) {
+  if (wsd_work_stealing_deque_size(level->schedule_from) == 0) {
+    if (wsd_work_stealing_deque_size(level->store_to) == 0) {
+      return NULL;
+    }
+    wsd_work_stealing_deque_t* const temp = level->schedule_from;
+    level->schedule_from = level->store_to;
+    level->store_to = temp;
   }
 
-  while (wsd_work_stealing_deque_size(scheduler->schedule_from) > 0) {
+  while (wsd_work_stealing_deque_size(level->schedule_from) > 0) {
     fiber_t* const new_fiber =
-        (fiber_t*)wsd_work_stealing_deque_pop_bottom(scheduler->schedule_from);
+        (fiber_t*)wsd_work_stealing_deque_pop_bottom(level->schedule_from);
     if (new_fiber != WSD_EMPTY && new_fiber != WSD_ABORT) {
       if (new_fiber->state == FIBER_STATE_SAVING_STATE_TO_WAIT) {
-        wsd_work_stealing_deque_push_bottom(scheduler->store_to, new_fiber);
+        wsd_work_stealing_deque_push_bottom(level->store_to, new_fiber);
       } else {
         return new_fiber;
       }
@@ -115,43 +188,182 @@ fiber_t* fiber_scheduler_next(fiber_scheduler_t* sched) {
   return NULL;
 }
 
-void fiber_scheduler_load_balance(fiber_scheduler_t* sched) {
+fiber_t* fiber_scheduler_wsd_next(fiber_scheduler_t* sched) {
+  fiber_scheduler_wsd_t* const scheduler = (fiber_scheduler_wsd_t*)sched;
+  assert(scheduler);
+  if (scheduler->levels_used == 1 << FIBER_PRIORITY_NORMAL) {
+    return fiber_scheduler_wsd_level_next(
+        &scheduler->levels[FIBER_PRIORITY_NORMAL]);
+  }
+  // a level which has been passed over for too long goes first
+  int level;
+  for (level = FIBER_NUM_PRIORITIES - 1; level > 0; --level) {
+    if (scheduler->passed_over[level] >= FIBER_SCHEDULER_AGING_LIMIT) {
+      scheduler->passed_over[level] = 0;
+      fiber_t* const new_fiber =
+          fiber_scheduler_wsd_level_next(&scheduler->levels[level]);
+      if (new_fiber) {
+        return new_fiber;
+      }
+    }
+  }
+
+  for (level = 0; level < FIBER_NUM_PRIORITIES; ++level) {
+    fiber_t* const new_fiber =
+        fiber_scheduler_wsd_level_next(&scheduler->levels[level]);
+    if (new_fiber) {
+      scheduler->passed_over[level] = 0;
+      int lower;
+      for (lower = level + 1; lower < FIBER_NUM_PRIORITIES; ++lower) {
+        if (fiber_scheduler_wsd_level_has_work(&scheduler->levels[lower])) {
+          ++scheduler->passed_over[lower];
+        }
+      }
+      return new_fiber;
+    }
+  }
+  return NULL;
+}
+
+static inline uint64_t fiber_scheduler_wsd_rand(
+    fiber_scheduler_wsd_t* scheduler) {
+  uint64_t x = scheduler->rand_state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  scheduler->rand_state = x;
+  return x;
+}
+
+static void fiber_scheduler_wsd_load_balance(fiber_scheduler_t* sched) {
   fiber_scheduler_wsd_t* const scheduler = (fiber_scheduler_wsd_t*)sched;
-  size_t max_steal = 50;
-  size_t i = 2 * (scheduler->id + 1);
-  const size_t end = i + 2 * (fiber_scheduler_num_threads - 1);
-  const size_t mod = 2 * fiber_scheduler_num_threads;
-  size_t local_count = wsd_work_stealing_deque_size(scheduler->schedule_from);
-  for (; i < end; ++i) {
-    const size_t index = i % mod;
-    wsd_work_stealing_deque_t* const remote_queue =
-        fiber_scheduler_thread_queues[index];
-    assert(remote_queue != scheduler->queue_one);
-    assert(remote_queue != scheduler->queue_two);
-    if (!remote_queue) {
-      continue;
+  if (fiber_scheduler_num_threads < 2) {
+    return;
+  }
+  size_t local_count = 0;
+  int level;
+  for (level = 0; level < FIBER_NUM_PRIORITIES; ++level) {
+    local_count +=
+        wsd_work_stealing_deque_size(scheduler->levels[level].schedule_from);
+  }
+  // a thread with work of its own backs off after failing to steal. an idle
+  // thread always looks, since it parks if it finds nothing.
+  if (local_count && scheduler->backoff) {
+    --scheduler->backoff;
+    return;
+  }
+
+  // start at a random victim so thieves don't all pile onto the same queues.
+  // every victim's high priority work is considered before any lower work.
+  const size_t num_victims = 2 * (fiber_scheduler_num_threads - 1);
+  const size_t start = fiber_scheduler_wsd_rand(scheduler) % num_victims;
+  for (level = 0; level < FIBER_NUM_PRIORITIES; ++level) {
+    wsd_work_stealing_deque_t* const local_queue =
+        scheduler->levels[level].schedule_from;
+    const size_t level_count = wsd_work_stealing_deque_size(local_queue);
+    size_t i;
+    for (i = 0; i < num_victims; ++i) {
+      const size_t victim = (start + i) % num_victims;
+      const size_t thread_id =
+          (scheduler->id + 1 + victim / 2) % fiber_scheduler_num_threads;
+      if (!(fiber_schedulers[thread_id].levels_used & (1 << level))) {
+        continue;
+      }
+      wsd_work_stealing_deque_t* const remote_queue =
+          fiber_scheduler_thread_queues[fiber_scheduler_wsd_queue_index(
+              thread_id, level, victim % 2)];
+      assert(remote_queue != scheduler->levels[level].queue_one);
+      assert(remote_queue != scheduler->levels[level].queue_two);
+      if (!remote_queue) {
+        continue;
+      }
+      const size_t remote_count = wsd_work_stealing_deque_size(remote_queue);
+      if (remote_count <= level_count) {
+        continue;
+      }
+      size_t max_steal = (remote_count - level_count + 1) / 2;
+      if (max_steal > FIBER_SCHEDULER_MAX_STEAL) {
+        max_steal = FIBER_SCHEDULER_MAX_STEAL;
+      }
+      const size_t stolen = wsd_work_stealing_deque_steal_half(
+          remote_queue, local_queue, max_steal);
+      if (stolen) {
+        scheduler->levels_used |= 1 << level;
+        scheduler->steal_count += stolen;
+        scheduler->backoff_limit = 0;
+        return;
+      }
+      ++scheduler->failed_steal_count;
     }
-    size_t remote_count = wsd_work_stealing_deque_size(remote_queue);
-    while (remote_count > local_count && max_steal > 0) {
-      fiber_t* const stolen =
-          (fiber_t*)wsd_work_stealing_deque_steal(remote_queue);
-      if (stolen == WSD_EMPTY || stolen == WSD_ABORT) {
+  }
+
+  if (!local_count) {
+    return;  // failing to find work while idle shouldn't throttle us later
+  }
+  if (scheduler->backoff_limit < FIBER_SCHEDULER_MAX_BACKOFF) {
+    scheduler->backoff_limit =
+        scheduler->backoff_limit ? scheduler->backoff_limit * 2 : 1;
+  }
+  scheduler->backoff = scheduler->backoff_limit;
+}
+
+static void fiber_scheduler_wsd_steal_from(fiber_scheduler_t* sched,
+                                           fiber_scheduler_t* victim_sched) {
+  fiber_scheduler_wsd_t* const scheduler = (fiber_scheduler_wsd_t*)sched;
+  fiber_scheduler_wsd_t* const victim = (fiber_scheduler_wsd_t*)victim_sched;
+  assert(scheduler);
+  assert(victim);
+  assert(scheduler != victim);
+  int level;
+  for (level = 0; level < FIBER_NUM_PRIORITIES; ++level) {
+    fiber_scheduler_wsd_level_t* const from = &victim->levels[level];
+    wsd_work_stealing_deque_t* const queues[2] = {from->queue_one,
+                                                  from->queue_two};
+    int i;
+    for (i = 0; i < 2; ++i) {
+      const size_t stolen = wsd_work_stealing_deque_steal_half(
+          queues[i], scheduler->levels[level].schedule_from,
+          FIBER_SCHEDULER_MAX_STEAL);
+      if (stolen) {
+        scheduler->levels_used |= 1 << level;
+        scheduler->steal_count += stolen;
+      } else if (wsd_work_stealing_deque_size(queues[i])) {
         ++scheduler->failed_steal_count;
-        break;
       }
-      wsd_work_stealing_deque_push_bottom(scheduler->schedule_from, stolen);
-      --remote_count;
-      ++local_count;
-      --max_steal;
-      ++scheduler->steal_count;
     }
   }
 }
 
-void fiber_scheduler_stats(fiber_scheduler_t* sched, uint64_t* steal_count,
-                           uint64_t* failed_steal_count) {
+static int fiber_scheduler_wsd_has_work(fiber_scheduler_t* sched) {
+  fiber_scheduler_wsd_t* const scheduler = (fiber_scheduler_wsd_t*)sched;
+  assert(scheduler);
+  int level;
+  for (level = 0; level < FIBER_NUM_PRIORITIES; ++level) {
+    if (fiber_scheduler_wsd_level_has_work(&scheduler->levels[level])) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void fiber_scheduler_wsd_stats(fiber_scheduler_t* sched,
+                                      uint64_t* steal_count,
+                                      uint64_t* failed_steal_count) {
   fiber_scheduler_wsd_t* const scheduler = (fiber_scheduler_wsd_t*)sched;
   assert(scheduler);
   *steal_count += scheduler->steal_count;
   *failed_steal_count += scheduler->failed_steal_count;
 }
+
+const fiber_scheduler_ops_t fiber_scheduler_wsd_ops = {
+    "wsd",
+    &fiber_scheduler_wsd_init,
+    &fiber_scheduler_wsd_shutdown,
+    &fiber_scheduler_wsd_for_thread,
+    &fiber_scheduler_wsd_schedule,
+    &fiber_scheduler_wsd_next,
+    &fiber_scheduler_wsd_load_balance,
+    &fiber_scheduler_wsd_steal_from,
+    &fiber_scheduler_wsd_has_work,
+    &fiber_scheduler_wsd_stats,
+};
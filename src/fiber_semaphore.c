@@ -39,6 +39,31 @@ int fiber_semaphore_wait(fiber_semaphore_t* semaphore) {
   return FIBER_SUCCESS;
 }
 
+int fiber_semaphore_timedwait(fiber_semaphore_t* semaphore,
+                              uint64_t deadline_ns) {
+  assert(semaphore);
+
+  if (fiber_semaphore_trywait(semaphore)) {
+    return FIBER_SUCCESS;
+  }
+
+  fiber_manager_t* const manager = fiber_manager_get();
+  fiber_wait_t* const wait = fiber_manager_get_wait(manager, deadline_ns);
+  if (!wait) {
+    return FIBER_ERROR;
+  }
+
+  const int val = atomic_fetch_sub(&semaphore->counter, 1) - 1;
+  if (val >= 0) {
+    return FIBER_SUCCESS;
+  }
+
+  // a waiter which times out keeps its place in the count; the poster which
+  // skips it gives the place back
+  return fiber_manager_wait_in_mpmc_queue_until(manager, &semaphore->waiters,
+                                                wait, deadline_ns);
+}
+
 int fiber_semaphore_trywait(fiber_semaphore_t* semaphore) {
   assert(semaphore);
 
@@ -68,10 +93,14 @@ int fiber_semaphore_post_internal(fiber_semaphore_t* semaphore) {
                                                 memory_order_acquire)) < 0) {
       // another fiber is waiting; attempt to schedule it to take this fiber's
       // place
-      if (fiber_manager_wake_from_mpmc_queue(fiber_manager_get(),
-                                             &semaphore->waiters, 0)) {
+      const int woken = fiber_manager_wake_from_mpmc_queue(
+          fiber_manager_get(), &semaphore->waiters, 0);
+      if (woken) {
         atomic_fetch_add(&semaphore->counter, 1);
-        return 1;
+        if (woken > 0) {
+          return 1;
+        }
+        // that waiter had timed out; it no longer needs its place
       }
     }
   } while (!atomic_compare_exchange_weak_explicit(
@@ -84,8 +113,9 @@ int fiber_semaphore_post_internal(fiber_semaphore_t* semaphore) {
 int fiber_semaphore_post(fiber_semaphore_t* semaphore) {
   const int had_waiters = fiber_semaphore_post_internal(semaphore);
   if (had_waiters) {
-    // the semaphore was contended - be nice and let the waiter run
-    fiber_yield();
+    // the semaphore was contended - be nice and hand off to the waiter we woke
+    fiber_manager_t* const manager = fiber_manager_get();
+    fiber_manager_yield_to(manager, fiber_manager_peek_run_next(manager));
   }
   return FIBER_SUCCESS;
 }
@@ -37,10 +37,15 @@ int fiber_spinlock_lock(fiber_spinlock_t* spinlock) {
 
   const uint32_t my_ticket = atomic_fetch_add_explicit(
       &spinlock->state.counters.users, 1, memory_order_acquire);
+  uint64_t spins = 0;
   while (atomic_load_explicit(&spinlock->state.counters.ticket,
                               memory_order_acquire) != my_ticket) {
     cpu_relax();
-    fiber_manager_get()->spin_count += 1;
+    spins += 1;
+  }
+  if (spins) {
+    // counted once, rather than looking up the manager every spin
+    fiber_manager_get()->spin_count += spins;
   }
 
   return FIBER_SUCCESS;
@@ -0,0 +1,246 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_stack_arena.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "machine_specific.h"
+#include "mpmc_lifo.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+// turns pages into guard pages without changing the protection of the mapping,
+// so the region stays a single VMA. older headers don't define it.
+#if defined(__linux__) && !defined(MADV_GUARD_INSTALL)
+#define MADV_GUARD_INSTALL 102
+#endif
+
+// enough classes for page_size << k to reach 1 << FIBER_STACK_ARENA_MAX_SHIFT
+// with any page size
+#define FIBER_STACK_ARENA_NUM_CLASSES (FIBER_STACK_ARENA_MAX_SHIFT + 1)
+
+static _Atomic size_t fiber_stack_arena_page_size = 0;
+static _Atomic int fiber_stack_arena_hugepage_policy =
+    FIBER_STACK_ARENA_HUGEPAGE_DEFAULT;
+static _Atomic int fiber_stack_arena_no_guard_install = 0;
+
+// free slots, one lifo per size class. the node lives at the top of the slot.
+static mpmc_lifo_t fiber_stack_arena_free_slots[FIBER_STACK_ARENA_NUM_CLASSES];
+
+// the unused tail of the current region. slots are carved from it in batches.
+static pthread_mutex_t fiber_stack_arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static char* fiber_stack_arena_region_next = NULL;
+static char* fiber_stack_arena_region_end = NULL;
+
+static size_t fiber_stack_arena_get_page_size() {
+  size_t page_size =
+      atomic_load_explicit(&fiber_stack_arena_page_size, memory_order_relaxed);
+  if (!page_size) {
+    page_size = sysconf(_SC_PAGESIZE);
+    atomic_store_explicit(&fiber_stack_arena_page_size, page_size,
+                          memory_order_relaxed);
+  }
+  return page_size;
+}
+
+// returns the size class whose usable size fits stack_size, or -1 if the stack
+// is too large for the arena
+static int fiber_stack_arena_class(size_t stack_size, size_t page_size) {
+  int size_class = 0;
+  size_t usable = page_size;
+  while (usable < stack_size) {
+    usable <<= 1;
+    ++size_class;
+  }
+  if (usable > ((size_t)1 << FIBER_STACK_ARENA_MAX_SHIFT)) {
+    return -1;
+  }
+  assert(size_class < FIBER_STACK_ARENA_NUM_CLASSES);
+  return size_class;
+}
+
+static inline mpmc_lifo_node_t* fiber_stack_arena_slot_to_node(
+    void* slot, size_t slot_size) {
+  return (mpmc_lifo_node_t*)((char*)slot + slot_size) - 1;
+}
+
+static inline void* fiber_stack_arena_node_to_slot(mpmc_lifo_node_t* node,
+                                                   size_t slot_size) {
+  return (char*)(node + 1) - slot_size;
+}
+
+static int fiber_stack_arena_install_guard(void* page, size_t page_size) {
+#ifdef MADV_GUARD_INSTALL
+  if (!atomic_load_explicit(&fiber_stack_arena_no_guard_install,
+                            memory_order_relaxed)) {
+    if (!madvise(page, page_size, MADV_GUARD_INSTALL)) {
+      return 1;
+    }
+    if (errno != EINVAL) {
+      return 0;
+    }
+    // the kernel predates guard regions
+    atomic_store_explicit(&fiber_stack_arena_no_guard_install, 1,
+                          memory_order_relaxed);
+  }
+#endif
+  return !mprotect(page, page_size, PROT_NONE);
+}
+
+// must hold fiber_stack_arena_lock
+static int fiber_stack_arena_reserve_region() {
+  char* const region =
+      mmap(0, FIBER_STACK_ARENA_REGION_SIZE, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (region == MAP_FAILED) {
+    return 0;
+  }
+
+  switch (atomic_load(&fiber_stack_arena_hugepage_policy)) {
+#ifdef MADV_NOHUGEPAGE
+    case FIBER_STACK_ARENA_HUGEPAGE_NEVER:
+      madvise(region, FIBER_STACK_ARENA_REGION_SIZE, MADV_NOHUGEPAGE);
+      break;
+#endif
+#ifdef MADV_HUGEPAGE
+    case FIBER_STACK_ARENA_HUGEPAGE_ALWAYS:
+      madvise(region, FIBER_STACK_ARENA_REGION_SIZE, MADV_HUGEPAGE);
+      break;
+#endif
+    default:
+      break;
+  }
+
+  // the tail of the previous region is abandoned. it was never touched so it
+  // only costs address space.
+  fiber_stack_arena_region_next = region;
+  fiber_stack_arena_region_end = region + FIBER_STACK_ARENA_REGION_SIZE;
+  return 1;
+}
+
+// carves a batch of slots from the current region, returning one and putting
+// the rest on the freelist
+static void* fiber_stack_arena_carve(int size_class, size_t slot_size,
+                                     size_t page_size) {
+  assert(slot_size <= FIBER_STACK_ARENA_REGION_SIZE);
+  mpmc_lifo_t* const free_slots = &fiber_stack_arena_free_slots[size_class];
+
+  pthread_mutex_lock(&fiber_stack_arena_lock);
+
+  // another thread may have carved a batch while we waited for the lock
+  mpmc_lifo_node_t* const node = mpmc_lifo_pop(free_slots);
+  if (node) {
+    pthread_mutex_unlock(&fiber_stack_arena_lock);
+    return fiber_stack_arena_node_to_slot(node, slot_size);
+  }
+
+  if ((size_t)(fiber_stack_arena_region_end - fiber_stack_arena_region_next) <
+          slot_size &&
+      !fiber_stack_arena_reserve_region()) {
+    pthread_mutex_unlock(&fiber_stack_arena_lock);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  size_t count = (size_t)(fiber_stack_arena_region_end -
+                          fiber_stack_arena_region_next) /
+                 slot_size;
+  if (count > FIBER_STACK_ARENA_CARVE_BATCH) {
+    count = FIBER_STACK_ARENA_CARVE_BATCH;
+  }
+
+  void* ret = NULL;
+  size_t i;
+  for (i = 0; i < count; ++i) {
+    char* const slot = fiber_stack_arena_region_next;
+    if (!fiber_stack_arena_install_guard(slot, page_size)) {
+      // most likely out of VMAs after falling back to mprotect(). the slot
+      // stays at the front of the region for the next carve to retry.
+      break;
+    }
+    fiber_stack_arena_region_next += slot_size;
+    if (!ret) {
+      ret = slot;
+    } else {
+      mpmc_lifo_push(free_slots,
+                     fiber_stack_arena_slot_to_node(slot, slot_size));
+    }
+  }
+
+  pthread_mutex_unlock(&fiber_stack_arena_lock);
+
+  if (!ret) {
+    errno = ENOMEM;
+  }
+  return ret;
+}
+
+void fiber_stack_arena_set_hugepage_policy(
+    fiber_stack_arena_hugepage_policy_t policy) {
+  atomic_store(&fiber_stack_arena_hugepage_policy, policy);
+}
+
+void fiber_stack_arena_use_mprotect_guards() {
+  atomic_store_explicit(&fiber_stack_arena_no_guard_install, 1,
+                        memory_order_relaxed);
+}
+
+void* fiber_stack_arena_alloc(size_t stack_size, size_t* out_size) {
+  assert(out_size);
+  const size_t page_size = fiber_stack_arena_get_page_size();
+  const int size_class = fiber_stack_arena_class(stack_size, page_size);
+
+  if (size_class < 0) {
+    // too big for the arena - map it on its own, like FIBER_STACK_MMAP
+    const size_t size =
+        (stack_size + page_size - 1) / page_size * page_size + page_size;
+    void* const stack = mmap(0, size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (stack == MAP_FAILED) {
+      return NULL;
+    }
+    if (!fiber_stack_arena_install_guard(stack, page_size)) {
+      munmap(stack, size);
+      return NULL;
+    }
+    *out_size = size;
+    return stack;
+  }
+
+  const size_t slot_size = (page_size << size_class) + page_size;
+  *out_size = slot_size;
+  mpmc_lifo_node_t* const node =
+      mpmc_lifo_pop(&fiber_stack_arena_free_slots[size_class]);
+  if (node) {
+    return fiber_stack_arena_node_to_slot(node, slot_size);
+  }
+  return fiber_stack_arena_carve(size_class, slot_size, page_size);
+}
+
+void fiber_stack_arena_free(void* stack, size_t size) {
+  if (!stack) {
+    return;
+  }
+  const size_t page_size = fiber_stack_arena_get_page_size();
+  assert(size > page_size);
+  const int size_class = fiber_stack_arena_class(size - page_size, page_size);
+  if (size_class < 0) {
+    munmap(stack, size);
+    return;
+  }
+  assert(size == (page_size << size_class) + page_size);
+  mpmc_lifo_push(&fiber_stack_arena_free_slots[size_class],
+                 fiber_stack_arena_slot_to_node(stack, size));
+}
@@ -129,3 +129,24 @@ void* wsd_work_stealing_deque_steal(wsd_work_stealing_deque_t* d) {
   }
   return ret;
 }
+
+size_t wsd_work_stealing_deque_steal_half(wsd_work_stealing_deque_t* from,
+                                          wsd_work_stealing_deque_t* to,
+                                          size_t max) {
+  assert(from);
+  assert(to);
+  assert(from != to);
+  size_t count = (wsd_work_stealing_deque_size(from) + 1) / 2;
+  if (count > max) {
+    count = max;
+  }
+  size_t i;
+  for (i = 0; i < count; ++i) {
+    void* const stolen = wsd_work_stealing_deque_steal(from);
+    if (stolen == WSD_EMPTY || stolen == WSD_ABORT) {
+      break;
+    }
+    wsd_work_stealing_deque_push_bottom(to, stolen);
+  }
+  return i;
+}
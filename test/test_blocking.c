@@ -0,0 +1,141 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "fiber_blocking.h"
+#include "fiber_manager.h"
+#include "test_helper.h"
+
+// fiber_run_blocking() makes a call on a helper thread while the caller's
+// manager keeps running other fibers. the shims send regular file io and
+// fsync() there on their own.
+#define NUM_THREADS 2
+#define SLEEP_US 20000
+// more than the pool has helpers, so some calls queue
+#define NUM_CALLERS (FIBER_BLOCKING_MAX_THREADS * 2)
+#define BIG_SIZE (1024 * 1024)
+
+volatile int counting = 0;
+volatile int count = 0;
+
+void* counter_function(void* param) {
+  while (counting) {
+    ++count;
+    fiber_yield();
+  }
+  return NULL;
+}
+
+void* sleep_function(void* param) {
+  // helpers aren't fibers, so this really sleeps
+  usleep(SLEEP_US);
+  return param;
+}
+
+void* fail_function(void* param) {
+  errno = (intptr_t)param;
+  return NULL;
+}
+
+void* self_function(void* param) { return (void*)pthread_self(); }
+
+void* caller_function(void* param) {
+  test_assert(fiber_run_blocking(&sleep_function, param) == param);
+  return NULL;
+}
+
+// main may wake on another thread after a call, so errno's address is looked
+// up afresh rather than cached across the calls
+static __attribute__((noinline)) int last_errno() { return errno; }
+
+static uint64_t blocking_count() {
+  fiber_manager_stats_t stats;
+  fiber_manager_all_stats(&stats);
+  return stats.blocking_count;
+}
+
+int main() {
+  // without fibers the call is made inline
+  test_assert(fiber_run_blocking(&self_function, NULL) ==
+              (void*)pthread_self());
+
+  fiber_manager_init(NUM_THREADS);
+
+  counting = 1;
+  fiber_t* const counter = fiber_create(20000, &counter_function, NULL);
+  test_assert(counter);
+
+  // the manager keeps running fibers while a helper sleeps
+  count = 0;
+  test_assert(fiber_run_blocking(&sleep_function, (void*)1) == (void*)1);
+  test_assert(count > 0);
+  test_assert(fiber_run_blocking(&self_function, NULL) !=
+              (void*)pthread_self());
+  test_assert(!fiber_run_blocking(&fail_function, (void*)EIO));
+  test_assert(last_errno() == EIO);
+  test_assert(blocking_count() == 3);
+
+  // calls beyond the helper limit wait their turn
+  fiber_t* callers[NUM_CALLERS];
+  intptr_t i;
+  for (i = 0; i < NUM_CALLERS; ++i) {
+    callers[i] = fiber_create(20000, &caller_function, (void*)(i + 1));
+    test_assert(callers[i]);
+  }
+  for (i = 0; i < NUM_CALLERS; ++i) {
+    test_assert(fiber_join(callers[i], NULL));
+  }
+  test_assert(blocking_count() == 3 + NUM_CALLERS);
+
+  // regular files go through the pool (or RWF_NOWAIT when cached)
+  char path[] = "/tmp/test_blocking_XXXXXX";
+  const int fd = mkstemp(path);
+  test_assert(fd >= 0);
+  unlink(path);
+
+  test_assert(write(fd, "hello world", 11) == 11);
+  test_assert(pwrite(fd, "W", 1, 6) == 1);
+  char buf[16] = {};
+  test_assert(pread(fd, buf, 11, 0) == 11);
+  test_assert(!strcmp(buf, "hello World"));
+  test_assert(read(fd, buf, sizeof(buf)) == 0);  // the position is at the end
+  test_assert(lseek(fd, 6, SEEK_SET) == 6);
+  memset(buf, 0, sizeof(buf));
+  struct iovec iov[2] = {{buf, 2}, {buf + 2, 3}};
+  test_assert(readv(fd, iov, 2) == 5);
+  test_assert(!strcmp(buf, "World"));
+
+  char* const big = malloc(BIG_SIZE);
+  char* const big_copy = malloc(BIG_SIZE);
+  test_assert(big && big_copy);
+  for (i = 0; i < BIG_SIZE; ++i) {
+    big[i] = (char)i;
+  }
+  struct iovec big_iov[2] = {{big, BIG_SIZE / 2},
+                             {big + BIG_SIZE / 2, BIG_SIZE / 2}};
+  test_assert(writev(fd, big_iov, 2) == BIG_SIZE);
+  test_assert(pread(fd, big_copy, BIG_SIZE, 11) == BIG_SIZE);
+  test_assert(!memcmp(big, big_copy, BIG_SIZE));
+  free(big);
+  free(big_copy);
+
+  // syncing always waits on the disk, so it always uses a helper
+  const uint64_t before_sync = blocking_count();
+  test_assert(!fsync(fd));
+  test_assert(!fdatasync(fd));
+  test_assert(fsync(-1) < 0 && last_errno() == EBADF);
+  test_assert(blocking_count() == before_sync + 3);
+  close(fd);
+
+  counting = 0;
+  test_assert(fiber_join(counter, NULL));
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
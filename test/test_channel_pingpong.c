@@ -2,6 +2,7 @@
 // SPDX-License-Identifier: MIT
 
 #include "fiber_channel.h"
+#include "fiber_event.h"
 #include "fiber_manager.h"
 #include "test_helper.h"
 
@@ -40,12 +41,17 @@ int main(int argc, char* argv[]) {
   channel_one = fiber_bounded_channel_create(7, argc > 1 ? NULL : &signal_one);
   channel_two = fiber_bounded_channel_create(7, argc > 1 ? NULL : &signal_two);
 
+  const uint64_t start = fiber_time_now_ns();
   fiber_t* ping_fiber;
   ping_fiber = fiber_create(20000, &ping_function, NULL);
 
   pong_function(NULL);
 
   fiber_join(ping_fiber, NULL);
+  const uint64_t end = fiber_time_now_ns();
+  printf("%d round trips in %" PRIu64 " nsec = %" PRIu64
+         " nsec per round trip\n",
+         PER_FIBER_COUNT, end - start, (end - start) / PER_FIBER_COUNT);
 
   fiber_bounded_channel_destroy(channel_one);
   fiber_bounded_channel_destroy(channel_two);
@@ -54,8 +54,9 @@ int main() {
 
   test_assert(counter == (NUM_FIBERS * PER_FIBER_COUNT + 1));
 
-  fiber_t* single = fiber_create(20000, &run_single, NULL);
+  // locked first, so single can't signal before this fiber waits
   fiber_mutex_lock(&mutex);
+  fiber_t* single = fiber_create(20000, &run_single, NULL);
   fiber_cond_wait(&cond, &mutex);
   fiber_cond_signal(&cond);
   fiber_mutex_unlock(&mutex);
@@ -0,0 +1,136 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "fiber_cond.h"
+#include "fiber_event.h"
+#include "fiber_group.h"
+#include "fiber_manager.h"
+#include "test_helper.h"
+
+// NUM_WAITERS fibers wait on one condition variable and are released by a
+// single broadcast, sent with and without the mutex held, for each mutex mode.
+// every tenth waiter uses a timed wait, and every tenth of those gives up
+// before the broadcast. each run reports the time from the broadcast until
+// every waiter has been through the mutex, and how often a fiber found the
+// mutex held in that time. waiters moved onto the mutex by the broadcast are
+// handed the lock in turn, so they don't add to that count.
+#define NUM_THREADS 4
+#define NUM_WAITERS 10000
+#define ROUNDS 5
+#define STACK_SIZE 16384
+
+fiber_mutex_t mutex;
+fiber_cond_t cond;
+int generation = 0;
+int waiting = 0;
+int passed = 0;
+int timeouts = 0;
+void* params[NUM_WAITERS];
+
+void* waiter_function(void* param) {
+  const intptr_t i = (intptr_t)param;
+  fiber_mutex_lock(&mutex);
+  const int my_generation = generation;
+  ++waiting;
+  uint64_t deadline = UINT64_MAX;
+  if (i % 10 == 0) {
+    deadline = fiber_time_now_ns() + (i % 100 ? 10000000000ull : 1000000);
+  }
+  int timed_out = 0;
+  while (generation == my_generation && !timed_out) {
+    timed_out = !fiber_cond_timedwait(&cond, &mutex, deadline);
+  }
+  if (timed_out) {
+    test_assert(errno == ETIMEDOUT);
+    ++timeouts;
+  }
+  ++passed;
+  fiber_mutex_unlock(&mutex);
+  return NULL;
+}
+
+static uint64_t lock_contention_count() {
+  fiber_manager_stats_t stats;
+  fiber_manager_all_stats(&stats);
+  return stats.lock_contention_count;
+}
+
+static void run_test(int mode, int hold_lock) {
+  test_assert(fiber_mutex_init_with_mode(&mutex, mode));
+  test_assert(fiber_cond_init(&cond));
+
+  uint64_t total_ns = 0;
+  uint64_t contention = 0;
+  int round;
+  for (round = 0; round < ROUNDS; ++round) {
+    waiting = 0;
+    passed = 0;
+    timeouts = 0;
+    fiber_group_t group;
+    fiber_group_init(&group);
+    test_assert(fiber_group_spawn_batch(&group, STACK_SIZE, &waiter_function,
+                                        params, NUM_WAITERS));
+    while (1) {
+      fiber_mutex_lock(&mutex);
+      const int all_waiting = waiting == NUM_WAITERS;
+      fiber_mutex_unlock(&mutex);
+      if (all_waiting) {
+        break;
+      }
+      fiber_sleep(0, 1000);
+    }
+
+    const uint64_t contention_before = lock_contention_count();
+    const uint64_t start = fiber_time_now_ns();
+    fiber_mutex_lock(&mutex);
+    ++generation;
+    if (hold_lock) {
+      fiber_cond_broadcast(&cond);
+    }
+    fiber_mutex_unlock(&mutex);
+    if (!hold_lock) {
+      fiber_cond_broadcast(&cond);
+    }
+    test_assert(fiber_group_wait_all(&group));
+    total_ns += fiber_time_now_ns() - start;
+    contention += lock_contention_count() - contention_before;
+    fiber_group_destroy(&group);
+
+    test_assert(passed == NUM_WAITERS);
+    test_assert(timeouts <= NUM_WAITERS / 100);
+  }
+
+  test_assert(fiber_mutex_trylock(&mutex));
+  fiber_mutex_unlock(&mutex);
+  fiber_cond_destroy(&cond);
+  fiber_mutex_destroy(&mutex);
+
+  printf("%s, broadcast %s the lock: %.1f us per broadcast, %.1f ns per "
+         "waiter, lock_contention_count %" PRIu64 " per broadcast\n",
+         mode == FIBER_MUTEX_FAIR ? "fair" : "throughput",
+         hold_lock ? "holding" : "after releasing",
+         total_ns / 1000.0 / ROUNDS,
+         (double)total_ns / ROUNDS / NUM_WAITERS, contention / ROUNDS);
+}
+
+int main() {
+  fiber_manager_init(NUM_THREADS);
+
+  intptr_t i;
+  for (i = 0; i < NUM_WAITERS; ++i) {
+    params[i] = (void*)i;
+  }
+
+  run_test(FIBER_MUTEX_FAIR, 1);
+  run_test(FIBER_MUTEX_FAIR, 0);
+  run_test(FIBER_MUTEX_THROUGHPUT, 1);
+  run_test(FIBER_MUTEX_THROUGHPUT, 0);
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
@@ -0,0 +1,153 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "fiber_event.h"
+#include "fiber_manager.h"
+#include "test_helper.h"
+
+// usage: test_echo_bench [num_connections] [num_messages] [num_threads]
+// clients bounce small messages off an echo server over loopback and report
+// the event syscalls made per message. build with EDGE_TRIGGERED=0 (or
+// -DFIBER_EDGE_TRIGGERED_EVENTS=OFF) to compare against one-shot registration,
+// or with USE_URING=1 (-DFIBER_USE_URING=ON) to compare against io_uring.
+#define DEFAULT_NUM_CONNECTIONS 32
+#define DEFAULT_NUM_MESSAGES 2000
+#define DEFAULT_NUM_THREADS 2
+#define MESSAGE_SIZE 64
+
+int num_connections = 0;
+int num_messages = 0;
+int listen_fd = -1;
+struct sockaddr_in server_addr;
+
+static void read_fully(int fd, char* buf, size_t size) {
+  while (size) {
+    const ssize_t ret = read(fd, buf, size);
+    test_assert(ret > 0);
+    buf += ret;
+    size -= ret;
+  }
+}
+
+static void write_fully(int fd, const char* buf, size_t size) {
+  while (size) {
+    const ssize_t ret = write(fd, buf, size);
+    test_assert(ret > 0);
+    buf += ret;
+    size -= ret;
+  }
+}
+
+void* echo_function(void* param) {
+  const int fd = (intptr_t)param;
+  char buf[MESSAGE_SIZE];
+  ssize_t ret;
+  while ((ret = read(fd, buf, sizeof(buf))) > 0) {
+    write_fully(fd, buf, ret);
+  }
+  close(fd);
+  return NULL;
+}
+
+void* server_function(void* param) {
+  int i;
+  for (i = 0; i < num_connections; ++i) {
+    const int fd = accept(listen_fd, NULL, NULL);
+    test_assert(fd >= 0);
+    fiber_t* const echo =
+        fiber_create(32768, &echo_function, (void*)(intptr_t)fd);
+    test_assert(echo);
+    fiber_detach(echo);
+  }
+  return NULL;
+}
+
+void* client_function(void* param) {
+  const int fd = socket(AF_INET, SOCK_STREAM, 0);
+  test_assert(fd >= 0);
+  test_assert(!connect(fd, (struct sockaddr*)&server_addr,
+                       sizeof(server_addr)));
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+  char out[MESSAGE_SIZE];
+  char in[MESSAGE_SIZE];
+  int i;
+  for (i = 0; i < num_messages; ++i) {
+    memset(out, i, sizeof(out));
+    write_fully(fd, out, sizeof(out));
+    read_fully(fd, in, sizeof(in));
+    test_assert(!memcmp(in, out, sizeof(out)));
+  }
+  close(fd);
+  return NULL;
+}
+
+int main(int argc, char* argv[]) {
+  num_connections = argc > 1 ? atoi(argv[1]) : DEFAULT_NUM_CONNECTIONS;
+  num_messages = argc > 2 ? atoi(argv[2]) : DEFAULT_NUM_MESSAGES;
+  const int num_threads = argc > 3 ? atoi(argv[3]) : DEFAULT_NUM_THREADS;
+  test_assert(num_connections > 0);
+  test_assert(num_messages > 0);
+  test_assert(num_threads > 0);
+
+  fiber_manager_init(num_threads);
+
+  listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  test_assert(listen_fd >= 0);
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  test_assert(!bind(listen_fd, (struct sockaddr*)&server_addr,
+                    sizeof(server_addr)));
+  socklen_t addr_len = sizeof(server_addr);
+  test_assert(!getsockname(listen_fd, (struct sockaddr*)&server_addr,
+                           &addr_len));
+  test_assert(!listen(listen_fd, num_connections));
+
+  fiber_manager_stats_t before = {};
+  fiber_manager_all_stats(&before);
+  const uint64_t start = fiber_time_now_ns();
+
+  fiber_t* const server = fiber_create(32768, &server_function, NULL);
+  test_assert(server);
+  fiber_t** const clients = calloc(num_connections, sizeof(*clients));
+  test_assert(clients);
+  int i;
+  for (i = 0; i < num_connections; ++i) {
+    clients[i] = fiber_create(32768, &client_function, NULL);
+    test_assert(clients[i]);
+  }
+  test_assert(fiber_join(server, NULL));
+  for (i = 0; i < num_connections; ++i) {
+    test_assert(fiber_join(clients[i], NULL));
+  }
+
+  const uint64_t end = fiber_time_now_ns();
+  fiber_manager_stats_t after = {};
+  fiber_manager_all_stats(&after);
+  close(listen_fd);
+  free(clients);
+
+  const uint64_t total = (uint64_t)num_connections * num_messages;
+  printf("%" PRIu64 " echoes on %d connections and %d threads in %" PRIu64
+         " nsec = %" PRIu64 " echoes per second\n",
+         total, num_connections, num_threads, end - start,
+         total * (uint64_t)1000000000 / (end - start));
+  printf(
+      "per echo: %.3f epoll_ctl, %.3f polls, %.3f fibers parked on fds, %.3f "
+      "io_uring_enter\n",
+      (double)(after.event_ctl_count - before.event_ctl_count) / total,
+      (double)(after.poll_count - before.poll_count) / total,
+      (double)(after.event_wait_count - before.event_wait_count) / total,
+      (double)(after.uring_enter_count - before.uring_enter_count) / total);
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
@@ -0,0 +1,80 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include <sys/socket.h>
+
+#include "fiber_event.h"
+#include "fiber_manager.h"
+#include "test_helper.h"
+
+// pairs of fibers bounce a counter over socketpairs while the threads steal
+// fibers from each other, so fds keep following their fibers between the
+// threads' event sets.
+#define NUM_THREADS 4
+#define NUM_PAIRS 64
+#define NUM_ROUND_TRIPS 2000
+
+int sockets[NUM_PAIRS][2];
+
+static void send_count(int fd, int count) {
+  test_assert(write(fd, &count, sizeof(count)) == sizeof(count));
+}
+
+static int recv_count(int fd) {
+  int count = -1;
+  test_assert(read(fd, &count, sizeof(count)) == sizeof(count));
+  return count;
+}
+
+void* ping_function(void* param) {
+  const int fd = sockets[(intptr_t)param][0];
+  int i;
+  for (i = 0; i < NUM_ROUND_TRIPS; ++i) {
+    send_count(fd, i);
+    test_assert(recv_count(fd) == i + 1);
+    if (i % 64 == 0) {
+      fiber_yield();
+    }
+  }
+  return NULL;
+}
+
+void* pong_function(void* param) {
+  const int fd = sockets[(intptr_t)param][1];
+  int i;
+  for (i = 0; i < NUM_ROUND_TRIPS; ++i) {
+    send_count(fd, recv_count(fd) + 1);
+  }
+  return NULL;
+}
+
+int main() {
+  fiber_manager_init(NUM_THREADS);
+
+  fiber_t* fibers[2 * NUM_PAIRS];
+  const uint64_t start = fiber_time_now_ns();
+  intptr_t i;
+  for (i = 0; i < NUM_PAIRS; ++i) {
+    test_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sockets[i]));
+    fibers[2 * i] = fiber_create(20000, &pong_function, (void*)i);
+    fibers[2 * i + 1] = fiber_create(20000, &ping_function, (void*)i);
+    test_assert(fibers[2 * i] && fibers[2 * i + 1]);
+  }
+  for (i = 0; i < 2 * NUM_PAIRS; ++i) {
+    test_assert(fiber_join(fibers[i], NULL));
+  }
+  const uint64_t end = fiber_time_now_ns();
+  for (i = 0; i < NUM_PAIRS; ++i) {
+    close(sockets[i][0]);
+    close(sockets[i][1]);
+  }
+
+  printf("%d round trips on %d threads in %" PRIu64 " nsec = %" PRIu64
+         " nsec per round trip\n",
+         NUM_PAIRS * NUM_ROUND_TRIPS, NUM_THREADS, end - start,
+         (end - start) / (NUM_PAIRS * NUM_ROUND_TRIPS));
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
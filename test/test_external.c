@@ -0,0 +1,215 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "fiber_event.h"
+#include "fiber_manager.h"
+#include "test_helper.h"
+
+// threads which aren't managers hand work to fibers with fiber_spawn_external
+// and fiber_wake_external. the spawns are timed against the usual workaround:
+// writing to a pipe which a fiber reads, spawning a fiber per byte.
+#define NUM_THREADS 2
+#define NUM_SENDERS 4
+#define PER_SENDER 20000
+#define NUM_WAKES 20000
+
+_Atomic int handled = 0;
+
+void* handle_function(void* param) {
+  atomic_fetch_add(&handled, 1);
+  return NULL;
+}
+
+static void wait_for_handled(int count) {
+  while (atomic_load(&handled) < count) {
+    fiber_yield();
+    usleep(100);
+  }
+}
+
+void* spawn_sender(void* param) {
+  int i;
+  for (i = 0; i < PER_SENDER; ++i) {
+    test_assert(fiber_spawn_external(&handle_function, NULL));
+  }
+  return NULL;
+}
+
+void* pipe_sender(void* param) {
+  const int fd = (intptr_t)param;
+  int i;
+  for (i = 0; i < PER_SENDER; ++i) {
+    const char c = 0;
+    test_assert(write(fd, &c, 1) == 1);
+  }
+  return NULL;
+}
+
+void* pipe_reader(void* param) {
+  const int fd = (intptr_t)param;
+  char buf[4096];
+  int remaining = NUM_SENDERS * PER_SENDER;
+  while (remaining > 0) {
+    const ssize_t ret = read(fd, buf, sizeof(buf));
+    test_assert(ret > 0);
+    ssize_t i;
+    for (i = 0; i < ret; ++i) {
+      fiber_t* const f = fiber_create(FIBER_DEFAULT_STACK_SIZE,
+                                      &handle_function, NULL);
+      test_assert(f);
+      fiber_detach(f);
+    }
+    remaining -= ret;
+  }
+  return NULL;
+}
+
+static double run_senders(void* (*sender)(void*), void* param) {
+  atomic_store(&handled, 0);
+  const uint64_t start = fiber_time_now_ns();
+  pthread_t senders[NUM_SENDERS];
+  int i;
+  for (i = 0; i < NUM_SENDERS; ++i) {
+    test_assert(!pthread_create(&senders[i], NULL, sender, param));
+  }
+  wait_for_handled(NUM_SENDERS * PER_SENDER);
+  const uint64_t elapsed = fiber_time_now_ns() - start;
+  for (i = 0; i < NUM_SENDERS; ++i) {
+    pthread_join(senders[i], NULL);
+  }
+  return (double)elapsed / (NUM_SENDERS * PER_SENDER);
+}
+
+// the waiting fiber stores itself here; the waker takes it
+_Atomic(void*) waiter = NULL;
+
+void* wait_function(void* param) {
+  int i;
+  for (i = 0; i < NUM_WAKES; ++i) {
+    fiber_manager_t* const manager = fiber_manager_get();
+    fiber_manager_set_and_wait(manager, (void**)&waiter,
+                               manager->current_fiber);
+  }
+  return NULL;
+}
+
+void* waker(void* param) {
+  int i;
+  for (i = 0; i < NUM_WAKES; ++i) {
+    fiber_t* f;
+    while (!(f = atomic_exchange(&waiter, NULL))) {
+      sched_yield();
+    }
+    test_assert(fiber_wake_external(f));
+  }
+  return NULL;
+}
+
+// threads which aren't managers block in the kernel, even on sockets a fiber
+// would wait for (or hand to the thread's ring)
+void* socket_reader(void* param) {
+  const int fd = (intptr_t)param;
+  char c;
+  test_assert(read(fd, &c, 1) == 1);
+  return NULL;
+}
+
+_Atomic int closer_waiting = 0;
+
+// a fiber blocked reading an fd is woken when another thread closes it
+void* closed_reader(void* param) {
+  const int fd = (intptr_t)param;
+  char c;
+  atomic_store(&closer_waiting, 1);
+  test_assert(read(fd, &c, 1) < 0);
+  return NULL;
+}
+
+void* closer(void* param) {
+  const int fd = (intptr_t)param;
+  while (!atomic_load(&closer_waiting)) {
+    sched_yield();
+  }
+  usleep(10000);  // let the reader block
+  test_assert(!close(fd));
+  return NULL;
+}
+
+static uint64_t external_count() {
+  fiber_manager_stats_t stats;
+  fiber_manager_all_stats(&stats);
+  return stats.external_count;
+}
+
+int main() {
+  test_assert(!fiber_spawn_external(&handle_function, NULL));
+  test_assert(errno == EINVAL);
+
+  fiber_manager_init(NUM_THREADS);
+
+  // from a fiber it's the same as fiber_create
+  test_assert(fiber_spawn_external(&handle_function, NULL));
+  wait_for_handled(1);
+  test_assert(external_count() == 0);
+
+  const double spawn_ns = run_senders(&spawn_sender, NULL);
+  test_assert(external_count() == NUM_SENDERS * PER_SENDER);
+
+  int fds[2];
+  test_assert(!pipe(fds));
+  fiber_t* const reader =
+      fiber_create(FIBER_DEFAULT_STACK_SIZE, &pipe_reader,
+                   (void*)(intptr_t)fds[0]);
+  test_assert(reader);
+  const double pipe_ns = run_senders(&pipe_sender, (void*)(intptr_t)fds[1]);
+  fiber_join(reader, NULL);
+  close(fds[0]);
+  close(fds[1]);
+  printf("spawn_external: %.0f ns/fiber, pipe: %.0f ns/fiber\n", spawn_ns,
+         pipe_ns);
+
+  // a fiber woken from another thread each time it waits
+  fiber_t* const waiting =
+      fiber_create(FIBER_DEFAULT_STACK_SIZE, &wait_function, NULL);
+  test_assert(waiting);
+  const uint64_t start = fiber_time_now_ns();
+  pthread_t waker_thread;
+  test_assert(!pthread_create(&waker_thread, NULL, &waker, NULL));
+  fiber_join(waiting, NULL);
+  printf("wake_external: %.0f ns/wake\n",
+         (double)(fiber_time_now_ns() - start) / NUM_WAKES);
+  pthread_join(waker_thread, NULL);
+  test_assert(external_count() == NUM_SENDERS * PER_SENDER + NUM_WAKES);
+
+  test_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  const char c = 0;
+  test_assert(write(fds[1], &c, 1) == 1);
+  pthread_t reader_thread;
+  test_assert(!pthread_create(&reader_thread, NULL, &socket_reader,
+                              (void*)(intptr_t)fds[0]));
+  pthread_join(reader_thread, NULL);
+  close(fds[0]);
+  close(fds[1]);
+
+  test_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  fiber_t* const blocked = fiber_create(
+      FIBER_DEFAULT_STACK_SIZE, &closed_reader, (void*)(intptr_t)fds[0]);
+  test_assert(blocked);
+  pthread_t closer_thread;
+  test_assert(!pthread_create(&closer_thread, NULL, &closer,
+                              (void*)(intptr_t)fds[0]));
+  fiber_join(blocked, NULL);
+  pthread_join(closer_thread, NULL);
+  close(fds[1]);
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
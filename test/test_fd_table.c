@@ -0,0 +1,107 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "fiber_event.h"
+#include "fiber_fd.h"
+#include "fiber_manager.h"
+#include "test_helper.h"
+
+// the fd table only allocates the pages which hold fds in use, and threads
+// racing to allocate the same page all end up with the same records
+#define NUM_THREADS 4
+#define NUM_PAGES 64
+
+pthread_barrier_t barrier;
+fiber_fd_t* records[NUM_THREADS][NUM_PAGES];
+
+void* race_function(void* param) {
+  const intptr_t index = (intptr_t)param;
+  pthread_barrier_wait(&barrier);
+  int i;
+  for (i = 0; i < NUM_PAGES; ++i) {
+    // well past any fds this process has open, so every page starts out empty
+    const int fd = fiber_fd_max - (i + 1) * FIBER_FD_PAGE_SIZE + i;
+    records[index][i] = fiber_fd_get(fd);
+  }
+  return NULL;
+}
+
+int main() {
+  // nothing is tracked until the fibers start
+  test_assert(!fiber_fd_find(0));
+  int fds[2];
+  test_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+  fiber_manager_init(NUM_THREADS);
+  test_assert(fiber_fd_max > (NUM_PAGES + 1) * FIBER_FD_PAGE_SIZE);
+  test_assert(!fiber_fd_find(fds[0]));
+
+  // the socketpair made before init is still a plain blocking socket
+  test_assert(write(fds[1], "x", 1) == 1);
+  char c;
+  test_assert(read(fds[0], &c, 1) == 1 && c == 'x');
+  close(fds[0]);
+  close(fds[1]);
+
+  // out of range fds have no record
+  errno = 0;
+  test_assert(!fiber_fd_get(-1) && errno == EBADF);
+  errno = 0;
+  test_assert(!fiber_fd_get(fiber_fd_max) && errno == EBADF);
+  test_assert(!fiber_wait_for_event(-1, FIBER_POLL_IN));
+
+  // an fd the event set won't take fails the wait instead of parking, every
+  // time it's waited on
+  const int null_fd = open("/dev/null", O_RDONLY);
+  test_assert(null_fd >= 0);
+  errno = 0;
+  test_assert(!fiber_wait_for_event(null_fd, FIBER_POLL_IN) && errno == EPERM);
+  errno = 0;
+  test_assert(!fiber_wait_for_event(null_fd, FIBER_POLL_IN) && errno == EPERM);
+  const fiber_event_fd_t null_wait = {null_fd, FIBER_POLL_IN};
+  errno = 0;
+  test_assert(!fiber_wait_for_any_event(&null_wait, 1, UINT64_MAX) &&
+              errno == EPERM);
+  close(null_fd);
+
+  // records are created with their page and are cache line aligned
+  test_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  fiber_fd_t* const info = fiber_fd_find(fds[0]);
+  test_assert(info);
+  test_assert(fiber_fd_get(fds[0]) == info);
+  test_assert((uintptr_t)info % FIBER_CACHELINE_SIZE == 0);
+  test_assert(fiber_fd_find(fds[1]) == info + (fds[1] - fds[0]));
+  close(fds[0]);
+  close(fds[1]);
+
+  // threads racing to allocate pages agree on the winner
+  pthread_barrier_init(&barrier, NULL, NUM_THREADS);
+  pthread_t threads[NUM_THREADS];
+  intptr_t i;
+  for (i = 1; i < NUM_THREADS; ++i) {
+    test_assert(!pthread_create(&threads[i], NULL, &race_function, (void*)i));
+  }
+  race_function(NULL);
+  for (i = 1; i < NUM_THREADS; ++i) {
+    test_assert(!pthread_join(threads[i], NULL));
+  }
+  int page;
+  for (page = 0; page < NUM_PAGES; ++page) {
+    test_assert(records[0][page]);
+    const int fd = fiber_fd_max - (page + 1) * FIBER_FD_PAGE_SIZE + page;
+    test_assert(fiber_fd_find(fd) == records[0][page]);
+    for (i = 1; i < NUM_THREADS; ++i) {
+      test_assert(records[i][page] == records[0][page]);
+    }
+  }
+  pthread_barrier_destroy(&barrier);
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
@@ -0,0 +1,136 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include <errno.h>
+#include <stdio.h>
+
+#include "fiber_event.h"
+#include "fiber_group.h"
+#include "fiber_manager.h"
+#include "test_helper.h"
+
+// a fan out of FAN_OUT children is gathered with fiber_group_wait_all, and
+// timed against creating the children and joining them one by one
+#define NUM_THREADS 4
+#define FAN_OUT 1000
+#define ROUNDS 50
+#define STACK_SIZE 16384
+
+intptr_t results[FAN_OUT];
+void* params[FAN_OUT];
+
+void* child_function(void* param) {
+  const intptr_t i = (intptr_t)param;
+  if (i % 8 == 0) {
+    fiber_yield();
+  }
+  results[i] = i * 2;
+  return NULL;
+}
+
+_Atomic int sleepers_done = 0;
+
+void* sleep_function(void* param) {
+  fiber_sleep(0, (intptr_t)param);
+  atomic_fetch_add(&sleepers_done, 1);
+  return NULL;
+}
+
+static void check_results() {
+  intptr_t i;
+  for (i = 0; i < FAN_OUT; ++i) {
+    test_assert(results[i] == i * 2);
+    results[i] = 0;
+  }
+}
+
+static uint64_t fan_out_group() {
+  const uint64_t start = fiber_time_now_ns();
+  fiber_group_t group;
+  fiber_group_init(&group);
+  test_assert(fiber_group_spawn_batch(&group, STACK_SIZE, &child_function,
+                                      params, FAN_OUT));
+  test_assert(fiber_group_wait_all(&group));
+  fiber_group_destroy(&group);
+  return fiber_time_now_ns() - start;
+}
+
+static uint64_t fan_out_join() {
+  static fiber_t* children[FAN_OUT];
+  const uint64_t start = fiber_time_now_ns();
+  intptr_t i;
+  for (i = 0; i < FAN_OUT; ++i) {
+    children[i] = fiber_create(STACK_SIZE, &child_function, (void*)i);
+    test_assert(children[i]);
+  }
+  for (i = 0; i < FAN_OUT; ++i) {
+    test_assert(fiber_join(children[i], NULL));
+  }
+  return fiber_time_now_ns() - start;
+}
+
+int main() {
+  fiber_manager_init(NUM_THREADS);
+
+  intptr_t i;
+  for (i = 0; i < FAN_OUT; ++i) {
+    params[i] = (void*)i;
+  }
+
+  fiber_group_t group;
+  fiber_group_init(&group);
+  test_assert(fiber_group_wait_all(&group));
+  test_assert(!fiber_group_wait_any(&group));
+  test_assert(errno == ECHILD);
+
+  // one at a time, then as a batch
+  for (i = 0; i < FAN_OUT; ++i) {
+    test_assert(
+        fiber_group_spawn(&group, STACK_SIZE, &child_function, (void*)i));
+  }
+  test_assert(fiber_group_wait_all(&group));
+  test_assert(fiber_group_running(&group) == 0);
+  check_results();
+  test_assert(!fiber_group_wait_any(&group));  // all were reported
+
+  test_assert(fiber_group_spawn_batch(&group, STACK_SIZE, &child_function,
+                                      params, FAN_OUT));
+  test_assert(fiber_group_wait_all(&group));
+  check_results();
+
+  // wait_any reports each child once, as it finishes
+  for (i = 1; i <= 3; ++i) {
+    test_assert(fiber_group_spawn(&group, STACK_SIZE, &sleep_function,
+                                  (void*)(i * 10000)));
+  }
+  for (i = 1; i <= 3; ++i) {
+    test_assert(fiber_group_wait_any(&group));
+    test_assert(atomic_load(&sleepers_done) >= i);
+  }
+  test_assert(!fiber_group_wait_any(&group));
+  test_assert(errno == ECHILD);
+  fiber_group_destroy(&group);
+
+  // joined children still have to be switched back to before they're done, so
+  // the join loops go last, where that work isn't left for the group to pay
+  // for. the first round warms the fiber cache.
+  fan_out_group();
+  check_results();
+  uint64_t group_ns = 0;
+  uint64_t join_ns = 0;
+  int round;
+  for (round = 0; round < ROUNDS; ++round) {
+    group_ns += fan_out_group();
+    check_results();
+  }
+  for (round = 0; round < ROUNDS; ++round) {
+    join_ns += fan_out_join();
+    check_results();
+  }
+  printf("%d way fan out: group %.1f us, join loop %.1f us\n", FAN_OUT,
+         group_ns / 1000.0 / ROUNDS, join_ns / 1000.0 / ROUNDS);
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
@@ -28,12 +28,28 @@ static inline void fiber_manager_print_stats() {
          "\nsignal_spin_count: %" PRIu64 "\nmulti_signal_spin_count: %" PRIu64
          "\nwake_mpsc_spin_count: %" PRIu64 "\nwake_mpmc_spin_count: %" PRIu64
          "\npoll_count: %" PRIu64 "\nevent_wait_count: %" PRIu64
-         "\nlock_contention_count: %" PRIu64 "\n",
+         "\nlock_contention_count: %" PRIu64
+         "\nfiber_cache_hit_count: %" PRIu64
+         "\nfiber_cache_miss_count: %" PRIu64 "\npark_count: %" PRIu64
+         "\nrun_next_count: %" PRIu64 "\nevent_migrate_count: %" PRIu64
+         "\nevent_ctl_count: %" PRIu64 "\nuring_op_count: %" PRIu64
+         "\nuring_enter_count: %" PRIu64 "\nblocking_count: %" PRIu64
+         "\nsysmon_handoff_count: %" PRIu64 "\nsysmon_check_count: %" PRIu64
+         "\nslice_yield_count: %" PRIu64
+         "\npreempt_count: %" PRIu64 "\nexternal_count: %" PRIu64
+         "\nspinlock_park_count: %" PRIu64 "\n",
          stats.yield_count, stats.steal_count, stats.failed_steal_count,
          stats.spin_count, stats.signal_spin_count,
          stats.multi_signal_spin_count, stats.wake_mpsc_spin_count,
          stats.wake_mpmc_spin_count, stats.poll_count, stats.event_wait_count,
-         stats.lock_contention_count);
+         stats.lock_contention_count, stats.fiber_cache_hit_count,
+         stats.fiber_cache_miss_count, stats.park_count, stats.run_next_count,
+         stats.event_migrate_count, stats.event_ctl_count,
+         stats.uring_op_count, stats.uring_enter_count, stats.blocking_count,
+         stats.sysmon_handoff_count, stats.sysmon_check_count,
+         stats.slice_yield_count,
+         stats.preempt_count, stats.external_count,
+         stats.spinlock_park_count);
 }
 
 #endif
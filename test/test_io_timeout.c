@@ -0,0 +1,149 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "fiber_event.h"
+#include "fiber_manager.h"
+#include "test_helper.h"
+
+// SO_RCVTIMEO and SO_SNDTIMEO make the shims give up with EAGAIN (EINPROGRESS
+// for connect) instead of suspending the fiber forever. other fibers keep
+// running while one waits for its timeout.
+#define NUM_THREADS 2
+#define TIMEOUT_MS 20
+
+volatile int counting = 0;
+volatile int count = 0;
+
+void* counter_function(void* param) {
+  while (counting) {
+    ++count;
+    fiber_yield();
+  }
+  return NULL;
+}
+
+int sockets[2] = {-1, -1};
+
+void* late_writer_function(void* param) {
+  fiber_sleep(0, (intptr_t)param);
+  test_assert(write(sockets[1], "x", 1) == 1);
+  return NULL;
+}
+
+static void set_timeout(int fd, int optname, int ms) {
+  struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
+  test_assert(!setsockopt(fd, SOL_SOCKET, optname, &tv, sizeof(tv)));
+}
+
+// runs op, which must fail with expected_errno no sooner than TIMEOUT_MS
+#define test_times_out(op, expected_errno)                                     \
+  do {                                                                         \
+    const uint64_t start = fiber_time_now_ns();                                \
+    count = 0;                                                                 \
+    test_assert((op) < 0);                                                     \
+    test_assert(errno == (expected_errno));                                    \
+    test_assert(fiber_time_now_ns() - start >= TIMEOUT_MS * 1000000);          \
+    test_assert(count > 0);                                                    \
+  } while (0)
+
+int main() {
+  fiber_manager_init(NUM_THREADS);
+
+  counting = 1;
+  fiber_t* const counter = fiber_create(20000, &counter_function, NULL);
+  test_assert(counter);
+
+  test_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+  char c;
+
+  // fiber_wait_for_event_timeout() on its own
+  uint64_t start = fiber_time_now_ns();
+  test_assert(!fiber_wait_for_event_timeout(sockets[0], FIBER_POLL_IN,
+                                            start + TIMEOUT_MS * 1000000));
+  test_assert(errno == ETIMEDOUT);
+  test_assert(fiber_time_now_ns() - start >= TIMEOUT_MS * 1000000);
+  test_assert(!fiber_wait_for_event_timeout(sockets[0], FIBER_POLL_IN, 0));
+  test_assert(errno == ETIMEDOUT);
+  test_assert(fiber_wait_for_event_timeout(sockets[1], FIBER_POLL_OUT,
+                                           fiber_time_now_ns() + 1000000000));
+
+  // reads time out, or complete if the data arrives in time
+  set_timeout(sockets[0], SO_RCVTIMEO, TIMEOUT_MS);
+  test_times_out(read(sockets[0], &c, 1), EAGAIN);
+  test_times_out(recv(sockets[0], &c, 1, 0), EAGAIN);
+  fiber_t* writer =
+      fiber_create(20000, &late_writer_function, (void*)(intptr_t)5000);
+  test_assert(writer);
+  set_timeout(sockets[0], SO_RCVTIMEO, 1000);
+  test_assert(read(sockets[0], &c, 1) == 1);
+  test_assert(fiber_join(writer, NULL));
+
+  // a zero timeout waits forever again
+  set_timeout(sockets[0], SO_RCVTIMEO, TIMEOUT_MS);
+  set_timeout(sockets[0], SO_RCVTIMEO, 0);
+  writer = fiber_create(20000, &late_writer_function,
+                        (void*)(intptr_t)(2 * TIMEOUT_MS * 1000));
+  test_assert(writer);
+  test_assert(read(sockets[0], &c, 1) == 1);
+  test_assert(fiber_join(writer, NULL));
+
+  // writes time out once the peer stops reading, having sent what fit
+  set_timeout(sockets[1], SO_SNDTIMEO, TIMEOUT_MS);
+  static char buf[65536];
+  ssize_t ret;
+  while ((ret = write(sockets[1], buf, sizeof(buf))) > 0) {
+  }
+  test_assert(errno == EAGAIN);
+  test_times_out(send(sockets[1], buf, sizeof(buf), 0), EAGAIN);
+  close(sockets[0]);
+  close(sockets[1]);
+
+  // accept times out, and accepted sockets inherit the listener's timeouts
+  const int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  test_assert(listen_fd >= 0);
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  test_assert(!bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)));
+  socklen_t addr_len = sizeof(addr);
+  test_assert(!getsockname(listen_fd, (struct sockaddr*)&addr, &addr_len));
+  test_assert(!listen(listen_fd, 1));
+  set_timeout(listen_fd, SO_RCVTIMEO, TIMEOUT_MS);
+  test_times_out(accept(listen_fd, NULL, NULL), EAGAIN);
+
+  const int client = socket(AF_INET, SOCK_STREAM, 0);
+  test_assert(client >= 0);
+  test_assert(!connect(client, (struct sockaddr*)&addr, sizeof(addr)));
+  const int server = accept(listen_fd, NULL, NULL);
+  test_assert(server >= 0);
+  test_times_out(read(server, &c, 1), EAGAIN);
+  struct timeval tv = {};
+  socklen_t tv_len = sizeof(tv);
+  test_assert(!getsockopt(server, SOL_SOCKET, SO_RCVTIMEO, &tv, &tv_len));
+  test_assert(tv.tv_sec == 0 && tv.tv_usec == TIMEOUT_MS * 1000);
+
+  // the timeout belongs to the fd, not to whatever reuses its number
+  close(server);
+  close(client);
+  close(listen_fd);
+  test_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+  writer = fiber_create(20000, &late_writer_function,
+                        (void*)(intptr_t)(2 * TIMEOUT_MS * 1000));
+  test_assert(writer);
+  test_assert(read(sockets[0], &c, 1) == 1);
+  test_assert(fiber_join(writer, NULL));
+  close(sockets[0]);
+  close(sockets[1]);
+
+  counting = 0;
+  test_assert(fiber_join(counter, NULL));
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
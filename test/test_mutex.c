@@ -1,30 +1,60 @@
 // SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
 // SPDX-License-Identifier: MIT
 
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fiber_event.h"
 #include "fiber_manager.h"
 #include "fiber_mutex.h"
 #include "test_helper.h"
 
+// usage: test_mutex [num_threads] [critical section length]
+//
+// NUM_FIBERS fibers each take the lock PER_FIBER_COUNT times, with each mode
+// and critical sections of each of the CRITICAL_SECTIONS lengths (or just the
+// one given). each run reports its time per lock and how often a locker had
+// to wait.
 int volatile counter = 0;
 fiber_mutex_t mutex;
+int critical_section = 0;
 #define PER_FIBER_COUNT 10000
 #define NUM_FIBERS 100
 #define NUM_THREADS 4
 
+static const int CRITICAL_SECTIONS[] = {0, 50, 500};
+#define NUM_CRITICAL_SECTIONS \
+  (sizeof(CRITICAL_SECTIONS) / sizeof(CRITICAL_SECTIONS[0]))
+
 void* run_function(void* param) {
   int i;
   for (i = 0; i < PER_FIBER_COUNT; ++i) {
     fiber_mutex_lock(&mutex);
     ++counter;
+    int j;
+    for (j = 0; j < critical_section; ++j) {
+      // the lock is held, so this is the only writer
+      counter = counter + 1 - 1;
+    }
     fiber_mutex_unlock(&mutex);
   }
   return NULL;
 }
 
-int main() {
-  fiber_manager_init(NUM_THREADS);
+static uint64_t lock_contention_count() {
+  fiber_manager_stats_t stats;
+  fiber_manager_all_stats(&stats);
+  return stats.lock_contention_count;
+}
 
-  fiber_mutex_init(&mutex);
+static void run_test(int mode, int length) {
+  test_assert(fiber_mutex_init_with_mode(&mutex, mode));
+  counter = 0;
+  critical_section = length;
+  const uint64_t contention_before = lock_contention_count();
+  const uint64_t start = fiber_time_now_ns();
 
   fiber_t* fibers[NUM_FIBERS];
   int i;
@@ -36,12 +66,40 @@ int main() {
     fiber_join(fibers[i], NULL);
   }
 
+  const uint64_t elapsed = fiber_time_now_ns() - start;
   test_assert(counter == NUM_FIBERS * PER_FIBER_COUNT);
   test_assert(fiber_mutex_trylock(&mutex));
   test_assert(!fiber_mutex_trylock(&mutex));
   fiber_mutex_unlock(&mutex);
   fiber_mutex_destroy(&mutex);
 
+  printf("%s critical_section %d: %.1f ns/lock lock_contention_count %" PRIu64
+         "\n",
+         mode == FIBER_MUTEX_FAIR ? "fair" : "throughput", length,
+         (double)elapsed / (NUM_FIBERS * PER_FIBER_COUNT),
+         lock_contention_count() - contention_before);
+}
+
+int main(int argc, char* argv[]) {
+  int num_threads = NUM_THREADS;
+  if (argc > 1) {
+    num_threads = atoi(argv[1]);
+  }
+  fiber_manager_init(num_threads);
+
+  test_assert(!fiber_mutex_init_with_mode(&mutex, 2));
+  test_assert(errno == EINVAL);
+
+  size_t i;
+  for (i = 0; i < NUM_CRITICAL_SECTIONS; ++i) {
+    const int length = argc > 2 ? atoi(argv[2]) : CRITICAL_SECTIONS[i];
+    run_test(FIBER_MUTEX_FAIR, length);
+    run_test(FIBER_MUTEX_THROUGHPUT, length);
+    if (argc > 2) {
+      break;
+    }
+  }
+
   fiber_manager_print_stats();
   fiber_shutdown();
   return 0;
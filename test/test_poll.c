@@ -0,0 +1,220 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#include "fiber_event.h"
+#include "fiber_manager.h"
+#include "test_helper.h"
+
+// a poll() driven client multiplexes many connections to echo server fibers.
+// poll(), select() and epoll_wait() suspend only the calling fiber, so the
+// servers (and a fiber counting while others sit in long timeouts) keep
+// running on the same threads.
+#define NUM_THREADS 2
+#define NUM_CONNECTIONS 64
+#define NUM_ROUNDS 50
+
+int listen_fd = -1;
+struct sockaddr_in listen_addr;
+
+void* echo_function(void* param) {
+  const int fd = (intptr_t)param;
+  int value;
+  ssize_t ret;
+  while ((ret = read(fd, &value, sizeof(value))) > 0) {
+    test_assert(ret == sizeof(value));
+    test_assert(write(fd, &value, sizeof(value)) == sizeof(value));
+  }
+  close(fd);
+  return NULL;
+}
+
+void* server_function(void* param) {
+  int i;
+  for (i = 0; i < NUM_CONNECTIONS; ++i) {
+    const int fd = accept(listen_fd, NULL, NULL);
+    test_assert(fd >= 0);
+    fiber_t* const echo =
+        fiber_create(20000, &echo_function, (void*)(intptr_t)fd);
+    test_assert(echo);
+    fiber_detach(echo);
+  }
+  return NULL;
+}
+
+void* poll_client_function(void* param) {
+  struct pollfd fds[NUM_CONNECTIONS];
+  int i;
+  for (i = 0; i < NUM_CONNECTIONS; ++i) {
+    fds[i].fd = socket(AF_INET, SOCK_STREAM, 0);
+    test_assert(fds[i].fd >= 0);
+    test_assert(!connect(fds[i].fd, (struct sockaddr*)&listen_addr,
+                         sizeof(listen_addr)));
+    fds[i].events = POLLIN;
+  }
+
+  int round;
+  for (round = 0; round < NUM_ROUNDS; ++round) {
+    for (i = 0; i < NUM_CONNECTIONS; ++i) {
+      const int value = round * NUM_CONNECTIONS + i;
+      test_assert(write(fds[i].fd, &value, sizeof(value)) == sizeof(value));
+    }
+    int pending = NUM_CONNECTIONS;
+    while (pending) {
+      const int ready = poll(fds, NUM_CONNECTIONS, -1);
+      test_assert(ready > 0);
+      int seen = 0;
+      for (i = 0; i < NUM_CONNECTIONS; ++i) {
+        if (!fds[i].revents) {
+          continue;
+        }
+        test_assert(fds[i].revents == POLLIN);
+        int value = -1;
+        test_assert(read(fds[i].fd, &value, sizeof(value)) == sizeof(value));
+        test_assert(value == round * NUM_CONNECTIONS + i);
+        ++seen;
+      }
+      test_assert(seen == ready);
+      pending -= ready;
+    }
+  }
+
+  for (i = 0; i < NUM_CONNECTIONS; ++i) {
+    close(fds[i].fd);
+  }
+  return NULL;
+}
+
+volatile int counting = 0;
+volatile int count = 0;
+
+void* counter_function(void* param) {
+  while (counting) {
+    ++count;
+    fiber_yield();
+  }
+  return NULL;
+}
+
+int timeout_fds[2] = {-1, -1};
+
+void* writer_function(void* param) {
+  fiber_sleep(0, 20000);
+  test_assert(write(timeout_fds[1], "x", 1) == 1);
+  return NULL;
+}
+
+int main() {
+  fiber_manager_init(NUM_THREADS);
+
+  listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  test_assert(listen_fd >= 0);
+  memset(&listen_addr, 0, sizeof(listen_addr));
+  listen_addr.sin_family = AF_INET;
+  listen_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  test_assert(!bind(listen_fd, (struct sockaddr*)&listen_addr,
+                    sizeof(listen_addr)));
+  socklen_t addr_len = sizeof(listen_addr);
+  test_assert(!getsockname(listen_fd, (struct sockaddr*)&listen_addr,
+                           &addr_len));
+  test_assert(!listen(listen_fd, NUM_CONNECTIONS));
+
+  fiber_t* const server = fiber_create(20000, &server_function, NULL);
+  fiber_t* const client = fiber_create(40000, &poll_client_function, NULL);
+  test_assert(server && client);
+  test_assert(fiber_join(server, NULL));
+  test_assert(fiber_join(client, NULL));
+  close(listen_fd);
+
+  test_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, timeout_fds));
+
+  // timeouts expire, and other fibers run while this one waits
+  counting = 1;
+  fiber_t* const counter = fiber_create(20000, &counter_function, NULL);
+  test_assert(counter);
+  struct pollfd pfd = {timeout_fds[0], POLLIN, 0};
+  uint64_t start = fiber_time_now_ns();
+  test_assert(poll(&pfd, 1, 20) == 0);
+  test_assert(fiber_time_now_ns() - start >= 20000000);
+  test_assert(count > 0);
+
+  // a zero timeout doesn't wait
+  test_assert(poll(&pfd, 1, 0) == 0);
+
+  // fds which are never ready don't stop the others from waking the poll
+  fiber_t* writer = fiber_create(20000, &writer_function, NULL);
+  test_assert(writer);
+  struct pollfd both[2] = {{timeout_fds[1], POLLPRI, 0},
+                           {timeout_fds[0], POLLIN, 0}};
+  test_assert(poll(both, 2, 1000) == 1);
+  test_assert(!both[0].revents && both[1].revents == POLLIN);
+  test_assert(fiber_join(writer, NULL));
+  char c;
+  test_assert(read(timeout_fds[0], &c, 1) == 1);
+
+  // select() reports the ready fd, clears the rest and updates the timeout
+  fd_set readfds;
+  FD_ZERO(&readfds);
+  FD_SET(timeout_fds[0], &readfds);
+  struct timeval tv = {0, 20000};
+  count = 0;
+  test_assert(select(timeout_fds[0] + 1, &readfds, NULL, NULL, &tv) == 0);
+  test_assert(!FD_ISSET(timeout_fds[0], &readfds));
+  test_assert(tv.tv_sec == 0 && tv.tv_usec == 0);
+  test_assert(count > 0);
+
+  writer = fiber_create(20000, &writer_function, NULL);
+  test_assert(writer);
+  fd_set writefds;
+  FD_ZERO(&readfds);
+  FD_ZERO(&writefds);
+  FD_SET(timeout_fds[0], &readfds);
+  FD_SET(timeout_fds[0], &writefds);
+  tv.tv_sec = 1;
+  tv.tv_usec = 0;
+  test_assert(select(timeout_fds[0] + 1, &readfds, &writefds, NULL, &tv) ==
+              1);
+  test_assert(!FD_ISSET(timeout_fds[0], &readfds));
+  test_assert(FD_ISSET(timeout_fds[0], &writefds));
+  test_assert(fiber_join(writer, NULL));
+
+  FD_ZERO(&readfds);
+  FD_SET(timeout_fds[0], &readfds);
+  test_assert(select(timeout_fds[0] + 1, &readfds, NULL, NULL, NULL) == 1);
+  test_assert(FD_ISSET(timeout_fds[0], &readfds));
+  test_assert(read(timeout_fds[0], &c, 1) == 1);
+
+  // epoll_wait() waits for the epoll fd itself to become readable
+  const int epfd = epoll_create1(0);
+  test_assert(epfd >= 0);
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.fd = timeout_fds[0];
+  test_assert(!epoll_ctl(epfd, EPOLL_CTL_ADD, timeout_fds[0], &ev));
+  count = 0;
+  start = fiber_time_now_ns();
+  test_assert(epoll_wait(epfd, &ev, 1, 20) == 0);
+  test_assert(fiber_time_now_ns() - start >= 20000000);
+  test_assert(count > 0);
+  writer = fiber_create(20000, &writer_function, NULL);
+  test_assert(writer);
+  test_assert(epoll_wait(epfd, &ev, 1, -1) == 1);
+  test_assert(ev.data.fd == timeout_fds[0] && (ev.events & EPOLLIN));
+  test_assert(fiber_join(writer, NULL));
+  close(epfd);
+
+  counting = 0;
+  test_assert(fiber_join(counter, NULL));
+  close(timeout_fds[0]);
+  close(timeout_fds[1]);
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
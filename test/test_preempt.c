@@ -0,0 +1,83 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include <sys/socket.h>
+
+#include "fiber_event.h"
+#include "fiber_manager.h"
+#include "test_helper.h"
+
+// a fiber which never blocks shares its manager by calling fiber_maybe_yield()
+// now and then. with preemption enabled, a shimmed io call does too once the
+// timer has flagged the fiber.
+#define SLICE_NS 1000000
+#define SPIN_NS (20 * SLICE_NS)
+
+volatile int ticking = 1;
+volatile int ticks = 0;
+
+void* tick_function(void* param) {
+  while (ticking) {
+    ++ticks;
+    fiber_yield();
+  }
+  return NULL;
+}
+
+int main() {
+  test_assert(fiber_manager_set_time_slice(SLICE_NS));
+  test_assert(fiber_manager_set_preemption(1));
+  fiber_manager_init(1);
+  test_assert(!fiber_manager_set_time_slice(0));
+  test_assert(!fiber_manager_set_preemption(0));
+  test_assert(fiber_manager_get_time_slice() == SLICE_NS);
+
+  fiber_t* const ticker = fiber_create(20000, &tick_function, NULL);
+  test_assert(ticker);
+
+  // spinning yields once a slice, letting the ticker run
+  int yields = 0;
+  int before = ticks;
+  const uint64_t start = fiber_time_now_ns();
+  while (fiber_time_now_ns() - start < SPIN_NS) {
+    yields += fiber_maybe_yield();
+  }
+  test_assert(yields > 0);
+  test_assert(yields <= SPIN_NS / SLICE_NS + 1);
+  test_assert(ticks > before);
+
+  // the timer flags a fiber which has used up its slice without checking
+  int fds[2];
+  test_assert(!pipe(fds));
+  while (!fiber_manager_get()->should_yield) {
+    cpu_relax();
+  }
+  before = ticks;
+  test_assert(write(fds[1], "x", 1) == 1);
+  test_assert(ticks > before);
+  close(fds[0]);
+  close(fds[1]);
+
+  // and so does every member of the send and recv families
+  test_assert(!socketpair(AF_UNIX, SOCK_DGRAM, 0, fds));
+  while (!fiber_manager_get()->should_yield) {
+    cpu_relax();
+  }
+  before = ticks;
+  test_assert(sendto(fds[1], "x", 1, 0, NULL, 0) == 1);
+  test_assert(ticks > before);
+  close(fds[0]);
+  close(fds[1]);
+
+  ticking = 0;
+  test_assert(fiber_join(ticker, NULL));
+
+  fiber_manager_stats_t stats;
+  fiber_manager_all_stats(&stats);
+  test_assert(stats.slice_yield_count >= yields + 1);
+  test_assert(stats.preempt_count > 0);
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
@@ -0,0 +1,124 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include <stdlib.h>
+
+#include "fiber_event.h"
+#include "fiber_manager.h"
+#include "test_helper.h"
+
+// foreground fibers are created in batches of background work, and measure how
+// long they wait to start. at the background's priority they queue behind it;
+// at a higher priority they shouldn't.
+#define NUM_BATCHES 50
+#define BATCH_SIZE 64
+#define FOREGROUND_EVERY 8
+#define NUM_SAMPLES (NUM_BATCHES * BATCH_SIZE / FOREGROUND_EVERY)
+#define BACKGROUND_NS 20000
+
+void* background_function(void* param) {
+  const uint64_t start = fiber_time_now_ns();
+  while (fiber_time_now_ns() - start < BACKGROUND_NS) {
+  }
+  return NULL;
+}
+
+void* foreground_function(void* param) {
+  uint64_t* const latency = (uint64_t*)param;
+  *latency = fiber_time_now_ns() - *latency;
+  return NULL;
+}
+
+int compare_latency(const void* a, const void* b) {
+  const uint64_t x = *(const uint64_t*)a;
+  const uint64_t y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+// returns the foreground's median wait. the 99th percentile is reported too,
+// but is at the mercy of the OS scheduler.
+uint64_t run_batches(int foreground_priority) {
+  static uint64_t latencies[NUM_SAMPLES];
+  fiber_attr_t background;
+  fiber_attr_init(&background);
+  background.priority = FIBER_PRIORITY_LOW;
+  fiber_attr_t foreground;
+  fiber_attr_init(&foreground);
+  foreground.priority = foreground_priority;
+
+  int sample = 0;
+  int batch;
+  for (batch = 0; batch < NUM_BATCHES; ++batch) {
+    fiber_t* fibers[BATCH_SIZE];
+    int i;
+    for (i = 0; i < BATCH_SIZE; ++i) {
+      if (i % FOREGROUND_EVERY == 0) {
+        uint64_t* const latency = &latencies[sample++];
+        *latency = fiber_time_now_ns();
+        fibers[i] = fiber_create_with_attr(&foreground, &foreground_function,
+                                           latency);
+      } else {
+        fibers[i] =
+            fiber_create_with_attr(&background, &background_function, NULL);
+      }
+      test_assert(fibers[i]);
+    }
+    for (i = 0; i < BATCH_SIZE; ++i) {
+      test_assert(fiber_join(fibers[i], NULL));
+    }
+  }
+
+  qsort(latencies, NUM_SAMPLES, sizeof(*latencies), &compare_latency);
+  printf("foreground at priority %d: p50 %" PRIu64 " nsec, p99 %" PRIu64
+         " nsec\n",
+         foreground_priority, latencies[NUM_SAMPLES / 2],
+         latencies[NUM_SAMPLES * 99 / 100]);
+  return latencies[NUM_SAMPLES / 2];
+}
+
+volatile int low_ran = 0;
+
+void* spin_until_low_ran(void* param) {
+  while (!low_ran) {
+    fiber_yield();
+  }
+  return NULL;
+}
+
+void* set_low_ran(void* param) {
+  low_ran = 1;
+  return NULL;
+}
+
+int main() {
+  fiber_manager_init(1);
+
+  fiber_attr_t attr;
+  fiber_attr_init(&attr);
+  attr.priority = FIBER_NUM_PRIORITIES;
+  test_assert(!fiber_create_with_attr(&attr, &set_low_ran, NULL));
+  fiber_t* const self = fiber_manager_get()->current_fiber;
+  test_assert(fiber_get_priority(self) == FIBER_PRIORITY_NORMAL);
+  test_assert(!fiber_set_priority(self, -1));
+
+  // two high priority fibers yielding to each other don't starve a low one
+  attr.priority = FIBER_PRIORITY_HIGH;
+  fiber_t* const high_one = fiber_create_with_attr(&attr, &spin_until_low_ran,
+                                                   NULL);
+  fiber_t* const high_two = fiber_create_with_attr(&attr, &spin_until_low_ran,
+                                                   NULL);
+  attr.priority = FIBER_PRIORITY_LOW;
+  fiber_t* const low = fiber_create_with_attr(&attr, &set_low_ran, NULL);
+  test_assert(high_one && high_two && low);
+  test_assert(fiber_join(high_one, NULL));
+  test_assert(fiber_join(high_two, NULL));
+  test_assert(fiber_join(low, NULL));
+
+  const uint64_t same_p50 = run_batches(FIBER_PRIORITY_LOW);
+  const uint64_t high_p50 = run_batches(FIBER_PRIORITY_HIGH);
+  test_assert(high_p50 < same_p50);
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
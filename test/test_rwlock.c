@@ -1,14 +1,29 @@
 // SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
 // SPDX-License-Identifier: MIT
 
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
 #include "fiber_barrier.h"
+#include "fiber_event.h"
 #include "fiber_manager.h"
 #include "fiber_rwlock.h"
 #include "test_helper.h"
 
+// usage: test_rwlock [num_threads]
+//
+// NUM_FIBERS fibers mix read and write locks on one lock, for each mode. then,
+// for each number of reader fibers from 1 to the number of threads, the
+// readers hammer a read-mostly lock (one lock in WRITE_INTERVAL is a write)
+// and report their time per lock, showing how reads scale with each mode.
 #define PER_FIBER_COUNT 10000
 #define NUM_FIBERS 100
-#define NUM_THREADS 2
+#define NUM_THREADS 4
+#define READS_PER_FIBER 200000
+#define WRITE_INTERVAL 10000
 
 fiber_rwlock_t mutex;
 volatile int counter = 0;
@@ -61,11 +76,36 @@ void* run_function(void* param) {
   return NULL;
 }
 
-int main() {
-  fiber_manager_init(NUM_THREADS);
+volatile int table_value = 0;
 
-  fiber_rwlock_init(&mutex);
+void* read_mostly_function(void* param) {
+  fiber_barrier_wait(&barrier);
+  int i;
+  for (i = 1; i <= READS_PER_FIBER; ++i) {
+    if (i % WRITE_INTERVAL == 0) {
+      fiber_rwlock_wrlock(&mutex);
+      table_value = table_value + 1;
+      fiber_rwlock_wrunlock(&mutex);
+    } else {
+      fiber_rwlock_rdlock(&mutex);
+      test_assert(table_value >= 0);
+      fiber_rwlock_rdunlock(&mutex);
+    }
+  }
+  return NULL;
+}
+
+static const char* mode_name(int mode) {
+  return mode == FIBER_RWLOCK_DEFAULT ? "default" : "read_biased";
+}
+
+static void run_test(int mode) {
+  test_assert(fiber_rwlock_init_with_mode(&mutex, mode));
   fiber_barrier_init(&barrier, NUM_FIBERS);
+  atomic_store(&try_wr, 0);
+  atomic_store(&try_rd, 0);
+  atomic_store(&count_rd, 0);
+  atomic_store(&count_wr, 0);
 
   fiber_t* fibers[NUM_FIBERS];
   int i;
@@ -77,11 +117,94 @@ int main() {
     fiber_join(fibers[i], NULL);
   }
 
+  test_assert(fiber_rwlock_trywrlock(&mutex));
+  test_assert(!fiber_rwlock_tryrdlock(&mutex));
+  fiber_rwlock_wrunlock(&mutex);
+  fiber_barrier_destroy(&barrier);
+  fiber_rwlock_destroy(&mutex);
+
+  printf("%s: try_rd %d try_wr %d count_rd %d count_wr %d\n",
+         mode_name(mode), try_rd, try_wr, count_rd, count_wr);
+}
+
+static void run_read_mostly(int mode, int num_readers) {
+  test_assert(fiber_rwlock_init_with_mode(&mutex, mode));
+  fiber_barrier_init(&barrier, num_readers);
+  const uint64_t start = fiber_time_now_ns();
+
+  fiber_t* fibers[num_readers];
+  int i;
+  for (i = 0; i < num_readers; ++i) {
+    fibers[i] = fiber_create(20000, &read_mostly_function, NULL);
+    test_assert(fibers[i]);
+  }
+  for (i = 0; i < num_readers; ++i) {
+    test_assert(fiber_join(fibers[i], NULL));
+  }
+
+  const uint64_t elapsed = fiber_time_now_ns() - start;
   fiber_barrier_destroy(&barrier);
   fiber_rwlock_destroy(&mutex);
+  printf("%s, %d readers: %.1f ns/lock\n", mode_name(mode), num_readers,
+         (double)elapsed / ((uint64_t)num_readers * READS_PER_FIBER));
+}
+
+_Atomic int foreign_reading = 0;
+_Atomic int foreign_release = 0;
 
-  printf("try_rd %d try_wr %d count_rd %d count_wr %d\n", try_rd, try_wr,
-         count_rd, count_wr);
+// a thread which isn't a manager reads a biased lock through the shared count
+void* foreign_reader(void* param) {
+  test_assert(fiber_rwlock_tryrdlock(&mutex));
+  test_assert(fiber_rwlock_rdunlock(&mutex));
+  test_assert(fiber_rwlock_rdlock(&mutex));
+  atomic_store(&foreign_reading, 1);
+  while (!atomic_load(&foreign_release)) {
+    sched_yield();
+  }
+  test_assert(fiber_rwlock_rdunlock(&mutex));
+  return NULL;
+}
+
+static void run_foreign_reader() {
+  test_assert(fiber_rwlock_init_with_mode(&mutex, FIBER_RWLOCK_READ_BIASED));
+  pthread_t reader;
+  test_assert(!pthread_create(&reader, NULL, &foreign_reader, NULL));
+  while (!atomic_load(&foreign_reading)) {
+    fiber_yield();
+  }
+  // the writer sees the foreign reader, and gets the lock once it's gone
+  test_assert(!fiber_rwlock_trywrlock(&mutex));
+  atomic_store(&foreign_release, 1);
+  test_assert(fiber_rwlock_wrlock(&mutex));
+  test_assert(fiber_rwlock_wrunlock(&mutex));
+  pthread_join(reader, NULL);
+  fiber_rwlock_destroy(&mutex);
+}
+
+int main(int argc, char* argv[]) {
+  int num_threads = NUM_THREADS;
+  if (argc > 1) {
+    num_threads = atoi(argv[1]);
+  }
+
+  // the per thread counts are sized when the managers start
+  test_assert(!fiber_rwlock_init_with_mode(&mutex, FIBER_RWLOCK_READ_BIASED));
+  test_assert(errno == EINVAL);
+
+  fiber_manager_init(num_threads);
+
+  test_assert(!fiber_rwlock_init_with_mode(&mutex, 2));
+  test_assert(errno == EINVAL);
+
+  run_test(FIBER_RWLOCK_DEFAULT);
+  run_test(FIBER_RWLOCK_READ_BIASED);
+  run_foreign_reader();
+
+  int num_readers;
+  for (num_readers = 1; num_readers <= num_threads; ++num_readers) {
+    run_read_mostly(FIBER_RWLOCK_DEFAULT, num_readers);
+    run_read_mostly(FIBER_RWLOCK_READ_BIASED, num_readers);
+  }
 
   fiber_manager_print_stats();
   fiber_shutdown();
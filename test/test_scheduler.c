@@ -0,0 +1,55 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fiber_manager.h"
+#include "test_helper.h"
+
+// the scheduler is picked when the managers start: from the config, or by
+// name from FIBER_SCHEDULER (which the scheduler test matrix sets)
+#define NUM_THREADS 2
+#define NUM_FIBERS 100
+
+_Atomic int ran = 0;
+
+void* run_function(void* param) {
+  atomic_fetch_add(&ran, 1);
+  fiber_yield();
+  return NULL;
+}
+
+int main() {
+  test_assert(fiber_scheduler_find("wsd") == &fiber_scheduler_wsd_ops);
+  test_assert(fiber_scheduler_find("dist") == &fiber_scheduler_dist_ops);
+  test_assert(!fiber_scheduler_find("nope"));
+  test_assert(!fiber_manager_get_scheduler());
+
+  const char* const name = getenv("FIBER_SCHEDULER");
+  const fiber_scheduler_ops_t* const expected =
+      name ? fiber_scheduler_find(name) : &fiber_scheduler_wsd_ops;
+  test_assert(expected);
+
+  fiber_manager_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.num_threads = NUM_THREADS;
+  test_assert(fiber_manager_init_with_config(&config));
+  test_assert(fiber_manager_get_scheduler() == expected);
+  printf("running with the %s scheduler\n", expected->name);
+
+  fiber_t* fibers[NUM_FIBERS];
+  int i;
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    fibers[i] = fiber_create(20000, &run_function, NULL);
+    test_assert(fibers[i]);
+  }
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    test_assert(fiber_join(fibers[i], NULL));
+  }
+  test_assert(ran == NUM_FIBERS);
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
@@ -0,0 +1,91 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_event.h"
+#include "fiber_manager.h"
+#include "test_helper.h"
+
+// usage: test_sleep_scale [num_sleepers] [num_threads] [sleep_ms]
+// each sleeper sleeps for between sleep_ms and 2 * sleep_ms. to have all of
+// them asleep at once, sleep_ms must cover the time it takes to spawn them
+// (ie. test_sleep_scale 1000000 4 10000). large sleeper counts need a stack
+// strategy which doesn't map every stack separately (malloc), or a raised
+// vm.max_map_count
+#define DEFAULT_NUM_SLEEPERS 10000
+#define DEFAULT_NUM_THREADS 2
+#define DEFAULT_SLEEP_MS 500
+#define SLEEPER_STACK_SIZE 16384
+
+uint64_t sleep_ns = 0;
+_Atomic uint64_t total_lateness = 0;
+_Atomic uint64_t max_lateness = 0;
+_Atomic int early_count = 0;
+_Atomic uint64_t sleeping = 0;
+_Atomic uint64_t max_sleeping = 0;
+
+static void update_max(_Atomic uint64_t* max, uint64_t value) {
+  uint64_t old_max = atomic_load(max);
+  while (value > old_max &&
+         !atomic_compare_exchange_weak(max, &old_max, value)) {
+  }
+}
+
+void* sleep_function(void* param) {
+  const uint64_t deadline =
+      fiber_time_now_ns() + sleep_ns + (uint64_t)(intptr_t)param % sleep_ns;
+  update_max(&max_sleeping, atomic_fetch_add(&sleeping, 1) + 1);
+  fiber_sleep_until(deadline);
+  atomic_fetch_sub(&sleeping, 1);
+  const uint64_t now = fiber_time_now_ns();
+  if (now < deadline) {
+    atomic_fetch_add(&early_count, 1);
+    return NULL;
+  }
+  const uint64_t lateness = now - deadline;
+  atomic_fetch_add(&total_lateness, lateness);
+  update_max(&max_lateness, lateness);
+  return NULL;
+}
+
+int main(int argc, char* argv[]) {
+  const int num_sleepers = argc > 1 ? atoi(argv[1]) : DEFAULT_NUM_SLEEPERS;
+  const int num_threads = argc > 2 ? atoi(argv[2]) : DEFAULT_NUM_THREADS;
+  const int sleep_ms = argc > 3 ? atoi(argv[3]) : DEFAULT_SLEEP_MS;
+  test_assert(num_sleepers > 0);
+  test_assert(num_threads > 0);
+  test_assert(sleep_ms > 0);
+  sleep_ns = sleep_ms * 1000000ULL;
+
+  fiber_manager_init(num_threads);
+
+  fiber_t** const fibers = calloc(num_sleepers, sizeof(*fibers));
+  test_assert(fibers);
+
+  srand(1);
+  const uint64_t start = fiber_time_now_ns();
+  int i;
+  for (i = 0; i < num_sleepers; ++i) {
+    fibers[i] = fiber_create(SLEEPER_STACK_SIZE, &sleep_function,
+                             (void*)(intptr_t)rand());
+    test_assert(fibers[i]);
+  }
+  const uint64_t spawned = fiber_time_now_ns();
+
+  for (i = 0; i < num_sleepers; ++i) {
+    fiber_join(fibers[i], NULL);
+  }
+  const uint64_t end = fiber_time_now_ns();
+
+  printf("%d sleepers on %d threads: spawned in %" PRIu64
+         " nsec, all woken after %" PRIu64 " nsec\n",
+         num_sleepers, num_threads, spawned - start, end - start);
+  printf("at most %" PRIu64 " sleeping at once. lateness: average %" PRIu64
+         " nsec, max %" PRIu64 " nsec\n",
+         max_sleeping, total_lateness / num_sleepers, max_lateness);
+  test_assert(early_count == 0);
+
+  free(fibers);
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
@@ -0,0 +1,80 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include <time.h>
+
+#include "fiber_manager.h"
+#include "test_helper.h"
+
+#define NUM_SPAWNS 200000
+#define BATCH_SIZE 64
+#define NUM_THREADS 1
+
+void* run_function(void* param) { return param; }
+
+long long getnsecs(struct timespec* tv) {
+  return (long long)tv->tv_sec * 1000000000LL + tv->tv_nsec;
+}
+
+// spawns and joins NUM_SPAWNS fibers, BATCH_SIZE at a time, checking each
+// fiber's stack size. returns the number of cache hits during the run.
+uint64_t spawn_and_join(const char* name, size_t stack_size) {
+  fiber_manager_stats_t before;
+  fiber_manager_all_stats(&before);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  fiber_t* fibers[BATCH_SIZE];
+  int i;
+  for (i = 0; i < NUM_SPAWNS; i += BATCH_SIZE) {
+    int j;
+    for (j = 0; j < BATCH_SIZE; ++j) {
+      fibers[j] = fiber_create(FIBER_DEFAULT_STACK_SIZE, &run_function,
+                               (void*)(intptr_t)(i + j));
+      test_assert(fibers[j]);
+      test_assert(fibers[j]->stack_size == stack_size);
+    }
+    // join the newest fiber first - it's the next one to run, so each fiber
+    // completes straight into its waiting joiner and is retired immediately
+    for (j = BATCH_SIZE - 1; j >= 0; --j) {
+      void* result = NULL;
+      test_assert(fiber_join(fibers[j], &result));
+      test_assert(result == (void*)(intptr_t)(i + j));
+    }
+  }
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  fiber_manager_stats_t after;
+  fiber_manager_all_stats(&after);
+
+  const long long diff = getnsecs(&end) - getnsecs(&start);
+  printf("%s: spawned and joined %d fibers in %lld nsec = %lf per second\n",
+         name, NUM_SPAWNS, diff,
+         (double)NUM_SPAWNS / ((double)diff / 1000000000.0));
+  return after.fiber_cache_hit_count - before.fiber_cache_hit_count;
+}
+
+int main() {
+  fiber_manager_init(NUM_THREADS);
+
+  test_assert(!fiber_manager_set_fiber_cache_watermarks(2, 1));
+
+  test_assert(fiber_manager_set_fiber_cache_watermarks(0, 0));
+  // without the cache, stacks are the size asked for
+  test_assert(spawn_and_join("uncached", FIBER_DEFAULT_STACK_SIZE) == 0);
+
+  test_assert(fiber_manager_set_fiber_cache_watermarks(
+      FIBER_CACHE_DEFAULT_LOW_WATERMARK, FIBER_CACHE_DEFAULT_HIGH_WATERMARK));
+  // with it, they're rounded up to their size class
+  const size_t class_size =
+      fiber_manager_round_stack_size(FIBER_DEFAULT_STACK_SIZE);
+  test_assert(class_size > FIBER_DEFAULT_STACK_SIZE);
+  test_assert(spawn_and_join("cached", class_size) > 0);
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
@@ -1,12 +1,16 @@
 // SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
 // SPDX-License-Identifier: MIT
 
+#include "fiber_event.h"
 #include "fiber_manager.h"
+#include "fiber_qspinlock.h"
 #include "fiber_spinlock.h"
 #include "test_helper.h"
 
+// the same contended counter behind the ticket lock and the queued lock
 int volatile counter = 0;
 fiber_spinlock_t mutex;
+fiber_qspinlock_t qmutex;
 #define PER_FIBER_COUNT 10000
 #define NUM_FIBERS 100
 #define NUM_THREADS 2
@@ -21,22 +25,58 @@ void* run_function(void* param) {
   return NULL;
 }
 
-int main() {
-  fiber_manager_init(NUM_THREADS);
+void* run_queued_function(void* param) {
+  int i;
+  for (i = 0; i < PER_FIBER_COUNT; ++i) {
+    fiber_qspinlock_lock(&qmutex);
+    ++counter;
+    fiber_qspinlock_unlock(&qmutex);
+  }
+  return NULL;
+}
 
-  fiber_spinlock_init(&mutex);
+static void run_test(const char* name, fiber_run_function_t function) {
+  fiber_manager_stats_t before = {};
+  fiber_manager_stats_t after = {};
+  fiber_manager_all_stats(&before);
+  counter = 0;
 
+  const uint64_t start = fiber_time_now_ns();
   fiber_t* fibers[NUM_FIBERS];
   int i;
   for (i = 0; i < NUM_FIBERS; ++i) {
-    fibers[i] = fiber_create(20000, &run_function, NULL);
+    fibers[i] = fiber_create(20000, function, NULL);
   }
-
   for (i = 0; i < NUM_FIBERS; ++i) {
     fiber_join(fibers[i], NULL);
   }
+  const uint64_t end = fiber_time_now_ns();
 
+  fiber_manager_all_stats(&after);
   test_assert(counter == NUM_FIBERS * PER_FIBER_COUNT);
+  printf("%s: %" PRIu64 " nsec per lock, %" PRIu64 " spins, %" PRIu64
+         " parks\n",
+         name, (end - start) / (NUM_FIBERS * PER_FIBER_COUNT),
+         after.spin_count - before.spin_count,
+         after.spinlock_park_count - before.spinlock_park_count);
+}
+
+int main() {
+  fiber_manager_init(NUM_THREADS);
+
+  fiber_qspinlock_init(&qmutex);
+  run_test("queued", &run_queued_function);
+  test_assert(fiber_qspinlock_trylock(&qmutex));
+  test_assert(!fiber_qspinlock_trylock(&qmutex));
+  fiber_qspinlock_unlock(&qmutex);
+  // waiting straight away still hands the lock over in order
+  fiber_qspinlock_set_spin_budget(0);
+  run_test("queued, no spinning", &run_queued_function);
+  fiber_qspinlock_set_spin_budget(FIBER_QSPINLOCK_DEFAULT_SPIN_BUDGET);
+  fiber_qspinlock_destroy(&qmutex);
+
+  fiber_spinlock_init(&mutex);
+  run_test("ticket", &run_function);
   test_assert(fiber_spinlock_trylock(&mutex));
   test_assert(!fiber_spinlock_trylock(&mutex));
   fiber_spinlock_unlock(&mutex);
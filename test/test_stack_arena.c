@@ -0,0 +1,109 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_stack_arena.h"
+
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "test_helper.h"
+
+#define NUM_STACKS 20000
+#define STACK_SIZE 16384
+#define LARGE_STACK_SIZE (32 << 20)
+
+static int count_mappings() {
+  FILE* const maps = fopen("/proc/self/maps", "r");
+  if (!maps) {
+    return 0;
+  }
+  int count = 0;
+  int c;
+  while ((c = fgetc(maps)) != EOF) {
+    count += c == '\n';
+  }
+  fclose(maps);
+  return count;
+}
+
+static void* stacks[NUM_STACKS];
+
+// allocates a stack of a size class nobody has used yet, so its slot is newly
+// carved (and guarded), and checks that writing just below its usable range
+// faults
+static void check_guard(size_t stack_size) {
+  size_t size = 0;
+  char* const stack = fiber_stack_arena_alloc(stack_size, &size);
+  test_assert(stack);
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  // the usable range starts after the guard page
+  stack[page_size] = 1;
+  stack[size - 1] = 1;
+
+  const pid_t child = fork();
+  test_assert(child >= 0);
+  if (!child) {
+    *(volatile char*)(stack + page_size - 1) = 1;
+    _exit(0);
+  }
+  int status = 0;
+  test_assert(waitpid(child, &status, 0) == child);
+  test_assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+  fiber_stack_arena_free(stack, size);
+}
+
+int main() {
+  const int mappings_before = count_mappings();
+
+  size_t size = 0;
+  int i;
+  for (i = 0; i < NUM_STACKS; ++i) {
+    stacks[i] = fiber_stack_arena_alloc(STACK_SIZE, &size);
+    test_assert(stacks[i]);
+    test_assert(size > STACK_SIZE);
+    // the top of each stack belongs to it alone
+    *((intptr_t*)((char*)stacks[i] + size) - 1) = i;
+  }
+  for (i = 0; i < NUM_STACKS; ++i) {
+    test_assert(*((intptr_t*)((char*)stacks[i] + size) - 1) == i);
+  }
+  const int mappings_after = count_mappings();
+  printf("%d stacks added %d mappings\n", NUM_STACKS,
+         mappings_after - mappings_before);
+
+  // freed slots are reused rather than mapping more memory
+  for (i = 0; i < NUM_STACKS; ++i) {
+    fiber_stack_arena_free(stacks[i], size);
+  }
+  for (i = 0; i < NUM_STACKS; ++i) {
+    size_t new_size = 0;
+    stacks[i] = fiber_stack_arena_alloc(STACK_SIZE, &new_size);
+    test_assert(stacks[i]);
+    test_assert(new_size == size);
+  }
+  test_assert(count_mappings() == mappings_after);
+  for (i = 0; i < NUM_STACKS; ++i) {
+    fiber_stack_arena_free(stacks[i], size);
+  }
+
+  // stacks bigger than any size class are mapped on their own
+  void* const large = fiber_stack_arena_alloc(LARGE_STACK_SIZE, &size);
+  test_assert(large);
+  test_assert(size > LARGE_STACK_SIZE);
+  *((intptr_t*)((char*)large + size) - 1) = 1;
+  fiber_stack_arena_free(large, size);
+
+  fiber_stack_arena_set_hugepage_policy(FIBER_STACK_ARENA_HUGEPAGE_NEVER);
+  void* const stack = fiber_stack_arena_alloc(1, &size);
+  test_assert(stack);
+  fiber_stack_arena_free(stack, size);
+  fiber_stack_arena_set_hugepage_policy(FIBER_STACK_ARENA_HUGEPAGE_DEFAULT);
+
+  // guard pages fault, whether installed with MADV_GUARD_INSTALL (where the
+  // kernel supports it) or mprotect()
+  check_guard(4 * STACK_SIZE);
+  fiber_stack_arena_use_mprotect_guards();
+  check_guard(16 * STACK_SIZE);
+
+  return 0;
+}
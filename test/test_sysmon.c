@@ -0,0 +1,72 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_event.h"
+#include "fiber_io.h"
+#include "fiber_manager.h"
+#include "test_helper.h"
+
+// the only manager blocks in a call the shims can't turn into a fiber switch
+// (a real sleep, with the thread locked). sysmon notices and a spare runs the
+// fibers queued behind it in the meantime. once every manager is parked sysmon
+// stops checking.
+#define NUM_FIBERS 100
+#define NUM_ROUNDS 3
+#define INTERVAL_NS 1000000
+#define BLOCK_US 200000
+#define IDLE_SECONDS 2
+
+_Atomic int ran = 0;
+
+void* run_function(void* param) {
+  atomic_fetch_add(&ran, 1);
+  return NULL;
+}
+
+int main() {
+  test_assert(fiber_manager_set_sysmon_interval(INTERVAL_NS));
+  fiber_manager_init(1);
+  // sysmon is already running
+  test_assert(!fiber_manager_set_sysmon_interval(0));
+  test_assert(fiber_manager_get_kernel_thread_count() == 1);
+  test_assert(fiber_manager_get_max_kernel_thread_count() ==
+              1 + FIBER_MANAGER_MAX_SPARES);
+
+  // the spare is retired when the manager comes back, and covers for it again
+  // next time
+  int round;
+  for (round = 1; round <= NUM_ROUNDS; ++round) {
+    fiber_t* fibers[NUM_FIBERS];
+    int i;
+    for (i = 0; i < NUM_FIBERS; ++i) {
+      fibers[i] = fiber_create(20000, &run_function, NULL);
+      test_assert(fibers[i]);
+    }
+
+    fiber_io_lock_thread();
+    usleep(BLOCK_US);
+    fiber_io_unlock_thread();
+    test_assert(ran == round * NUM_FIBERS);
+
+    for (i = 0; i < NUM_FIBERS; ++i) {
+      test_assert(fiber_join(fibers[i], NULL));
+    }
+    // switch fibers for a while so sysmon sees the manager is back
+    fiber_sleep(0, 10 * INTERVAL_NS / 1000);
+  }
+
+  fiber_manager_stats_t stats;
+  fiber_manager_all_stats(&stats);
+  test_assert(stats.sysmon_handoff_count == NUM_ROUNDS);
+
+  // sleeping parks the manager, so sysmon only checks around the edges (it
+  // would check every INTERVAL_NS otherwise)
+  const uint64_t checks = stats.sysmon_check_count;
+  fiber_sleep(IDLE_SECONDS, 0);
+  fiber_manager_all_stats(&stats);
+  test_assert(stats.sysmon_check_count - checks < 10);
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
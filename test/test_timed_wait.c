@@ -0,0 +1,332 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include <errno.h>
+#include <stdio.h>
+
+#include "fiber_channel.h"
+#include "fiber_cond.h"
+#include "fiber_event.h"
+#include "fiber_manager.h"
+#include "fiber_mutex.h"
+#include "fiber_rwlock.h"
+#include "fiber_semaphore.h"
+#include "test_helper.h"
+
+// each primitive's timed wait must give up at its deadline, and the waiter it
+// leaves behind in the queue must be skipped by whoever releases the primitive
+// next. the contended run mixes timeouts and hand offs on a mutex.
+#define NUM_THREADS 4
+#define TIMEOUT_MS 10
+#define NUM_FIBERS 50
+#define PER_FIBER_COUNT 200
+#define NUM_SKIPPED 1000
+
+static uint64_t deadline_after_ms(int ms) {
+  return fiber_time_now_ns() + (uint64_t)ms * 1000000;
+}
+
+// runs op, which must fail with ETIMEDOUT no sooner than TIMEOUT_MS
+#define test_times_out(op)                                            \
+  do {                                                                \
+    const uint64_t start = fiber_time_now_ns();                       \
+    test_assert(!(op));                                               \
+    test_assert(errno == ETIMEDOUT);                                  \
+    test_assert(fiber_time_now_ns() - start >= TIMEOUT_MS * 1000000); \
+  } while (0)
+
+fiber_mutex_t mutex;
+fiber_cond_t cond;
+fiber_semaphore_t semaphore;
+fiber_rwlock_t rwlock;
+
+void* mutex_timeout_function(void* param) {
+  test_times_out(fiber_mutex_timedlock(&mutex, deadline_after_ms(TIMEOUT_MS)));
+  return NULL;
+}
+
+void* mutex_lock_function(void* param) {
+  test_assert(fiber_mutex_timedlock(&mutex, deadline_after_ms(1000)));
+  fiber_mutex_unlock(&mutex);
+  return NULL;
+}
+
+_Atomic int in_critical_section = 0;
+_Atomic int lock_count = 0;
+_Atomic int timeout_count = 0;
+
+void* contended_function(void* param) {
+  int i;
+  for (i = 0; i < PER_FIBER_COUNT; ++i) {
+    const uint64_t deadline = fiber_time_now_ns() + (i % 8) * 50000;
+    if (!fiber_mutex_timedlock(&mutex, deadline)) {
+      test_assert(errno == ETIMEDOUT);
+      atomic_fetch_add(&timeout_count, 1);
+      continue;
+    }
+    test_assert(atomic_fetch_add(&in_critical_section, 1) == 0);
+    atomic_fetch_add(&lock_count, 1);
+    if (i % 4 == 0) {
+      fiber_yield();
+    }
+    atomic_fetch_sub(&in_critical_section, 1);
+    fiber_mutex_unlock(&mutex);
+  }
+  return NULL;
+}
+
+static void run_fiber(fiber_run_function_t run, void* param) {
+  fiber_t* const f = fiber_create(20000, run, param);
+  test_assert(f);
+  test_assert(fiber_join(f, NULL));
+}
+
+static void test_mutex(int mode) {
+  test_assert(fiber_mutex_init_with_mode(&mutex, mode));
+
+  // uncontended, the deadline doesn't matter
+  test_assert(fiber_mutex_timedlock(&mutex, 0));
+
+  // the timed out waiter is skipped when the lock is released
+  run_fiber(&mutex_timeout_function, NULL);
+  fiber_mutex_unlock(&mutex);
+  test_assert(fiber_mutex_trylock(&mutex));
+
+  // released before the deadline
+  fiber_t* const locker = fiber_create(20000, &mutex_lock_function, NULL);
+  test_assert(locker);
+  fiber_sleep(0, 5000);
+  fiber_mutex_unlock(&mutex);
+  test_assert(fiber_join(locker, NULL));
+
+  atomic_store(&lock_count, 0);
+  atomic_store(&timeout_count, 0);
+  fiber_t* fibers[NUM_FIBERS];
+  int i;
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    fibers[i] = fiber_create(20000, &contended_function, NULL);
+    test_assert(fibers[i]);
+  }
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    test_assert(fiber_join(fibers[i], NULL));
+  }
+  test_assert(atomic_load(&lock_count) + atomic_load(&timeout_count) ==
+              NUM_FIBERS * PER_FIBER_COUNT);
+  test_assert(fiber_mutex_trylock(&mutex));
+  test_assert(!fiber_mutex_trylock(&mutex));
+  fiber_mutex_unlock(&mutex);
+  fiber_mutex_destroy(&mutex);
+
+  printf("%s: %d locks, %d timeouts\n",
+         mode == FIBER_MUTEX_FAIR ? "fair" : "throughput",
+         atomic_load(&lock_count), atomic_load(&timeout_count));
+}
+
+volatile int cond_ready = 0;
+
+void* cond_wait_function(void* param) {
+  fiber_mutex_lock(&mutex);
+  while (!cond_ready) {
+    fiber_cond_wait(&cond, &mutex);
+  }
+  fiber_mutex_unlock(&mutex);
+  return NULL;
+}
+
+// the entries left in a condition's queue
+static int queued_cond_waiters() {
+  int count = 0;
+  const mpsc_fifo_node_t* node;
+  for (node = cond.waiters.head->next; node; node = node->next) {
+    ++count;
+  }
+  return count;
+}
+
+static void test_cond() {
+  test_assert(fiber_mutex_init(&mutex));
+  test_assert(fiber_cond_init(&cond));
+
+  // the mutex is held again after a timeout
+  fiber_mutex_lock(&mutex);
+  test_times_out(
+      fiber_cond_timedwait(&cond, &mutex, deadline_after_ms(TIMEOUT_MS)));
+  fiber_mutex_unlock(&mutex);
+  test_assert(fiber_mutex_trylock(&mutex));
+  fiber_mutex_unlock(&mutex);
+
+  // a periodic tick which is never signalled doesn't collect timed out waiters
+  fiber_mutex_lock(&mutex);
+  int i;
+  for (i = 0; i < NUM_SKIPPED; ++i) {
+    test_assert(!fiber_cond_timedwait(&cond, &mutex,
+                                      fiber_time_now_ns() + 10000));
+    test_assert(queued_cond_waiters() == 0);
+    test_assert(atomic_load(&cond.waiter_count) == 0);
+  }
+  fiber_mutex_unlock(&mutex);
+
+  // a signal skips the timed out waiter and wakes the one behind it
+  cond_ready = 0;
+  fiber_t* const waiter = fiber_create(20000, &cond_wait_function, NULL);
+  test_assert(waiter);
+  fiber_sleep(0, 5000);
+  fiber_mutex_lock(&mutex);
+  cond_ready = 1;
+  fiber_cond_signal(&cond);
+  fiber_mutex_unlock(&mutex);
+  test_assert(fiber_join(waiter, NULL));
+
+  fiber_cond_destroy(&cond);
+  fiber_mutex_destroy(&mutex);
+}
+
+void* semaphore_timeout_function(void* param) {
+  const uint64_t deadline = (uintptr_t)param;
+  test_assert(!fiber_semaphore_timedwait(&semaphore, deadline));
+  test_assert(errno == ETIMEDOUT);
+  return NULL;
+}
+
+void* semaphore_wait_function(void* param) {
+  test_assert(fiber_semaphore_timedwait(&semaphore, deadline_after_ms(1000)));
+  return NULL;
+}
+
+static void test_semaphore() {
+  test_assert(fiber_semaphore_init(&semaphore, 1));
+  test_assert(fiber_semaphore_timedwait(&semaphore, 0));
+  test_times_out(
+      fiber_semaphore_timedwait(&semaphore, deadline_after_ms(TIMEOUT_MS)));
+
+  // a post skips the timed out waiter and wakes the one behind it
+  fiber_t* const waiter = fiber_create(20000, &semaphore_wait_function, NULL);
+  test_assert(waiter);
+  fiber_sleep(0, 5000);
+  fiber_semaphore_post(&semaphore);
+  test_assert(fiber_join(waiter, NULL));
+  test_assert(fiber_semaphore_getvalue(&semaphore) == 0);
+
+  // with only timed out waiters left the post is kept. this is what an
+  // overloaded service shedding its waiters looks like to the poster.
+  const uint64_t deadline = deadline_after_ms(TIMEOUT_MS);
+  static fiber_t* waiters[NUM_SKIPPED];
+  int i;
+  for (i = 0; i < NUM_SKIPPED; ++i) {
+    waiters[i] = fiber_create(20000, &semaphore_timeout_function,
+                              (void*)(uintptr_t)deadline);
+    test_assert(waiters[i]);
+  }
+  for (i = 0; i < NUM_SKIPPED; ++i) {
+    test_assert(fiber_join(waiters[i], NULL));
+  }
+  const uint64_t start = fiber_time_now_ns();
+  test_assert(fiber_semaphore_post(&semaphore));
+  const uint64_t elapsed = fiber_time_now_ns() - start;
+  test_assert(fiber_semaphore_getvalue(&semaphore) == 1);
+  test_assert(fiber_semaphore_trywait(&semaphore));
+  test_assert(!fiber_semaphore_trywait(&semaphore));
+  fiber_semaphore_destroy(&semaphore);
+
+  printf("semaphore: %d timed out waiters skipped by one post in %.1f us\n",
+         NUM_SKIPPED, elapsed / 1000.0);
+}
+
+void* rwlock_timeout_function(void* param) {
+  const uint64_t deadline = deadline_after_ms(TIMEOUT_MS);
+  if (param) {
+    test_times_out(fiber_rwlock_timedwrlock(&rwlock, deadline));
+  } else {
+    test_times_out(fiber_rwlock_timedrdlock(&rwlock, deadline));
+  }
+  return NULL;
+}
+
+void* rwlock_read_function(void* param) {
+  test_assert(fiber_rwlock_timedrdlock(&rwlock, deadline_after_ms(1000)));
+  fiber_rwlock_rdunlock(&rwlock);
+  return NULL;
+}
+
+static void test_rwlock(int mode) {
+  test_assert(fiber_rwlock_init_with_mode(&rwlock, mode));
+
+  // readers and writers give up behind a writer
+  test_assert(fiber_rwlock_timedwrlock(&rwlock, 0));
+  run_fiber(&rwlock_timeout_function, NULL);
+  run_fiber(&rwlock_timeout_function, (void*)1);
+  fiber_rwlock_wrunlock(&rwlock);
+
+  // and a writer gives up behind a reader. readers which come later still
+  // queue behind it, and get the lock once the reader skips it on unlocking.
+  // with a read biased lock the writer gives up waiting for the reader to
+  // drain instead, and leaves the lock biased for the later readers.
+  test_assert(fiber_rwlock_timedrdlock(&rwlock, 0));
+  run_fiber(&rwlock_timeout_function, (void*)1);
+  fiber_t* const reader = fiber_create(20000, &rwlock_read_function, NULL);
+  test_assert(reader);
+  fiber_sleep(0, 5000);
+  fiber_rwlock_rdunlock(&rwlock);
+  test_assert(fiber_join(reader, NULL));
+
+  test_assert(fiber_rwlock_trywrlock(&rwlock));
+  test_assert(!fiber_rwlock_tryrdlock(&rwlock));
+  fiber_rwlock_wrunlock(&rwlock);
+  test_assert(fiber_rwlock_tryrdlock(&rwlock));
+  fiber_rwlock_rdunlock(&rwlock);
+  fiber_rwlock_destroy(&rwlock);
+}
+
+fiber_unbounded_channel_t channel;
+
+void* late_send_function(void* param) {
+  fiber_sleep(0, 5000);
+  fiber_unbounded_channel_send(&channel, param);
+  return NULL;
+}
+
+static void test_channel() {
+  fiber_signal_t signal;
+  fiber_signal_init(&signal);
+  test_assert(fiber_unbounded_channel_init(&channel, &signal));
+  test_times_out(fiber_unbounded_channel_timed_receive(
+      &channel, deadline_after_ms(TIMEOUT_MS)));
+
+  fiber_unbounded_channel_message_t* const message =
+      malloc(sizeof(*message));
+  test_assert(message);
+  message->data = &channel;
+  fiber_t* const sender = fiber_create(20000, &late_send_function, message);
+  test_assert(sender);
+  fiber_unbounded_channel_message_t* const received =
+      fiber_unbounded_channel_timed_receive(&channel, deadline_after_ms(1000));
+  test_assert(received && received->data == &channel);
+  test_assert(fiber_join(sender, NULL));
+  free(received);
+  fiber_unbounded_channel_destroy(&channel);
+  fiber_signal_destroy(&signal);
+
+  // a channel without a signal yields until the deadline
+  fiber_bounded_channel_t* const bounded =
+      fiber_bounded_channel_create(4, NULL);
+  test_assert(bounded);
+  test_times_out(fiber_bounded_channel_timed_receive(
+      bounded, deadline_after_ms(TIMEOUT_MS)));
+  fiber_bounded_channel_destroy(bounded);
+}
+
+int main() {
+  fiber_manager_init(NUM_THREADS);
+
+  test_mutex(FIBER_MUTEX_FAIR);
+  test_mutex(FIBER_MUTEX_THROUGHPUT);
+  test_cond();
+  test_semaphore();
+  test_rwlock(FIBER_RWLOCK_DEFAULT);
+  test_rwlock(FIBER_RWLOCK_READ_BIASED);
+  test_channel();
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
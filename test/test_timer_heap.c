@@ -0,0 +1,49 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "test_helper.h"
+#include "timer_heap.h"
+
+#define NUM_NODES 100000
+
+timer_heap_node_t nodes[NUM_NODES];
+
+int main(int argc, char* argv[]) {
+  timer_heap_t heap;
+  test_assert(timer_heap_init(&heap, 1));
+  test_assert(!timer_heap_peek(&heap));
+  test_assert(!timer_heap_pop(&heap));
+
+  srand(1);
+  int i;
+  for (i = 0; i < NUM_NODES; ++i) {
+    nodes[i].deadline = rand() % (NUM_NODES / 10);
+    nodes[i].data = &nodes[i];
+    test_assert(timer_heap_push(&heap, &nodes[i]));
+  }
+  test_assert(timer_heap_size(&heap) == NUM_NODES);
+
+  // remove every third node from wherever it sits in the heap
+  size_t expected_size = NUM_NODES;
+  for (i = 0; i < NUM_NODES; i += 3) {
+    timer_heap_remove(&heap, &nodes[i]);
+    test_assert(nodes[i].index == TIMER_HEAP_INVALID_INDEX);
+    --expected_size;
+  }
+  test_assert(timer_heap_size(&heap) == expected_size);
+
+  uint64_t last_deadline = 0;
+  timer_heap_node_t* node;
+  while ((node = timer_heap_pop(&heap))) {
+    test_assert(node->deadline >= last_deadline);
+    test_assert(node->data == node);
+    test_assert((node - nodes) % 3 != 0);
+    last_deadline = node->deadline;
+    --expected_size;
+  }
+  test_assert(expected_size == 0);
+  test_assert(timer_heap_size(&heap) == 0);
+
+  timer_heap_destroy(&heap);
+  return 0;
+}
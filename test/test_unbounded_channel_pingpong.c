@@ -2,6 +2,7 @@
 // SPDX-License-Identifier: MIT
 
 #include "fiber_channel.h"
+#include "fiber_event.h"
 #include "fiber_manager.h"
 #include "test_helper.h"
 
@@ -45,12 +46,17 @@ int main(int argc, char* argv[]) {
   fiber_unbounded_channel_init(&channel_one, argc > 1 ? NULL : &signal_one);
   fiber_unbounded_channel_init(&channel_two, argc > 1 ? NULL : &signal_two);
 
+  const uint64_t start = fiber_time_now_ns();
   fiber_t* ping_fiber;
   ping_fiber = fiber_create(20000, &ping_function, NULL);
 
   pong_function(NULL);
 
   fiber_join(ping_fiber, NULL);
+  const uint64_t end = fiber_time_now_ns();
+  printf("%d round trips in %" PRIu64 " nsec = %" PRIu64
+         " nsec per round trip\n",
+         PER_FIBER_COUNT, end - start, (end - start) / PER_FIBER_COUNT);
 
   fiber_unbounded_channel_destroy(&channel_one);
   fiber_unbounded_channel_destroy(&channel_two);
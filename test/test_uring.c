@@ -0,0 +1,267 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "fiber_event.h"
+#include "fiber_event_uring.h"
+#include "fiber_manager.h"
+#include "test_helper.h"
+
+// exercises each of the shimmed socket calls which io_uring builds (USE_URING=1
+// or -DFIBER_USE_URING=ON) perform as ring operations. the results must match
+// the readiness based shims.
+#define NUM_THREADS 2
+#define NUM_ROUNDS 100
+
+struct sockaddr_in listen_addr;
+int listen_fd = -1;
+int udp_fds[2] = {-1, -1};
+struct sockaddr_in udp_addrs[2];
+
+static void bind_loopback(int fd, struct sockaddr_in* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  test_assert(!bind(fd, (struct sockaddr*)addr, sizeof(*addr)));
+  socklen_t addr_len = sizeof(*addr);
+  test_assert(!getsockname(fd, (struct sockaddr*)addr, &addr_len));
+}
+
+void* tcp_server_function(void* param) {
+  struct sockaddr_in peer = {};
+  socklen_t peer_len = sizeof(peer);
+  const int fd = accept(listen_fd, (struct sockaddr*)&peer, &peer_len);
+  test_assert(fd >= 0);
+  test_assert(peer_len == sizeof(peer));
+  test_assert(peer.sin_addr.s_addr == htonl(INADDR_LOOPBACK));
+
+  int i;
+  for (i = 0; i < NUM_ROUNDS; ++i) {
+    int a = 0;
+    int b = 0;
+    struct iovec iov[2] = {{&a, sizeof(a)}, {&b, sizeof(b)}};
+    test_assert(readv(fd, iov, 2) == sizeof(a) + sizeof(b));
+    test_assert(a == i && b == -i);
+
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    a = i + 1;
+    b = -i - 1;
+    test_assert(sendmsg(fd, &msg, 0) == sizeof(a) + sizeof(b));
+  }
+
+  // the client closes its end, so the next read sees end of file
+  char c;
+  test_assert(read(fd, &c, 1) == 0);
+  close(fd);
+  return NULL;
+}
+
+void* tcp_client_function(void* param) {
+  const int fd = socket(AF_INET, SOCK_STREAM, 0);
+  test_assert(fd >= 0);
+  test_assert(!connect(fd, (struct sockaddr*)&listen_addr,
+                       sizeof(listen_addr)));
+
+  int i;
+  for (i = 0; i < NUM_ROUNDS; ++i) {
+    int a = i;
+    int b = -i;
+    struct iovec iov[2] = {{&a, sizeof(a)}, {&b, sizeof(b)}};
+    test_assert(writev(fd, iov, 2) == sizeof(a) + sizeof(b));
+
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    test_assert(recvmsg(fd, &msg, MSG_WAITALL) == sizeof(a) + sizeof(b));
+    test_assert(a == i + 1 && b == -i - 1);
+  }
+  close(fd);
+  return NULL;
+}
+
+void* udp_function(void* param) {
+  const intptr_t self = (intptr_t)param;
+  const int fd = udp_fds[self];
+  const struct sockaddr_in* const other = &udp_addrs[!self];
+  int i;
+  for (i = 0; i < NUM_ROUNDS; ++i) {
+    int value = -1;
+    if (self == 0) {
+      test_assert(sendto(fd, &i, sizeof(i), 0, (const struct sockaddr*)other,
+                         sizeof(*other)) == sizeof(i));
+    }
+    struct sockaddr_in from = {};
+    socklen_t from_len = sizeof(from);
+    test_assert(recvfrom(fd, &value, sizeof(value), 0, (struct sockaddr*)&from,
+                         &from_len) == sizeof(value));
+    test_assert(value == i);
+    test_assert(from_len == sizeof(from));
+    test_assert(from.sin_port == other->sin_port);
+    if (self == 1) {
+      test_assert(sendto(fd, &i, sizeof(i), 0, (const struct sockaddr*)other,
+                         sizeof(*other)) == sizeof(i));
+    }
+  }
+  return NULL;
+}
+
+int blocked_fds[2] = {-1, -1};
+
+void* blocked_reader_function(void* param) {
+  char c;
+  // nobody ever writes; the fd is closed underneath us instead
+  test_assert(read(blocked_fds[0], &c, 1) < 0);
+  return NULL;
+}
+
+// more reads than the completion queues of every ring can hold, so at least one
+// ring's completions overflow while its thread is busy
+#define NUM_BURST_READERS \
+  (NUM_THREADS * 4 * FIBER_URING_ENTRIES + FIBER_URING_ENTRIES)
+
+int burst_fds[NUM_BURST_READERS][2];
+_Atomic int busy_count = 0;
+_Atomic int burst_written = 0;
+
+void* burst_reader_function(void* param) {
+  char c;
+  test_assert(read(burst_fds[(intptr_t)param][0], &c, 1) == 1);
+  return NULL;
+}
+
+// keeps a thread from polling (and reaping) until the burst is written
+void* busy_function(void* param) {
+  atomic_fetch_add(&busy_count, 1);
+  while (!atomic_load(&burst_written)) {
+  }
+  return NULL;
+}
+
+// completes every burst read at once, straight to the kernel, once every
+// thread is busy
+void* burst_writer_function(void* param) {
+  while (atomic_load(&busy_count) < NUM_THREADS) {
+    usleep(1000);
+  }
+  int i;
+  for (i = 0; i < NUM_BURST_READERS; ++i) {
+    test_assert(syscall(SYS_write, burst_fds[i][1], "x", 1) == 1);
+  }
+  atomic_store(&burst_written, 1);
+  return NULL;
+}
+
+static int raise_fd_limit(rlim_t needed) {
+  struct rlimit limit;
+  test_assert(!getrlimit(RLIMIT_NOFILE, &limit));
+  if (limit.rlim_cur >= needed) {
+    return 1;
+  }
+  if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < needed) {
+    return 0;
+  }
+  limit.rlim_cur = needed;
+  return !setrlimit(RLIMIT_NOFILE, &limit);
+}
+
+static void test_burst() {
+  if (!raise_fd_limit(2 * NUM_BURST_READERS + 64)) {
+    printf("skipping the burst: not enough fds\n");
+    return;
+  }
+  fiber_t* readers[NUM_BURST_READERS];
+  intptr_t i;
+  for (i = 0; i < NUM_BURST_READERS; ++i) {
+    test_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, burst_fds[i]));
+    readers[i] = fiber_create(20000, &burst_reader_function, (void*)i);
+    test_assert(readers[i]);
+  }
+  // let every read get submitted
+  fiber_sleep(0, 50000);
+
+  fiber_t* busy[NUM_THREADS];
+  for (i = 0; i < NUM_THREADS; ++i) {
+    busy[i] = fiber_create(20000, &busy_function, NULL);
+    test_assert(busy[i]);
+  }
+  pthread_t writer;
+  test_assert(!pthread_create(&writer, NULL, &burst_writer_function, NULL));
+  for (i = 0; i < NUM_THREADS; ++i) {
+    test_assert(fiber_join(busy[i], NULL));
+  }
+  for (i = 0; i < NUM_BURST_READERS; ++i) {
+    test_assert(fiber_join(readers[i], NULL));
+  }
+  test_assert(!pthread_join(writer, NULL));
+  for (i = 0; i < NUM_BURST_READERS; ++i) {
+    close(burst_fds[i][0]);
+    close(burst_fds[i][1]);
+  }
+}
+
+int main() {
+  fiber_manager_init(NUM_THREADS);
+
+  fiber_manager_stats_t before = {};
+  fiber_manager_all_stats(&before);
+
+  // stream calls: accept, connect, readv, writev, sendmsg, recvmsg, read
+  listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  test_assert(listen_fd >= 0);
+  bind_loopback(listen_fd, &listen_addr);
+  test_assert(!listen(listen_fd, 1));
+  fiber_t* const server = fiber_create(20000, &tcp_server_function, NULL);
+  fiber_t* const client = fiber_create(20000, &tcp_client_function, NULL);
+  test_assert(server && client);
+  test_assert(fiber_join(server, NULL));
+  test_assert(fiber_join(client, NULL));
+  close(listen_fd);
+
+  // datagram calls: sendto, recvfrom
+  intptr_t i;
+  for (i = 0; i < 2; ++i) {
+    udp_fds[i] = socket(AF_INET, SOCK_DGRAM, 0);
+    test_assert(udp_fds[i] >= 0);
+    bind_loopback(udp_fds[i], &udp_addrs[i]);
+  }
+  fiber_t* udp[2];
+  for (i = 0; i < 2; ++i) {
+    udp[i] = fiber_create(20000, &udp_function, (void*)i);
+    test_assert(udp[i]);
+  }
+  for (i = 0; i < 2; ++i) {
+    test_assert(fiber_join(udp[i], NULL));
+    close(udp_fds[i]);
+  }
+
+  // closing an fd wakes a fiber blocked on it
+  test_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, blocked_fds));
+  fiber_t* const reader = fiber_create(20000, &blocked_reader_function, NULL);
+  test_assert(reader);
+  fiber_sleep(0, 10000);
+  close(blocked_fds[0]);
+  test_assert(fiber_join(reader, NULL));
+  close(blocked_fds[1]);
+
+  // completions arriving faster than they're reaped all wake their fibers
+  test_burst();
+
+  fiber_manager_stats_t after = {};
+  fiber_manager_all_stats(&after);
+  printf("%" PRIu64 " ring operations\n",
+         after.uring_op_count - before.uring_op_count);
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
@@ -0,0 +1,56 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include <sched.h>
+
+#include "fiber_event.h"
+#include "fiber_manager.h"
+#include "test_helper.h"
+
+// measures how long a parked manager thread takes to pick up a fiber scheduled
+// by a busy one. the main fiber never yields while it waits, so the new fiber
+// can only run if the idle thread is woken to steal it.
+#define NUM_WAKES 1000
+#define NUM_THREADS 2
+
+_Atomic uint64_t ran_at = 0;
+
+void* record_time(void* param) {
+  atomic_store(&ran_at, fiber_time_now_ns());
+  return NULL;
+}
+
+int main() {
+  fiber_manager_init(NUM_THREADS);
+
+  uint64_t total = 0;
+  uint64_t max = 0;
+  int i;
+  for (i = 0; i < NUM_WAKES; ++i) {
+    // give the other thread time to run out of work and park
+    fiber_do_real_sleep(0, 1000);
+
+    atomic_store(&ran_at, 0);
+    const uint64_t start = fiber_time_now_ns();
+    fiber_t* const f =
+        fiber_create(FIBER_DEFAULT_STACK_SIZE, &record_time, NULL);
+    test_assert(f);
+    uint64_t end;
+    while (!(end = atomic_load(&ran_at))) {
+      sched_yield();
+    }
+    test_assert(fiber_join(f, NULL));
+
+    const uint64_t latency = end - start;
+    total += latency;
+    max = latency > max ? latency : max;
+  }
+
+  printf("woke a parked thread %d times: average %" PRIu64 " nsec, max %" PRIu64
+         " nsec\n",
+         NUM_WAKES, total / NUM_WAKES, max);
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
@@ -44,6 +44,23 @@ int main(int argc, char* argv[]) {
     void* item = wsd_work_stealing_deque_pop_bottom(wsd_d);
     test_assert((intptr_t)item == i - 1);
   }
+
+  // steal half moves the oldest elements, rounding up and honouring max
+  wsd_work_stealing_deque_t* const thief = wsd_work_stealing_deque_create();
+  for (i = 0; i < 9; ++i) {
+    wsd_work_stealing_deque_push_bottom(wsd_d, (void*)(intptr_t)i);
+  }
+  test_assert(wsd_work_stealing_deque_steal_half(wsd_d, thief, 100) == 5);
+  test_assert(wsd_work_stealing_deque_size(wsd_d) == 4);
+  test_assert(wsd_work_stealing_deque_steal_half(wsd_d, thief, 1) == 1);
+  for (i = 5; i >= 0; --i) {
+    test_assert((intptr_t)wsd_work_stealing_deque_pop_bottom(thief) == i);
+  }
+  for (i = 8; i > 5; --i) {
+    test_assert((intptr_t)wsd_work_stealing_deque_pop_bottom(wsd_d) == i);
+  }
+  test_assert(wsd_work_stealing_deque_steal_half(wsd_d, thief, 100) == 0);
+  wsd_work_stealing_deque_destroy(thief);
   wsd_work_stealing_deque_destroy(wsd_d);
 
   wsd_d2 = wsd_work_stealing_deque_create();
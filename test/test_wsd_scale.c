@@ -11,6 +11,9 @@
 int NUM_THREADS = 4;
 int PER_THREAD_COUNT = 1000000;
 int WORK_FACTOR = 0;
+// 0: steal one element at a time, trying victims in a fixed order
+// 1: steal half of a victim's elements, starting at a random victim
+int STEAL_HALF = 0;
 pthread_barrier_t barrier;
 
 long long getusecs(struct timeval* tv) {
@@ -78,6 +81,27 @@ void* run_function(void* param) {
       n->data = (void*)i;
       wsd_work_stealing_deque_push_bottom(my_fifo, n);
       ++my_data->push_count;
+    } else if (STEAL_HALF) {
+      intptr_t tries = NUM_THREADS - 1;  // don't steal from yourself
+      // start at a random victim
+      intptr_t j = thread_id + 1 + (tries ? rand_r(&seed) % tries : 0);
+      while (tries > 0) {
+        wsd_work_stealing_deque_t* const steal_fifo = fifo[j % NUM_THREADS];
+        ++my_data->attempt_count;
+        const size_t stolen =
+            wsd_work_stealing_deque_steal_half(steal_fifo, my_fifo, SIZE_MAX);
+        if (stolen) {
+          my_data->steal_count += stolen;
+          my_data->dummy = do_some_work(i);
+          break;
+        }
+        ++my_data->empty_count;
+        --tries;
+        ++j;
+        if (j % NUM_THREADS == thread_id) {
+          ++j;
+        }
+      }
     } else {
       intptr_t j = thread_id + 1;
       intptr_t tries = NUM_THREADS - 1;  // don't steal from yourself
@@ -124,6 +148,9 @@ int main(int argc, char* argv[]) {
   if (argc > 3) {
     WORK_FACTOR = atoi(argv[3]);
   }
+  if (argc > 4) {
+    STEAL_HALF = atoi(argv[4]);
+  }
   fifo = calloc(NUM_THREADS, sizeof(*fifo));
   data = calloc(NUM_THREADS, sizeof(*data));
   pthread_barrier_init(&barrier, NULL, NUM_THREADS);
@@ -180,8 +207,11 @@ int main(int argc, char* argv[]) {
       total.empty_count);
 
   double seconds = (getusecs(&end) - getusecs(&begin)) / 1000000.0;
-  printf("timing: %d threads %d events %d work %lf seconds\n", NUM_THREADS,
-         PER_THREAD_COUNT, WORK_FACTOR, seconds);
+  printf("timing: %d threads %d events %d work %lf seconds %s\n", NUM_THREADS,
+         PER_THREAD_COUNT, WORK_FACTOR, seconds,
+         STEAL_HALF ? "steal-half" : "steal-one");
+  printf("steal throughput: %lf stolen per second\n",
+         total.steal_count / seconds);
 
   return 0;
 }
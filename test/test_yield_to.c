@@ -0,0 +1,75 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_event.h"
+#include "fiber_manager.h"
+#include "fiber_semaphore.h"
+#include "fiber_signal.h"
+#include "test_helper.h"
+
+#define NUM_ROUND_TRIPS 100000
+
+fiber_signal_t signal_one;
+volatile int woken = 0;
+
+void* wait_for_signal(void* param) {
+  fiber_signal_wait(&signal_one);
+  woken = 1;
+  return NULL;
+}
+
+fiber_semaphore_t ping;
+fiber_semaphore_t pong;
+
+void* pong_function(void* param) {
+  int i;
+  for (i = 0; i < NUM_ROUND_TRIPS; ++i) {
+    fiber_semaphore_wait(&ping);
+    fiber_semaphore_post(&pong);
+  }
+  return NULL;
+}
+
+int main() {
+  fiber_manager_init(1);
+
+  // a fiber which was just woken runs as soon as we hand off to it
+  fiber_signal_init(&signal_one);
+  fiber_t* const waiter = fiber_create(20000, &wait_for_signal, NULL);
+  test_assert(waiter);
+  fiber_yield();  // let it wait
+  test_assert(!woken);
+  test_assert(fiber_signal_raise(&signal_one));
+  test_assert(!woken);
+  fiber_yield_to(waiter);
+  test_assert(woken);
+  fiber_join(waiter, NULL);
+  fiber_signal_destroy(&signal_one);
+
+  // anything else is just a yield
+  fiber_yield_to(NULL);
+  fiber_yield_to(fiber_manager_get()->current_fiber);
+
+  // semaphores hand off to the waiter they wake
+  fiber_semaphore_init(&ping, 0);
+  fiber_semaphore_init(&pong, 0);
+  fiber_t* const pong_fiber = fiber_create(20000, &pong_function, NULL);
+  test_assert(pong_fiber);
+  const uint64_t start = fiber_time_now_ns();
+  int i;
+  for (i = 0; i < NUM_ROUND_TRIPS; ++i) {
+    fiber_semaphore_post(&ping);
+    fiber_semaphore_wait(&pong);
+  }
+  const uint64_t end = fiber_time_now_ns();
+  fiber_join(pong_fiber, NULL);
+  printf("%d semaphore round trips in %" PRIu64 " nsec = %" PRIu64
+         " nsec per round trip\n",
+         NUM_ROUND_TRIPS, end - start, (end - start) / NUM_ROUND_TRIPS);
+  fiber_semaphore_destroy(&ping);
+  fiber_semaphore_destroy(&pong);
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}